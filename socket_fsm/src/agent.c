@@ -0,0 +1,476 @@
+#include "client.h"
+#include <signal.h>
+#include <sys/un.h>
+
+static volatile sig_atomic_t agent_stop = 0;
+
+static void agent_signal(int sig)
+{
+    (void)sig;
+    agent_stop = 1;
+}
+
+static int unix_address(const char *socket_path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path))
+    {
+        return -1;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+static int agent_listen(const char *socket_path, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    struct sockaddr_un addr;
+    int fd;
+
+    if (unix_address(socket_path, &addr) == -1)
+    {
+        SET_ERROR(context, "Submission socket path is too long");
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        SET_ERROR(context, "Socket creation failed");
+        return -1;
+    }
+    // A socket file left behind by an agent that did not shut down cleanly
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1)
+    {
+        SET_ERROR(context, "Cannot listen on the submission socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// (Re)open the warm connection after the server went away.
+static int agent_connect(void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    int keepalive = 1;
+
+    context->sockfd = socket_create(context->addr.ss_family, SOCK_STREAM, 0, ctx);
+    if (context->sockfd == -1)
+    {
+        return -1;
+    }
+    if (socket_connect(context->sockfd, &context->addr, context->port, ctx) == -1 ||
+        (context->tls_ca != NULL && setup_tls(context->sockfd, context->tls_ca, context->address, ctx) == -1) ||
+        limit_rate(context->sockfd, ctx) == -1 ||
+        send_hello(context->sockfd, FEATURE_ACKS, ctx) == -1)
+    {
+        socket_close(context->sockfd, ctx);
+        context->sockfd = -1;
+        return -1;
+    }
+    setsockopt(context->sockfd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+    // The server numbers files per connection
+    context->files_sent       = 0;
+    context->agent->connected = 1;
+    return 0;
+}
+
+// Drop the connection; files the server never acknowledged are reported as failed.
+static void agent_disconnect(void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    while (context->in_flight > 0)
+    {
+        pending_ack *pending = &context->pending_acks[--context->in_flight];
+        report_submission(pending->owner, pending->path, ACK_FAILED, 0, ctx);
+        free(pending->path);
+    }
+    socket_close(context->sockfd, ctx);
+    context->sockfd           = -1;
+    context->agent->connected = 0;
+    fprintf(stderr, "Lost the connection to the server\n");
+}
+
+static void finish_submitter(agent_state *agent, int fd)
+{
+    submitter *sub = &agent->submitters[fd];
+
+    if (sub->done && sub->outstanding == 0)
+    {
+        close(fd);
+        sub->in_use = 0;
+    }
+}
+
+static int enqueue(agent_state *agent, const char *path, int owner)
+{
+    char *copy;
+
+    if (agent->head == agent->tail)
+    {
+        agent->head = agent->tail = 0;
+    }
+    if (agent->tail == agent->capacity)
+    {
+        size_t     capacity = agent->capacity ? agent->capacity * 2 : 64;
+        submission *queue   = realloc(agent->queue, capacity * sizeof(submission));
+        if (queue == NULL)
+        {
+            return -1;
+        }
+        agent->queue    = queue;
+        agent->capacity = capacity;
+    }
+    if ((copy = strdup(path)) == NULL)
+    {
+        return -1;
+    }
+    agent->queue[agent->tail].path  = copy;
+    agent->queue[agent->tail].owner = owner;
+    agent->tail++;
+    agent->submitters[owner].outstanding++;
+    return 0;
+}
+
+static void accept_submitter(agent_state *agent)
+{
+    int fd = accept4(agent->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd == -1)
+    {
+        return;
+    }
+    if (fd >= MAX_SUBMITTERS)
+    {
+        close(fd);
+        return;
+    }
+    memset(&agent->submitters[fd], 0, sizeof(submitter));
+    agent->submitters[fd].in_use = 1;
+}
+
+// Queue every complete line the submitter has written so far.
+static void read_submitter(agent_state *agent, int fd)
+{
+    submitter *sub = &agent->submitters[fd];
+    char      *newline;
+    ssize_t   received;
+
+    received = read(fd, sub->line + sub->used, sizeof(sub->line) - sub->used);
+    if (received <= 0)
+    {
+        sub->done = 1;
+        finish_submitter(agent, fd);
+        return;
+    }
+    sub->used += received;
+    while ((newline = memchr(sub->line, '\n', sub->used)) != NULL)
+    {
+        size_t consumed = newline - sub->line + 1;
+
+        *newline = '\0';
+        if (newline != sub->line && enqueue(agent, sub->line, fd) == -1)
+        {
+            dprintf(fd, "FAILED 0 %s\n", sub->line);
+        }
+        memmove(sub->line, newline + 1, sub->used - consumed);
+        sub->used -= consumed;
+    }
+    if (sub->used == sizeof(sub->line))
+    {
+        // Not a path we could open anyway
+        sub->done = 1;
+        finish_submitter(agent, fd);
+    }
+}
+
+// Send the queued files on the warm connection, keeping up to ack_window of them
+// unacknowledged.
+static void dispatch(agent_state *agent, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    while (agent->head < agent->tail && !agent_stop)
+    {
+        submission next = agent->queue[agent->head];
+
+        if (!agent->connected && agent_connect(ctx) == -1)
+        {
+            fprintf(stderr, "Cannot reach the server: %s\n", context->error_message);
+            while (agent->head < agent->tail)
+            {
+                next = agent->queue[agent->head++];
+                report_submission(next.owner, next.path, ACK_FAILED, 0, ctx);
+                free(next.path);
+            }
+            return;
+        }
+        agent->head++;
+        if (access(next.path, R_OK) != 0)
+        {
+            report_submission(next.owner, next.path, ACK_FAILED, 0, ctx);
+        }
+        else if (collect_acks(context->sockfd, context->ack_window - 1, ctx) == -1 ||
+                 send_file(context->sockfd, next.path, ctx) == -1)
+        {
+            report_submission(next.owner, next.path, ACK_FAILED, 0, ctx);
+            agent_disconnect(ctx);
+        }
+        else if (track_ack(context->ack_id, next.path, next.owner, ctx) == -1)
+        {
+            report_submission(next.owner, next.path, ACK_FAILED, 0, ctx);
+        }
+        free(next.path);
+    }
+}
+
+// Tell the submitter how a file went, and let it go once all its files are done.
+void report_submission(int owner, const char *path, uint32_t status, uint64_t bytes, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    agent_state *agent  = context->agent;
+
+    dprintf(owner, "%s %" PRIu64 " %s\n", status == ACK_OK ? "OK" : "FAILED", bytes, path);
+    agent->submitters[owner].outstanding--;
+    finish_submitter(agent, owner);
+}
+
+int serve_submissions(const char *socket_path, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    agent_state agent   = { 0 };
+    struct sigaction sa = { 0 };
+    struct pollfd *fds;
+    int result = 0;
+
+    sa.sa_handler = agent_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // Submitters may hang up before their answers are written
+    signal(SIGPIPE, SIG_IGN);
+
+    agent.submitters = calloc(MAX_SUBMITTERS, sizeof(submitter));
+    fds              = malloc((MAX_SUBMITTERS + 2) * sizeof(struct pollfd));
+    if (agent.submitters == NULL || fds == NULL)
+    {
+        free(agent.submitters);
+        free(fds);
+        SET_ERROR(context, "Failed to allocate memory");
+        return -1;
+    }
+    agent.listen_fd = agent_listen(socket_path, ctx);
+    if (agent.listen_fd == -1)
+    {
+        free(agent.submitters);
+        free(fds);
+        return -1;
+    }
+    agent.connected = 1;
+    context->agent  = &agent;
+    printf("Accepting submissions on %s\n", socket_path);
+
+    while (!agent_stop)
+    {
+        nfds_t nfds = 2;
+
+        fds[0] = (struct pollfd){ agent.listen_fd, POLLIN, 0 };
+        fds[1] = (struct pollfd){ agent.connected ? context->sockfd : -1, POLLIN, 0 };
+        for (int fd = 0; fd < MAX_SUBMITTERS; fd++)
+        {
+            if (agent.submitters[fd].in_use && !agent.submitters[fd].done)
+            {
+                fds[nfds++] = (struct pollfd){ fd, POLLIN, 0 };
+            }
+        }
+        if (poll(fds, nfds, agent.head < agent.tail || tls_pending(context->sockfd) ? 0 : -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            SET_ERROR(context, "poll");
+            result = -1;
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            accept_submitter(&agent);
+        }
+        if (agent.connected && (fds[1].revents || tls_pending(context->sockfd)))
+        {
+            // The server only speaks to answer a file, anything else means it hung up
+            if (context->in_flight == 0 || collect_acks(context->sockfd, context->in_flight, ctx) == -1)
+            {
+                agent_disconnect(ctx);
+            }
+        }
+        for (nfds_t i = 2; i < nfds; i++)
+        {
+            if (fds[i].revents)
+            {
+                read_submitter(&agent, fds[i].fd);
+            }
+        }
+        dispatch(&agent, ctx);
+    }
+
+    // Answer everything that was accepted before going away
+    while (agent.head < agent.tail)
+    {
+        submission next = agent.queue[agent.head++];
+        report_submission(next.owner, next.path, ACK_FAILED, 0, ctx);
+        free(next.path);
+    }
+    if (agent.connected && collect_acks(context->sockfd, 0, ctx) == -1)
+    {
+        agent_disconnect(ctx);
+    }
+    if (!agent.connected)
+    {
+        // cleanup_handler closes a connection that is still open
+        context->sockfd = -1;
+    }
+    for (int fd = 0; fd < MAX_SUBMITTERS; fd++)
+    {
+        if (agent.submitters[fd].in_use)
+        {
+            close(fd);
+        }
+    }
+    close(agent.listen_fd);
+    unlink(socket_path);
+    context->agent = NULL;
+    free(agent.queue);
+    free(agent.submitters);
+    free(fds);
+    return result;
+}
+
+// Print the complete answer lines received so far.
+static void print_replies(char *replies, size_t *used, int *failed)
+{
+    char *newline;
+
+    while ((newline = memchr(replies, '\n', *used)) != NULL)
+    {
+        size_t consumed = newline - replies + 1;
+
+        fwrite(replies, 1, consumed, stdout);
+        if (strncmp(replies, "FAILED", strlen("FAILED")) == 0)
+        {
+            (*failed)++;
+        }
+        memmove(replies, newline + 1, *used - consumed);
+        *used -= consumed;
+    }
+}
+
+// Hand the files to a running agent and print its answer for each of them.
+// Answers are read while paths are still being written, so a large batch
+// cannot fill both socket buffers and stall.
+int submit_files(const char *socket_path, char **file_paths, int num_files, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    struct sockaddr_un addr;
+    char resolved[PATH_MAX];
+    char replies[PATH_MAX + 64];
+    size_t replies_used = 0;
+    char *request = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    size_t offset = 0;
+    int failed = 0;
+    int result = 0;
+    int fd;
+
+    if (unix_address(socket_path, &addr) == -1)
+    {
+        SET_ERROR(context, "Submission socket path is too long");
+        return -1;
+    }
+    for (int i = 0; i < num_files; i++)
+    {
+        // The agent runs in its own working directory
+        if (realpath(file_paths[i], resolved) == NULL || strchr(resolved, '\n') != NULL)
+        {
+            fprintf(stderr, "Skipping %s\n", file_paths[i]);
+            failed++;
+            continue;
+        }
+        if (append(&request, &length, &capacity, resolved, strlen(resolved)) == -1 ||
+            append(&request, &length, &capacity, "\n", 1) == -1)
+        {
+            free(request);
+            SET_ERROR(context, "Failed to allocate memory");
+            return -1;
+        }
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        free(request);
+        SET_ERROR(context, "Cannot reach the agent");
+        return -1;
+    }
+    if (length == 0)
+    {
+        shutdown(fd, SHUT_WR);
+    }
+    for (;;)
+    {
+        struct pollfd pfd = { fd, POLLIN | (offset < length ? POLLOUT : 0), 0 };
+        ssize_t       transferred;
+
+        if (poll(&pfd, 1, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            SET_ERROR(context, "poll");
+            result = -1;
+            break;
+        }
+        if (pfd.revents & POLLOUT)
+        {
+            transferred = send(fd, request + offset, length - offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (transferred == -1 && errno != EAGAIN)
+            {
+                SET_ERROR(context, "Error submitting files");
+                result = -1;
+                break;
+            }
+            offset += transferred > 0 ? (size_t)transferred : 0;
+            if (offset == length)
+            {
+                shutdown(fd, SHUT_WR);
+            }
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            transferred = read(fd, replies + replies_used, sizeof(replies) - replies_used);
+            if (transferred <= 0)
+            {
+                break;
+            }
+            replies_used += transferred;
+            print_replies(replies, &replies_used, &failed);
+        }
+    }
+    close(fd);
+    free(request);
+    if (result == 0 && (failed > 0 || offset < length))
+    {
+        SET_ERROR(context, "Some files were not stored");
+        result = -1;
+    }
+    return result;
+}
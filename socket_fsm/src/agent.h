@@ -0,0 +1,45 @@
+#ifndef SOCKET_FSM_AGENT_H
+#define SOCKET_FSM_AGENT_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Long-lived client agent (-D). It keeps one warm, acknowledged connection to
+// the server and accepts transfer requests from local tools on a Unix domain
+// socket. A submitter (client -S) writes one absolute path per line and shuts
+// down its write side; the agent queues the files from all submitters onto the
+// connection and answers every path with "OK <bytes> <path>" or
+// "FAILED 0 <path>" once the server has acknowledged it.
+#define MAX_SUBMITTERS 1024
+// Ack window of the agent's connection when -w is not given
+#define AGENT_WINDOW 64
+
+typedef struct {
+    int    in_use;
+    int    done;         // no more paths will arrive
+    int    outstanding;  // paths queued or waiting for their ack
+    size_t used;
+    char   line[PATH_MAX];
+} submitter;
+
+typedef struct {
+    char *path;
+    int  owner;
+} submission;
+
+typedef struct {
+    int        listen_fd;
+    int        connected;
+    submitter  *submitters;  // indexed by socket descriptor
+    submission *queue;
+    size_t     head;
+    size_t     tail;
+    size_t     capacity;
+} agent_state;
+
+int serve_submissions(const char *socket_path, void* ctx);
+void report_submission(int owner, const char *path, uint32_t status, uint64_t bytes, void* ctx);
+int submit_files(const char *socket_path, char **file_paths, int num_files, void* ctx);
+
+#endif //SOCKET_FSM_AGENT_H
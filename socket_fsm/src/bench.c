@@ -0,0 +1,1100 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ratelimit.h"
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Loopback benchmark of the server and client binaries. For every combination
+// of file size, number of concurrent clients and chunk size it starts a fresh
+// server, runs the clients with an ack window (-w) and prints one JSON object
+// per run: throughput, CPU seconds per GB on each side and file latency
+// percentiles. A file's latency is the time from the client's line saying it
+// starts sending the file to the line with its ack. Combinations in which a
+// single file per client is more than the data budget (-m) are skipped, except
+// with one client, so 10G files and 1000 clients fit in one matrix.
+//
+// With a baseline file of earlier results, runs that lost more than the
+// tolerance in throughput are reported and the exit status is 1. A baseline
+// that is missing fails the bench too, after the results are written.
+//
+// Each -N adds a network to the matrix: the clients then go through wanproxy,
+// started with those options on the next port, instead of straight to the
+// server.
+//
+// -k runs every combination against more storage sinks of the server (-S). The
+// file sinks are checked by what is on disk, the others by the client's acks.
+//
+// -T tls runs every combination over TLS too, with a self-signed certificate
+// made by the openssl command, and gives its throughput against the plaintext
+// run before it. A connection that never starts its handshake is held open to
+// the server for the whole TLS run; the clients must not wait on it.
+
+#define DEFAULT_SIZES   "1K,64K,1M,16M,10G"
+#define DEFAULT_CLIENTS "1,10,100,1000"
+#define DEFAULT_WINDOW  "64"
+#define DEFAULT_CHUNKS  "1K,64K,1M"
+#define DEFAULT_BUDGET  (256ull << 20)
+#define DEFAULT_PORT    "47011"
+#define DEFAULT_TOLERANCE 10.0
+#define MAX_MATRIX      32
+#define MAX_CLIENTS     1000
+#define MAX_FILES_PER_CLIENT 100
+#define MAX_BASELINE    1024
+#define READY_TIMEOUT_MS 5000
+#define FILL_BLOCK      (1 << 20)
+#define ACK_LINE        "Server stored "
+#define SEND_LINE       "File name: "
+#define STREAM_LINE     "Stream "
+#define SIZE_FIELD      " with the File size"
+#define MAX_PROXY_ARGS  32
+#define MAX_NETWORK_LEN 128
+#define MAX_SINK_LEN    32
+#define DEFAULT_SINKS   "file"
+#define DEFAULT_TRANSPORTS "plain"
+#define MAX_TRANSPORT_LEN 8
+
+typedef struct {
+    uint64_t size;
+    int      clients;
+    uint64_t chunk;
+    char     network[MAX_NETWORK_LEN];  // wanproxy options, empty for loopback
+    char     sink[MAX_SINK_LEN];
+    char     transport[MAX_TRANSPORT_LEN];
+    double   mb_per_s;
+} baseline_entry;
+
+typedef struct {
+    pid_t    pid;
+    int      out;       // read end of the client's stdout, -1 at EOF
+    uint64_t *started;  // when each file started, by its number in the name
+    int      files;
+    char     line[512];
+    size_t   used;
+} client_run;
+
+typedef struct {
+    const char *server;
+    const char *client;
+    const char *dir;
+    const char *port;
+    const char *proxy;
+    const char *window;
+    const char *openssl;
+    char       cert[4096];  // -T tls
+    char       key[4096];
+    uint64_t   budget;
+    FILE       *results;
+} bench_config;
+
+static baseline_entry baseline[MAX_BASELINE];
+static int            num_baseline;
+static int            regressions;
+static int            failed_runs;
+static double         tolerance = DEFAULT_TOLERANCE;
+static double         plain_mb_per_s;   // last plaintext run, what TLS is compared with
+static int            missing_baseline;
+
+static void usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s -S <server> -C <client> [-s sizes] [-c clients] [-b chunks] [-k sinks]\n"
+                    "          [-w window] [-m bytes] [-P wanproxy -N options]... [-d dir] [-p port] [-o results]\n"
+                    "          [-B baseline] [-t percent] [-T transports] [-O openssl]\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -S <server>, -C <client>  The binaries to measure\n", stderr);
+    fputs("  -s <sizes>  File sizes, comma separated with K, M and G suffixes (default " DEFAULT_SIZES ")\n", stderr);
+    fputs("  -c <clients>  Numbers of concurrent clients, 1-1000 (default " DEFAULT_CLIENTS ")\n", stderr);
+    fputs("  -b <chunks>  Frame payload sizes of the clients (default " DEFAULT_CHUNKS ")\n", stderr);
+    fputs("  -k <sinks>  Storage sinks of the server: file, buffered, memory, null (default " DEFAULT_SINKS ")\n", stderr);
+    fputs("  -w <window>  Ack window of the clients (default " DEFAULT_WINDOW ")\n", stderr);
+    fputs("  -m <bytes>  Data to send per run, spread over the clients (default 256M);\n"
+          "              every client sends 1 to 100 files, and more than one client\n"
+          "              only runs when a file each fits in <bytes>\n", stderr);
+    fputs("  -P <wanproxy>  The proxy binary for -N\n", stderr);
+    fputs("  -N <options>  Also run every combination through wanproxy with these options,\n"
+          "               e.g. \"-d 40 -b 12M\"; may be given more than once\n", stderr);
+    fputs("  -d <dir>  Directory for the input and received files (default a new one in /tmp)\n", stderr);
+    fputs("  -p <port>  Loopback port of the server (default " DEFAULT_PORT ")\n", stderr);
+    fputs("  -o <file>  Write the JSON results to <file> instead of stdout\n", stderr);
+    fputs("  -B <file>  Compare with earlier results; a missing file fails the bench\n", stderr);
+    fputs("  -t <percent>  Throughput loss that counts as a regression (default 10)\n", stderr);
+    fputs("  -T <transports>  plain, tls or both (default " DEFAULT_TRANSPORTS ")\n", stderr);
+    fputs("  -O <openssl>  The openssl command that makes the certificate for -T tls (default openssl)\n", stderr);
+}
+
+static int parse_list(const char *text, uint64_t *values, int *count)
+{
+    char *copy = strdup(text);
+    char *save = NULL;
+
+    *count = 0;
+    for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        if (*count == MAX_MATRIX || parse_rate(item, &values[*count]) == -1 || values[*count] == 0)
+        {
+            free(copy);
+            return -1;
+        }
+        (*count)++;
+    }
+    free(copy);
+    return *count > 0 ? 0 : -1;
+}
+
+// Value of "key": in one of our own JSON lines
+static int json_number(const char *line, const char *key, double *value)
+{
+    char        pattern[64];
+    const char *found;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    found = strstr(line, pattern);
+    if (found == NULL)
+    {
+        return -1;
+    }
+    *value = strtod(found + strlen(pattern), NULL);
+    return 0;
+}
+
+static void json_string(const char *line, const char *key, char *value, size_t size)
+{
+    char       pattern[64];
+    const char *found;
+    size_t     len;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+    found = strstr(line, pattern);
+    value[0] = '\0';
+    if (found == NULL)
+    {
+        return;
+    }
+    found += strlen(pattern);
+    len    = strcspn(found, "\"");
+    if (len < size)
+    {
+        memcpy(value, found, len);
+        value[len] = '\0';
+    }
+}
+
+static void load_baseline(const char *path)
+{
+    char line[1024];
+    FILE *in = fopen(path, "r");
+
+    if (in == NULL)
+    {
+        fprintf(stderr, "No baseline at %s, nothing to compare with\n", path);
+        missing_baseline = 1;
+        return;
+    }
+    while (num_baseline < MAX_BASELINE && fgets(line, sizeof(line), in) != NULL)
+    {
+        double size;
+        double clients;
+        double chunk;
+        double mb_per_s;
+        if (json_number(line, "size", &size) == 0 && json_number(line, "clients", &clients) == 0 &&
+            json_number(line, "chunk", &chunk) == 0 && json_number(line, "mb_per_s", &mb_per_s) == 0)
+        {
+            baseline_entry *entry = &baseline[num_baseline++];
+            *entry = (baseline_entry){ .size = (uint64_t)size, .clients = (int)clients, .chunk = (uint64_t)chunk,
+                                       .mb_per_s = mb_per_s };
+            json_string(line, "network", entry->network, sizeof(entry->network));
+            // Results from before -k were all stored in files
+            json_string(line, "sink", entry->sink, sizeof(entry->sink));
+            if (entry->sink[0] == '\0')
+            {
+                strcpy(entry->sink, "file");
+            }
+            json_string(line, "transport", entry->transport, sizeof(entry->transport));
+            if (entry->transport[0] == '\0')
+            {
+                strcpy(entry->transport, "plain");
+            }
+        }
+    }
+    fclose(in);
+}
+
+static const baseline_entry *find_baseline(uint64_t size, int clients, uint64_t chunk, const char *network,
+                                           const char *sink, const char *transport)
+{
+    for (int i = 0; i < num_baseline; i++)
+    {
+        if (baseline[i].size == size && baseline[i].clients == clients && baseline[i].chunk == chunk &&
+            strcmp(baseline[i].network, network) == 0 && strcmp(baseline[i].sink, sink) == 0 &&
+            strcmp(baseline[i].transport, transport) == 0)
+        {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+// Incompressible content, so the numbers do not depend on what the data is
+static int make_input(const char *path, uint64_t size)
+{
+    static char block[FILL_BLOCK];
+    uint64_t    state = 0x9E3779B97F4A7C15ull;
+    int         fd;
+
+    for (size_t i = 0; i + sizeof(uint64_t) <= sizeof(block); i += sizeof(uint64_t))
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        memcpy(block + i, &state, sizeof(state));
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    for (uint64_t written = 0; written < size;)
+    {
+        size_t  want  = size - written < sizeof(block) ? (size_t)(size - written) : sizeof(block);
+        ssize_t moved = write(fd, block, want);
+        if (moved <= 0)
+        {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        written += (uint64_t)moved;
+    }
+    close(fd);
+    return 0;
+}
+
+static void remove_files(const char *dir)
+{
+    DIR           *listing = opendir(dir);
+    struct dirent *entry;
+    char          path[4096];
+
+    if (listing == NULL)
+    {
+        return;
+    }
+    while ((entry = readdir(listing)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+        {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(listing);
+}
+
+static pid_t spawn(char *const argv[], int out, int err)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        // Nothing outlives the bench, and the server must not inherit an
+        // ignored SIGINT as that is how a run ends
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        dup2(out, STDOUT_FILENO);
+        dup2(err, STDERR_FILENO);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int open_loopback(const char *port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)atoi(port)) };
+    int                fd   = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_loopback(const char *port)
+{
+    int fd = open_loopback(port);
+
+    if (fd == -1)
+    {
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+// A certificate for 127.0.0.1 and its key, in the bench directory
+static int make_certificate(bench_config *config)
+{
+    char  *argv[] = { (char *)config->openssl, "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1",
+                      "-subj", "/CN=localhost", "-addext", "subjectAltName=IP:127.0.0.1",
+                      "-keyout", config->key, "-out", config->cert, NULL };
+    int   devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int   status;
+    pid_t pid;
+
+    snprintf(config->cert, sizeof(config->cert), "%s/cert.pem", config->dir);
+    snprintf(config->key, sizeof(config->key), "%s/key.pem", config->dir);
+    pid = fork();
+    if (pid == 0)
+    {
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(devnull);
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "%s could not make a certificate for -T tls\n", config->openssl);
+        return -1;
+    }
+    return 0;
+}
+
+// Until the server listens, and as long as it is still running
+static int wait_ready(pid_t server, const char *port)
+{
+    struct timespec pause = { 0, 10 * 1000000L };
+
+    for (int waited = 0; waited < READY_TIMEOUT_MS; waited += 10)
+    {
+        if (waitpid(server, NULL, WNOHANG) != 0)
+        {
+            return -1;
+        }
+        if (connect_loopback(port))
+        {
+            return 0;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+// wanproxy on port in front of the server, with the options of a -N
+static pid_t start_proxy(const bench_config *config, const char *network, const char *port, int out, int err)
+{
+    char  *copy = strdup(network);
+    char  *argv[MAX_PROXY_ARGS + 6];
+    char  *save = NULL;
+    int   argc  = 0;
+    pid_t proxy;
+
+    if (connect_loopback(port))
+    {
+        fprintf(stderr, "Port %s is already in use\n", port);
+        free(copy);
+        return -1;
+    }
+    argv[argc++] = (char *)config->proxy;
+    for (char *item = strtok_r(copy, " ", &save); item != NULL && argc <= MAX_PROXY_ARGS;
+         item = strtok_r(NULL, " ", &save))
+    {
+        argv[argc++] = item;
+    }
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = (char *)port;
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = (char *)config->port;
+    argv[argc]   = NULL;
+    proxy = spawn(argv, out, err);
+    free(copy);
+    if (proxy == -1 || wait_ready(proxy, port) == -1)
+    {
+        return -1;
+    }
+    return proxy;
+}
+
+static double cpu_seconds(const struct rusage *usage)
+{
+    return (double)usage->ru_utime.tv_sec + (double)usage->ru_utime.tv_usec / 1e6 +
+           (double)usage->ru_stime.tv_sec + (double)usage->ru_stime.tv_usec / 1e6;
+}
+
+static int by_value(const void *left, const void *right)
+{
+    uint64_t a = *(const uint64_t *)left;
+    uint64_t b = *(const uint64_t *)right;
+    return a < b ? -1 : a > b;
+}
+
+static double percentile_ms(const uint64_t *sorted, size_t count, double q)
+{
+    size_t rank = (size_t)(q * (double)count + 0.5);
+
+    if (count == 0)
+    {
+        return 0.0;
+    }
+    rank = rank < 1 ? 1 : rank > count ? count : rank;
+    return (double)sorted[rank - 1] / 1e6;
+}
+
+// Number of the file a client line names: the digits after the last '-' of
+// the name, which ends at end. -1 if there are none.
+static int file_number(const char *name, const char *end)
+{
+    const char *dash = NULL;
+
+    for (const char *c = name; c < end; c++)
+    {
+        dash = *c == '-' ? c : dash;
+    }
+    return dash != NULL && dash + 1 < end ? atoi(dash + 1) : -1;
+}
+
+// Read what a client printed. A line announcing a file starts its clock, and the
+// line with its ack stops it.
+static void read_client(client_run *client, uint64_t *latencies, size_t *num_latencies, size_t capacity)
+{
+    ssize_t got = read(client->out, client->line + client->used, sizeof(client->line) - 1 - client->used);
+    uint64_t now = monotonic_ns();
+    char     *newline;
+
+    if (got <= 0)
+    {
+        if (got == 0 || (errno != EINTR && errno != EAGAIN))
+        {
+            close(client->out);
+            client->out = -1;
+        }
+        return;
+    }
+    client->used += (size_t)got;
+    client->line[client->used] = '\0';
+    while ((newline = strchr(client->line, '\n')) != NULL)
+    {
+        const char *size_field = strstr(client->line, SIZE_FIELD);
+        int        file;
+
+        *newline = '\0';
+        if (size_field != NULL &&
+            (strncmp(client->line, SEND_LINE, strlen(SEND_LINE)) == 0 ||
+             strncmp(client->line, STREAM_LINE, strlen(STREAM_LINE)) == 0))
+        {
+            file = file_number(client->line, size_field);
+            if (file >= 0 && file < client->files)
+            {
+                client->started[file] = now;
+            }
+        }
+        else if (strncmp(client->line, ACK_LINE, strlen(ACK_LINE)) == 0)
+        {
+            const char *path = client->line + strlen(ACK_LINE);
+            const char *end  = strstr(path, " (");
+            file = file_number(path, end != NULL ? end : path + strlen(path));
+            if (file >= 0 && file < client->files && client->started[file] != 0 && *num_latencies < capacity)
+            {
+                latencies[(*num_latencies)++] = now - client->started[file];
+            }
+        }
+        client->used -= (size_t)(newline + 1 - client->line);
+        memmove(client->line, newline + 1, client->used + 1);
+    }
+    // A line longer than the buffer is neither, drop it
+    if (client->used == sizeof(client->line) - 1)
+    {
+        client->used = 0;
+    }
+}
+
+static int run(const bench_config *config, const char *input, uint64_t size, int clients, uint64_t chunk,
+               const char *network, const char *sink, const char *transport)
+{
+    char         in_dir[4096];
+    char         source[sizeof(in_dir) + 32];
+    int          copies = 0;
+    char         out_dir[4096];
+    char         log_path[4096];
+    char         chunk_arg[32];
+    char         proxy_port[16];
+    const char   *client_port = config->port;
+    int          files   = (int)(config->budget / size / (uint64_t)clients);
+    client_run   *runs   = calloc((size_t)clients, sizeof(client_run));
+    uint64_t     *latencies;
+    size_t       num_latencies = 0;
+    int          failures      = 0;
+    int          missing       = 0;
+    int          devnull       = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int          log;
+    pid_t        server;
+    pid_t        proxy = -1;
+    struct rusage usage;
+    double       server_cpu = 0.0;
+    double       client_cpu = 0.0;
+    uint64_t     start;
+    uint64_t     elapsed;
+    uint64_t     total;
+    int          open_outputs;
+    int          tls  = strcmp(transport, "tls") == 0;
+    int          idle = -1;
+    const baseline_entry *previous;
+
+    files = files < 1 ? 1 : files > MAX_FILES_PER_CLIENT ? MAX_FILES_PER_CLIENT : files;
+    latencies = calloc((size_t)clients * (size_t)files, sizeof(uint64_t));
+    snprintf(in_dir, sizeof(in_dir), "%s/in", config->dir);
+    snprintf(out_dir, sizeof(out_dir), "%s/out", config->dir);
+    snprintf(log_path, sizeof(log_path), "%s/bench.log", config->dir);
+    snprintf(chunk_arg, sizeof(chunk_arg), "%llu", (unsigned long long)chunk);
+    log = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (runs == NULL || latencies == NULL || devnull == -1 || log == -1)
+    {
+        perror("bench");
+        return -1;
+    }
+    mkdir(in_dir, 0755);
+    mkdir(out_dir, 0755);
+    // Every file gets its own name, so nothing on the server is overwritten. The
+    // names are links to the input, or to a copy of it once the file system
+    // allows no more links to one file.
+    snprintf(source, sizeof(source), "%s", input);
+    for (int client = 0; client < clients; client++)
+    {
+        for (int file = 0; file < files; file++)
+        {
+            char link_path[sizeof(in_dir) + 32];
+            snprintf(link_path, sizeof(link_path), "%s/%d-%d", in_dir, client, file);
+            if (link(source, link_path) == -1 && errno == EMLINK)
+            {
+                snprintf(source, sizeof(source), "%s/copy-%d", in_dir, copies++);
+                if (make_input(source, size) == -1)
+                {
+                    return -1;
+                }
+                link(source, link_path);
+            }
+            if (access(link_path, F_OK) == -1)
+            {
+                perror(link_path);
+                return -1;
+            }
+        }
+    }
+
+    // Another server on the port would take the clients' files
+    if (connect_loopback(config->port))
+    {
+        fprintf(stderr, "Port %s is already in use\n", config->port);
+        return -1;
+    }
+    char *server_argv[] = { (char *)config->server, "-S", (char *)sink, "127.0.0.1", (char *)config->port, out_dir,
+                            NULL, NULL, NULL, NULL, NULL };
+    if (tls)
+    {
+        server_argv[3] = "-t";
+        server_argv[4] = (char *)config->cert;
+        server_argv[5] = "-k";
+        server_argv[6] = (char *)config->key;
+        server_argv[7] = "127.0.0.1";
+        server_argv[8] = (char *)config->port;
+        server_argv[9] = out_dir;
+    }
+    server = spawn(server_argv, devnull, log);
+    if (server == -1 || wait_ready(server, config->port) == -1)
+    {
+        fprintf(stderr, "The server did not start, see %s\n", log_path);
+        return -1;
+    }
+    if (tls && (idle = open_loopback(config->port)) == -1)
+    {
+        perror("idle connection");
+        return -1;
+    }
+    if (network != NULL)
+    {
+        snprintf(proxy_port, sizeof(proxy_port), "%d", atoi(config->port) + 1);
+        proxy = start_proxy(config, network, proxy_port, devnull, log);
+        if (proxy == -1)
+        {
+            fprintf(stderr, "The proxy did not start, see %s\n", log_path);
+            return -1;
+        }
+        client_port = proxy_port;
+    }
+
+    start = monotonic_ns();
+    for (int client = 0; client < clients; client++)
+    {
+        char **argv = calloc((size_t)files + 12, sizeof(char *));
+        int  argc   = 0;
+        int  pipe_fds[2];
+
+        argv[argc++] = (char *)config->client;
+        argv[argc++] = "-w";
+        argv[argc++] = (char *)config->window;
+        argv[argc++] = "-b";
+        argv[argc++] = chunk_arg;
+        if (tls)
+        {
+            argv[argc++] = "-t";
+            argv[argc++] = (char *)config->cert;
+        }
+        argv[argc++] = "127.0.0.1";
+        argv[argc++] = (char *)client_port;
+        for (int file = 0; file < files; file++)
+        {
+            char link_path[sizeof(in_dir) + 32];
+            snprintf(link_path, sizeof(link_path), "%s/%d-%d", in_dir, client, file);
+            argv[argc++] = strdup(link_path);
+        }
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe2");
+            return -1;
+        }
+        runs[client].files   = files;
+        runs[client].started = calloc((size_t)files, sizeof(uint64_t));
+        if (runs[client].started == NULL)
+        {
+            perror("bench");
+            return -1;
+        }
+        runs[client].pid     = spawn(argv, pipe_fds[1], log);
+        runs[client].out     = pipe_fds[0];
+        close(pipe_fds[1]);
+        for (int i = argc - files; i < argc; i++)
+        {
+            free(argv[i]);
+        }
+        free(argv);
+    }
+
+    open_outputs = clients;
+    while (open_outputs > 0)
+    {
+        struct pollfd *fds = calloc((size_t)open_outputs, sizeof(struct pollfd));
+        int           *who = calloc((size_t)open_outputs, sizeof(int));
+        int           n    = 0;
+
+        for (int client = 0; client < clients; client++)
+        {
+            if (runs[client].out != -1)
+            {
+                fds[n].fd     = runs[client].out;
+                fds[n].events = POLLIN;
+                who[n++]      = client;
+            }
+        }
+        if (poll(fds, (nfds_t)n, -1) > 0)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                if (fds[i].revents != 0)
+                {
+                    read_client(&runs[who[i]], latencies, &num_latencies, (size_t)clients * (size_t)files);
+                }
+            }
+        }
+        free(fds);
+        free(who);
+        open_outputs = 0;
+        for (int client = 0; client < clients; client++)
+        {
+            open_outputs += runs[client].out != -1;
+        }
+    }
+    for (int client = 0; client < clients; client++)
+    {
+        int status;
+        if (wait4(runs[client].pid, &status, 0, &usage) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            failures++;
+        }
+        client_cpu += cpu_seconds(&usage);
+        free(runs[client].started);
+    }
+    elapsed = monotonic_ns() - start;
+
+    if (proxy != -1)
+    {
+        kill(proxy, SIGINT);
+        waitpid(proxy, NULL, 0);
+    }
+    if (idle != -1)
+    {
+        close(idle);
+    }
+    kill(server, SIGINT);
+    if (wait4(server, NULL, 0, &usage) != -1)
+    {
+        server_cpu = cpu_seconds(&usage);
+    }
+
+    // Only what the server actually stored counts
+    total = 0;
+    int on_disk = strcmp(sink, "file") == 0 || strcmp(sink, "buffered") == 0;
+    if (!on_disk)
+    {
+        total   = (uint64_t)num_latencies * size;
+        missing = clients * files - (int)num_latencies;
+    }
+    for (int client = 0; on_disk && client < clients; client++)
+    {
+        for (int file = 0; file < files; file++)
+        {
+            char        path[sizeof(out_dir) + 32];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%d-%d", out_dir, client, file);
+            if (stat(path, &st) == 0 && (uint64_t)st.st_size == size)
+            {
+                total += size;
+            }
+            else
+            {
+                missing++;
+            }
+        }
+    }
+    remove_files(out_dir);
+    remove_files(in_dir);
+
+    qsort(latencies, num_latencies, sizeof(uint64_t), by_value);
+    double seconds   = (double)elapsed / 1e9;
+    double gigabytes = (double)total / 1e9;
+    double mb_per_s  = (double)total / (1024.0 * 1024.0) / seconds;
+    fprintf(config->results,
+            "{\"size\":%llu,\"clients\":%d,\"chunk\":%llu,\"network\":\"%s\",\"sink\":\"%s\",\"transport\":\"%s\",\"files\":%d,\"bytes\":%llu,\"failed_clients\":%d,\"missing_files\":%d,"
+            "\"seconds\":%.6f,\"mb_per_s\":%.3f,\"files_per_s\":%.1f,"
+            "\"server_cpu_s_per_gb\":%.4f,\"client_cpu_s_per_gb\":%.4f,"
+            "\"p50_ms\":%.3f,\"p99_ms\":%.3f",
+            (unsigned long long)size, clients, (unsigned long long)chunk, network ? network : "", sink, transport, clients * files,
+            (unsigned long long)total, failures, missing, seconds, mb_per_s, (double)(total / size) / seconds,
+            gigabytes > 0 ? server_cpu / gigabytes : 0.0, gigabytes > 0 ? client_cpu / gigabytes : 0.0,
+            percentile_ms(latencies, num_latencies, 0.5), percentile_ms(latencies, num_latencies, 0.99));
+    if (network != NULL)
+    {
+        fprintf(stderr, "[%s] ", network);
+    }
+    if (strcmp(sink, "file") != 0)
+    {
+        fprintf(stderr, "(%s) ", sink);
+    }
+    if (tls)
+    {
+        fputs("(tls) ", stderr);
+    }
+    fprintf(stderr, "%10llu B x %4d clients, %8llu B chunks: %10.1f MiB/s %10.1f files/s  p50 %9.3f ms  p99 %9.3f ms",
+            (unsigned long long)size, clients, (unsigned long long)chunk, mb_per_s, (double)(total / size) / seconds,
+            percentile_ms(latencies, num_latencies, 0.5), percentile_ms(latencies, num_latencies, 0.99));
+    if (!tls)
+    {
+        plain_mb_per_s = mb_per_s;
+    }
+    else if (plain_mb_per_s > 0)
+    {
+        fprintf(config->results, ",\"plain_mb_per_s\":%.3f", plain_mb_per_s);
+        fprintf(stderr, "  %.0f%% of plaintext", mb_per_s / plain_mb_per_s * 100.0);
+    }
+    previous = find_baseline(size, clients, chunk, network ? network : "", sink, transport);
+    if (previous != NULL && previous->mb_per_s > 0)
+    {
+        double change = (mb_per_s / previous->mb_per_s - 1.0) * 100.0;
+        fprintf(config->results, ",\"baseline_mb_per_s\":%.3f,\"change_pct\":%.1f", previous->mb_per_s, change);
+        fprintf(stderr, "  %+6.1f%%", change);
+        if (change < -tolerance)
+        {
+            fputs(" REGRESSION", stderr);
+            regressions++;
+        }
+    }
+    fputs("}\n", config->results);
+    fflush(config->results);
+    if (failures > 0 || missing > 0)
+    {
+        failed_runs++;
+        fprintf(stderr, "  %d clients failed and %d files missing, see %s", failures, missing, log_path);
+    }
+    fputc('\n', stderr);
+
+    free(runs);
+    free(latencies);
+    close(devnull);
+    close(log);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config  config = { .port = DEFAULT_PORT, .window = DEFAULT_WINDOW, .openssl = "openssl", .budget = DEFAULT_BUDGET, .results = stdout };
+    uint64_t      sizes[MAX_MATRIX];
+    uint64_t      clients[MAX_MATRIX];
+    uint64_t      chunks[MAX_MATRIX];
+    int           num_sizes;
+    int           num_clients;
+    int           num_chunks;
+    const char    *size_list    = DEFAULT_SIZES;
+    const char    *client_list  = DEFAULT_CLIENTS;
+    const char    *chunk_list   = DEFAULT_CHUNKS;
+    char          sink_list[256] = DEFAULT_SINKS;
+    char          *sinks[MAX_MATRIX];
+    int           num_sinks     = 0;
+    char          transport_list[64] = DEFAULT_TRANSPORTS;
+    char          *transports[2];
+    int           num_transports = 0;
+    int           use_tls       = 0;
+    char          *save         = NULL;
+    const char    *results_path = NULL;
+    const char    *baseline_path = NULL;
+    const char    *networks[MAX_MATRIX] = { NULL };  // loopback first
+    int           num_networks  = 1;
+    char          temp_dir[]    = "/tmp/fsmbench.XXXXXX";
+    char          temp_dir_path[4096];
+    struct rlimit limit;
+    int           opt;
+
+    while ((opt = getopt(argc, argv, "hS:C:s:c:b:k:w:m:d:p:o:B:t:P:N:T:O:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'S': config.server = optarg; break;
+            case 'C': config.client = optarg; break;
+            case 's': size_list = optarg; break;
+            case 'c': client_list = optarg; break;
+            case 'b': chunk_list = optarg; break;
+            case 'k':
+                if (strlen(optarg) >= sizeof(sink_list))
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                strcpy(sink_list, optarg);
+                break;
+            case 'T':
+                if (strlen(optarg) >= sizeof(transport_list))
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                strcpy(transport_list, optarg);
+                break;
+            case 'O': config.openssl = optarg; break;
+            case 'w':
+                if (atoi(optarg) < 1)
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                config.window = optarg;
+                break;
+            case 'd': config.dir = optarg; break;
+            case 'p': config.port = optarg; break;
+            case 'o': results_path = optarg; break;
+            case 'B': baseline_path = optarg; break;
+            case 'P': config.proxy = optarg; break;
+            case 'N':
+                if (num_networks == MAX_MATRIX || strlen(optarg) >= MAX_NETWORK_LEN)
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                networks[num_networks++] = optarg;
+                break;
+            case 'm':
+                if (parse_rate(optarg, &config.budget) == -1 || config.budget == 0)
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                tolerance = strtod(optarg, NULL);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (config.server == NULL || config.client == NULL || parse_list(size_list, sizes, &num_sizes) == -1 ||
+        parse_list(client_list, clients, &num_clients) == -1 || parse_list(chunk_list, chunks, &num_chunks) == -1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (char *item = strtok_r(sink_list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        if (num_sinks == MAX_MATRIX || strlen(item) >= MAX_SINK_LEN)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        sinks[num_sinks++] = item;
+    }
+    if (num_sinks == 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    save = NULL;
+    for (char *item = strtok_r(transport_list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        if (num_transports == 2 || (strcmp(item, "plain") != 0 && strcmp(item, "tls") != 0))
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        use_tls |= strcmp(item, "tls") == 0;
+        transports[num_transports++] = item;
+    }
+    if (num_transports == 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    // Plaintext first, so each TLS run has its plaintext run to compare with
+    if (num_transports == 2 && strcmp(transports[0], "tls") == 0)
+    {
+        transports[0] = transports[1];
+        transports[1] = "tls";
+    }
+    if (num_networks > 1 && config.proxy == NULL)
+    {
+        fputs("-N needs the proxy binary, -P\n", stderr);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_clients; i++)
+    {
+        if (clients[i] > MAX_CLIENTS)
+        {
+            fputs("At most 1000 concurrent clients\n", stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    // A pipe per client on top of the server's connections
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (config.dir == NULL && (config.dir = mkdtemp(temp_dir)) == NULL)
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    if (mkdir(config.dir, 0755) == -1 && errno != EEXIST)
+    {
+        perror(config.dir);
+        return EXIT_FAILURE;
+    }
+    if (results_path != NULL && (config.results = fopen(results_path, "we")) == NULL)
+    {
+        perror(results_path);
+        return EXIT_FAILURE;
+    }
+    if (baseline_path != NULL)
+    {
+        load_baseline(baseline_path);
+    }
+    if (use_tls && make_certificate(&config) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int s = 0; s < num_sizes; s++)
+    {
+        char input[4096];
+        snprintf(input, sizeof(input), "%s/input-%llu", config.dir, (unsigned long long)sizes[s]);
+        if (make_input(input, sizes[s]) == -1)
+        {
+            return EXIT_FAILURE;
+        }
+        for (int n = 0; n < num_networks; n++)
+        {
+            for (int k = 0; k < num_sinks; k++)
+            {
+                for (int c = 0; c < num_clients; c++)
+                {
+                    if (clients[c] > 1 && sizes[s] > config.budget / clients[c])
+                    {
+                        fprintf(stderr, "%10llu B x %4d clients: skipped, a file each is more than -m\n",
+                                (unsigned long long)sizes[s], (int)clients[c]);
+                        continue;
+                    }
+                    for (int b = 0; b < num_chunks; b++)
+                    {
+                        for (int t = 0; t < num_transports; t++)
+                        {
+                            if (run(&config, input, sizes[s], (int)clients[c], chunks[b], networks[n], sinks[k],
+                                    transports[t]) == -1)
+                            {
+                                unlink(input);
+                                return EXIT_FAILURE;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        unlink(input);
+    }
+    if (results_path != NULL)
+    {
+        fclose(config.results);
+    }
+    // Keep a directory we were given, and the log of our own one if it has errors
+    snprintf(temp_dir_path, sizeof(temp_dir_path), "%s/in", config.dir);
+    rmdir(temp_dir_path);
+    snprintf(temp_dir_path, sizeof(temp_dir_path), "%s/out", config.dir);
+    rmdir(temp_dir_path);
+    if (use_tls)
+    {
+        unlink(config.cert);
+        unlink(config.key);
+    }
+    if (config.dir == temp_dir && !failed_runs)
+    {
+        snprintf(temp_dir_path, sizeof(temp_dir_path), "%s/bench.log", config.dir);
+        unlink(temp_dir_path);
+        rmdir(config.dir);
+    }
+    if (failed_runs > 0)
+    {
+        fprintf(stderr, "%d runs did not store every file\n", failed_runs);
+        return EXIT_FAILURE;
+    }
+    if (regressions > 0)
+    {
+        fprintf(stderr, "%d runs lost more than %.0f%% throughput against the baseline\n", regressions, tolerance);
+        return EXIT_FAILURE;
+    }
+    if (missing_baseline)
+    {
+        fprintf(stderr, "No baseline at %s, so nothing was compared. To make these results the baseline:\n"
+                        "  cp %s %s\n", baseline_path, results_path != NULL ? results_path : "<results>",
+                baseline_path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
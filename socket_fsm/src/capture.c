@@ -0,0 +1,99 @@
+#include "capture.h"
+#include "ratelimit.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Writes come from the thread that owns the connection, so nothing is locked
+static FILE     *capture_out;
+static int      captured_fd = -1;
+static uint32_t session;
+static uint64_t start_ns;
+
+int capture_start(const char *path)
+{
+    capture_out = fopen(path, "we");
+    if (capture_out == NULL)
+    {
+        return -1;
+    }
+    start_ns = monotonic_ns();
+    if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, capture_out) != CAPTURE_MAGIC_LEN)
+    {
+        capture_stop();
+        return -1;
+    }
+    return 0;
+}
+
+void capture_connection(int fd)
+{
+    if (capture_out != NULL)
+    {
+        captured_fd = fd;
+        session++;
+    }
+}
+
+static void write_record(uint32_t length)
+{
+    capture_record record = { monotonic_ns() - start_ns, session, length };
+
+    fwrite(&record, sizeof(record), 1, capture_out);
+}
+
+static void check_output(void)
+{
+    if (ferror(capture_out))
+    {
+        perror("capture");
+        capture_stop();
+    }
+}
+
+void capture_data(int fd, const void *data, size_t size)
+{
+    if (capture_out == NULL || fd != captured_fd || size == 0)
+    {
+        return;
+    }
+    write_record((uint32_t)size);
+    fwrite(data, 1, size, capture_out);
+    check_output();
+}
+
+// What sendfile just sent, read back from the file
+void capture_file(int fd, int file_fd, off_t offset, size_t size)
+{
+    char buffer[65536];
+
+    if (capture_out == NULL || fd != captured_fd || size == 0)
+    {
+        return;
+    }
+    write_record((uint32_t)size);
+    while (size > 0)
+    {
+        ssize_t got = pread(file_fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer), offset);
+        if (got <= 0)
+        {
+            // Keep the record its stated length even if the file shrank
+            memset(buffer, 0, sizeof(buffer));
+            got = (ssize_t)(size < sizeof(buffer) ? size : sizeof(buffer));
+        }
+        fwrite(buffer, 1, (size_t)got, capture_out);
+        offset += got;
+        size   -= (size_t)got;
+    }
+    check_output();
+}
+
+void capture_stop(void)
+{
+    if (capture_out != NULL)
+    {
+        fclose(capture_out);
+        capture_out = NULL;
+        captured_fd = -1;
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef SOCKET_FSM_CAPTURE_H
+#define SOCKET_FSM_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Wire capture of what the client sends (-X), for fsmreplay. The file starts
+// with CAPTURE_MAGIC and then holds one record per write to the server:
+//   u64 ns since the capture started, u32 session, u32 length, length bytes
+// Sessions number the connections to the server from 1, so an agent that
+// reconnects leaves several in one file. Bytes are captured before TLS, so a
+// capture replays over plain TCP; descriptors passed with -p are not captured.
+#define CAPTURE_MAGIC       "FSMCAP1\n"
+#define CAPTURE_MAGIC_LEN   8
+#define CAPTURE_RECORD_SIZE 16
+
+typedef struct {
+    uint64_t ns;
+    uint32_t session;
+    uint32_t length;
+} capture_record;
+
+int capture_start(const char *path);
+// Capture the writes to fd from now on, as a new session
+void capture_connection(int fd);
+void capture_data(int fd, const void *data, size_t size);
+void capture_file(int fd, int file_fd, off_t offset, size_t size);
+void capture_stop(void);
+
+#endif //SOCKET_FSM_CAPTURE_H
@@ -0,0 +1,703 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "catalog.h"
+#include "codec.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define CATALOG_MIN_CAPACITY 1024
+#define CATALOG_MIN_EXTRA    (64 * 1024)
+#define CATALOG_TEMP_NAME    CATALOG_TABLE_NAME ".tmp"
+
+typedef struct {
+    char     magic[CATALOG_MAGIC_LEN];
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t heap_size;
+    uint64_t check;             // hash_bytes of the fields before it
+} catalog_header;
+
+static uint64_t hash_of_name(const char *name, size_t name_len)
+{
+    uint64_t hash = hash_bytes(HASH_BASIS, name, name_len);
+
+    return hash < 2 ? hash + 2 : hash;
+}
+
+static uint64_t header_check(const catalog_header *header)
+{
+    return hash_bytes(HASH_BASIS, header, offsetof(catalog_header, check));
+}
+
+static uint32_t record_check(const catalog_record *record, const char *name)
+{
+    catalog_record copy = *record;
+
+    copy.check = 0;
+    return (uint32_t)hash_bytes(hash_bytes(HASH_BASIS, &copy, sizeof(copy)), name, copy.name_len);
+}
+
+static const char *entry_name(const catalog *index, const catalog_entry *entry)
+{
+    return entry->name_offset < index->heap_size ? index->heap + entry->name_offset
+                                                 : index->extra + (entry->name_offset - index->heap_size);
+}
+
+static int entries_in_map(const catalog *index)
+{
+    return index->map != NULL && (unsigned char *)index->entries == index->map + sizeof(catalog_header);
+}
+
+// The slot holding name, or the free slot that ends its probe sequence
+static catalog_entry *find_slot(const catalog *index, const char *name, size_t name_len, uint64_t name_hash)
+{
+    uint64_t mask = index->capacity - 1;
+
+    for (uint64_t i = name_hash & mask;; i = (i + 1) & mask)
+    {
+        catalog_entry *entry = &index->entries[i];
+        if (entry->name_hash == 0 ||
+            (entry->name_hash == name_hash && entry->name_len == name_len &&
+             memcmp(entry_name(index, entry), name, name_len) == 0))
+        {
+            return entry;
+        }
+    }
+}
+
+static catalog_entry *free_slot(catalog_entry *entries, uint64_t capacity, uint64_t name_hash)
+{
+    uint64_t i = name_hash & (capacity - 1);
+
+    while (entries[i].name_hash != 0)
+    {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &entries[i];
+}
+
+// Rehash into a table with room for twice the names, leaving removed ones behind.
+// The names stay where they are.
+static int grow_table(catalog *index)
+{
+    uint64_t      capacity = index->capacity;
+    catalog_entry *entries;
+
+    while ((index->count + 1) * 2 > capacity)
+    {
+        capacity *= 2;
+    }
+    entries = calloc(capacity, sizeof(catalog_entry));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < index->capacity; i++)
+    {
+        if (index->entries[i].name_hash >= 2)
+        {
+            *free_slot(entries, capacity, index->entries[i].name_hash) = index->entries[i];
+        }
+    }
+    if (!entries_in_map(index))
+    {
+        free(index->entries);
+    }
+    index->entries  = entries;
+    index->capacity = capacity;
+    index->used     = index->count;
+    return 0;
+}
+
+static int add_name(catalog *index, const char *name, size_t name_len, uint64_t *offset)
+{
+    if (index->extra_size + name_len > index->extra_capacity)
+    {
+        uint64_t capacity = index->extra_capacity ? index->extra_capacity : CATALOG_MIN_EXTRA;
+        char     *grown;
+        while (index->extra_size + name_len > capacity)
+        {
+            capacity *= 2;
+        }
+        grown = realloc(index->extra, capacity);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        index->extra          = grown;
+        index->extra_capacity = capacity;
+    }
+    memcpy(index->extra + index->extra_size, name, name_len);
+    *offset = index->heap_size + index->extra_size;
+    index->extra_size += name_len;
+    return 0;
+}
+
+static int empty_table(catalog *index)
+{
+    index->capacity = CATALOG_MIN_CAPACITY;
+    index->entries  = calloc(index->capacity, sizeof(catalog_entry));
+    return index->entries == NULL ? -1 : 0;
+}
+
+static int apply_put(catalog *index, const char *name, size_t name_len, uint64_t size, uint64_t hash,
+                     uint32_t flags)
+{
+    uint64_t      name_hash = hash_of_name(name, name_len);
+    catalog_entry *entry;
+
+    if (index->entries == NULL && empty_table(index) == -1)
+    {
+        return -1;
+    }
+    entry = find_slot(index, name, name_len, name_hash);
+    if (entry->name_hash == 0)
+    {
+        uint64_t offset;
+        if ((index->used + 1) * 10 > index->capacity * 7)
+        {
+            if (grow_table(index) == -1)
+            {
+                return -1;
+            }
+            entry = find_slot(index, name, name_len, name_hash);
+        }
+        if (add_name(index, name, name_len, &offset) == -1)
+        {
+            return -1;
+        }
+        entry->name_hash   = name_hash;
+        entry->name_offset = offset;
+        entry->name_len    = (uint32_t)name_len;
+        index->used++;
+        index->count++;
+    }
+    entry->flags = flags;
+    entry->size  = size;
+    entry->hash  = hash;
+    return 0;
+}
+
+static void apply_remove(catalog *index, const char *name, size_t name_len)
+{
+    catalog_entry *entry = find_slot(index, name, name_len, hash_of_name(name, name_len));
+
+    if (entry->name_hash >= 2)
+    {
+        entry->name_hash = 1;
+        index->count--;
+    }
+}
+
+static void release_table(catalog *index)
+{
+    if (index->entries != NULL && !entries_in_map(index))
+    {
+        free(index->entries);
+    }
+    if (index->map != NULL)
+    {
+        munmap(index->map, index->map_size);
+    }
+    free(index->extra);
+    index->map            = NULL;
+    index->map_size       = 0;
+    index->entries        = NULL;
+    index->capacity       = 0;
+    index->count          = 0;
+    index->used           = 0;
+    index->heap           = NULL;
+    index->heap_size      = 0;
+    index->extra          = NULL;
+    index->extra_size     = 0;
+    index->extra_capacity = 0;
+}
+
+// Every slot is free or holds a name that lies within the heap, and the names
+// are as many as the header says, so no probe runs out of free slots
+static int entries_valid(const catalog_entry *entries, const catalog_header *header)
+{
+    uint64_t names = 0;
+
+    for (uint64_t i = 0; i < header->capacity; i++)
+    {
+        const catalog_entry *entry = &entries[i];
+        if (entry->name_hash == 0)
+        {
+            continue;
+        }
+        if (entry->name_hash == 1 || entry->name_len == 0 || entry->name_offset > header->heap_size ||
+            entry->name_len > header->heap_size - entry->name_offset)
+        {
+            return 0;
+        }
+        names++;
+    }
+    return names == header->count;
+}
+
+// Map the table private: lookups read it where it lies and changes stay in this
+// process. A table that does not check out is counted as damaged and the
+// catalog starts empty, which only makes files be sent again.
+static int load_table(catalog *index)
+{
+    catalog_header header;
+    struct stat    st;
+    unsigned char  *map;
+    int            fd = openat(index->dir_fd, CATALOG_TABLE_NAME, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        return errno == ENOENT ? empty_table(index) : -1;
+    }
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(header))
+    {
+        close(fd);
+        index->damaged += (uint64_t)st.st_size;
+        return empty_table(index);
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, CATALOG_MAGIC, CATALOG_MAGIC_LEN) != 0 || header.check != header_check(&header) ||
+        header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0 || header.count > header.capacity / 2 ||
+        header.capacity > ((uint64_t)st.st_size - sizeof(header)) / sizeof(catalog_entry) ||
+        sizeof(header) + header.capacity * sizeof(catalog_entry) + header.heap_size != (uint64_t)st.st_size ||
+        !entries_valid((const catalog_entry *)(map + sizeof(header)), &header))
+    {
+        munmap(map, (size_t)st.st_size);
+        index->damaged += (uint64_t)st.st_size;
+        return empty_table(index);
+    }
+    index->map       = map;
+    index->map_size  = (size_t)st.st_size;
+    index->entries   = (catalog_entry *)(map + sizeof(header));
+    index->capacity  = header.capacity;
+    index->count     = header.count;
+    index->used      = header.count;
+    index->heap      = (const char *)map + sizeof(header) + header.capacity * sizeof(catalog_entry);
+    index->heap_size = header.heap_size;
+    return 0;
+}
+
+// Apply the log up to its first bad record and cut it off there
+static int replay_log(catalog *index)
+{
+    struct stat   st;
+    unsigned char *map;
+    uint64_t      offset = 0;
+    uint64_t      size;
+    int           result = 0;
+
+    if (fstat(index->log_fd, &st) == -1)
+    {
+        return -1;
+    }
+    size = (uint64_t)st.st_size;
+    if (size == 0)
+    {
+        return 0;
+    }
+    map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, index->log_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    while (offset + sizeof(catalog_record) <= size)
+    {
+        catalog_record record;
+        const char     *name = (const char *)map + offset + sizeof(record);
+
+        memcpy(&record, map + offset, sizeof(record));
+        if ((record.type != CATALOG_PUT && record.type != CATALOG_REMOVE) || record.name_len == 0 ||
+            record.name_len > MAX_NAME_LEN || record.name_len > size - offset - sizeof(record) ||
+            record.check != record_check(&record, name))
+        {
+            break;
+        }
+        if (record.type == CATALOG_PUT)
+        {
+            if (apply_put(index, name, record.name_len, record.size, record.hash, record.flags) == -1)
+            {
+                result = -1;
+                break;
+            }
+        }
+        else
+        {
+            apply_remove(index, name, record.name_len);
+        }
+        index->replayed++;
+        offset += sizeof(record) + record.name_len;
+    }
+    munmap(map, (size_t)size);
+    if (result == 0 && offset < size)
+    {
+        index->damaged += size - offset;
+        result = ftruncate(index->log_fd, (off_t)offset);
+    }
+    index->log_size = offset;
+    return result;
+}
+
+// Whether the catalog followed the run before the one with this generation. A
+// catalog without a generation (new, or from before they were kept) did not.
+static int follows(const catalog *index, uint64_t generation)
+{
+    char    text[32];
+    char    *end;
+    int     fd = openat(index->dir_fd, CATALOG_GENERATION_NAME, O_RDONLY | O_CLOEXEC);
+    ssize_t got;
+
+    if (fd == -1)
+    {
+        return 0;
+    }
+    got = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    text[got > 0 ? got : 0] = '\0';
+    return got > 0 && strtoull(text, &end, 10) + 1 == generation && *end == '\n';
+}
+
+// Synced before the catalog answers for this run, like the table it goes with
+static int follow_generation(catalog *index, uint64_t generation)
+{
+    char text[32];
+    int  length = snprintf(text, sizeof(text), "%" PRIu64 "\n", generation);
+    int  fd     = openat(index->dir_fd, CATALOG_GENERATION_NAME ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int  result = -1;
+
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (write(fd, text, (size_t)length) == length && fsync(fd) == 0 &&
+        renameat(index->dir_fd, CATALOG_GENERATION_NAME ".tmp", index->dir_fd, CATALOG_GENERATION_NAME) == 0 &&
+        fsync(index->dir_fd) == 0)
+    {
+        result = 0;
+    }
+    close(fd);
+    return result;
+}
+
+int catalog_open(catalog *index, const char *directory, uint64_t generation)
+{
+    int base_fd;
+    int saved;
+
+    memset(index, 0, sizeof(*index));
+    index->dir_fd  = -1;
+    index->lock_fd = -1;
+    index->log_fd  = -1;
+    base_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd == -1)
+    {
+        return -1;
+    }
+    if (mkdirat(base_fd, CATALOG_DIR_NAME, 0755) == -1 && errno != EEXIST)
+    {
+        saved = errno;
+        close(base_fd);
+        errno = saved;
+        return -1;
+    }
+    index->dir_fd = openat(base_fd, CATALOG_DIR_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(base_fd);
+    if (index->dir_fd == -1)
+    {
+        return -1;
+    }
+    index->lock_fd = openat(index->dir_fd, CATALOG_LOCK_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (index->lock_fd == -1 || flock(index->lock_fd, LOCK_EX | LOCK_NB) == -1 || load_table(index) == -1)
+    {
+        goto fail;
+    }
+    index->log_fd = openat(index->dir_fd, CATALOG_LOG_NAME, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (index->log_fd == -1 || replay_log(index) == -1)
+    {
+        goto fail;
+    }
+    // A run without the catalog may have replaced or removed any file it holds,
+    // and what that run left is not known: start over empty
+    if (!follows(index, generation))
+    {
+        index->forgotten = index->count;
+        release_table(index);
+        if (empty_table(index) == -1 || catalog_checkpoint(index) == -1)
+        {
+            goto fail;
+        }
+    }
+    if (index->log_size > CATALOG_LOG_LIMIT && catalog_checkpoint(index) == -1)
+    {
+        goto fail;
+    }
+    if (follow_generation(index, generation) == -1)
+    {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    saved = errno;
+    if (index->log_fd != -1)
+    {
+        // Nothing was changed, there is nothing to checkpoint
+        close(index->log_fd);
+        index->log_fd = -1;
+    }
+    catalog_close(index);
+    errno = saved;
+    return -1;
+}
+
+const catalog_entry *catalog_find(const catalog *index, const char *name)
+{
+    size_t        name_len = strlen(name);
+    catalog_entry *entry;
+
+    if (index->entries == NULL)
+    {
+        return NULL;
+    }
+    entry = find_slot(index, name, name_len, hash_of_name(name, name_len));
+    return entry->name_hash >= 2 ? entry : NULL;
+}
+
+// One writev per record; a failed one is cut off again, and when that fails too
+// the log is closed so nothing follows a partial record
+static int log_append(catalog *index, catalog_record *record, const char *name)
+{
+    struct iovec iov[2] = { { record, sizeof(*record) }, { (void *)name, record->name_len } };
+    size_t       bytes  = sizeof(*record) + record->name_len;
+    ssize_t      written;
+
+    if (index->log_fd == -1)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    record->check = record_check(record, name);
+    do
+    {
+        written = writev(index->log_fd, iov, 2);
+    } while (written == -1 && errno == EINTR);
+    if (written != (ssize_t)bytes)
+    {
+        int saved = written == -1 ? errno : ENOSPC;
+        if (ftruncate(index->log_fd, (off_t)index->log_size) == -1)
+        {
+            close(index->log_fd);
+            index->log_fd = -1;
+        }
+        errno = saved;
+        return -1;
+    }
+    index->log_size += bytes;
+    return 0;
+}
+
+int catalog_put(catalog *index, const char *name, uint64_t size, const uint64_t *hash)
+{
+    catalog_record record = { CATALOG_PUT, (uint32_t)strlen(name), hash != NULL ? CATALOG_HASHED : 0, 0, size,
+                              hash != NULL ? *hash : 0 };
+
+    if (log_append(index, &record, name) == -1 ||
+        apply_put(index, name, record.name_len, record.size, record.hash, record.flags) == -1)
+    {
+        return -1;
+    }
+    return index->log_size > CATALOG_LOG_LIMIT ? catalog_checkpoint(index) : 0;
+}
+
+// Names the catalog does not hold cost no record
+int catalog_remove(catalog *index, const char *name)
+{
+    catalog_record record = { CATALOG_REMOVE, (uint32_t)strlen(name), 0, 0, 0, 0 };
+
+    int            result;
+
+    if (catalog_find(index, name) == NULL)
+    {
+        return 0;
+    }
+    // The file is about to change: forget it here even when the log fails
+    result = log_append(index, &record, name);
+    apply_remove(index, name, record.name_len);
+    return result;
+}
+
+// Write the names into a fresh table at half load with the heap compacted, sync
+// it and rename it over the old one. Only then is the log emptied: replaying it
+// again over the new table would change nothing.
+int catalog_checkpoint(catalog *index)
+{
+    catalog_header header;
+    catalog_entry  *entries;
+    uint64_t       capacity  = CATALOG_MIN_CAPACITY;
+    uint64_t       heap_size = 0;
+    int            result    = 0;
+    FILE           *out;
+    int            fd;
+
+    while (index->count * 2 > capacity)
+    {
+        capacity *= 2;
+    }
+    entries = calloc(capacity, sizeof(catalog_entry));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < index->capacity; i++)
+    {
+        catalog_entry *entry = &index->entries[i];
+        catalog_entry *slot;
+        if (entry->name_hash < 2)
+        {
+            continue;
+        }
+        slot              = free_slot(entries, capacity, entry->name_hash);
+        *slot             = *entry;
+        slot->name_offset = heap_size;
+        heap_size        += entry->name_len;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CATALOG_MAGIC, CATALOG_MAGIC_LEN);
+    header.capacity  = capacity;
+    header.count     = index->count;
+    header.heap_size = heap_size;
+    header.check     = header_check(&header);
+
+    fd = openat(index->dir_fd, CATALOG_TEMP_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || (out = fdopen(fd, "w")) == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        free(entries);
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, out) != 1 || fwrite(entries, sizeof(catalog_entry), capacity, out) != capacity)
+    {
+        result = -1;
+    }
+    free(entries);
+    // The names in the order their offsets were handed out above
+    for (uint64_t i = 0; i < index->capacity && result == 0; i++)
+    {
+        const catalog_entry *entry = &index->entries[i];
+        if (entry->name_hash >= 2 && fwrite(entry_name(index, entry), 1, entry->name_len, out) != entry->name_len)
+        {
+            result = -1;
+        }
+    }
+    if (fflush(out) == EOF || fsync(fileno(out)) == -1)
+    {
+        result = -1;
+    }
+    if (fclose(out) == EOF)
+    {
+        result = -1;
+    }
+    if (result == -1 || renameat(index->dir_fd, CATALOG_TEMP_NAME, index->dir_fd, CATALOG_TABLE_NAME) == -1 ||
+        fsync(index->dir_fd) == -1)
+    {
+        unlinkat(index->dir_fd, CATALOG_TEMP_NAME, 0);
+        return -1;
+    }
+    if (ftruncate(index->log_fd, 0) == -1)
+    {
+        return -1;
+    }
+    index->log_size = 0;
+    release_table(index);
+    if (load_table(index) == -1)
+    {
+        // The table is on disk; this process only forgets it until it opens it again
+        return empty_table(index);
+    }
+    return 0;
+}
+
+// Forget that the catalog followed this run, so the next open empties it, and
+// close it without a checkpoint. The generation is zeroed if it cannot be removed.
+int catalog_abandon(catalog *index)
+{
+    int result = 0;
+    int fd;
+
+    if (unlinkat(index->dir_fd, CATALOG_GENERATION_NAME, 0) == -1 && errno != ENOENT)
+    {
+        fd = openat(index->dir_fd, CATALOG_GENERATION_NAME, O_WRONLY | O_TRUNC | O_CLOEXEC);
+        if (fd == -1 || fsync(fd) == -1)
+        {
+            result = -1;
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+    if (fsync(index->dir_fd) == -1)
+    {
+        result = -1;
+    }
+    if (index->log_fd != -1)
+    {
+        close(index->log_fd);
+        index->log_fd = -1;
+    }
+    catalog_close(index);
+    return result;
+}
+
+// A catalog that changed since it was opened is checkpointed first
+int catalog_close(catalog *index)
+{
+    int result = 0;
+
+    if (index->log_fd != -1)
+    {
+        if (index->log_size > 0)
+        {
+            result = catalog_checkpoint(index);
+        }
+        close(index->log_fd);
+        index->log_fd = -1;
+    }
+    release_table(index);
+    if (index->lock_fd != -1)
+    {
+        close(index->lock_fd);
+        index->lock_fd = -1;
+    }
+    if (index->dir_fd != -1)
+    {
+        close(index->dir_fd);
+        index->dir_fd = -1;
+    }
+    return result;
+}
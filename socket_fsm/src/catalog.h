@@ -0,0 +1,95 @@
+#ifndef SOCKET_FSM_CATALOG_H
+#define SOCKET_FSM_CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Persistent index of the files a server has stored (server -I): the size of
+// every name and, when its data went through user space, its content hash
+// (hash_bytes, as in -H manifests). Manifests are answered from it without a
+// stat or a read per file. It lives in .catalog under the storage directory:
+//   table  "FSMCAT1\n", u64 capacity, u64 count, u64 heap_size, u64 check,
+//          then capacity catalog_entry slots of an open addressing table
+//          (linear probing), then heap_size bytes of names
+//   log    catalog_record and the name, for every change since the table
+// The table is only ever replaced whole, written aside and renamed over the
+// old one, so opening maps it private and checks its entries; the log after
+// it is replayed on top, up to its first torn or damaged record. A checkpoint
+// writes a new table and empties the log, when the log passes
+// CATALOG_LOG_LIMIT and at close.
+//
+// Records are written to the log before the table in memory changes, without
+// an fsync: what was committed survives the server crashing, a power loss may
+// cost the last records, and with them the catalog only forgets files, which
+// are then sent again.
+//
+// generation holds the store generation (STORAGE_GENERATION_NAME) of the last
+// run the catalog followed. Every server run on the store bumps that, with -I
+// or not; a catalog that did not follow the run before this one may vouch for
+// files that have changed since, so it is emptied at open.
+#define CATALOG_DIR_NAME   ".catalog"
+#define CATALOG_TABLE_NAME "table"
+#define CATALOG_LOG_NAME   "log"
+#define CATALOG_LOCK_NAME  "lock"
+#define CATALOG_GENERATION_NAME "generation"
+#define CATALOG_MAGIC      "FSMCAT1\n"
+#define CATALOG_MAGIC_LEN  8
+#define CATALOG_LOG_LIMIT  (4u << 20)
+#define CATALOG_PUT        0x20545550u      // "PUT "
+#define CATALOG_REMOVE     0x204d4552u      // "REM "
+#define CATALOG_HASHED     1u               // entry flag: hash is the content hash
+
+// A slot with name_hash 0 is free, 1 is a removed name
+typedef struct {
+    uint64_t name_hash;
+    uint64_t name_offset;       // in the name heap
+    uint32_t name_len;
+    uint32_t flags;
+    uint64_t size;
+    uint64_t hash;
+} catalog_entry;
+
+typedef struct {
+    uint32_t type;
+    uint32_t name_len;
+    uint32_t flags;
+    uint32_t check;             // of the rest of the record and the name
+    uint64_t size;
+    uint64_t hash;
+} catalog_record;
+
+typedef struct {
+    int           dir_fd;
+    int           lock_fd;
+    int           log_fd;
+    unsigned char *map;         // the table file, private
+    size_t        map_size;
+    catalog_entry *entries;     // in map, or allocated once the table grew
+    uint64_t      capacity;     // a power of two
+    uint64_t      count;        // names
+    uint64_t      used;         // slots not free
+    const char    *heap;        // names in map
+    uint64_t      heap_size;
+    char          *extra;       // names added since, at offsets from heap_size on
+    uint64_t      extra_size;
+    uint64_t      extra_capacity;
+    uint64_t      log_size;
+    uint64_t      replayed;     // log records applied at open
+    uint64_t      damaged;      // bytes of log cut off, or of a table not used, at open
+    uint64_t      forgotten;    // names dropped at open, as the store changed without the catalog
+} catalog;
+
+// Takes the catalog's lock, fails with EWOULDBLOCK while another server has it.
+// generation is this run's store generation.
+int catalog_open(catalog *index, const char *directory, uint64_t generation);
+// Safe from several threads while nothing changes the catalog
+const catalog_entry *catalog_find(const catalog *index, const char *name);
+// hash is NULL when the content hash is not known
+int catalog_put(catalog *index, const char *name, uint64_t size, const uint64_t *hash);
+int catalog_remove(catalog *index, const char *name);
+int catalog_checkpoint(catalog *index);
+// Give the catalog up after a change it could not record
+int catalog_abandon(catalog *index);
+int catalog_close(catalog *index);
+
+#endif //SOCKET_FSM_CATALOG_H
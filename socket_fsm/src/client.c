@@ -6,13 +6,145 @@ int parse_arguments(int argc, char *argv[], char **address, char **port, char **
 {
     FSMContext* context = (FSMContext*) ctx;
     int opt;
+    static const struct option long_options[] = {
+        {"rate", required_argument, NULL, 'R'},
+        {"latency", no_argument,    NULL, 'L'},
+        {NULL,   0,                 NULL, 0}
+    };
 
     opterr = 0;
 
-    while((opt = getopt(argc, argv, "h")) != -1)
+    while((opt = getopt_long(argc, argv, "hcmHrj:t:zb:i:w:D:S:pN:R:T:X:L", long_options, NULL)) != -1)
     {
         switch(opt)
         {
+            case 'T':
+            {
+#if TRACE_LEVEL > LEVEL_NONE
+                context->trace_path = optarg;
+                break;
+#else
+                SET_ERROR( context, "Built without tracing, see SOCKET_FSM_TRACE_LEVEL.");
+                return -1;
+#endif
+            }
+            case 'X':
+            {
+                context->capture_path = optarg;
+                break;
+            }
+            case 'L':
+            {
+                context->report_latency = 1;
+                break;
+            }
+            case 'R':
+            {
+                if (parse_rate(optarg, &context->rate) == -1)
+                {
+                    SET_ERROR( context, "Rates are bytes per second with an optional K, M or G suffix.");
+                    return -1;
+                }
+                break;
+            }
+            case 'p':
+            {
+                context->pass_fds = 1;
+                break;
+            }
+            case 'N':
+            {
+                context->stdin_name = optarg;
+                break;
+            }
+            case 'D':
+            {
+                context->agent_socket = optarg;
+                break;
+            }
+            case 'S':
+            {
+                context->submit_socket = optarg;
+                break;
+            }
+            case 'w':
+            {
+                char *endptr;
+                long window = strtol(optarg, &endptr, BASE_TEN);
+                if(*endptr != '\0' || window < 1 || window > MAX_ACK_WINDOW)
+                {
+                    SET_ERROR( context, "Ack window must be between 1 and 4096.");
+                    return -1;
+                }
+                context->ack_window = (int)window;
+                break;
+            }
+            case 'b':
+            {
+                uint64_t chunk;
+                if (parse_rate(optarg, &chunk) == -1 || chunk < 1 || chunk > MAX_FRAME_PAYLOAD)
+                {
+                    SET_ERROR( context, "Chunk size must be between 1 and 16M bytes.");
+                    return -1;
+                }
+                context->chunk_size = (uint32_t)chunk;
+                break;
+            }
+            case 'i':
+            {
+                char *endptr;
+                long streams = strtol(optarg, &endptr, BASE_TEN);
+                if(*endptr != '\0' || streams < 1 || streams > MAX_STREAMS)
+                {
+                    SET_ERROR( context, "Streams must be between 1 and 64.");
+                    return -1;
+                }
+                context->streams = (int)streams;
+                break;
+            }
+            case 't':
+            {
+                context->tls_ca = optarg;
+                break;
+            }
+            case 'z':
+            {
+                context->zero_copy = 1;
+                break;
+            }
+            case 'r':
+            {
+                context->recursive = 1;
+                break;
+            }
+            case 'j':
+            {
+                char *endptr;
+                long threads = strtol(optarg, &endptr, BASE_TEN);
+                if(*endptr != '\0' || threads < 1 || threads > WALK_MAX_THREADS)
+                {
+                    SET_ERROR( context, "Walk threads must be between 1 and 64.");
+                    return -1;
+                }
+                context->walk_threads = (int)threads;
+                break;
+            }
+            case 'c':
+            {
+                context->cache_hints = 1;
+                break;
+            }
+            case 'm':
+            {
+                context->send_manifest = 1;
+                break;
+            }
+            case 'H':
+            {
+                context->send_manifest = 1;
+                context->manifest_hashes = 1;
+                break;
+            }
             case 'h':
             {
                 usage(argv[0], NULL);
@@ -36,21 +168,93 @@ int parse_arguments(int argc, char *argv[], char **address, char **port, char **
         }
     }
 
-    if(optind + 2 >= argc)
+    // A unix:/path endpoint has no port
+    int endpoint_args = optind < argc && strncmp(argv[optind], UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0 ? 1 : 2;
+
+    if (context->submit_socket != NULL)
+    {
+        // Only files, the agent owns the connection
+        if (optind >= argc)
+        {
+            SET_ERROR( context, "Too few arguments.");
+            return -1;
+        }
+        *num_files  = argc - optind;
+        *file_paths = malloc(*num_files * sizeof(char*));
+        if (*file_paths == NULL)
+        {
+            SET_ERROR( context, "Failed to allocate memory");
+            return -1;
+        }
+        memcpy(*file_paths, &argv[optind], *num_files * sizeof(char*));
+        return 0;
+    }
+    if (context->agent_socket != NULL)
+    {
+        if (optind + endpoint_args != argc)
+        {
+            SET_ERROR( context, "The agent takes an address and a port, files are submitted with -S.");
+            return -1;
+        }
+        if (context->send_manifest || context->recursive || context->streams > 0)
+        {
+            SET_ERROR( context, "The agent cannot be combined with -m, -H, -r or -i.");
+            return -1;
+        }
+        if (context->ack_window == 0)
+        {
+            context->ack_window = AGENT_WINDOW;
+        }
+        *address    = argv[optind];
+        *port       = endpoint_args == 2 ? argv[optind + 1] : NULL;
+        *num_files  = 0;
+        *file_paths = NULL;
+        return 0;
+    }
+    if(optind + endpoint_args >= argc)
     {
         SET_ERROR( context, "Too few arguments.");
         return -1;
     }
 
     *address = argv[optind];
-    *port    = argv[optind + 1];
-    int total_files = argc - (optind + 2);
+    *port    = endpoint_args == 2 ? argv[optind + 1] : NULL;
+    int total_files = argc - (optind + endpoint_args);
+
+    if (context->recursive)
+    {
+        // Files are streamed from the walk while we connect and send
+        context->walker = malloc(sizeof(path_walker));
+        if (context->walker == NULL ||
+            walker_start(context->walker, &argv[optind + endpoint_args], total_files,
+                         context->walk_threads ? context->walk_threads : WALK_DEFAULT_THREADS) == -1)
+        {
+            free(context->walker);
+            context->walker = NULL;
+            SET_ERROR( context, "Could not start the directory walk.");
+            return -1;
+        }
+        *num_files  = 0;
+        *file_paths = NULL;
+        return 0;
+    }
     int valid_files_count = 0;
 
+    // Standard input is only sent by passing its descriptor
+    for (int i = 0; i < total_files && !context->pass_fds; i++)
+    {
+        if (is_stdin(argv[optind + endpoint_args + i]))
+        {
+            usage(argv[0], NULL);
+            SET_ERROR( context, "Standard input (-) needs -p.");
+            return -1;
+        }
+    }
+
     // First pass: Count valid (existing) files
     for (int i = 0; i < total_files; i++)
     {
-        if (access(argv[optind + 2 + i], F_OK) == 0) // F_OK tests for the existence of the file
+        if (is_stdin(argv[optind + endpoint_args + i]) || access(argv[optind + endpoint_args + i], F_OK) == 0) // F_OK tests for the existence of the file
         {
             valid_files_count++;
         }
@@ -61,9 +265,9 @@ int parse_arguments(int argc, char *argv[], char **address, char **port, char **
     int j = 0;
     for (int i = 0; i < total_files; i++)
     {
-        if (access(argv[optind + 2 + i], F_OK) == 0)
+        if (is_stdin(argv[optind + endpoint_args + i]) || access(argv[optind + endpoint_args + i], F_OK) == 0)
         {
-            (*file_paths)[j] = argv[optind + 2 + i];
+            (*file_paths)[j] = argv[optind + endpoint_args + i];
             j++;
         }
     }
@@ -80,13 +284,22 @@ int handle_arguments(const char *binary_name, const char *address, const char *p
         return -1;
     }
 
-    if(port_str == NULL)
+    int is_unix = strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0;
+    if(port_str == NULL && !is_unix)
     {
         SET_ERROR( context, "The address is required.");
         return -1;
     }
+    if(is_unix && context->tls_ca != NULL)
+    {
+        SET_ERROR( context, "TLS is not used on a Unix domain socket.");
+        return -1;
+    }
 
-    parse_in_port_t(binary_name, port_str, port, ctx);
+    if(port_str != NULL)
+    {
+        parse_in_port_t(binary_name, port_str, port, ctx);
+    }
     return 0;
 }
 
@@ -131,9 +344,32 @@ void usage(const char *program_name,  const char *message)
         fprintf(stderr, "%s\n", message);
     }
 
-    fprintf(stderr, "Usage: %s [-h] <address> <port>\n", program_name);
+    fprintf(stderr, "Usage: %s [-h] [-c] [-m] [-H] [-r] [-j threads] [-t ca] [-z] [-b bytes] [-i streams] [-w window] [--rate rate] <address> <port> <files...>\n", program_name);
+    fprintf(stderr, "       %s [options] unix:/path/to/socket <files...>\n", program_name);
+    fprintf(stderr, "       %s [-c] [-t ca] [-z] [-w window] -D <socket> <address> [port]\n", program_name);
+    fprintf(stderr, "       %s -S <socket> <files...>\n", program_name);
     fputs("Options:\n", stderr);
     fputs("  -h  Display this help message\n", stderr);
+    fputs("  -c  Read files sequentially and prefetch the next file\n", stderr);
+    fputs("  -m  Send a manifest first and only send the files the server asks for\n", stderr);
+    fputs("  -H  Like -m, with a content hash of every file in the manifest\n", stderr);
+    fputs("  -r  Walk directories and expand wildcards, sending files as they are found\n", stderr);
+    fputs("  -j <threads>  Number of threads walking directories with -r (default 4)\n", stderr);
+    fputs("  -t <ca>  Use TLS and verify the server against this PEM CA file\n", stderr);
+    fputs("  -z  Send file data with sendfile instead of copying it\n", stderr);
+    fputs("  -b <bytes>  Payload of each frame when copying file data (default 1023)\n", stderr);
+    fputs("  -i <streams>  Interleave up to <streams> files on the connection (1-64)\n", stderr);
+    fputs("  -w <window>  Have the server ack every file, with up to <window> unacked\n", stderr);
+    fputs("  -D <socket>  Run as an agent that keeps the connection open and sends the\n"
+          "               files submitted on the Unix socket <socket>\n", stderr);
+    fputs("  -S <socket>  Submit the files to the agent listening on <socket>\n", stderr);
+    fputs("  -p  On a unix: endpoint, pass file descriptors instead of sending data;\n"
+          "      a file named - is standard input, passed through a memfd\n", stderr);
+    fputs("  -N <name>  Name to store standard input under with -p (default stdin)\n", stderr);
+    fputs("  -R, --rate <rate>  Send at most <rate> bytes per second (K, M and G suffixes)\n", stderr);
+    fputs("  -T <file>  Write binary trace events to <file>, read it with tracedump\n", stderr);
+    fputs("  -X <file>  Record what is sent to the server, with timing, for fsmreplay\n", stderr);
+    fputs("  -L, --latency  Print the time spent per state and transition to stderr on exit\n", stderr);
 }
 
 
@@ -142,6 +378,16 @@ int convert_address(const char *address, struct sockaddr_storage *addr, void* ct
     FSMContext* context = (FSMContext*) ctx;
     memset(addr, 0, sizeof(*addr));
 
+    switch(unix_endpoint(address, addr))
+    {
+        case 1:
+            return 0;
+        case -1:
+            SET_ERROR(context, "Unix socket path is too long");
+            return -1;
+        default:
+            break;
+    }
     if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) == 1)
     {
         // IPv4 address
@@ -180,6 +426,19 @@ int socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port,  v
     char      addr_str[INET6_ADDRSTRLEN];
     in_port_t net_port;
 
+    if(addr->ss_family == AF_UNIX)
+    {
+        const char *path = ((struct sockaddr_un *)addr)->sun_path;
+        printf("\nConnecting to: %s%s\n", UNIX_PREFIX, path);
+        if(connect(sockfd, (struct sockaddr *)addr, sizeof(struct sockaddr_un)) == -1)
+        {
+            SET_ERROR(context, "connect AF_UNIX");
+            return -1;
+        }
+        printf("Connected to: %s%s\n\n", UNIX_PREFIX, path);
+        capture_connection(sockfd);
+        return 0;
+    }
     if(inet_ntop(addr->ss_family, addr->ss_family == AF_INET ? (void *)&(((struct sockaddr_in *)addr)->sin_addr) : (void *)&(((struct sockaddr_in6 *)addr)->sin6_addr), addr_str, sizeof(addr_str)) == NULL)
     {
         SET_ERROR(context, "inet_ntop");
@@ -216,9 +475,17 @@ int socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port,  v
         SET_ERROR(context,"Invalid address family");
         return -1;
     }
-
+    // With acks the client waits on the server after each file, so a file's
+    // last small write must not sit behind the server's delayed ACK (Nagle)
+    int nodelay = 1;
+    if(setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1)
+    {
+        SET_ERROR(context, "setsockopt TCP_NODELAY");
+        return -1;
+    }
 
     printf("Connected to: %s:%u\n\n", addr_str, port);
+    capture_connection(sockfd);
     return 0;
 }
 
@@ -226,6 +493,8 @@ int socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port,  v
 int socket_close(int sockfd ,void* ctx)
 {
     FSMContext* context = (FSMContext*) ctx;
+    tls_close(sockfd);
+    tls_cleanup();
     if(close(sockfd) == -1)
     {
         SET_ERROR(context,"Error closing socket");
@@ -234,10 +503,20 @@ int socket_close(int sockfd ,void* ctx)
     return 0;
 }
 
+static int send_large_file(int sockfd, const char *file_path, uint32_t id, void* ctx);
+
+// The name a file is stored under on the server: its base name, or with -r its
+// path from the walk root (walk_name). Points into path_copy.
+static char *stored_name(char *path_copy, const FSMContext *context)
+{
+    const char *name = context->recursive ? walk_name(path_copy) : NULL;
+
+    return name != NULL ? (char *)name : basename(path_copy);
+}
+
 int send_file(int sockfd, const char *file_path, void* ctx)
 {
     FSMContext* context = (FSMContext*) ctx;
-    sleep(3);
 
     FILE *fp = fopen(file_path, "rb");
     if (fp == NULL)
@@ -247,61 +526,924 @@ int send_file(int sockfd, const char *file_path, void* ctx)
         perror("");
         return -1;
     }
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (context->cache_hints)
+    {
+        posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
 
     fseek(fp, 0, SEEK_END);
-    uint32_t file_size = ftell(fp);
+    long end = ftell(fp);
     fseek(fp, 0, SEEK_SET);
+    if (end < 0)
+    {
+        SET_ERROR(context,"Error reading the file size");
+        fclose(fp);
+        return -1;
+    }
+    if ((uint64_t)end > MAX_PLAIN_FILE)
+    {
+        fclose(fp);
+        context->ack_id = LARGE_FILE_STREAM + context->large_files++;
+        return send_large_file(sockfd, file_path, context->ack_id, ctx);
+    }
+    uint32_t file_size = (uint32_t)end;
 
     uint32_t length = strlen(file_path);
     char *pathCopy = malloc(length + 1);
 
     if (pathCopy == NULL) {
         SET_ERROR(context,"Failed to allocate memory");
+        fclose(fp);
         return -1;
     }
     strcpy(pathCopy, file_path);
-    char *filename = basename(pathCopy);
+    char *filename = stored_name(pathCopy, context);
     uint32_t filename_size = strlen(filename);
-    // Send the filename size and filename
+    if (filename_size > MAX_NAME_LEN) {
+        SET_ERROR(context,"File name too long");
+        free(pathCopy);
+        fclose(fp);
+        return -1;
+    }
+    // Send the filename size, filename and file size in one write
+    char header[FILE_HEADER_SIZE(MAX_NAME_LEN)];
+    if (write_fully(sockfd, header, encode_file_header(header, filename, filename_size, file_size)) == -1) {
+        SET_ERROR(context,"bytes written");
+        free(pathCopy);
+        fclose(fp);
+        return -1;
+    }
 
-    write(sockfd, &filename_size, sizeof(filename_size));
+    context->ack_id = ++context->files_sent;
+    LOG_INFO("\nFile name: %s with the File size: %u Bytes is sending.\n\n", filename, file_size);
+    // filename points into it
+    free(pathCopy);
+    TRACE(LEVEL_INFO, TRACE_FILE_START, sockfd, file_size, context->ack_id);
+    PROBE3(file__start, sockfd, file_size, context->ack_id);
 
-    write(sockfd, filename, filename_size);
+    char *buffer;
+    uint32_t buffer_size;
 
-    write(sockfd, &file_size, sizeof(file_size));
+    if (context->zero_copy)
+    {
+        int result = send_chunks_zero_copy(sockfd, fileno(fp), file_size, ctx);
+        fclose(fp);
+        return result;
+    }
 
-    printf("\nFile name: %s with the File size: %u Bytes is sending.\n\n", filename, file_size);
+    // Room for the chunk header in front of the data, so each chunk is one write
+    buffer = malloc(CHUNK_HEADER_SIZE + context->chunk_size);
+    if (buffer == NULL)
+    {
+        SET_ERROR(context,"Failed to allocate memory");
+        fclose(fp);
+        return -1;
+    }
+    while (file_size > 0)
+    {
+        buffer_size = fread(buffer + CHUNK_HEADER_SIZE, 1, context->chunk_size, fp);
 
-    char buffer[1024];
-    uint32_t buffer_size;
+        if (buffer_size == 0) {
+            SET_ERROR(context,"bytes read");
+            free(buffer);
+            fclose(fp);
+            return -1;
+        }
+
+        encode_chunk_header(buffer, buffer_size);
+        if (write_fully(sockfd, buffer, CHUNK_HEADER_SIZE + buffer_size) == -1) {
+            SET_ERROR(context,"bytes written");
+            free(buffer);
+            fclose(fp);
+            return -1;
+        }
+        TRACE(LEVEL_DEBUG, TRACE_FRAME_SENT, sockfd, buffer_size, 0);
+        PROBE2(frame__sent, sockfd, buffer_size);
+
+        file_size -= buffer_size;
+    }
+    free(buffer);
+    fclose(fp);
+    return 0;
+}
+
+// Ask the kernel to start reading a file we are about to send, so its pages are
+// already cached when send_file gets to it.
+void prefetch_file(const char *file_path)
+{
+#ifdef POSIX_FADV_WILLNEED
+    int fd = open(file_path, O_RDONLY);
+    if (fd == -1)
+    {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#else
+    (void)file_path;
+#endif
+}
+
+int append(char **buffer, size_t *used, size_t *capacity, const void *data, size_t size)
+{
+    if (*used + size > *capacity)
+    {
+        size_t new_capacity = *capacity ? *capacity * 2 : 4096;
+        char   *grown;
+        while (new_capacity < *used + size)
+        {
+            new_capacity *= 2;
+        }
+        grown = realloc(*buffer, new_capacity);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        *buffer   = grown;
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *used, data, size);
+    *used += size;
+    return 0;
+}
+
+// Describe every file to the server before sending any payload, then keep only
+// the files the server planned to receive.
+int send_manifest(int sockfd, char **file_paths, int *num_files, int with_hashes, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    char     *buffer   = NULL;
+    size_t   used      = 0;
+    size_t   capacity  = 0;
+    uint32_t tag       = FRAME_MANIFEST;
+    uint32_t count     = (uint32_t)*num_files;
+    uint8_t  *plan;
+    int      kept      = 0;
+
+    if (append(&buffer, &used, &capacity, &tag, sizeof(tag)) == -1 ||
+        append(&buffer, &used, &capacity, &count, sizeof(count)) == -1)
+    {
+        SET_ERROR(context, "Failed to allocate memory");
+        free(buffer);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        char        *pathCopy = strdup(file_paths[i]);
+        char        *filename;
+        struct stat st;
+        uint32_t    name_len;
+        uint64_t    size;
+        uint64_t    hash      = 0;
+        uint32_t    hash_len  = 0;
+        int         fd;
+
+        fd = open(file_paths[i], O_RDONLY);
+        if (pathCopy == NULL || fd == -1 || fstat(fd, &st) == -1 ||
+            (with_hashes && hash_file(fd, &hash) == -1))
+        {
+            SET_ERROR(context, "Error reading file for the manifest");
+            fprintf(stderr, "File Path %s: ", file_paths[i]);
+            perror("");
+            if (fd != -1)
+            {
+                close(fd);
+            }
+            free(pathCopy);
+            free(buffer);
+            return -1;
+        }
+        close(fd);
+        filename = stored_name(pathCopy, context);
+        name_len = strlen(filename);
+        size     = (uint64_t)st.st_size;
+        hash_len = with_hashes ? MANIFEST_HASH_LEN : 0;
+        if (append(&buffer, &used, &capacity, &name_len, sizeof(name_len)) == -1 ||
+            append(&buffer, &used, &capacity, filename, name_len) == -1 ||
+            append(&buffer, &used, &capacity, &size, sizeof(size)) == -1 ||
+            append(&buffer, &used, &capacity, &hash_len, sizeof(hash_len)) == -1 ||
+            (with_hashes && append(&buffer, &used, &capacity, &hash, sizeof(hash)) == -1))
+        {
+            SET_ERROR(context, "Failed to allocate memory");
+            free(pathCopy);
+            free(buffer);
+            return -1;
+        }
+        free(pathCopy);
+    }
+    if (write_fully(sockfd, buffer, used) == -1)
+    {
+        SET_ERROR(context, "Error sending the manifest");
+        free(buffer);
+        return -1;
+    }
+    free(buffer);
+
+    if (read_fully(sockfd, &tag, sizeof(tag)) == -1 || tag != FRAME_PLAN ||
+        read_fully(sockfd, &count, sizeof(count)) == -1 || count != (uint32_t)*num_files)
+    {
+        SET_ERROR(context, "Invalid plan from the server");
+        return -1;
+    }
+    plan = malloc(count ? count : 1);
+    if (plan == NULL || read_fully(sockfd, plan, count) == -1)
+    {
+        SET_ERROR(context, "Invalid plan from the server");
+        free(plan);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (plan[i] == PLAN_REJECT)
+        {
+            SET_ERROR(context, "The server rejected the batch");
+            free(plan);
+            return -1;
+        }
+        if (plan[i] == PLAN_SKIP)
+        {
+            printf("Skipping %s, the server already has it.\n", file_paths[i]);
+            continue;
+        }
+        // Swap rather than overwrite so paths owned by the walk can still be freed
+        char *sent       = file_paths[i];
+        file_paths[i]    = file_paths[kept];
+        file_paths[kept++] = sent;
+    }
+    free(plan);
+    printf("Manifest: sending %d of %d files.\n", kept, *num_files);
+    *num_files = kept;
+    return 0;
+}
+
+// A manifest needs the complete list up front, so wait for the walk to finish.
+int collect_walk(path_walker *walker, char ***file_paths, int *num_files, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    int  capacity = 0;
+    char *path;
+
+    while ((path = walker_next(walker)) != NULL)
+    {
+        if (*num_files == capacity)
+        {
+            char **grown;
+            capacity = capacity ? capacity * 2 : 1024;
+            grown    = realloc(*file_paths, capacity * sizeof(char *));
+            if (grown == NULL)
+            {
+                SET_ERROR(context, "Failed to allocate memory");
+                free(path);
+                return -1;
+            }
+            *file_paths = grown;
+        }
+        (*file_paths)[(*num_files)++] = path;
+    }
+    return 0;
+}
+
+// Handshake in user space; tls.c hands the record layer to the kernel when it can.
+int setup_tls(int sockfd, const char *ca_file, const char *address, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    if (tls_client_init(ca_file, address) == -1)
+    {
+        SET_ERROR(context, "Cannot set up TLS");
+        return -1;
+    }
+    if (tls_connect(sockfd) == -1)
+    {
+        SET_ERROR(context, "TLS handshake failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Frame the file in ZERO_COPY_CHUNK pieces and let the kernel move each payload
+// straight from the page cache to the socket.
+int send_chunks_zero_copy(int sockfd, int fd, uint32_t file_size, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    off_t offset = 0;
 
     while (file_size > 0)
     {
+        uint32_t chunk = file_size < ZERO_COPY_CHUNK ? file_size : ZERO_COPY_CHUNK;
+        char     header[CHUNK_HEADER_SIZE];
 
-        memset(buffer, 0, sizeof(buffer));  // Clear the buffer
+        if (write_fully(sockfd, header, encode_chunk_header(header, chunk)) == -1 ||
+            send_payload(sockfd, fd, offset, chunk, 1) == -1)
+        {
+            SET_ERROR(context, "bytes written");
+            return -1;
+        }
+        TRACE(LEVEL_DEBUG, TRACE_FRAME_SENT, sockfd, chunk, 0);
+        PROBE2(frame__sent, sockfd, chunk);
+        offset    += chunk;
+        file_size -= chunk;
+    }
+    return 0;
+}
 
-        buffer_size = fread(buffer, 1, sizeof(buffer) - 1, fp);
+// Write size bytes of the file at offset to the socket, with sendfile or a copy.
+int send_payload(int sockfd, int fd, off_t offset, uint32_t size, int zero_copy)
+{
+    char buffer[STREAM_CHUNK];
 
-        if (buffer_size == 0) {
-            SET_ERROR(context,"bytes read");
+    while (size > 0)
+    {
+        ssize_t sent;
+        if (zero_copy)
+        {
+            sent = net_sendfile(sockfd, fd, offset, size);
+        }
+        else
+        {
+            sent = pread(fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer), offset);
+            if (sent > 0 && write_fully(sockfd, buffer, (size_t)sent) == -1)
+            {
+                return -1;
+            }
+        }
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
             return -1;
         }
+        offset += sent;
+        size   -= (uint32_t)sent;
+    }
+    return 0;
+}
+
+// Cap the connection's egress at --rate. TCP sockets are paced by the kernel
+// (SO_MAX_PACING_RATE), which holds back sendfile as well as write; Unix sockets,
+// or a kernel that refuses the option, get a token bucket in the write path.
+int limit_rate(int sockfd, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    if (context->rate == 0)
+    {
+        return 0;
+    }
+    if (context->rate_start_ns == 0)
+    {
+        context->rate_start_ns = monotonic_ns();
+    }
+#ifdef SO_MAX_PACING_RATE
+    if (context->addr.ss_family != AF_UNIX && context->rate <= UINT32_MAX)
+    {
+        unsigned int pacing = (unsigned int)context->rate;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing, sizeof(pacing)) == 0)
+        {
+            context->kernel_pacing = 1;
+            net_limit(sockfd, 0);
+            return 0;
+        }
+    }
+#endif
+    context->kernel_pacing = 0;
+    net_limit(sockfd, context->rate);
+    return 0;
+}
 
-        uint32_t bytes_written = write(sockfd, &buffer_size, sizeof(buffer_size));
-        if (bytes_written <= 0) {
-            SET_ERROR(context,"bytes written");
+// Bytes in the socket's send queue that the peer has not acknowledged yet
+static uint64_t unacked_bytes(int sockfd)
+{
+    int pending = 0;
+
+    if (sockfd == -1 || ioctl(sockfd, SIOCOUTQ, &pending) == -1 || pending < 0)
+    {
+        return 0;
+    }
+    return (uint64_t)pending;
+}
+
+// The rate reached, counting only what the server acknowledged. Bytes still in
+// the send buffer would make it look faster than the link, so wait for the
+// queue to drain, and give up on what is left once it stops shrinking for a
+// second.
+void report_rate(void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    double      seconds;
+    uint64_t    bytes = net_limited_bytes();
+    uint64_t    pending;
+    uint64_t    progress_ns;
+
+    if (context->rate == 0 || context->rate_start_ns == 0)
+    {
+        return;
+    }
+    pending     = unacked_bytes(context->sockfd);
+    progress_ns = monotonic_ns();
+    while (pending > 0 && monotonic_ns() - progress_ns < NS_PER_SECOND)
+    {
+        struct timespec pause = { 0, 1000000L };
+        uint64_t        left;
+
+        nanosleep(&pause, NULL);
+        left = unacked_bytes(context->sockfd);
+        if (left < pending)
+        {
+            progress_ns = monotonic_ns();
+        }
+        pending = left;
+    }
+    bytes  -= pending < bytes ? pending : bytes;
+    seconds = (double)(monotonic_ns() - context->rate_start_ns) / NS_PER_SECOND;
+    printf("Sent %" PRIu64 " acknowledged bytes in %.3f s: %.2f MiB/s against a target of %.2f MiB/s (%s)\n", bytes,
+           seconds, seconds > 0 ? (double)bytes / seconds / (1024 * 1024) : 0.0, (double)context->rate / (1024 * 1024),
+           context->kernel_pacing ? "kernel pacing" : "token bucket");
+}
+
+// Next file to send, from the walk or the argument list. The caller frees it.
+char *next_file_path(void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    if (context->walker != NULL)
+    {
+        return walker_next(context->walker);
+    }
+    if (context->current_file_index < context->num_files)
+    {
+        return strdup(context->file_paths[context->current_file_index++]);
+    }
+    return NULL;
+}
+
+static int open_outgoing_stream(int sockfd, outgoing_stream *stream, char *path, uint32_t id, void* ctx)
+{
+    FSMContext*  context = (FSMContext*) ctx;
+    struct stat  st;
+    char         *pathCopy;
+    char         *filename;
+    uint32_t     name_len;
+    frame_header header;
+
+    stream->fd = open(path, O_RDONLY);
+    if (stream->fd == -1 || fstat(stream->fd, &st) == -1)
+    {
+        SET_ERROR(context, "Error opening file");
+        fprintf(stderr, "File Path %s: ", path);
+        perror("");
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (context->cache_hints)
+    {
+        posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+    stream->id     = id;
+    stream->size   = (uint64_t)st.st_size;
+    stream->offset = 0;
+    stream->path   = path;
+
+    pathCopy = strdup(path);
+    if (pathCopy == NULL)
+    {
+        SET_ERROR(context, "Failed to allocate memory");
+        return -1;
+    }
+    filename      = stored_name(pathCopy, context);
+    name_len      = strlen(filename);
+    header.tag    = FRAME_STREAM_OPEN;
+    header.stream = id;
+    header.length = sizeof(stream->size) + name_len;
+    if (write_fully(sockfd, &header, sizeof(header)) == -1 ||
+        write_fully(sockfd, &stream->size, sizeof(stream->size)) == -1 ||
+        write_fully(sockfd, filename, name_len) == -1)
+    {
+        SET_ERROR(context, "bytes written");
+        free(pathCopy);
+        return -1;
+    }
+    LOG_INFO("Stream %u: %s with the File size: %" PRIu64 " Bytes is sending.\n", id, filename, stream->size);
+    TRACE(LEVEL_INFO, TRACE_FILE_START, sockfd, stream->size, id);
+    PROBE3(file__start, sockfd, stream->size, id);
+    free(pathCopy);
+    return 0;
+}
+
+static void close_outgoing_stream(outgoing_stream *stream)
+{
+    if (stream->fd > 0)
+    {
+        close(stream->fd);
+    }
+    free(stream->path);
+    memset(stream, 0, sizeof(*stream));
+}
+
+// Send the next STREAM_CHUNK of a stream, and FRAME_STREAM_END after its last
+// one. 1 once the stream is ended, 0 while more is left, -1 on error.
+static int send_stream_chunk(int sockfd, outgoing_stream *stream, void* ctx)
+{
+    FSMContext*  context = (FSMContext*) ctx;
+    frame_header header;
+    uint64_t     left = stream->size - stream->offset;
+
+    header.stream = stream->id;
+    if (left > 0)
+    {
+        header.tag    = FRAME_STREAM_DATA;
+        header.length = left < STREAM_CHUNK ? (uint32_t)left : STREAM_CHUNK;
+        if (write_fully(sockfd, &header, sizeof(header)) == -1 ||
+            send_payload(sockfd, stream->fd, (off_t)stream->offset, header.length, context->zero_copy) == -1)
+        {
+            SET_ERROR(context, "bytes written");
             return -1;
         }
+        TRACE(LEVEL_DEBUG, TRACE_FRAME_SENT, sockfd, header.length, header.tag);
+        PROBE3(frame__sent, sockfd, header.length, header.tag);
+        stream->offset += header.length;
+    }
+    if (stream->offset < stream->size)
+    {
+        return 0;
+    }
+    header.tag    = FRAME_STREAM_END;
+    header.length = 0;
+    if (write_fully(sockfd, &header, sizeof(header)) == -1)
+    {
+        SET_ERROR(context, "bytes written");
+        return -1;
+    }
+    return 1;
+}
 
-        bytes_written = write(sockfd, buffer, buffer_size);
+// A file over MAX_PLAIN_FILE outside -i: the same frames as -i with one stream.
+static int send_large_file(int sockfd, const char *file_path, uint32_t id, void* ctx)
+{
+    FSMContext*     context = (FSMContext*) ctx;
+    outgoing_stream stream  = { 0 };
+    char            *path   = strdup(file_path);
+    int             result;
 
-        if (bytes_written <= 0) {
-            SET_ERROR(context,"bytes written");
+    if (path == NULL)
+    {
+        SET_ERROR(context, "Failed to allocate memory");
+        return -1;
+    }
+    result = open_outgoing_stream(sockfd, &stream, path, id, ctx);
+    while (result == 0)
+    {
+        result = send_stream_chunk(sockfd, &stream, ctx);
+    }
+    if (stream.path == NULL)
+    {
+        free(path);
+    }
+    close_outgoing_stream(&stream);
+    return result == 1 ? 0 : -1;
+}
+
+// Send every file over up to max_streams interleaved streams. Each open stream
+// gets one STREAM_CHUNK per round, so small files finish within a round or two
+// even while a large file shares the connection.
+int send_streams(int sockfd, int max_streams, void* ctx)
+{
+    FSMContext*     context = (FSMContext*) ctx;
+    outgoing_stream *streams = calloc(max_streams, sizeof(outgoing_stream));
+    uint32_t        next_id  = 1;
+    int             active   = 0;
+    int             more     = 1;
+    int             result   = 0;
+
+    if (streams == NULL)
+    {
+        SET_ERROR(context, "Failed to allocate memory");
+        return -1;
+    }
+    while (result == 0)
+    {
+        for (int i = 0; i < max_streams && more && result == 0; i++)
+        {
+            char *path;
+            if (streams[i].path != NULL)
+            {
+                continue;
+            }
+            path = next_file_path(ctx);
+            if (path == NULL)
+            {
+                more = 0;
+                break;
+            }
+            if (open_outgoing_stream(sockfd, &streams[i], path, next_id++, ctx) == -1)
+            {
+                streams[i].path = path;
+                result = -1;
+                break;
+            }
+            active++;
+        }
+        if (active == 0 || result == -1)
+        {
+            break;
+        }
+        for (int i = 0; i < max_streams && result == 0; i++)
+        {
+            outgoing_stream *stream = &streams[i];
+            int             sent;
+
+            if (stream->path == NULL)
+            {
+                continue;
+            }
+            sent = send_stream_chunk(sockfd, stream, ctx);
+            if (sent == 1)
+            {
+                // Only finished files count against the window, so waiting here cannot stall
+                if (context->ack_window > 0 &&
+                    (collect_acks(sockfd, context->ack_window - 1, ctx) == -1 ||
+                     track_ack(stream->id, stream->path, -1, ctx) == -1))
+                {
+                    result = -1;
+                    break;
+                }
+                close_outgoing_stream(stream);
+                active--;
+            }
+            result = sent == -1 ? -1 : result;
+        }
+    }
+    for (int i = 0; i < max_streams; i++)
+    {
+        if (streams[i].path != NULL)
+        {
+            close_outgoing_stream(&streams[i]);
+        }
+    }
+    free(streams);
+    return result;
+}
+
+// Turn on server features for this connection.
+int send_hello(int sockfd, uint32_t features, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    uint32_t    hello[2] = { FRAME_HELLO, features };
+
+    if (write_fully(sockfd, hello, sizeof(hello)) == -1)
+    {
+        SET_ERROR(context, "Error sending hello");
+        return -1;
+    }
+    return 0;
+}
+
+// Remember a file that was sent and still needs its ack. owner is the agent's
+// submitter waiting for it, or -1.
+int track_ack(uint32_t file, const char *path, int owner, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    pending_ack *pending;
+
+    if (context->pending_acks == NULL &&
+        (context->pending_acks = calloc(context->ack_window, sizeof(pending_ack))) == NULL)
+    {
+        SET_ERROR(context, "Failed to allocate memory");
+        return -1;
+    }
+    if (context->in_flight == context->ack_window || (path = strdup(path)) == NULL)
+    {
+        SET_ERROR(context, "Ack window overflow");
+        return -1;
+    }
+    pending       = &context->pending_acks[context->in_flight++];
+    pending->file = file;
+    pending->path  = (char *)path;
+    pending->owner = owner;
+    return 0;
+}
+
+// Read the acks that have arrived, and wait for more while more than keep files
+// are unacknowledged. Failures are reported and counted, not treated as errors.
+int collect_acks(int sockfd, int keep, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    while (context->in_flight > 0)
+    {
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        uint32_t      file;
+        uint32_t      status;
+        uint64_t      bytes;
+        int           found = 0;
+
+        if (context->in_flight <= keep && !tls_pending(sockfd) && poll(&pfd, 1, 0) <= 0)
+        {
+            break;
+        }
+        if (read_ack(sockfd, &file, &status, &bytes) == -1)
+        {
+            SET_ERROR(context, "Error reading ack");
             return -1;
         }
+        for (int i = 0; i < context->in_flight && !found; i++)
+        {
+            pending_ack *pending = &context->pending_acks[i];
+            if (pending->file != file)
+            {
+                continue;
+            }
+            if (status == ACK_OK)
+            {
+                PROBE3(file__end, sockfd, bytes, file);
+            }
+            else
+            {
+                PROBE3(file__failed, sockfd, bytes, file);
+            }
+            if (pending->owner >= 0)
+            {
+                report_submission(pending->owner, pending->path, status, bytes, ctx);
+            }
+            else if (status == ACK_OK)
+            {
+                LOG_INFO("Server stored %s (%" PRIu64 " Bytes).\n", pending->path, bytes);
+            }
+            else
+            {
+                fprintf(stderr, "Server failed to store %s.\n", pending->path);
+                context->failed_files++;
+            }
+            free(pending->path);
+            *pending = context->pending_acks[--context->in_flight];
+            found    = 1;
+        }
+        if (!found)
+        {
+            SET_ERROR(context, "Ack for an unknown file");
+            return -1;
+        }
+    }
+    return 0;
+}
 
-        file_size -= buffer_size;
+// Wait for every outstanding ack and fail if the server could not store a file.
+int finish_acks(int sockfd, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    if (context->ack_window == 0)
+    {
+        return 0;
+    }
+    if (collect_acks(sockfd, 0, ctx) == -1)
+    {
+        return -1;
+    }
+    if (context->failed_files > 0)
+    {
+        SET_ERROR(context, "The server failed to store some files");
+        return -1;
     }
-    fclose(fp);
     return 0;
-}
\ No newline at end of file
+}
+
+int is_stdin(const char *file_path)
+{
+    return strcmp(file_path, "-") == 0;
+}
+
+// Descriptor holding standard input. A redirected regular file is passed as it
+// is; generated data from a pipe is collected in a memfd first.
+static int stdin_descriptor(void)
+{
+    struct stat st;
+    int         fd;
+
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        return dup(STDIN_FILENO);
+    }
+    fd = memfd_create("stdin", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    for (;;)
+    {
+        ssize_t moved = splice(STDIN_FILENO, NULL, fd, NULL, ZERO_COPY_CHUNK, SPLICE_F_MOVE);
+        if (moved == -1 && errno == EINVAL)
+        {
+            // stdin is not a pipe, copy it through a buffer instead
+            char buffer[BUFSIZ];
+            moved = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (moved > 0 && write_fully(fd, buffer, (size_t)moved) == -1)
+            {
+                moved = -1;
+            }
+        }
+        if (moved == 0)
+        {
+            return fd;
+        }
+        if (moved == -1)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+}
+
+// Hand the file's descriptor to the server with SCM_RIGHTS (FRAME_FD_PASS).
+// Returns 1 when the path is not a regular file and has to be sent as data.
+int pass_file(int sockfd, const char *file_path, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    const char  *name;
+    char        *path_copy = NULL;
+    char        *frame;
+    size_t      frame_size;
+    uint32_t    name_len;
+    struct stat st;
+    int         fd;
+
+    if (is_stdin(file_path))
+    {
+        fd   = stdin_descriptor();
+        name = context->stdin_name != NULL ? context->stdin_name : "stdin";
+    }
+    else
+    {
+        fd        = open(file_path, O_RDONLY | O_CLOEXEC);
+        path_copy = strdup(file_path);
+        name      = path_copy != NULL ? stored_name(path_copy, context) : NULL;
+    }
+    if (fd == -1 || name == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        free(path_copy);
+        SET_ERROR(context, "Error opening file");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        free(path_copy);
+        return 1;
+    }
+
+    name_len   = strlen(name);
+    frame_size = 2 * sizeof(uint32_t) + name_len;
+    frame      = malloc(frame_size);
+    if (frame == NULL)
+    {
+        close(fd);
+        free(path_copy);
+        SET_ERROR(context, "Failed to allocate memory");
+        return -1;
+    }
+    uint32_t tag = FRAME_FD_PASS;
+    memcpy(frame, &tag, sizeof(tag));
+    memcpy(frame + sizeof(tag), &name_len, sizeof(name_len));
+    memcpy(frame + 2 * sizeof(uint32_t), name, name_len);
+    context->ack_id = ++context->files_sent;
+    LOG_INFO("\nFile name: %s with the File size: %lld Bytes is passed.\n\n", name, (long long)st.st_size);
+    TRACE(LEVEL_INFO, TRACE_FILE_START, sockfd, st.st_size, context->ack_id);
+    PROBE3(file__start, sockfd, st.st_size, context->ack_id);
+
+    struct iovec iov = { frame, frame_size };
+    union {
+        char           buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { 0 };
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    // The descriptor travels with the first byte; the rest of a short send is
+    // plain data
+    ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    int result = sent > 0 && write_fully(sockfd, frame + sent, frame_size - (size_t)sent) == 0 ? 0 : -1;
+    if (result == -1)
+    {
+        SET_ERROR(context, "Error passing the file descriptor");
+    }
+    free(frame);
+    close(fd);
+    free(path_copy);
+    return result;
+}
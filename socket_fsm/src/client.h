@@ -5,16 +5,22 @@
 #ifndef SOCKET_FSM_CLIENT_H
 #define SOCKET_FSM_CLIENT_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <time.h>
@@ -24,6 +30,23 @@
 #include <string.h>
 #include <stdint.h>
 #include <glob.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include "protocol.h"
+#include "codec.h"
+#include "walk.h"
+#include "tls.h"
+#include "agent.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
+#include "capture.h"
+#include <poll.h>
 
 int parse_arguments(int argc, char *argv[], char **address, char **port, char ***file_paths, int *num_files, void* ctx);
 int handle_arguments(const char *binary_name, const char *address, const char *port_str, in_port_t *port, void* ctx);
@@ -34,22 +57,56 @@ int socket_create(int domain, int type, int protocol, void* ctx);
 int socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port, void* ctx);
 int socket_close(int sockfd, void* ctx);
 int send_file(int sockfd, const char *file_path, void* ctx);
+void prefetch_file(const char *file_path);
+int append(char **buffer, size_t *used, size_t *capacity, const void *data, size_t size);
+int send_manifest(int sockfd, char **file_paths, int *num_files, int with_hashes, void* ctx);
+int setup_tls(int sockfd, const char *ca_file, const char *address, void* ctx);
+int send_chunks_zero_copy(int sockfd, int fd, uint32_t file_size, void* ctx);
+int send_payload(int sockfd, int fd, off_t offset, uint32_t size, int zero_copy);
+char *next_file_path(void* ctx);
+int send_streams(int sockfd, int max_streams, void* ctx);
+int is_stdin(const char *file_path);
+int pass_file(int sockfd, const char *file_path, void* ctx);
+int send_hello(int sockfd, uint32_t features, void* ctx);
+int track_ack(uint32_t file, const char *path, int owner, void* ctx);
+int collect_acks(int sockfd, int keep, void* ctx);
+int finish_acks(int sockfd, void* ctx);
+int limit_rate(int sockfd, void* ctx);
+void report_rate(void* ctx);
+int collect_walk(path_walker *walker, char ***file_paths, int *num_files, void* ctx);
 
 
 #define UNKNOWN_OPTION_MESSAGE_LEN 24
 #define BASE_TEN 10
+// Default payload size of each frame on the copy path, -b changes it
+#define COPY_CHUNK 1023
+// Payload size of each frame on the sendfile path (-z)
+#define ZERO_COPY_CHUNK (1024 * 1024)
+// Bytes each stream sends per round when files are interleaved (-i)
+#define STREAM_CHUNK (64 * 1024)
+// The plain file header has a 32-bit size. Larger files go over a stream, with
+// ids from LARGE_FILE_STREAM up so their acks never match a plain file's number.
+#define MAX_PLAIN_FILE 0xFFFFFFFFull
+#define LARGE_FILE_STREAM 0x80000000u
+#define MAX_ACK_WINDOW 4096
 typedef enum {
     STATE_PARSE_ARGUMENTS,
     STATE_HANDLE_ARGUMENTS,
     STATE_CONVERT_ADDRESS,
     STATE_SOCKET_CREATE,
     STATE_SOCKET_CONNECT,
+    STATE_SEND_MANIFEST,
+    STATE_PASS_FILE,
     STATE_SEND_FILE,
+    STATE_SERVE_SUBMISSIONS,
+    STATE_SUBMIT,
     STATE_CLEANUP,
     STATE_ERROR,
     STATE_EXIT,
 } client_state;
 
+const char* state_to_string(client_state state);
+
 typedef struct {
     client_state state;
     client_state (*state_handler)(void* context);
@@ -63,6 +120,20 @@ typedef client_state (*StateHandlerFunc)(void* context);
     slash ? slash + 1 : file; \
 })
 
+typedef struct {
+    int      fd;
+    uint32_t id;
+    uint64_t size;
+    uint64_t offset;
+    char     *path;
+} outgoing_stream;
+
+typedef struct {
+    uint32_t file;
+    char     *path;
+    int      owner;
+} pending_ack;
+
 typedef struct {
     int argc;
     char **argv;
@@ -74,6 +145,35 @@ typedef struct {
     char **file_paths;
     int num_files;
     int current_file_index;
+    int cache_hints;
+    int send_manifest;
+    int manifest_hashes;
+    int recursive;
+    int walk_threads;
+    path_walker *walker;
+    int num_owned_paths;
+    char *tls_ca;
+    int zero_copy;
+    uint32_t chunk_size;
+    int streams;
+    int ack_window;
+    pending_ack *pending_acks;
+    int in_flight;
+    uint32_t files_sent;
+    uint32_t large_files;
+    uint32_t ack_id;        // what the server acks the last file sent with
+    int failed_files;
+    char *agent_socket;
+    char *submit_socket;
+    agent_state *agent;
+    int pass_fds;
+    char *stdin_name;
+    uint64_t rate;
+    uint64_t rate_start_ns;
+    int kernel_pacing;
+    char *trace_path;
+    char *capture_path;
+    int report_latency;     // -L
     char *trace_message;
     client_state trace_state;
     int trace_line;
@@ -97,7 +197,8 @@ typedef struct {
         ctx->trace_message = msg; \
         ctx->trace_state = curr_state; \
         ctx->trace_line = __LINE__; \
-        printf("TRACE: %s \nEntered state %s (%d) at line %d.\n\n", \
+        LOG_DEBUG("TRACE: %s \nEntered state %s (%d) at line %d.\n\n", \
                ctx->trace_message, state_to_string(ctx->trace_state),ctx->trace_state, ctx->trace_line); \
+        TRACE(LEVEL_DEBUG, TRACE_STATE, curr_state, __LINE__, 0); \
     } while (0)
 #endif //SOCKET_FSM_CLIENT_H
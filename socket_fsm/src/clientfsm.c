@@ -6,7 +6,11 @@ const char* state_to_string(client_state state) {
         case STATE_CONVERT_ADDRESS:      return "STATE_CONVERT_ADDRESS";
         case STATE_SOCKET_CREATE:        return "STATE_SOCKET_CREATE";
         case STATE_SOCKET_CONNECT:       return "STATE_SOCKET_CONNECT";
+        case STATE_SEND_MANIFEST:        return "STATE_SEND_MANIFEST";
+        case STATE_PASS_FILE:            return "STATE_PASS_FILE";
         case STATE_SEND_FILE:            return "STATE_SEND_FILE";
+        case STATE_SERVE_SUBMISSIONS:    return "STATE_SERVE_SUBMISSIONS";
+        case STATE_SUBMIT:               return "STATE_SUBMIT";
         case STATE_CLEANUP:              return "STATE_CLEANUP";
         case STATE_EXIT:                 return "STATE_EXIT";
         case STATE_ERROR:                return "STATE_ERROR";
@@ -21,6 +25,32 @@ client_state parse_arguments_handler(void* ctx) {
     if (parse_arguments(context->argc, context->argv, &context->address, &context->port_str, &context->file_paths, &context->num_files, ctx) != 0) {
         return STATE_ERROR;
     }
+    // Report every ack as it arrives, also into a pipe
+    if (context->ack_window > 0) {
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+    static const char *state_names[STATE_EXIT + 1];
+    for (int state = 0; state <= STATE_EXIT; state++) {
+        state_names[state] = state_to_string((client_state)state);
+    }
+    // No listener, the state times are dumped on SIGUSR1, and at exit with -L
+    if (metrics_start(NULL, state_names, STATE_EXIT + 1) != 0) {
+        SET_ERROR(context, "Cannot start metrics");
+        return STATE_ERROR;
+    }
+    if (context->trace_path != NULL) {
+        if (trace_start(context->trace_path, state_names, STATE_EXIT + 1) != 0) {
+            SET_ERROR(context, "Cannot open the trace file");
+            return STATE_ERROR;
+        }
+    }
+    if (context->capture_path != NULL && capture_start(context->capture_path) != 0) {
+        SET_ERROR(context, "Cannot open the capture file");
+        return STATE_ERROR;
+    }
+    if (context->submit_socket != NULL) {
+        return STATE_SUBMIT;
+    }
     return STATE_HANDLE_ARGUMENTS;
 }
 client_state handle_arguments_handler(void* ctx) {
@@ -62,20 +92,131 @@ client_state socket_connect_handler(void* ctx) {
     if (socket_connect(context->sockfd, &context->addr, context->port, ctx) != 0) {
         return STATE_ERROR;
     }
-    return STATE_SEND_FILE;
+    if (context->tls_ca != NULL && setup_tls(context->sockfd, context->tls_ca, context->address, ctx) != 0) {
+        return STATE_ERROR;
+    }
+    if (limit_rate(context->sockfd, ctx) != 0) {
+        return STATE_ERROR;
+    }
+    if (context->ack_window > 0 && send_hello(context->sockfd, FEATURE_ACKS, ctx) != 0) {
+        return STATE_ERROR;
+    }
+    return STATE_SEND_MANIFEST;
+}
+
+client_state send_manifest_handler(void* ctx) {
+    FSMContext* context = (FSMContext*) ctx;
+    SET_TRACE(context, "Entering send_manifest_handler.", STATE_SEND_MANIFEST);
+
+    if (context->send_manifest && context->walker != NULL) {
+        int result = collect_walk(context->walker, &context->file_paths, &context->num_files, ctx);
+        context->num_owned_paths = context->num_files;
+        if (result != 0) {
+            return STATE_ERROR;
+        }
+        walker_stop(context->walker);
+        free(context->walker);
+        context->walker = NULL;
+    }
+    if (context->send_manifest &&
+        send_manifest(context->sockfd, context->file_paths, &context->num_files, context->manifest_hashes, ctx) != 0) {
+        return STATE_ERROR;
+    }
+    if (context->agent_socket != NULL) {
+        return STATE_SERVE_SUBMISSIONS;
+    }
+    return STATE_PASS_FILE;
+}
+
+// Local transfers with -p hand descriptors to the server. Everything else, and
+// files that are not regular, falls back to STATE_SEND_FILE, which also finishes
+// the run once no files are left.
+client_state pass_file_handler(void* ctx) {
+    FSMContext* context = (FSMContext*) ctx;
+    SET_TRACE(context, "Entering pass_file_handler.", STATE_PASS_FILE);
+
+    if (!context->pass_fds || context->addr.ss_family != AF_UNIX || context->streams > 0) {
+        return STATE_SEND_FILE;
+    }
+    if (context->ack_window > 0 && collect_acks(context->sockfd, context->ack_window - 1, ctx) != 0) {
+        return STATE_ERROR;
+    }
+    char *path = next_file_path(ctx);
+    if (path == NULL) {
+        return STATE_SEND_FILE;
+    }
+    int result = pass_file(context->sockfd, path, ctx);
+    if (result == 1) {
+        result = send_file(context->sockfd, path, ctx);
+    }
+    if (result == 0 && context->ack_window > 0) {
+        result = track_ack(context->ack_id, path, -1, ctx);
+    }
+    free(path);
+    return result == 0 ? STATE_PASS_FILE : STATE_ERROR;
 }
 
 client_state send_file_handler(void* ctx) {
     FSMContext* context = (FSMContext*) ctx;
     SET_TRACE(context, "Entering send_file_handler.", STATE_SEND_FILE);
 
+    if (context->streams > 0) {
+        if (send_streams(context->sockfd, context->streams, ctx) != 0 || finish_acks(context->sockfd, ctx) != 0) {
+            return STATE_ERROR;
+        }
+        return STATE_CLEANUP;
+    }
+
+    // Keep at most ack_window files unacknowledged instead of waiting on each one
+    if (context->ack_window > 0 && collect_acks(context->sockfd, context->ack_window - 1, ctx) != 0) {
+        return STATE_ERROR;
+    }
+    if (context->walker != NULL) {
+        char *path = walker_next(context->walker);
+        if (path == NULL) {
+            return finish_acks(context->sockfd, ctx) == 0 ? STATE_CLEANUP : STATE_ERROR;
+        }
+        int result = send_file(context->sockfd, path, ctx);
+        if (result == 0 && context->ack_window > 0) {
+            result = track_ack(context->ack_id, path, -1, ctx);
+        }
+        free(path);
+        return result == 0 ? STATE_SEND_FILE : STATE_ERROR;
+    }
     if (context->current_file_index < context->num_files) {
-        if (send_file(context->sockfd, context->file_paths[context->current_file_index], ctx) != 0) {
+        const char *path = context->file_paths[context->current_file_index];
+        if (context->cache_hints && context->current_file_index + 1 < context->num_files) {
+            prefetch_file(context->file_paths[context->current_file_index + 1]);
+        }
+        if (send_file(context->sockfd, path, ctx) != 0) {
+            return STATE_ERROR;
+        }
+        if (context->ack_window > 0 && track_ack(context->ack_id, path, -1, ctx) != 0) {
             return STATE_ERROR;
         }
         context->current_file_index++;
         return STATE_SEND_FILE;  // repeat for the next file
     }
+    return finish_acks(context->sockfd, ctx) == 0 ? STATE_CLEANUP : STATE_ERROR;
+}
+
+client_state serve_submissions_handler(void* ctx) {
+    FSMContext* context = (FSMContext*) ctx;
+    SET_TRACE(context, "Entering serve_submissions_handler.", STATE_SERVE_SUBMISSIONS);
+
+    if (serve_submissions(context->agent_socket, ctx) != 0) {
+        return STATE_ERROR;
+    }
+    return STATE_CLEANUP;
+}
+
+client_state submit_handler(void* ctx) {
+    FSMContext* context = (FSMContext*) ctx;
+    SET_TRACE(context, "Entering submit_handler.", STATE_SUBMIT);
+
+    if (submit_files(context->submit_socket, context->file_paths, context->num_files, ctx) != 0) {
+        return STATE_ERROR;
+    }
     return STATE_CLEANUP;
 }
 
@@ -83,9 +224,30 @@ client_state cleanup_handler(void* ctx) {
     FSMContext* context = (FSMContext*) ctx;
     SET_TRACE(context, "Entering cleanup_handler.", STATE_CLEANUP);
 
-    if (socket_close(context->sockfd, ctx) != 0) {
+    if (context->walker != NULL) {
+        walker_stop(context->walker);
+        free(context->walker);
+        context->walker = NULL;
+    }
+    report_rate(ctx);
+    metrics_stop();
+    // stdout carries the ack lines scripts read, so the table is only printed on request
+    if (context->report_latency) {
+        metrics_report(stderr);
+    }
+    trace_stop();
+    capture_stop();
+    if (context->sockfd != -1 && socket_close(context->sockfd, ctx) != 0) {
         return STATE_ERROR;
     }
+    for (int i = 0; i < context->in_flight; i++) {
+        free(context->pending_acks[i].path);
+    }
+    free(context->pending_acks);
+    // Paths collected from the walk for a manifest, including the skipped ones
+    for (int i = 0; i < context->num_owned_paths; i++) {
+        free(context->file_paths[i]);
+    }
     free(context->file_paths);
     return STATE_EXIT; // Or return STATE_EXIT or similar if you have an exit state
 }
@@ -100,12 +262,16 @@ client_state error_handler(void* ctx)
     return STATE_CLEANUP;
 }
 FSMState fsm_table[] = {
-        { STATE_PARSE_ARGUMENTS,  parse_arguments_handler, { STATE_HANDLE_ARGUMENTS, STATE_ERROR } },
+        { STATE_PARSE_ARGUMENTS,  parse_arguments_handler, { STATE_HANDLE_ARGUMENTS, STATE_SUBMIT } },
         { STATE_HANDLE_ARGUMENTS, handle_arguments_handler, { STATE_CONVERT_ADDRESS, STATE_ERROR } },
         { STATE_CONVERT_ADDRESS,  convert_address_handler,  { STATE_SOCKET_CREATE, STATE_ERROR } },
         { STATE_SOCKET_CREATE,    socket_create_handler,    { STATE_SOCKET_CONNECT, STATE_ERROR } },
-        { STATE_SOCKET_CONNECT,   socket_connect_handler,   { STATE_SEND_FILE, STATE_ERROR } },
+        { STATE_SOCKET_CONNECT,   socket_connect_handler,   { STATE_SEND_MANIFEST, STATE_ERROR } },
+        { STATE_SEND_MANIFEST,    send_manifest_handler,    { STATE_PASS_FILE, STATE_SERVE_SUBMISSIONS } },
+        { STATE_PASS_FILE,        pass_file_handler,        { STATE_PASS_FILE, STATE_SEND_FILE } },
         { STATE_SEND_FILE,        send_file_handler,        { STATE_SEND_FILE, STATE_CLEANUP } },
+        { STATE_SERVE_SUBMISSIONS, serve_submissions_handler, { STATE_CLEANUP, STATE_ERROR } },
+        { STATE_SUBMIT,           submit_handler,           { STATE_CLEANUP, STATE_ERROR } },
         { STATE_CLEANUP,          cleanup_handler,          {  STATE_EXIT, STATE_ERROR } },
         { STATE_ERROR,            error_handler,            { STATE_CLEANUP, STATE_CLEANUP } },
         { STATE_EXIT,             NULL,                     { STATE_EXIT, STATE_EXIT } }
@@ -116,14 +282,20 @@ int main(int argc, char *argv[]) {
     FSMContext context = {
             .argc = argc,
             .argv = argv,
-            .current_file_index = 0
+            .current_file_index = 0,
+            .chunk_size = COPY_CHUNK,
+            .sockfd = -1
     };
 
     client_state current_state = STATE_PARSE_ARGUMENTS;
 
     while (current_state != STATE_EXIT) {
         FSMState* current_fsm_state = &fsm_table[current_state];
+        uint64_t entered = monotonic_ns();
         client_state next_state = current_fsm_state->state_handler(&context);
+        uint64_t elapsed = monotonic_ns() - entered;
+        metrics_transition(current_state, next_state, elapsed);
+        PROBE3(transition, current_state, next_state, elapsed);
 
         if (next_state == STATE_ERROR) {
             current_state = next_state;
@@ -135,5 +307,7 @@ int main(int argc, char *argv[]) {
             current_state = current_fsm_state->next_states[1];
         }
     }
-    return EXIT_SUCCESS;
+    // Scripts and -S callers rely on the status: any error, or a file the server
+    // failed to store, fails the run
+    return context.error_message == NULL && context.failed_files == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
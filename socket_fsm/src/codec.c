@@ -0,0 +1,130 @@
+#include "codec.h"
+#include <errno.h>
+#include <string.h>
+
+int memory_read(void *source, void *buffer, size_t size)
+{
+    memory_source *memory = (memory_source *)source;
+
+    if (memory->size - memory->offset < size)
+    {
+        memory->offset = memory->size;
+        errno = EPIPE;
+        return -1;
+    }
+    memcpy(buffer, memory->data + memory->offset, size);
+    memory->offset += size;
+    return 0;
+}
+
+size_t encode_file_header(void *out, const char *name, uint32_t name_len, uint32_t size)
+{
+    unsigned char *bytes = (unsigned char *)out;
+
+    memcpy(bytes, &name_len, sizeof(name_len));
+    memcpy(bytes + sizeof(name_len), name, name_len);
+    memcpy(bytes + sizeof(name_len) + name_len, &size, sizeof(size));
+    return FILE_HEADER_SIZE(name_len);
+}
+
+size_t encode_chunk_header(void *out, uint32_t length)
+{
+    memcpy(out, &length, sizeof(length));
+    return CHUNK_HEADER_SIZE;
+}
+
+size_t encode_frame_header(void *out, uint32_t tag, uint32_t stream, uint32_t length)
+{
+    frame_header header = { tag, stream, length };
+
+    memcpy(out, &header, sizeof(header));
+    return sizeof(header);
+}
+
+size_t encode_ack(void *out, uint32_t file, uint32_t status, uint64_t bytes)
+{
+    unsigned char *frame = (unsigned char *)out;
+    uint32_t      tag    = FRAME_ACK;
+
+    memcpy(frame, &tag, sizeof(tag));
+    memcpy(frame + 4, &file, sizeof(file));
+    memcpy(frame + 8, &status, sizeof(status));
+    memcpy(frame + 12, &bytes, sizeof(bytes));
+    return ACK_FRAME_SIZE;
+}
+
+int decode_file_header(const byte_reader *in, uint32_t name_len, char *name, uint32_t *size)
+{
+    if (name_len > MAX_NAME_LEN)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    if (in->read(in->source, name, name_len) == -1 || in->read(in->source, size, sizeof(*size)) == -1)
+    {
+        return -1;
+    }
+    name[name_len] = '\0';
+    return 0;
+}
+
+int decode_chunk_header(const byte_reader *in, uint32_t *length)
+{
+    if (in->read(in->source, length, sizeof(*length)) == -1)
+    {
+        return -1;
+    }
+    if (*length == 0 || *length > MAX_FRAME_PAYLOAD)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+int decode_frame_header(const byte_reader *in, uint32_t *stream, uint32_t *length)
+{
+    uint32_t rest[2];
+
+    if (in->read(in->source, rest, sizeof(rest)) == -1)
+    {
+        return -1;
+    }
+    if (rest[1] > MAX_FRAME_PAYLOAD)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    *stream = rest[0];
+    *length = rest[1];
+    return 0;
+}
+
+int decode_ack(const void *frame, uint32_t *file, uint32_t *status, uint64_t *bytes)
+{
+    const unsigned char *bytes_in = (const unsigned char *)frame;
+    uint32_t            tag;
+
+    memcpy(&tag, bytes_in, sizeof(tag));
+    if (tag != FRAME_ACK)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(file, bytes_in + 4, sizeof(*file));
+    memcpy(status, bytes_in + 8, sizeof(*status));
+    memcpy(bytes, bytes_in + 12, sizeof(*bytes));
+    return 0;
+}
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
@@ -0,0 +1,49 @@
+#ifndef SOCKET_FSM_CODEC_H
+#define SOCKET_FSM_CODEC_H
+
+#include "protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Framing of the wire format in protocol.h, apart from any socket. Encoders
+// write a header into a caller's buffer and return its length, so a header and
+// its payload can go out in one write. Decoders pull bytes from a byte_reader,
+// which is a socket in the server and a buffer in codecbench, and check what
+// they read; they return 0, or -1 with errno EPROTO for a malformed frame and
+// whatever the reader left for a short read.
+#define FILE_HEADER_SIZE(name_len) (2 * sizeof(uint32_t) + (name_len))
+#define CHUNK_HEADER_SIZE          sizeof(uint32_t)
+
+typedef struct {
+    int  (*read)(void *source, void *buffer, size_t size);  // all size bytes or -1
+    void *source;
+} byte_reader;
+
+// A reader over bytes already in memory
+typedef struct {
+    const unsigned char *data;
+    size_t              size;
+    size_t              offset;
+} memory_source;
+
+int memory_read(void *source, void *buffer, size_t size);
+
+// Plain file: u32 name_len, name, u32 size, then chunks of u32 length, data
+size_t encode_file_header(void *out, const char *name, uint32_t name_len, uint32_t size);
+size_t encode_chunk_header(void *out, uint32_t length);
+// Stream frames: u32 tag, u32 stream id, u32 payload length
+size_t encode_frame_header(void *out, uint32_t tag, uint32_t stream, uint32_t length);
+size_t encode_ack(void *out, uint32_t file, uint32_t status, uint64_t bytes);
+
+// The name length is the tag already read; name must hold name_len + 1 bytes
+int decode_file_header(const byte_reader *in, uint32_t name_len, char *name, uint32_t *size);
+int decode_chunk_header(const byte_reader *in, uint32_t *length);
+// The rest of a stream frame header whose tag has been read
+int decode_frame_header(const byte_reader *in, uint32_t *stream, uint32_t *length);
+int decode_ack(const void *frame, uint32_t *file, uint32_t *status, uint64_t *bytes);
+
+// 64-bit FNV-1a, the content hash of -H manifests and of packed files
+#define HASH_BASIS 14695981039346656037ull
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+
+#endif //SOCKET_FSM_CODEC_H
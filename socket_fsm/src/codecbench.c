@@ -0,0 +1,303 @@
+#include "codec.h"
+#include "ratelimit.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Microbenchmark of the framing in codec.c, without sockets. For every frame
+// size it encodes a plain file (header and chunks) and a stream (open, data
+// frames and end) into memory, decodes them again through a memory_source, and
+// prints one JSON object per framing and size with ns per frame and GB/s of
+// payload each way. Decoding copies every payload out of the input, as the
+// server's reads do. Each figure is the best of a few rounds.
+
+#define DEFAULT_SIZES  "16,256,4K,64K,1M"
+#define DEFAULT_BUDGET (64ull << 20)
+#define DEFAULT_ROUNDS 5
+#define MAX_SIZES      32
+#define BENCH_NAME     "codecbench.bin"
+
+typedef struct {
+    unsigned char *wire;
+    size_t        wire_size;
+    unsigned char *payload;
+    uint32_t      frame_size;
+    uint64_t      frames;
+} bench_buffers;
+
+typedef size_t (*encode_fn)(const bench_buffers *buffers);
+typedef int (*decode_fn)(const bench_buffers *buffers, unsigned char *out, uint64_t *checksum);
+
+static void usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-s sizes] [-m bytes] [-r rounds] [-o results]\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -s <sizes>  Frame payload sizes, comma separated with K and M suffixes\n"
+          "              (default " DEFAULT_SIZES ")\n", stderr);
+    fputs("  -m <bytes>  Payload to frame per round (default 64M)\n", stderr);
+    fputs("  -r <rounds>  Rounds per measurement, the best one counts (default 5)\n", stderr);
+    fputs("  -o <file>  Write the JSON results to <file> instead of stdout\n", stderr);
+}
+
+static int parse_list(const char *text, uint64_t *values, int *count)
+{
+    char *copy = strdup(text);
+    char *save = NULL;
+
+    *count = 0;
+    for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        if (*count == MAX_SIZES || parse_rate(item, &values[*count]) == -1 || values[*count] == 0 ||
+            values[*count] > MAX_FRAME_PAYLOAD)
+        {
+            free(copy);
+            return -1;
+        }
+        (*count)++;
+    }
+    free(copy);
+    return *count > 0 ? 0 : -1;
+}
+
+static size_t encode_plain(const bench_buffers *buffers)
+{
+    unsigned char *out  = buffers->wire;
+    uint32_t      size  = (uint32_t)(buffers->frames * buffers->frame_size);
+
+    out += encode_file_header(out, BENCH_NAME, strlen(BENCH_NAME), size);
+    for (uint64_t i = 0; i < buffers->frames; i++)
+    {
+        out += encode_chunk_header(out, buffers->frame_size);
+        memcpy(out, buffers->payload, buffers->frame_size);
+        out += buffers->frame_size;
+    }
+    return (size_t)(out - buffers->wire);
+}
+
+static int decode_plain(const bench_buffers *buffers, unsigned char *out, uint64_t *checksum)
+{
+    memory_source source = { buffers->wire, buffers->wire_size, 0 };
+    byte_reader   in     = { memory_read, &source };
+    char          name[MAX_NAME_LEN + 1];
+    uint32_t      name_len;
+    uint32_t      size;
+    uint32_t      length;
+
+    if (memory_read(&source, &name_len, sizeof(name_len)) == -1 ||
+        decode_file_header(&in, name_len, name, &size) == -1)
+    {
+        return -1;
+    }
+    while (size > 0)
+    {
+        if (decode_chunk_header(&in, &length) == -1 || length > size || memory_read(&source, out, length) == -1)
+        {
+            return -1;
+        }
+        *checksum += out[length - 1];
+        size      -= length;
+    }
+    return 0;
+}
+
+static size_t encode_stream(const bench_buffers *buffers)
+{
+    unsigned char *out  = buffers->wire;
+    uint64_t      size  = buffers->frames * buffers->frame_size;
+    uint32_t      name_len = strlen(BENCH_NAME);
+
+    out += encode_frame_header(out, FRAME_STREAM_OPEN, 1, sizeof(size) + name_len);
+    memcpy(out, &size, sizeof(size));
+    memcpy(out + sizeof(size), BENCH_NAME, name_len);
+    out += sizeof(size) + name_len;
+    for (uint64_t i = 0; i < buffers->frames; i++)
+    {
+        out += encode_frame_header(out, FRAME_STREAM_DATA, 1, buffers->frame_size);
+        memcpy(out, buffers->payload, buffers->frame_size);
+        out += buffers->frame_size;
+    }
+    out += encode_frame_header(out, FRAME_STREAM_END, 1, 0);
+    return (size_t)(out - buffers->wire);
+}
+
+static int decode_stream(const bench_buffers *buffers, unsigned char *out, uint64_t *checksum)
+{
+    memory_source source = { buffers->wire, buffers->wire_size, 0 };
+    byte_reader   in     = { memory_read, &source };
+    uint32_t      tag;
+    uint32_t      stream;
+    uint32_t      length;
+
+    while (memory_read(&source, &tag, sizeof(tag)) == 0)
+    {
+        if (decode_frame_header(&in, &stream, &length) == -1 || (length > 0 && memory_read(&source, out, length) == -1))
+        {
+            return -1;
+        }
+        if (tag == FRAME_STREAM_END)
+        {
+            return source.offset == source.size ? 0 : -1;
+        }
+        *checksum += length > 0 ? out[length - 1] : 0;
+    }
+    return -1;
+}
+
+static uint64_t best_encode(encode_fn encode, bench_buffers *buffers, int rounds)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int i = 0; i < rounds; i++)
+    {
+        uint64_t start = monotonic_ns();
+        buffers->wire_size = encode(buffers);
+        uint64_t elapsed = monotonic_ns() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    return best;
+}
+
+static uint64_t best_decode(decode_fn decode, const bench_buffers *buffers, unsigned char *out, int rounds,
+                            uint64_t *checksum)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int i = 0; i < rounds; i++)
+    {
+        uint64_t start = monotonic_ns();
+        if (decode(buffers, out, checksum) == -1)
+        {
+            return 0;
+        }
+        uint64_t elapsed = monotonic_ns() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    return best;
+}
+
+static void report(FILE *results, const char *framing, const bench_buffers *buffers, uint64_t encode_ns,
+                   uint64_t decode_ns)
+{
+    double payload = (double)buffers->frames * buffers->frame_size;
+    double frames  = (double)buffers->frames;
+
+    fprintf(results,
+            "{\"framing\":\"%s\",\"frame_size\":%u,\"frames\":%llu,\"wire_bytes\":%zu,"
+            "\"encode_ns_per_frame\":%.2f,\"encode_gb_per_s\":%.3f,"
+            "\"decode_ns_per_frame\":%.2f,\"decode_gb_per_s\":%.3f}\n",
+            framing, buffers->frame_size, (unsigned long long)buffers->frames, buffers->wire_size,
+            encode_ns / frames, payload / encode_ns, decode_ns / frames, payload / decode_ns);
+    fprintf(stderr, "%-6s %8u B frames: encode %9.2f ns/frame %7.3f GB/s   decode %9.2f ns/frame %7.3f GB/s\n",
+            framing, buffers->frame_size, encode_ns / frames, payload / encode_ns, decode_ns / frames,
+            payload / decode_ns);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t   sizes[MAX_SIZES];
+    int        num_sizes;
+    const char *size_list    = DEFAULT_SIZES;
+    const char *results_path = NULL;
+    FILE       *results      = stdout;
+    uint64_t   budget        = DEFAULT_BUDGET;
+    int        rounds        = DEFAULT_ROUNDS;
+    uint64_t   checksum      = 0;
+    int        failed        = 0;
+    int        opt;
+
+    while ((opt = getopt(argc, argv, "hs:m:r:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's': size_list = optarg; break;
+            case 'o': results_path = optarg; break;
+            case 'm':
+                if (parse_rate(optarg, &budget) == -1 || budget == 0 || budget > UINT32_MAX)
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (rounds <= 0 || parse_list(size_list, sizes, &num_sizes) == -1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (results_path != NULL && (results = fopen(results_path, "w")) == NULL)
+    {
+        perror(results_path);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < num_sizes && !failed; i++)
+    {
+        bench_buffers buffers = { .frame_size = (uint32_t)sizes[i] };
+        unsigned char *out;
+        size_t        capacity;
+
+        // The plain header has a 32-bit file size, so the budget stays below 4 GiB
+        buffers.frames = budget / buffers.frame_size ? budget / buffers.frame_size : 1;
+        capacity       = buffers.frames * (sizeof(frame_header) + buffers.frame_size) + 2 * sizeof(frame_header) +
+                         sizeof(uint64_t) + FILE_HEADER_SIZE(MAX_NAME_LEN);
+        buffers.wire    = malloc(capacity);
+        buffers.payload = malloc(buffers.frame_size);
+        out             = malloc(buffers.frame_size);
+        if (buffers.wire == NULL || buffers.payload == NULL || out == NULL)
+        {
+            perror("malloc");
+            failed = 1;
+        }
+        else
+        {
+            const struct {
+                const char *name;
+                encode_fn  encode;
+                decode_fn  decode;
+            } framings[] = { { "plain", encode_plain, decode_plain }, { "stream", encode_stream, decode_stream } };
+
+            for (size_t b = 0; b < buffers.frame_size; b++)
+            {
+                buffers.payload[b] = (unsigned char)(b * 31 + 7);
+            }
+            // Touch every page before timing anything
+            memset(buffers.wire, 0, capacity);
+            for (size_t f = 0; f < sizeof(framings) / sizeof(framings[0]) && !failed; f++)
+            {
+                uint64_t encode_ns = best_encode(framings[f].encode, &buffers, rounds);
+                uint64_t decode_ns = best_decode(framings[f].decode, &buffers, out, rounds, &checksum);
+
+                if (decode_ns == 0)
+                {
+                    fprintf(stderr, "%s framing of %u B frames did not decode\n", framings[f].name,
+                            buffers.frame_size);
+                    failed = 1;
+                    break;
+                }
+                report(results, framings[f].name, &buffers, encode_ns ? encode_ns : 1, decode_ns);
+            }
+        }
+        free(buffers.wire);
+        free(buffers.payload);
+        free(out);
+    }
+    // Keeps the payload copies from being optimised away
+    if (checksum == 1)
+    {
+        fputs("\n", stderr);
+    }
+    if (results != stdout)
+    {
+        fclose(results);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,232 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "pack.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Works on the pack a server keeps with -S packed:
+//   list      every packed name with its size, and how much of the log is live
+//   extract   write packed files out as ordinary files, checking their hashes
+//   compact   copy the live records into new segments and drop the old ones,
+//             which takes the pack's lock, so not while a server has it open
+// list and extract only read and may run next to the server; they see what
+// its last snapshot and the log after it hold.
+
+static void usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s list <directory>\n"
+                    "       %s extract <directory> <out-directory> [name...]\n"
+                    "       %s compact <directory>\n", program_name, program_name, program_name);
+    fputs("  <directory> is where the server stores files, the pack is in " PACK_DIR_NAME " under it\n", stderr);
+}
+
+static void summary(const pack *store)
+{
+    uint64_t dead = store->log_bytes > store->live_bytes ? store->log_bytes - store->live_bytes : 0;
+
+    fprintf(stderr, "%zu files, %" PRIu64 " of %" PRIu64 " bytes live in segments %" PRIu32 " to %" PRIu32
+                    " (%.1f%% dead), %" PRIu64 " records replayed, %" PRIu64 " bytes damaged\n",
+            store->files, store->live_bytes, store->log_bytes, store->first_segment, store->segment,
+            store->log_bytes > 0 ? 100.0 * (double)dead / (double)store->log_bytes : 0.0, store->replayed,
+            store->damaged);
+}
+
+static int list(const pack *store)
+{
+    for (size_t i = 0; i < store->capacity; i++)
+    {
+        const pack_entry *entry = &store->entries[i];
+        if (entry->name != NULL && entry->segment != 0)
+        {
+            printf("%" PRIu64 "\t%016" PRIx64 "\t%s\n", entry->size, entry->hash, entry->name);
+        }
+    }
+    summary(store);
+    return 0;
+}
+
+// Names from a tree upload (client -r) have directories in them
+static int make_parent_dirs(int out_fd, const char *name)
+{
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s", name) >= (int)sizeof(path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdirat(out_fd, path, 0755) == -1 && errno != EEXIST)
+        {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+static int extract_one(const pack *store, const pack_entry *entry, int out_fd, unsigned char **data,
+                       uint64_t *capacity)
+{
+    uint64_t done = 0;
+    int      fd;
+
+    if (entry->size > *capacity)
+    {
+        unsigned char *grown = realloc(*data, (size_t)entry->size);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        *data     = grown;
+        *capacity = entry->size;
+    }
+    if (pack_read(store, entry, *data) == -1)
+    {
+        return -1;
+    }
+    fd = openat(out_fd, entry->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == ENOENT && make_parent_dirs(out_fd, entry->name) == 0)
+    {
+        fd = openat(out_fd, entry->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd == -1)
+    {
+        return -1;
+    }
+    while (done < entry->size)
+    {
+        ssize_t written = write(fd, *data + done, (size_t)(entry->size - done));
+        if (written <= 0)
+        {
+            if (written == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        done += (uint64_t)written;
+    }
+    return close(fd);
+}
+
+// Every packed file, or only the names given
+static int extract(const pack *store, const char *out_directory, char **names, int num_names)
+{
+    unsigned char *data     = NULL;
+    uint64_t      capacity  = 0;
+    size_t        extracted = 0;
+    int           failed    = 0;
+    int           out_fd    = open(out_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (out_fd == -1)
+    {
+        perror(out_directory);
+        return -1;
+    }
+    for (size_t i = 0; num_names == 0 && i < store->capacity; i++)
+    {
+        const pack_entry *entry = &store->entries[i];
+        if (entry->name == NULL || entry->segment == 0)
+        {
+            continue;
+        }
+        if (extract_one(store, entry, out_fd, &data, &capacity) == -1)
+        {
+            perror(entry->name);
+            failed++;
+            continue;
+        }
+        extracted++;
+    }
+    for (int i = 0; i < num_names; i++)
+    {
+        const pack_entry *entry = pack_find(store, names[i]);
+        if (entry == NULL)
+        {
+            fprintf(stderr, "%s: not in the pack\n", names[i]);
+            failed++;
+            continue;
+        }
+        if (extract_one(store, entry, out_fd, &data, &capacity) == -1)
+        {
+            perror(names[i]);
+            failed++;
+            continue;
+        }
+        extracted++;
+    }
+    free(data);
+    close(out_fd);
+    fprintf(stderr, "%zu files extracted, %d failed\n", extracted, failed);
+    return failed > 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    pack       store;
+    const char *command;
+    int        writable;
+    int        result;
+
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    command  = argv[1];
+    writable = strcmp(command, "compact") == 0;
+    if (!writable && strcmp(command, "list") != 0 && !(strcmp(command, "extract") == 0 && argc >= 4))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (pack_open(&store, argv[2], writable) == -1)
+    {
+        if (errno == EWOULDBLOCK)
+        {
+            fprintf(stderr, "%s: the pack is open in another process\n", argv[2]);
+        }
+        else
+        {
+            perror(argv[2]);
+        }
+        return EXIT_FAILURE;
+    }
+    if (strcmp(command, "list") == 0)
+    {
+        result = list(&store);
+    }
+    else if (strcmp(command, "extract") == 0)
+    {
+        result = extract(&store, argv[3], argv + 4, argc - 4);
+    }
+    else
+    {
+        summary(&store);
+        result = pack_compact(&store);
+        if (result == -1)
+        {
+            perror("compact");
+        }
+        summary(&store);
+    }
+    if (pack_close(&store) == -1)
+    {
+        perror("Cannot write the index snapshot");
+        result = -1;
+    }
+    return result == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,839 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "protocol.h"
+#include "ratelimit.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Synthetic load for the server: many connections from one process, each
+// sending plain files from memory with acks on, one file at a time. The number
+// of connections steps through the given levels; every level is held for a
+// while and reported on its own, so the report shows where connecting,
+// latency or throughput give out.
+//
+// Payloads come from one random buffer, so memory does not grow with the
+// connections. Each connection writes its files under one name, which the
+// server overwrites, so the disk use stays at a file per connection.
+
+#define DEFAULT_LEVELS   "10,100,1000"
+#define DEFAULT_SECONDS  5.0
+#define DEFAULT_SIZE     "64K"
+#define DEFAULT_CHUNK    (64 * 1024)
+#define MAX_LEVELS       32
+#define MAX_LOAD_CONNECTIONS 100000
+#define RECONNECT_NS     (100 * 1000000ull)
+#define MAX_EVENTS       1024
+#define MAX_PLAIN_FILE   0xFFFFFFFFull
+// A level whose throughput falls this far below the best so far has collapsed,
+// unless connections were refused or reset there, which is reported instead
+#define COLLAPSE_RATIO   0.9
+#define LOAD_NAME_LEN    32
+
+typedef enum {
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_EXPONENTIAL
+} dist_kind;
+
+// fixed:a, uniform:a-b or exp:mean
+typedef struct {
+    dist_kind kind;
+    double    a;
+    double    b;
+} distribution;
+
+typedef enum {
+    CONN_CLOSED,
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_WAITING,
+    CONN_THINKING
+} conn_phase;
+
+typedef struct {
+    int        fd;
+    conn_phase phase;
+    uint64_t   wake_ns;     // thinking, or waiting to reconnect
+    int        heap_index;  // position in the timer heap, -1 when not in it
+    uint64_t   connect_ns;
+    uint64_t   started_ns;
+    // The frames of the current file: header, then chunks from the payload
+    uint8_t    header[4 + 4 + 4 + LOAD_NAME_LEN + 4];
+    size_t     header_len;
+    size_t     header_sent;
+    uint64_t   size;
+    uint64_t   sent;
+    uint32_t   chunk_len;
+    uint32_t   chunk_left;
+    size_t     chunk_header_sent;
+    uint32_t   file;        // 1-based number of the file on this connection
+    uint32_t   files_left;  // before reconnecting, 0 for never
+    uint8_t    ack[ACK_FRAME_SIZE];
+    size_t     ack_used;
+} load_conn;
+
+typedef struct {
+    uint64_t *values;
+    size_t   count;
+    size_t   capacity;
+} samples;
+
+typedef struct {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t connects;
+    uint64_t connect_failures;
+    uint64_t resets;
+    uint64_t failed_files;
+    samples  latency;
+    samples  connect_latency;
+} level_stats;
+
+static load_conn    *conns;
+static int          num_conns;
+static int          epoll_fd;
+static int          *timer_heap;
+static int          heap_size;
+static struct sockaddr_storage server_addr;
+static socklen_t    server_addr_len;
+static distribution size_dist;
+static distribution think_dist;
+static uint32_t     files_per_connection;
+static uint32_t     chunk_size = DEFAULT_CHUNK;
+static uint8_t      *payload;
+static uint64_t     random_state = 0x9E3779B97F4A7C15ull;
+static level_stats  stats;
+
+static void usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-c levels] [-d seconds] [-s size] [-t think] [-n files] [-b chunk]\n"
+                    "          [-P server pid] [-o results] <address> <port>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -c <levels>  Connection counts to step through (default " DEFAULT_LEVELS ")\n", stderr);
+    fputs("  -d <seconds>  How long to hold each level (default 5)\n", stderr);
+    fputs("  -s <size>  File sizes: 64K, uniform:1K-1M or exp:64K (default " DEFAULT_SIZE ")\n", stderr);
+    fputs("  -t <think>  Milliseconds between a file's ack and the next file, in the\n"
+          "              same forms (default 0)\n", stderr);
+    fputs("  -n <files>  Reconnect after this many files (default never)\n", stderr);
+    fputs("  -b <chunk>  Payload of each frame (default 64K)\n", stderr);
+    fputs("  -P <pid>  The server's pid, to report its memory per connection\n", stderr);
+    fputs("  -o <file>  Write the JSON results to <file> instead of stdout\n", stderr);
+}
+
+static uint64_t next_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static int parse_value(const char *text, int is_time, double *value)
+{
+    uint64_t bytes;
+    char     *end;
+
+    if (is_time)
+    {
+        *value = strtod(text, &end);
+        return end != text && *end == '\0' && *value >= 0 ? 0 : -1;
+    }
+    if (parse_rate(text, &bytes) == -1)
+    {
+        return -1;
+    }
+    *value = (double)bytes;
+    return 0;
+}
+
+static int parse_distribution(const char *text, int is_time, distribution *dist)
+{
+    char buffer[64];
+    char *dash;
+
+    snprintf(buffer, sizeof(buffer), "%s", text);
+    if (strncmp(buffer, "uniform:", 8) == 0 && (dash = strchr(buffer + 8, '-')) != NULL)
+    {
+        *dash      = '\0';
+        dist->kind = DIST_UNIFORM;
+        return parse_value(buffer + 8, is_time, &dist->a) == 0 && parse_value(dash + 1, is_time, &dist->b) == 0 &&
+               dist->a <= dist->b ? 0 : -1;
+    }
+    if (strncmp(buffer, "exp:", 4) == 0)
+    {
+        dist->kind = DIST_EXPONENTIAL;
+        return parse_value(buffer + 4, is_time, &dist->a);
+    }
+    dist->kind = DIST_FIXED;
+    return parse_value(strncmp(buffer, "fixed:", 6) == 0 ? buffer + 6 : buffer, is_time, &dist->a);
+}
+
+static double sample(const distribution *dist)
+{
+    double unit = (double)(next_random() >> 11) / 9007199254740992.0;
+
+    switch (dist->kind)
+    {
+        case DIST_UNIFORM:
+            return dist->a + (dist->b - dist->a) * unit;
+        case DIST_EXPONENTIAL:
+            return -dist->a * log(1.0 - unit);
+        default:
+            return dist->a;
+    }
+}
+
+static void record(samples *into, uint64_t value)
+{
+    if (into->count == into->capacity)
+    {
+        size_t   capacity = into->capacity ? into->capacity * 2 : 4096;
+        uint64_t *grown   = realloc(into->values, capacity * sizeof(uint64_t));
+        if (grown == NULL)
+        {
+            return;
+        }
+        into->values   = grown;
+        into->capacity = capacity;
+    }
+    into->values[into->count++] = value;
+}
+
+static int by_value(const void *left, const void *right)
+{
+    uint64_t a = *(const uint64_t *)left;
+    uint64_t b = *(const uint64_t *)right;
+    return a < b ? -1 : a > b;
+}
+
+// Of samples sorted with by_value
+static double percentile_ms(const samples *from, double q)
+{
+    size_t rank = (size_t)(q * (double)from->count + 0.5);
+
+    if (from->count == 0)
+    {
+        return 0.0;
+    }
+    rank = rank < 1 ? 1 : rank > from->count ? from->count : rank;
+    return (double)from->values[rank - 1] / 1e6;
+}
+
+// Min-heap of connections by wake time
+static int earlier(int a, int b)
+{
+    return conns[timer_heap[a]].wake_ns < conns[timer_heap[b]].wake_ns;
+}
+
+static void heap_swap(int a, int b)
+{
+    int held      = timer_heap[a];
+    timer_heap[a] = timer_heap[b];
+    timer_heap[b] = held;
+    conns[timer_heap[a]].heap_index = a;
+    conns[timer_heap[b]].heap_index = b;
+}
+
+static void sift_up(int at)
+{
+    while (at > 0 && earlier(at, (at - 1) / 2))
+    {
+        heap_swap(at, (at - 1) / 2);
+        at = (at - 1) / 2;
+    }
+}
+
+static void sift_down(int at)
+{
+    for (;;)
+    {
+        int child = 2 * at + 1;
+        if (child >= heap_size)
+        {
+            return;
+        }
+        if (child + 1 < heap_size && earlier(child + 1, child))
+        {
+            child++;
+        }
+        if (!earlier(child, at))
+        {
+            return;
+        }
+        heap_swap(child, at);
+        at = child;
+    }
+}
+
+static void heap_push(int conn)
+{
+    timer_heap[heap_size]  = conn;
+    conns[conn].heap_index = heap_size++;
+    sift_up(heap_size - 1);
+}
+
+static void heap_remove(int conn)
+{
+    int at = conns[conn].heap_index;
+
+    heap_swap(at, --heap_size);
+    conns[conn].heap_index = -1;
+    if (at < heap_size)
+    {
+        sift_down(at);
+        sift_up(at);
+    }
+}
+
+static void wait_until(int index, uint64_t wake_ns, conn_phase phase)
+{
+    if (conns[index].heap_index != -1)
+    {
+        heap_remove(index);
+    }
+    conns[index].phase   = phase;
+    conns[index].wake_ns = wake_ns;
+    heap_push(index);
+}
+
+static void watch(int index, uint32_t events)
+{
+    struct epoll_event event = { .events = events, .data.u32 = (uint32_t)index };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conns[index].fd, &event);
+}
+
+static void start_connect(int index);
+
+// The connection is lost: count it and come back after a pause
+static void fail(int index, uint64_t now)
+{
+    load_conn *conn = &conns[index];
+
+    if (conn->phase == CONN_CONNECTING)
+    {
+        stats.connect_failures++;
+    }
+    else
+    {
+        stats.resets++;
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    wait_until(index, now + RECONNECT_NS, CONN_CLOSED);
+}
+
+static void start_file(int index, uint64_t now)
+{
+    load_conn *conn = &conns[index];
+    char      name[LOAD_NAME_LEN];
+    uint32_t  name_len;
+    double    size = sample(&size_dist);
+    uint32_t  size32;
+
+    conn->size = size < 0 ? 0 : size > (double)MAX_PLAIN_FILE ? MAX_PLAIN_FILE : (uint64_t)size;
+    size32     = (uint32_t)conn->size;
+    name_len   = (uint32_t)snprintf(name, sizeof(name), "load-%d", index);
+    conn->header_len = 0;
+    memcpy(conn->header + conn->header_len, &name_len, sizeof(name_len));
+    conn->header_len += sizeof(name_len);
+    memcpy(conn->header + conn->header_len, name, name_len);
+    conn->header_len += name_len;
+    memcpy(conn->header + conn->header_len, &size32, sizeof(size32));
+    conn->header_len += sizeof(size32);
+    conn->header_sent       = 0;
+    conn->sent              = 0;
+    conn->chunk_left        = 0;
+    conn->chunk_header_sent = 0;
+    conn->ack_used          = 0;
+    conn->file++;
+    conn->started_ns = now;
+    conn->phase      = CONN_SENDING;
+}
+
+// Write as much of the current file as the socket takes
+static void send_some(int index, uint64_t now)
+{
+    load_conn *conn = &conns[index];
+
+    while (conn->phase == CONN_SENDING)
+    {
+        ssize_t written;
+
+        if (conn->header_sent < conn->header_len)
+        {
+            written = write(conn->fd, conn->header + conn->header_sent, conn->header_len - conn->header_sent);
+            if (written > 0)
+            {
+                conn->header_sent += (size_t)written;
+            }
+        }
+        else if (conn->sent < conn->size || conn->chunk_left > 0)
+        {
+            struct iovec frame[2];
+            if (conn->chunk_left == 0)
+            {
+                uint64_t left           = conn->size - conn->sent;
+                conn->chunk_len         = left < chunk_size ? (uint32_t)left : chunk_size;
+                conn->chunk_left        = conn->chunk_len;
+                conn->chunk_header_sent = 0;
+            }
+            frame[0].iov_base = (uint8_t *)&conn->chunk_len + conn->chunk_header_sent;
+            frame[0].iov_len  = sizeof(conn->chunk_len) - conn->chunk_header_sent;
+            frame[1].iov_base = payload + (conn->chunk_len - conn->chunk_left);
+            frame[1].iov_len  = conn->chunk_left;
+            written = writev(conn->fd, frame, 2);
+            if (written > 0)
+            {
+                size_t header_part = (size_t)written < frame[0].iov_len ? (size_t)written : frame[0].iov_len;
+                conn->chunk_header_sent += header_part;
+                conn->chunk_left        -= (uint32_t)((size_t)written - header_part);
+                conn->sent              += (size_t)written - header_part;
+            }
+        }
+        else
+        {
+            conn->phase = CONN_WAITING;
+            watch(index, EPOLLIN);
+            return;
+        }
+        if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            watch(index, EPOLLIN | EPOLLOUT);
+            return;
+        }
+        if (written <= 0)
+        {
+            fail(index, now);
+            return;
+        }
+    }
+}
+
+static void next_file(int index, uint64_t now)
+{
+    double think_ms = sample(&think_dist);
+
+    if (think_ms > 0)
+    {
+        watch(index, EPOLLIN);
+        wait_until(index, now + (uint64_t)(think_ms * 1e6), CONN_THINKING);
+        return;
+    }
+    start_file(index, now);
+    send_some(index, now);
+}
+
+static void start_connect(int index)
+{
+    load_conn          *conn = &conns[index];
+    struct epoll_event event = { .events = EPOLLOUT, .data.u32 = (uint32_t)index };
+    uint64_t           now   = monotonic_ns();
+    int                one   = 1;
+
+    conn->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1)
+    {
+        conn->phase = CONN_CONNECTING;
+        stats.connect_failures++;
+        wait_until(index, now + RECONNECT_NS, CONN_CLOSED);
+        return;
+    }
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    conn->phase      = CONN_CONNECTING;
+    conn->connect_ns = now;
+    conn->file       = 0;
+    conn->files_left = files_per_connection;
+    if ((connect(conn->fd, (struct sockaddr *)&server_addr, server_addr_len) == -1 && errno != EINPROGRESS) ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1)
+    {
+        fail(index, now);
+    }
+}
+
+static void connected(int index, uint64_t now)
+{
+    load_conn *conn = &conns[index];
+    uint32_t  hello[2] = { FRAME_HELLO, FEATURE_ACKS };
+    int       error    = 0;
+    socklen_t length   = sizeof(error);
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0 ||
+        write(conn->fd, hello, sizeof(hello)) != (ssize_t)sizeof(hello))
+    {
+        fail(index, now);
+        return;
+    }
+    stats.connects++;
+    record(&stats.connect_latency, now - conn->connect_ns);
+    next_file(index, now);
+}
+
+static void receive_ack(int index, uint64_t now)
+{
+    load_conn *conn = &conns[index];
+    ssize_t   got   = read(conn->fd, conn->ack + conn->ack_used, sizeof(conn->ack) - conn->ack_used);
+    uint32_t  tag;
+    uint32_t  file;
+    uint32_t  status;
+
+    if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return;
+    }
+    if (got <= 0 || conn->phase != CONN_WAITING)
+    {
+        // The server closed, or answered before the file was complete
+        fail(index, now);
+        return;
+    }
+    conn->ack_used += (size_t)got;
+    if (conn->ack_used < sizeof(conn->ack))
+    {
+        return;
+    }
+    memcpy(&tag, conn->ack, sizeof(tag));
+    memcpy(&file, conn->ack + 4, sizeof(file));
+    memcpy(&status, conn->ack + 8, sizeof(status));
+    if (tag != FRAME_ACK || file != conn->file)
+    {
+        fail(index, now);
+        return;
+    }
+    if (status == ACK_OK)
+    {
+        stats.files++;
+        stats.bytes += conn->size;
+        record(&stats.latency, now - conn->started_ns);
+    }
+    else
+    {
+        stats.failed_files++;
+    }
+    if (conn->files_left > 0 && --conn->files_left == 0)
+    {
+        // Churn: a new connection for the next files
+        close(conn->fd);
+        conn->fd = -1;
+        start_connect(index);
+        return;
+    }
+    next_file(index, now);
+}
+
+static void handle_event(int index, uint32_t events, uint64_t now)
+{
+    load_conn *conn = &conns[index];
+
+    if (conn->fd == -1)
+    {
+        return;
+    }
+    if (conn->phase == CONN_CONNECTING)
+    {
+        connected(index, now);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    {
+        receive_ack(index, now);
+    }
+    if (conn->fd != -1 && conn->phase == CONN_SENDING && (events & EPOLLOUT))
+    {
+        send_some(index, now);
+    }
+}
+
+static void run_timers(uint64_t now)
+{
+    while (heap_size > 0 && conns[timer_heap[0]].wake_ns <= now)
+    {
+        int index = timer_heap[0];
+        heap_remove(index);
+        if (conns[index].phase == CONN_CLOSED)
+        {
+            start_connect(index);
+        }
+        else
+        {
+            start_file(index, now);
+            send_some(index, now);
+        }
+    }
+}
+
+static long server_rss_kb(pid_t pid)
+{
+    char line[256];
+    char path[64];
+    long rss = -1;
+    FILE *status;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    status = fopen(path, "r");
+    if (status == NULL)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+        {
+            break;
+        }
+    }
+    fclose(status);
+    return rss;
+}
+
+static int resolve(const char *address, const char *port)
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+    struct addrinfo *found;
+
+    if (getaddrinfo(address, port, &hints, &found) != 0)
+    {
+        return -1;
+    }
+    memcpy(&server_addr, found->ai_addr, found->ai_addrlen);
+    server_addr_len = found->ai_addrlen;
+    freeaddrinfo(found);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char         *level_list = DEFAULT_LEVELS;
+    const char         *results_path = NULL;
+    FILE               *results    = stdout;
+    uint64_t           levels[MAX_LEVELS];
+    int                num_levels  = 0;
+    double             seconds     = DEFAULT_SECONDS;
+    pid_t              server_pid  = 0;
+    long               base_rss    = -1;
+    double             best_rate   = 0.0;
+    int                best_level  = 0;
+    int                collapsed   = 0;
+    int                broken      = 0;
+    struct rlimit      limit;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t           value;
+    int                opt;
+    char               *copy;
+    char               *save = NULL;
+
+    if (parse_distribution(DEFAULT_SIZE, 0, &size_dist) == -1 || parse_distribution("0", 1, &think_dist) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    while ((opt = getopt(argc, argv, "hc:d:s:t:n:b:P:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': level_list = optarg; break;
+            case 'd': seconds = strtod(optarg, NULL); break;
+            case 'P': server_pid = (pid_t)atoi(optarg); break;
+            case 'o': results_path = optarg; break;
+            case 's':
+                if (parse_distribution(optarg, 0, &size_dist) == -1)
+                {
+                    fputs("Sizes are 64K, uniform:1K-1M or exp:64K\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                if (parse_distribution(optarg, 1, &think_dist) == -1)
+                {
+                    fputs("Think times are milliseconds: 10, uniform:0-20 or exp:10\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                files_per_connection = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                if (parse_rate(optarg, &value) == -1 || value == 0 || value > MAX_FRAME_PAYLOAD)
+                {
+                    fputs("Chunks are 1 byte to 16M\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                chunk_size = (uint32_t)value;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    copy = strdup(level_list);
+    for (char *item = strtok_r(copy, ",", &save); item != NULL && num_levels < MAX_LEVELS;
+         item = strtok_r(NULL, ",", &save))
+    {
+        levels[num_levels] = strtoull(item, NULL, 10);
+        if (levels[num_levels] == 0 || levels[num_levels] > MAX_LOAD_CONNECTIONS ||
+            (num_levels > 0 && levels[num_levels] < levels[num_levels - 1]))
+        {
+            fputs("Levels are rising connection counts up to 100000\n", stderr);
+            return EXIT_FAILURE;
+        }
+        num_levels++;
+    }
+    free(copy);
+    if (optind + 2 != argc || num_levels == 0 || seconds <= 0 || resolve(argv[optind], argv[optind + 1]) == -1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (results_path != NULL && (results = fopen(results_path, "w")) == NULL)
+    {
+        perror(results_path);
+        return EXIT_FAILURE;
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < levels[num_levels - 1] + 16)
+        {
+            fprintf(stderr, "Only %llu descriptors allowed, raise ulimit -n\n", (unsigned long long)limit.rlim_cur);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    num_conns  = (int)levels[num_levels - 1];
+    conns      = calloc((size_t)num_conns, sizeof(load_conn));
+    timer_heap = calloc((size_t)num_conns, sizeof(int));
+    payload    = malloc(chunk_size);
+    epoll_fd   = epoll_create1(EPOLL_CLOEXEC);
+    if (conns == NULL || timer_heap == NULL || payload == NULL || epoll_fd == -1)
+    {
+        perror("loadgen");
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < chunk_size; i++)
+    {
+        payload[i] = (uint8_t)next_random();
+    }
+    if (server_pid > 0)
+    {
+        base_rss = server_rss_kb(server_pid);
+    }
+
+    int active = 0;
+    for (int level = 0; level < num_levels; level++)
+    {
+        uint64_t start = monotonic_ns();
+        uint64_t end   = start + (uint64_t)(seconds * 1e9);
+        uint64_t now   = start;
+
+        free(stats.latency.values);
+        free(stats.connect_latency.values);
+        memset(&stats, 0, sizeof(stats));
+        for (; active < (int)levels[level]; active++)
+        {
+            conns[active].heap_index = -1;
+            start_connect(active);
+        }
+        while (now < end)
+        {
+            uint64_t wake  = heap_size > 0 && conns[timer_heap[0]].wake_ns < end ? conns[timer_heap[0]].wake_ns : end;
+            int      wait  = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+            int      ready = epoll_wait(epoll_fd, events, MAX_EVENTS, wait);
+
+            now = monotonic_ns();
+            for (int i = 0; i < ready; i++)
+            {
+                handle_event((int)events[i].data.u32, events[i].events, now);
+            }
+            run_timers(now);
+        }
+
+        // Only connections the server holds at the end count for its memory
+        int held = 0;
+        for (int i = 0; i < active; i++)
+        {
+            held += conns[i].fd != -1 && conns[i].phase != CONN_CONNECTING;
+        }
+
+        double elapsed   = (double)(now - start) / 1e9;
+        double rate      = (double)stats.bytes / (1024.0 * 1024.0) / elapsed;
+        long   rss       = server_pid > 0 ? server_rss_kb(server_pid) : -1;
+        double per_conn  = rss >= 0 && base_rss >= 0 && held > 0 ? (double)(rss - base_rss) / held : -1.0;
+
+        qsort(stats.latency.values, stats.latency.count, sizeof(uint64_t), by_value);
+        qsort(stats.connect_latency.values, stats.connect_latency.count, sizeof(uint64_t), by_value);
+        double p50       = percentile_ms(&stats.latency, 0.5);
+        double p99       = percentile_ms(&stats.latency, 0.99);
+        double p999      = percentile_ms(&stats.latency, 0.999);
+        double c50       = percentile_ms(&stats.connect_latency, 0.5);
+        double c99       = percentile_ms(&stats.connect_latency, 0.99);
+
+        fprintf(results,
+                "{\"connections\":%llu,\"seconds\":%.3f,\"connects\":%llu,\"connect_failures\":%llu,"
+                "\"resets\":%llu,\"held\":%d,\"failed_files\":%llu,\"files\":%llu,\"files_per_s\":%.1f,"
+                "\"mb_per_s\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"connect_p50_ms\":%.3f,"
+                "\"connect_p99_ms\":%.3f,\"server_rss_kb\":%ld,\"server_kb_per_connection\":%.1f}\n",
+                (unsigned long long)levels[level], elapsed, (unsigned long long)stats.connects,
+                (unsigned long long)stats.connect_failures, (unsigned long long)stats.resets, held,
+                (unsigned long long)stats.failed_files, (unsigned long long)stats.files,
+                (double)stats.files / elapsed, rate, p50, p99, p999, c50, c99, rss, per_conn);
+        fflush(results);
+        fprintf(stderr, "%6llu connections: %9.1f files/s %9.1f MiB/s  p50 %8.3f ms  p99 %8.3f ms  p99.9 %8.3f ms"
+                        "  connects %llu (%llu failed, p99 %.3f ms)  resets %llu  held %d  failed files %llu",
+                (unsigned long long)levels[level], (double)stats.files / elapsed, rate, p50, p99, p999,
+                (unsigned long long)stats.connects, (unsigned long long)stats.connect_failures, c99,
+                (unsigned long long)stats.resets, held, (unsigned long long)stats.failed_files);
+        if (per_conn >= 0)
+        {
+            fprintf(stderr, "  server %.1f KiB/connection", per_conn);
+        }
+        fputc('\n', stderr);
+        if (stats.connect_failures > 0 || stats.resets > 0)
+        {
+            // Whatever the throughput does from here on, the server stopped
+            // taking or keeping connections first
+            if (!broken)
+            {
+                broken = 1;
+                fprintf(stderr, "Connections broke at %llu: %llu connects failed, %llu reset, %d of %llu held\n",
+                        (unsigned long long)levels[level], (unsigned long long)stats.connect_failures,
+                        (unsigned long long)stats.resets, held, (unsigned long long)levels[level]);
+            }
+        }
+        else if (rate > best_rate)
+        {
+            best_rate  = rate;
+            best_level = level;
+        }
+        else if (!collapsed && !broken && rate < best_rate * COLLAPSE_RATIO)
+        {
+            collapsed = 1;
+            fprintf(stderr, "Throughput collapsed at %llu connections: %.0f%% of the peak at %llu\n",
+                    (unsigned long long)levels[level], rate / best_rate * 100.0, (unsigned long long)levels[best_level]);
+        }
+    }
+    if (!collapsed && !broken)
+    {
+        fprintf(stderr, "No collapse up to %llu connections, the peak was at %llu\n",
+                (unsigned long long)levels[num_levels - 1], (unsigned long long)levels[best_level]);
+    }
+    if (results_path != NULL)
+    {
+        fclose(results);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,603 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "metrics.h"
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+typedef struct {
+    _Alignas(64) atomic_int owned;
+    _Atomic uint64_t counters[METRIC_COUNT];
+    _Atomic uint64_t latency[LATENCY_BUCKETS + 1];   // the last bucket is +Inf
+    _Atomic uint64_t latency_ns;
+} metrics_shard;
+
+// Log-bucketed like HdrHistogram: values below 2^HISTOGRAM_SUB_BITS have a
+// bucket each, and every power of two above is split into 2^HISTOGRAM_SUB_BITS
+// linear buckets, so any value is known to within about 6%.
+typedef struct {
+    _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} histogram;
+
+typedef struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    const char *label;  // NULL, or the label telling series of one name apart
+} metric_info;
+
+static const metric_info metric_table[METRIC_COUNT] = {
+    [METRIC_ACCEPTS]          = { "socket_fsm_accepts_total", "counter", "Connections accepted.", NULL },
+    [METRIC_DISCONNECTS]      = { "socket_fsm_disconnects_total", "counter", "Connections closed.", NULL },
+    [METRIC_CONNECTIONS]      = { "socket_fsm_connections", "gauge", "Connections open.", NULL },
+    [METRIC_BYTES_RECEIVED]   = { "socket_fsm_bytes_received_total", "counter", "File data and framing read from clients.", NULL },
+    [METRIC_FILES_RECEIVED]   = { "socket_fsm_files_received_total", "counter", "Files stored.", NULL },
+    [METRIC_FILES_FAILED]     = { "socket_fsm_files_failed_total", "counter", "Files that could not be stored.", NULL },
+    [METRIC_OPEN_FILES]       = { "socket_fsm_open_files", "gauge", "Files being received.", NULL },
+    [METRIC_BYTES_IN_FLIGHT]  = { "socket_fsm_bytes_in_flight", "gauge", "Announced bytes of open files not received yet.", NULL },
+    [METRIC_THROTTLED_NS]     = { "socket_fsm_throttled_nanoseconds_total", "counter", "Time closed connections spent over their rate limit.", NULL },
+    [METRIC_SYSCALL_READ]     = { "socket_fsm_syscalls_total", "counter", "System calls on the data path.", "call=\"read\"" },
+    [METRIC_SYSCALL_RECVMSG]  = { "socket_fsm_syscalls_total", "counter", NULL, "call=\"recvmsg\"" },
+    [METRIC_SYSCALL_WRITE]    = { "socket_fsm_syscalls_total", "counter", NULL, "call=\"write\"" },
+    [METRIC_SYSCALL_SENDFILE] = { "socket_fsm_syscalls_total", "counter", NULL, "call=\"sendfile\"" },
+    [METRIC_SYSCALL_SPLICE]   = { "socket_fsm_syscalls_total", "counter", NULL, "call=\"splice\"" },
+    [METRIC_SYSCALL_POLL]     = { "socket_fsm_syscalls_total", "counter", NULL, "call=\"poll\"" },
+    [METRIC_SYSCALL_ACCEPT]   = { "socket_fsm_syscalls_total", "counter", NULL, "call=\"accept\"" },
+    [METRIC_SYSCALL_IOCTL]    = { "socket_fsm_syscalls_total", "counter", NULL, "call=\"ioctl\"" },
+};
+
+// The extra shard is shared, with atomic adds, by threads beyond the limit
+static metrics_shard              shards[MAX_METRIC_SHARDS + 1];
+static _Thread_local metrics_shard *local_shard;
+static pthread_key_t              shard_key;
+static pthread_once_t             shard_once = PTHREAD_ONCE_INIT;
+
+// Only the thread running the FSM records state and transition times, so they
+// need no shards; transition histograms are allocated when an edge first fires.
+static histogram         state_histograms[MAX_METRIC_STATES];
+static histogram *_Atomic transition_histograms[MAX_METRIC_STATES][MAX_METRIC_STATES];
+
+static const char *const *state_names;
+static int               num_state_names;
+static pthread_t         exporter;
+static int               exporter_running;
+static int               listen_fd = -1;
+static int               signal_fd = -1;
+static int               stop_pipe[2] = { -1, -1 };
+static char              unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+// A thread that exits hands its shard, counts and all, to the next new thread.
+static void release_shard(void *shard)
+{
+    atomic_store(&((metrics_shard *)shard)->owned, 0);
+}
+
+static void create_shard_key(void)
+{
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static metrics_shard *shard(void)
+{
+    if (local_shard != NULL)
+    {
+        return local_shard;
+    }
+    pthread_once(&shard_once, create_shard_key);
+    for (int i = 0; i < MAX_METRIC_SHARDS; i++)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&shards[i].owned, &expected, 1))
+        {
+            local_shard = &shards[i];
+            pthread_setspecific(shard_key, local_shard);
+            return local_shard;
+        }
+    }
+    local_shard = &shards[MAX_METRIC_SHARDS];
+    return local_shard;
+}
+
+static void bump(metrics_shard *own, _Atomic uint64_t *value, uint64_t delta)
+{
+    if (own == &shards[MAX_METRIC_SHARDS])
+    {
+        atomic_fetch_add_explicit(value, delta, memory_order_relaxed);
+        return;
+    }
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+void metrics_add(metric_id id, int64_t delta)
+{
+    metrics_shard *own = shard();
+    bump(own, &own->counters[id], (uint64_t)delta);
+}
+
+void metrics_write_latency(uint64_t ns)
+{
+    metrics_shard *own    = shard();
+    int           bucket  = 0;
+    uint64_t      limit   = 1000;
+
+    while (bucket < LATENCY_BUCKETS && ns > limit)
+    {
+        bucket++;
+        limit *= 4;
+    }
+    bump(own, &own->latency[bucket], 1);
+    bump(own, &own->latency_ns, ns);
+}
+
+static int histogram_bucket(uint64_t value)
+{
+    int magnitude;
+
+    if (value < (1u << HISTOGRAM_SUB_BITS))
+    {
+        return (int)value;
+    }
+    magnitude = 63 - __builtin_clzll(value);
+    if (magnitude > HISTOGRAM_MAX_BITS)
+    {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    return ((magnitude - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+           (int)((value >> (magnitude - HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+}
+
+// Largest value that falls in a bucket
+static uint64_t bucket_limit(int bucket)
+{
+    int magnitude = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    int sub       = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+    {
+        return (uint64_t)bucket;
+    }
+    return (((uint64_t)(1 << HISTOGRAM_SUB_BITS) + (uint64_t)sub + 1) << (magnitude - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+static void histogram_record(histogram *h, uint64_t value)
+{
+    _Atomic uint64_t *count = &h->counts[histogram_bucket(value)];
+
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&h->total, atomic_load_explicit(&h->total, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&h->sum, atomic_load_explicit(&h->sum, memory_order_relaxed) + value, memory_order_relaxed);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed))
+    {
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+    }
+}
+
+// Value at or below which the fraction q of the recorded values lie
+static uint64_t histogram_quantile(const histogram *h, double q)
+{
+    uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+    uint64_t max   = atomic_load_explicit(&h->max, memory_order_relaxed);
+    uint64_t rank  = (uint64_t)(q * (double)total + 0.5);
+    uint64_t seen  = 0;
+
+    rank = rank < 1 ? 1 : rank;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += atomic_load_explicit(&h->counts[bucket], memory_order_relaxed);
+        if (seen >= rank)
+        {
+            uint64_t limit = bucket_limit(bucket);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+// Time spent in the handler of from, which chose to go to to.
+void metrics_transition(int from, int to, uint64_t ns)
+{
+    histogram *edge;
+
+    if (from < 0 || from >= MAX_METRIC_STATES || to < 0 || to >= MAX_METRIC_STATES)
+    {
+        return;
+    }
+    histogram_record(&state_histograms[from], ns);
+    edge = atomic_load_explicit(&transition_histograms[from][to], memory_order_relaxed);
+    if (edge == NULL)
+    {
+        edge = calloc(1, sizeof(histogram));
+        if (edge == NULL)
+        {
+            return;
+        }
+        atomic_store_explicit(&transition_histograms[from][to], edge, memory_order_release);
+    }
+    histogram_record(edge, ns);
+}
+
+static uint64_t sum(size_t offset)
+{
+    uint64_t total = 0;
+    for (int i = 0; i <= MAX_METRIC_SHARDS; i++)
+    {
+        total += atomic_load_explicit((_Atomic uint64_t *)((char *)&shards[i] + offset), memory_order_relaxed);
+    }
+    return total;
+}
+
+#define SUM(field) sum(offsetof(metrics_shard, field))
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static void print_summary(FILE *out, const char *name, const char *labels, const histogram *h)
+{
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    {
+        fprintf(out, "%s{%s,quantile=\"%g\"} %.9f\n", name, labels, quantiles[i],
+                (double)histogram_quantile(h, quantiles[i]) / 1e9);
+    }
+    fprintf(out, "%s_sum{%s} %.9f\n", name, labels, (double)atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e9);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels,
+            (unsigned long long)atomic_load_explicit(&h->total, memory_order_relaxed));
+}
+
+static void print_duration(FILE *out, uint64_t ns)
+{
+    if (ns < 10000)
+    {
+        fprintf(out, " %8llu ns", (unsigned long long)ns);
+    }
+    else if (ns < 10000000)
+    {
+        fprintf(out, " %8.1f us", (double)ns / 1e3);
+    }
+    else if (ns < 10000000000ull)
+    {
+        fprintf(out, " %8.1f ms", (double)ns / 1e6);
+    }
+    else
+    {
+        fprintf(out, " %8.1f s ", (double)ns / 1e9);
+    }
+}
+
+static void report_row(FILE *out, const char *name, const histogram *h)
+{
+    uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+
+    fprintf(out, "%-56s %10llu", name, (unsigned long long)total);
+    print_duration(out, total ? atomic_load_explicit(&h->sum, memory_order_relaxed) / total : 0);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    {
+        print_duration(out, histogram_quantile(h, quantiles[i]));
+    }
+    print_duration(out, atomic_load_explicit(&h->max, memory_order_relaxed));
+    fputc('\n', out);
+}
+
+// Percentiles of the time spent in each state and on each transition, as a table.
+void metrics_report(FILE *out)
+{
+    if (num_state_names == 0)
+    {
+        return;
+    }
+    fprintf(out, "%-56s %10s %11s %11s %11s %11s %11s %11s\n", "State", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int state = 0; state < num_state_names; state++)
+    {
+        if (atomic_load_explicit(&state_histograms[state].total, memory_order_relaxed) > 0)
+        {
+            report_row(out, state_names[state], &state_histograms[state]);
+        }
+    }
+    fprintf(out, "%-56s\n", "Transition");
+    for (int from = 0; from < num_state_names; from++)
+    {
+        for (int to = 0; to < num_state_names; to++)
+        {
+            histogram *edge = atomic_load_explicit(&transition_histograms[from][to], memory_order_acquire);
+            char      name[128];
+            if (edge != NULL)
+            {
+                snprintf(name, sizeof(name), "%s -> %s", state_names[from], state_names[to]);
+                report_row(out, name, edge);
+            }
+        }
+    }
+}
+
+void metrics_print(FILE *out)
+{
+    uint64_t cumulative = 0;
+    double   bound      = 1e-6;
+
+    for (int id = 0; id < METRIC_COUNT; id++)
+    {
+        const metric_info *info  = &metric_table[id];
+        uint64_t          value  = SUM(counters[id]);
+
+        if (info->help != NULL)
+        {
+            fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help, info->name, info->type);
+        }
+        if (strcmp(info->type, "gauge") == 0)
+        {
+            fprintf(out, "%s%s%s%s %lld\n", info->name, info->label ? "{" : "", info->label ? info->label : "",
+                    info->label ? "}" : "", (long long)(int64_t)value);
+        }
+        else
+        {
+            fprintf(out, "%s%s%s%s %llu\n", info->name, info->label ? "{" : "", info->label ? info->label : "",
+                    info->label ? "}" : "", (unsigned long long)value);
+        }
+    }
+    fputs("# HELP socket_fsm_write_seconds Time to write one chunk of received data to its file.\n"
+          "# TYPE socket_fsm_write_seconds histogram\n", out);
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+        cumulative += SUM(latency[bucket]);
+        fprintf(out, "socket_fsm_write_seconds_bucket{le=\"%g\"} %llu\n", bound, (unsigned long long)cumulative);
+        bound *= 4;
+    }
+    cumulative += SUM(latency[LATENCY_BUCKETS]);
+    fprintf(out, "socket_fsm_write_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+    fprintf(out, "socket_fsm_write_seconds_sum %.9f\n", (double)SUM(latency_ns) / 1e9);
+    fprintf(out, "socket_fsm_write_seconds_count %llu\n", (unsigned long long)cumulative);
+
+    fputs("# HELP socket_fsm_state_seconds Time spent in each state handler.\n"
+          "# TYPE socket_fsm_state_seconds summary\n", out);
+    for (int state = 0; state < num_state_names; state++)
+    {
+        char labels[128];
+        snprintf(labels, sizeof(labels), "state=\"%s\"", state_names[state]);
+        print_summary(out, "socket_fsm_state_seconds", labels, &state_histograms[state]);
+    }
+    fputs("# HELP socket_fsm_transition_seconds Time spent in a state handler, by the state it went to.\n"
+          "# TYPE socket_fsm_transition_seconds summary\n", out);
+    for (int from = 0; from < num_state_names; from++)
+    {
+        for (int to = 0; to < num_state_names; to++)
+        {
+            histogram *edge = atomic_load_explicit(&transition_histograms[from][to], memory_order_acquire);
+            char      labels[192];
+            if (edge != NULL)
+            {
+                snprintf(labels, sizeof(labels), "from=\"%s\",to=\"%s\"", state_names[from], state_names[to]);
+                print_summary(out, "socket_fsm_transition_seconds", labels, edge);
+            }
+        }
+    }
+}
+
+// Answer one scrape. The request itself is not looked at: every path gets the
+// metrics, over HTTP/1.0 so the connection simply ends with the body.
+static void serve_scrape(int fd)
+{
+    static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+    struct timeval timeout = { 1, 0 };
+    char           request[4096];
+    char           *body   = NULL;
+    size_t         length  = 0;
+    FILE           *out;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (read(fd, request, sizeof(request)) <= 0 || (out = open_memstream(&body, &length)) == NULL)
+    {
+        return;
+    }
+    metrics_print(out);
+    fclose(out);
+    if (write_fully(fd, header, sizeof(header) - 1) == 0)
+    {
+        write_fully(fd, body, length);
+    }
+    free(body);
+}
+
+static void *export_metrics(void *arg)
+{
+    struct pollfd fds[3] = {
+        { stop_pipe[0], POLLIN, 0 },
+        { signal_fd,    POLLIN, 0 },
+        { listen_fd,    POLLIN, 0 },
+    };
+    (void)arg;
+
+    while (poll(fds, listen_fd == -1 ? 2 : 3, -1) >= 0 || errno == EINTR)
+    {
+        if (fds[0].revents != 0)
+        {
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                metrics_print(stderr);
+                fflush(stderr);
+            }
+        }
+        if (listen_fd != -1 && (fds[2].revents & POLLIN))
+        {
+            int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client != -1)
+            {
+                serve_scrape(client);
+                close(client);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Listen on unix:/path or <address>:<port>, an IPv6 address in brackets.
+static int open_listener(const char *endpoint)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    int                     enable = 1;
+    int                     kind   = unix_endpoint(endpoint, &addr);
+    int                     fd;
+
+    if (kind == -1)
+    {
+        return -1;
+    }
+    if (kind == 1)
+    {
+        struct stat st;
+        strcpy(unix_path, ((struct sockaddr_un *)&addr)->sun_path);
+        // Replace the socket of a previous run, but never a regular file
+        if (lstat(unix_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        {
+            unlink(unix_path);
+        }
+        addr_len = sizeof(struct sockaddr_un);
+    }
+    else
+    {
+        const char *colon = strrchr(endpoint, ':');
+        char       host[INET6_ADDRSTRLEN + 2];
+        char       *end;
+        long       port;
+        size_t     host_len;
+
+        if (colon == NULL || (host_len = (size_t)(colon - endpoint)) >= sizeof(host))
+        {
+            return -1;
+        }
+        memcpy(host, endpoint, host_len);
+        host[host_len] = '\0';
+        if (host_len >= 2 && host[0] == '[' && host[host_len - 1] == ']')
+        {
+            memmove(host, host + 1, host_len - 2);
+            host[host_len - 2] = '\0';
+        }
+        port = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port < 1 || port > 65535)
+        {
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        if (inet_pton(AF_INET, host, &((struct sockaddr_in *)&addr)->sin_addr) == 1)
+        {
+            addr.ss_family                         = AF_INET;
+            ((struct sockaddr_in *)&addr)->sin_port = htons((in_port_t)port);
+            addr_len                               = sizeof(struct sockaddr_in);
+        }
+        else if (inet_pton(AF_INET6, host, &((struct sockaddr_in6 *)&addr)->sin6_addr) == 1)
+        {
+            addr.ss_family                           = AF_INET6;
+            ((struct sockaddr_in6 *)&addr)->sin6_port = htons((in_port_t)port);
+            addr_len                                 = sizeof(struct sockaddr_in6);
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) == -1 || listen(fd, 16) == -1)
+    {
+        close(fd);
+        unix_path[0] = '\0';
+        return -1;
+    }
+    return fd;
+}
+
+// Start the exporter thread. SIGUSR1 is blocked in the calling thread, and so in
+// every thread it starts later, and read from a signalfd instead, so it never
+// interrupts the event loop. endpoint may be NULL for the signal dump alone.
+int metrics_start(const char *endpoint, const char *const *names, int num_states)
+{
+    sigset_t mask;
+    sigset_t all;
+    sigset_t previous;
+    int      result;
+
+    state_names     = names;
+    num_state_names = num_states < MAX_METRIC_STATES ? num_states : MAX_METRIC_STATES;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0 ||
+        (signal_fd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1 ||
+        pipe2(stop_pipe, O_CLOEXEC) == -1)
+    {
+        metrics_stop();
+        return -1;
+    }
+    if (endpoint != NULL && (listen_fd = open_listener(endpoint)) == -1)
+    {
+        metrics_stop();
+        return -1;
+    }
+    // SIGINT and the like must reach the thread that polls for them
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    result = pthread_create(&exporter, NULL, export_metrics, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0)
+    {
+        metrics_stop();
+        return -1;
+    }
+    exporter_running = 1;
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (exporter_running)
+    {
+        write(stop_pipe[1], "", 1);
+        pthread_join(exporter, NULL);
+        exporter_running = 0;
+    }
+    if (listen_fd != -1)
+    {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (unix_path[0] != '\0')
+    {
+        unlink(unix_path);
+        unix_path[0] = '\0';
+    }
+    if (signal_fd != -1)
+    {
+        close(signal_fd);
+        signal_fd = -1;
+    }
+    if (stop_pipe[0] != -1)
+    {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        stop_pipe[0] = stop_pipe[1] = -1;
+    }
+}
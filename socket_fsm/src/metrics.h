@@ -0,0 +1,52 @@
+#ifndef SOCKET_FSM_METRICS_H
+#define SOCKET_FSM_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters and gauges in per-thread shards. A thread only ever writes its own
+// shard, with relaxed atomic loads and stores, so counting costs no locked
+// instruction and no shared cache line; the exporter sums the shards. Gauges
+// are counters that also go down, kept modulo 2^64.
+//
+// The server exports them in the Prometheus text format over HTTP on a TCP or
+// unix: listener (-M), and writes the same text to stderr on SIGUSR1.
+#define MAX_METRIC_SHARDS 64
+#define MAX_METRIC_STATES 32
+// Write latency buckets, powers of four from 1 us
+#define LATENCY_BUCKETS 12
+// State and transition times: 16 buckets per power of two up to 2^40 ns (18 min)
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) << HISTOGRAM_SUB_BITS)
+
+typedef enum {
+    METRIC_ACCEPTS,
+    METRIC_DISCONNECTS,
+    METRIC_CONNECTIONS,
+    METRIC_BYTES_RECEIVED,
+    METRIC_FILES_RECEIVED,
+    METRIC_FILES_FAILED,
+    METRIC_OPEN_FILES,
+    METRIC_BYTES_IN_FLIGHT,
+    METRIC_THROTTLED_NS,
+    METRIC_SYSCALL_READ,
+    METRIC_SYSCALL_RECVMSG,
+    METRIC_SYSCALL_WRITE,
+    METRIC_SYSCALL_SENDFILE,
+    METRIC_SYSCALL_SPLICE,
+    METRIC_SYSCALL_POLL,
+    METRIC_SYSCALL_ACCEPT,
+    METRIC_SYSCALL_IOCTL,
+    METRIC_COUNT
+} metric_id;
+
+void metrics_add(metric_id id, int64_t delta);
+void metrics_write_latency(uint64_t ns);
+void metrics_transition(int from, int to, uint64_t ns);
+void metrics_print(FILE *out);
+void metrics_report(FILE *out);
+int metrics_start(const char *endpoint, const char *const *state_names, int num_states);
+void metrics_stop(void);
+
+#endif //SOCKET_FSM_METRICS_H
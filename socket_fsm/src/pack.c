@@ -0,0 +1,764 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "pack.h"
+#include "codec.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define PACK_MIN_CAPACITY 1024
+#define PACK_TEMP_NAME    PACK_INDEX_NAME ".tmp"
+
+typedef struct {
+    char     magic[PACK_MAGIC_LEN];
+    uint32_t count;
+    uint32_t segment;
+    uint64_t offset;
+} pack_index_header;
+
+typedef struct {
+    uint32_t segment;
+    uint32_t name_len;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t hash;
+} pack_index_record;
+
+static void segment_name(uint32_t segment, char *name, size_t len)
+{
+    snprintf(name, len, "%08" PRIu32 ".seg", segment);
+}
+
+static uint64_t record_bytes(size_t name_len, uint64_t size)
+{
+    return sizeof(pack_record) + name_len + size;
+}
+
+// The slot holding name, or the free slot where it goes
+static pack_entry *index_slot(const pack *store, const char *name, size_t name_len, uint32_t name_hash)
+{
+    size_t mask = store->capacity - 1;
+
+    for (size_t i = name_hash & mask;; i = (i + 1) & mask)
+    {
+        pack_entry *entry = &store->entries[i];
+        if (entry->name == NULL ||
+            (entry->name_hash == name_hash && memcmp(entry->name, name, name_len) == 0 && entry->name[name_len] == '\0'))
+        {
+            return entry;
+        }
+    }
+}
+
+// Rehash into capacity slots, leaving the deleted names behind
+static int index_resize(pack *store, size_t capacity)
+{
+    pack_entry *old          = store->entries;
+    size_t     old_capacity  = store->capacity;
+
+    store->entries = calloc(capacity, sizeof(pack_entry));
+    if (store->entries == NULL)
+    {
+        store->entries = old;
+        return -1;
+    }
+    store->capacity = capacity;
+    store->used     = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        pack_entry *entry = &old[i];
+        if (entry->name == NULL)
+        {
+            continue;
+        }
+        if (entry->segment == 0)
+        {
+            free(entry->name);
+            continue;
+        }
+        *index_slot(store, entry->name, strlen(entry->name), entry->name_hash) = *entry;
+        store->used++;
+    }
+    free(old);
+    return 0;
+}
+
+static void index_clear(pack *store)
+{
+    for (size_t i = 0; i < store->capacity; i++)
+    {
+        free(store->entries[i].name);
+    }
+    memset(store->entries, 0, store->capacity * sizeof(pack_entry));
+    store->used       = 0;
+    store->files      = 0;
+    store->live_bytes = 0;
+}
+
+// Point name at a record; a name that is new may grow the table, one that is
+// already there never moves
+static int index_put(pack *store, const char *name, size_t name_len, uint32_t segment, uint64_t offset,
+                     uint64_t size, uint64_t hash)
+{
+    uint32_t   name_hash = (uint32_t)hash_bytes(HASH_BASIS, name, name_len);
+    pack_entry *entry    = index_slot(store, name, name_len, name_hash);
+
+    if (entry->name == NULL)
+    {
+        if ((store->used + 1) * 10 > store->capacity * 7)
+        {
+            size_t capacity = store->capacity;
+            while ((store->files + 1) * 2 > capacity)
+            {
+                capacity *= 2;
+            }
+            if (index_resize(store, capacity) == -1)
+            {
+                return -1;
+            }
+            entry = index_slot(store, name, name_len, name_hash);
+        }
+        if ((entry->name = strndup(name, name_len)) == NULL)
+        {
+            return -1;
+        }
+        entry->name_hash = name_hash;
+        store->used++;
+    }
+    else if (entry->segment != 0)
+    {
+        store->files--;
+        store->live_bytes -= record_bytes(name_len, entry->size);
+    }
+    entry->segment = segment;
+    entry->offset  = offset;
+    entry->size    = size;
+    entry->hash    = hash;
+    store->files++;
+    store->live_bytes += record_bytes(name_len, size);
+    return 0;
+}
+
+static void index_remove(pack *store, const char *name, size_t name_len)
+{
+    pack_entry *entry = index_slot(store, name, name_len, (uint32_t)hash_bytes(HASH_BASIS, name, name_len));
+
+    if (entry->name != NULL && entry->segment != 0)
+    {
+        entry->segment = 0;
+        store->files--;
+        store->live_bytes -= record_bytes(name_len, entry->size);
+    }
+}
+
+const pack_entry *pack_find(const pack *store, const char *name)
+{
+    size_t     name_len = strlen(name);
+    pack_entry *entry   = index_slot(store, name, name_len, (uint32_t)hash_bytes(HASH_BASIS, name, name_len));
+
+    return entry->name != NULL && entry->segment != 0 ? entry : NULL;
+}
+
+// The lowest and highest segment numbers in the directory, 0 for none
+static int find_segments(pack *store)
+{
+    int           fd  = openat(store->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR           *dir = fd == -1 ? NULL : fdopendir(fd);
+    struct dirent *entry;
+
+    if (dir == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        uint32_t segment;
+        if (strlen(entry->d_name) != 12 || strspn(entry->d_name, "0123456789") != 8 ||
+            strcmp(entry->d_name + 8, ".seg") != 0)
+        {
+            continue;
+        }
+        segment = (uint32_t)strtoul(entry->d_name, NULL, 10);
+        if (segment == 0)
+        {
+            continue;
+        }
+        if (store->first_segment == 0 || segment < store->first_segment)
+        {
+            store->first_segment = segment;
+        }
+        if (segment > store->segment)
+        {
+            store->segment = segment;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int load_snapshot(pack *store, uint32_t *segment, uint64_t *offset)
+{
+    pack_index_header header;
+    struct stat       st;
+    unsigned char     *map;
+    uint64_t          hash;
+    size_t            body;
+    size_t            at;
+    int               result = -1;
+    int               fd     = openat(store->dir_fd, PACK_INDEX_NAME, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(header) + sizeof(hash))
+    {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    body = (size_t)st.st_size - sizeof(hash);
+    memcpy(&hash, map + body, sizeof(hash));
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, PACK_INDEX_MAGIC, PACK_MAGIC_LEN) == 0 && hash == hash_bytes(HASH_BASIS, map, body))
+    {
+        result = 0;
+        at     = sizeof(header);
+        for (uint32_t i = 0; i < header.count && result == 0; i++)
+        {
+            pack_index_record record;
+            if (at + sizeof(record) > body)
+            {
+                result = -1;
+                break;
+            }
+            memcpy(&record, map + at, sizeof(record));
+            at += sizeof(record);
+            if (record.segment == 0 || record.name_len == 0 || record.name_len > MAX_NAME_LEN ||
+                at + record.name_len > body)
+            {
+                result = -1;
+                break;
+            }
+            result = index_put(store, (const char *)map + at, record.name_len, record.segment, record.offset,
+                               record.size, record.hash);
+            at += record.name_len;
+        }
+    }
+    munmap(map, (size_t)st.st_size);
+    if (result == -1)
+    {
+        index_clear(store);
+        return -1;
+    }
+    *segment = header.segment;
+    *offset  = header.offset;
+    return 0;
+}
+
+// Apply the records of a segment from offset on (0 for the start) and return
+// where the last whole record ends, 0 when the segment is not one.
+static uint64_t replay_segment(pack *store, uint32_t segment, uint64_t offset)
+{
+    char          name[32];
+    struct stat   st;
+    unsigned char *map = NULL;
+    uint64_t      size;
+    int           fd;
+
+    segment_name(segment, name, sizeof(name));
+    fd = openat(store->dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return 0;
+    }
+    size = (uint64_t)st.st_size;
+    if (size > 0)
+    {
+        map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED || size < PACK_MAGIC_LEN || memcmp(map, PACK_SEGMENT_MAGIC, PACK_MAGIC_LEN) != 0)
+    {
+        if (map != NULL && map != MAP_FAILED)
+        {
+            munmap(map, (size_t)size);
+        }
+        store->damaged += size;
+        return 0;
+    }
+    if (offset < PACK_MAGIC_LEN)
+    {
+        offset = PACK_MAGIC_LEN;
+    }
+    while (offset + sizeof(pack_record) <= size)
+    {
+        pack_record   record;
+        const char    *record_name;
+        unsigned char *data;
+
+        memcpy(&record, map + offset, sizeof(record));
+        record_name = (const char *)map + offset + sizeof(record);
+        data        = map + offset + sizeof(record) + record.name_len;
+        if ((record.type != PACK_FILE && record.type != PACK_DELETE) || record.name_len == 0 ||
+            record.name_len > MAX_NAME_LEN || record.size > size - offset - sizeof(record) - record.name_len ||
+            (record.type == PACK_DELETE && record.size != 0) ||
+            (record.type == PACK_FILE && hash_bytes(HASH_BASIS, data, (size_t)record.size) != record.hash))
+        {
+            break;
+        }
+        if (record.type == PACK_FILE)
+        {
+            if (index_put(store, record_name, record.name_len, segment, offset, record.size, record.hash) == -1)
+            {
+                break;
+            }
+        }
+        else
+        {
+            index_remove(store, record_name, record.name_len);
+        }
+        store->replayed++;
+        offset += record_bytes(record.name_len, record.size);
+    }
+    munmap(map, (size_t)size);
+    store->damaged += size - offset;
+    return offset;
+}
+
+// Append to segment from valid on, cutting off whatever follows; a segment with
+// no valid start is begun again
+static int open_segment(pack *store, uint32_t segment, uint64_t valid)
+{
+    char name[32];
+    int  fd;
+
+    segment_name(segment, name, sizeof(name));
+    fd = openat(store->dir_fd, name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)(valid < PACK_MAGIC_LEN ? 0 : valid)) == -1 ||
+        (valid < PACK_MAGIC_LEN && write(fd, PACK_SEGMENT_MAGIC, PACK_MAGIC_LEN) != PACK_MAGIC_LEN))
+    {
+        close(fd);
+        return -1;
+    }
+    if (valid < PACK_MAGIC_LEN)
+    {
+        store->log_bytes += PACK_MAGIC_LEN - valid;
+        valid = PACK_MAGIC_LEN;
+    }
+    store->segment      = segment;
+    store->segment_fd   = fd;
+    store->segment_size = valid;
+    if (store->first_segment == 0)
+    {
+        store->first_segment = segment;
+    }
+    return 0;
+}
+
+// Load the snapshot and replay the log after it. A writer then cuts off a torn
+// tail and appends to the last segment.
+int pack_open(pack *store, const char *directory, int writable)
+{
+    uint32_t segment = 0;
+    uint64_t offset  = 0;
+    uint64_t valid   = 0;
+    int      base_fd;
+    int      saved;
+
+    memset(store, 0, sizeof(*store));
+    store->dir_fd     = -1;
+    store->lock_fd    = -1;
+    store->segment_fd = -1;
+    base_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd == -1)
+    {
+        return -1;
+    }
+    if (writable && mkdirat(base_fd, PACK_DIR_NAME, 0755) == -1 && errno != EEXIST)
+    {
+        saved = errno;
+        close(base_fd);
+        errno = saved;
+        return -1;
+    }
+    store->dir_fd = openat(base_fd, PACK_DIR_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(base_fd);
+    if (store->dir_fd == -1)
+    {
+        return -1;
+    }
+    if (writable)
+    {
+        store->lock_fd = openat(store->dir_fd, PACK_LOCK_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (store->lock_fd == -1 || flock(store->lock_fd, LOCK_EX | LOCK_NB) == -1)
+        {
+            goto fail;
+        }
+    }
+    store->capacity = PACK_MIN_CAPACITY;
+    store->entries  = calloc(store->capacity, sizeof(pack_entry));
+    if (store->entries == NULL || find_segments(store) == -1)
+    {
+        goto fail;
+    }
+    if (load_snapshot(store, &segment, &offset) == -1 || segment < store->first_segment)
+    {
+        segment = store->first_segment;
+        offset  = 0;
+    }
+    for (uint32_t s = store->first_segment; s != 0 && s <= store->segment; s++)
+    {
+        if (s < segment)
+        {
+            char        name[32];
+            struct stat st;
+            segment_name(s, name, sizeof(name));
+            if (fstatat(store->dir_fd, name, &st, 0) == 0)
+            {
+                store->log_bytes += (uint64_t)st.st_size;
+            }
+            continue;
+        }
+        valid = replay_segment(store, s, s == segment ? offset : 0);
+        store->log_bytes += valid;
+    }
+    if (writable)
+    {
+        if (store->segment == 0)
+        {
+            store->segment = 1;
+        }
+        else if (valid >= PACK_SEGMENT_SIZE)
+        {
+            store->segment++;
+            valid = 0;
+        }
+        if (open_segment(store, store->segment, valid) == -1)
+        {
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    saved = errno;
+    pack_close(store);
+    errno = saved;
+    return -1;
+}
+
+static int snapshot_write(FILE *out, uint64_t *hash, const void *data, size_t size)
+{
+    *hash = hash_bytes(*hash, data, size);
+    return fwrite(data, size, 1, out) == 1 ? 0 : -1;
+}
+
+// The segment is synced first so the snapshot never covers records that could
+// still be lost. It is written aside and renamed over the old one.
+int pack_snapshot(pack *store)
+{
+    pack_index_header header;
+    uint64_t          hash   = HASH_BASIS;
+    int               result = 0;
+    FILE              *out;
+    int               fd;
+
+    if (store->segment_fd == -1)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (fdatasync(store->segment_fd) == -1)
+    {
+        return -1;
+    }
+    fd = openat(store->dir_fd, PACK_TEMP_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || (out = fdopen(fd, "w")) == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    memcpy(header.magic, PACK_INDEX_MAGIC, PACK_MAGIC_LEN);
+    header.count   = (uint32_t)store->files;
+    header.segment = store->segment;
+    header.offset  = store->segment_size;
+    result |= snapshot_write(out, &hash, &header, sizeof(header));
+    for (size_t i = 0; i < store->capacity && result == 0; i++)
+    {
+        const pack_entry  *entry = &store->entries[i];
+        pack_index_record record;
+        if (entry->name == NULL || entry->segment == 0)
+        {
+            continue;
+        }
+        record.segment  = entry->segment;
+        record.name_len = (uint32_t)strlen(entry->name);
+        record.offset   = entry->offset;
+        record.size     = entry->size;
+        record.hash     = entry->hash;
+        result |= snapshot_write(out, &hash, &record, sizeof(record));
+        result |= snapshot_write(out, &hash, entry->name, record.name_len);
+    }
+    if (result == 0 && fwrite(&hash, sizeof(hash), 1, out) != 1)
+    {
+        result = -1;
+    }
+    if (fflush(out) == EOF || fsync(fileno(out)) == -1)
+    {
+        result = -1;
+    }
+    if (fclose(out) == EOF)
+    {
+        result = -1;
+    }
+    if (result == -1 || renameat(store->dir_fd, PACK_TEMP_NAME, store->dir_fd, PACK_INDEX_NAME) == -1)
+    {
+        unlinkat(store->dir_fd, PACK_TEMP_NAME, 0);
+        return -1;
+    }
+    return fsync(store->dir_fd);
+}
+
+// Continue in a new segment once the current one is full
+static int roll_segment(pack *store)
+{
+    int full = store->segment_fd;
+
+    if (fdatasync(full) == -1 || open_segment(store, store->segment + 1, 0) == -1)
+    {
+        return -1;
+    }
+    close(full);
+    return pack_snapshot(store);
+}
+
+// One writev per record. A failed write is cut off again so the next record
+// does not follow a partial one.
+static int append_record(pack *store, const pack_record *record, const char *name, const void *data)
+{
+    struct iovec iov[3] = {
+        { (void *)record, sizeof(*record) },
+        { (void *)name, record->name_len },
+        { (void *)data, (size_t)record->size }
+    };
+    uint64_t     bytes  = record_bytes(record->name_len, record->size);
+    uint64_t     offset = store->segment_size;
+    ssize_t      written;
+
+    if (store->segment_fd == -1)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    do
+    {
+        written = writev(store->segment_fd, iov, 3);
+    } while (written == -1 && errno == EINTR);
+    if (written != (ssize_t)bytes)
+    {
+        int saved = written == -1 ? errno : ENOSPC;
+        if (ftruncate(store->segment_fd, (off_t)offset) == -1)
+        {
+            // Nothing may follow a partial record
+            close(store->segment_fd);
+            store->segment_fd = -1;
+        }
+        errno = saved;
+        return -1;
+    }
+    store->segment_size += bytes;
+    store->log_bytes    += bytes;
+    if (record->type == PACK_FILE)
+    {
+        if (index_put(store, name, record->name_len, store->segment, offset, record->size, record->hash) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        index_remove(store, name, record->name_len);
+    }
+    return store->segment_size >= PACK_SEGMENT_SIZE ? roll_segment(store) : 0;
+}
+
+int pack_append(pack *store, const char *name, const void *data, uint64_t size)
+{
+    pack_record record;
+
+    record.type     = PACK_FILE;
+    record.name_len = (uint32_t)strlen(name);
+    record.size     = size;
+    record.hash     = hash_bytes(HASH_BASIS, data, (size_t)size);
+    return append_record(store, &record, name, data);
+}
+
+// Only names the pack holds get a delete record
+int pack_delete(pack *store, const char *name)
+{
+    pack_record record = { PACK_DELETE, (uint32_t)strlen(name), 0, 0 };
+
+    return pack_find(store, name) == NULL ? 0 : append_record(store, &record, name, NULL);
+}
+
+int pack_read(const pack *store, const pack_entry *entry, void *data)
+{
+    char     name[32];
+    off_t    at   = (off_t)(entry->offset + sizeof(pack_record) + strlen(entry->name));
+    uint64_t done = 0;
+    int      fd;
+
+    segment_name(entry->segment, name, sizeof(name));
+    fd = openat(store->dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    while (done < entry->size)
+    {
+        ssize_t got = pread(fd, (char *)data + done, (size_t)(entry->size - done), at + (off_t)done);
+        if (got <= 0)
+        {
+            if (got == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            errno = got == 0 ? EIO : errno;
+            return -1;
+        }
+        done += (uint64_t)got;
+    }
+    close(fd);
+    if (hash_bytes(HASH_BASIS, data, (size_t)entry->size) != entry->hash)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Live records are copied into fresh segments, the snapshot moves over to them
+// and only then are the old segments removed, so the pack opens to the same
+// files wherever this stops.
+int pack_compact(pack *store)
+{
+    unsigned char *data     = NULL;
+    uint64_t      capacity  = 0;
+    uint32_t      boundary;
+    int           result    = 0;
+
+    if (store->segment_fd == -1)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (roll_segment(store) == -1)
+    {
+        return -1;
+    }
+    boundary = store->segment;
+    // Names already in the table do not move, so appending while walking it is safe
+    for (size_t i = 0; i < store->capacity && result == 0; i++)
+    {
+        pack_entry *entry = &store->entries[i];
+        if (entry->name == NULL || entry->segment == 0 || entry->segment >= boundary)
+        {
+            continue;
+        }
+        if (entry->size > capacity)
+        {
+            unsigned char *grown = realloc(data, (size_t)entry->size);
+            if (grown == NULL)
+            {
+                result = -1;
+                break;
+            }
+            data     = grown;
+            capacity = entry->size;
+        }
+        if (pack_read(store, entry, data) == -1 || pack_append(store, entry->name, data, entry->size) == -1)
+        {
+            result = -1;
+        }
+    }
+    free(data);
+    if (result == -1 || pack_snapshot(store) == -1)
+    {
+        return -1;
+    }
+    for (uint32_t s = store->first_segment; s < boundary; s++)
+    {
+        char        name[32];
+        struct stat st;
+        segment_name(s, name, sizeof(name));
+        if (fstatat(store->dir_fd, name, &st, 0) == 0 && unlinkat(store->dir_fd, name, 0) == 0)
+        {
+            store->log_bytes -= (uint64_t)st.st_size;
+        }
+    }
+    store->first_segment = boundary;
+    return index_resize(store, store->capacity);
+}
+
+int pack_close(pack *store)
+{
+    int result = 0;
+
+    if (store->segment_fd != -1)
+    {
+        result = pack_snapshot(store);
+        close(store->segment_fd);
+        store->segment_fd = -1;
+    }
+    if (store->entries != NULL)
+    {
+        index_clear(store);
+        free(store->entries);
+        store->entries = NULL;
+    }
+    if (store->lock_fd != -1)
+    {
+        close(store->lock_fd);
+        store->lock_fd = -1;
+    }
+    if (store->dir_fd != -1)
+    {
+        close(store->dir_fd);
+        store->dir_fd = -1;
+    }
+    return result;
+}
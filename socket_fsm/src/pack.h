@@ -0,0 +1,85 @@
+#ifndef SOCKET_FSM_PACK_H
+#define SOCKET_FSM_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-structured store for small files (server -S packed, fsmpack). Files are
+// appended as records to segment files in .pack under the storage directory:
+//   00000001.seg  "FSMSEG1\n", then records of
+//                 u32 type, u32 name_len, u64 size, u64 hash, name, data
+// A later record for a name replaces the earlier one and a PACK_DELETE record,
+// without data, drops it. The hash is hash_bytes of the data, as in -H
+// manifests.
+//
+// Where the latest record of every name is, is kept in memory in an open
+// addressing table; pack.index is a snapshot of it:
+//   "FSMIDX1\n", u32 count, u32 segment, u64 offset, then count entries of
+//   u32 segment, u32 name_len, u64 offset, u64 size, u64 hash, name,
+//   and last the u64 hash_bytes of everything before it.
+// The snapshot covers the log up to segment:offset. Opening the pack loads it
+// and replays the records after it, checking their hashes, so the torn tail a
+// crash leaves is found and cut off. Without a usable snapshot the whole log is
+// replayed. A snapshot is taken when a segment is full and when the pack is
+// closed.
+#define PACK_DIR_NAME       ".pack"
+#define PACK_INDEX_NAME     "pack.index"
+#define PACK_LOCK_NAME      "pack.lock"
+#define PACK_SEGMENT_MAGIC  "FSMSEG1\n"
+#define PACK_INDEX_MAGIC    "FSMIDX1\n"
+#define PACK_MAGIC_LEN      8
+#define PACK_SEGMENT_SIZE   (256ull << 20)
+// Larger files are stored as files of their own
+#define PACK_MAX_FILE       (1u << 20)
+#define PACK_FILE           0x454c4946u     // "FILE"
+#define PACK_DELETE         0x454c4544u     // "DELE"
+
+typedef struct {
+    uint32_t type;
+    uint32_t name_len;
+    uint64_t size;
+    uint64_t hash;
+} pack_record;
+
+// A free slot has no name, a deleted name has segment 0
+typedef struct {
+    char     *name;
+    uint32_t name_hash;
+    uint32_t segment;
+    uint64_t offset;            // of the record
+    uint64_t size;
+    uint64_t hash;
+} pack_entry;
+
+typedef struct {
+    int        dir_fd;          // .pack
+    int        lock_fd;         // held by a writer, -1 for a reader
+    pack_entry *entries;
+    size_t     capacity;        // a power of two
+    size_t     used;            // slots with a name
+    size_t     files;           // names not deleted
+    uint32_t   first_segment;
+    uint32_t   segment;         // the last one, appended to by a writer
+    int        segment_fd;
+    uint64_t   segment_size;
+    uint64_t   log_bytes;       // all segments together
+    uint64_t   live_bytes;      // records the index points to
+    uint64_t   replayed;        // records read after the snapshot
+    uint64_t   damaged;         // bytes cut off or skipped in the replay
+} pack;
+
+// A writer (the server, fsmpack compact) holds pack.lock, so there is one at a
+// time; readers take no lock.
+int pack_open(pack *store, const char *directory, int writable);
+const pack_entry *pack_find(const pack *store, const char *name);
+int pack_append(pack *store, const char *name, const void *data, uint64_t size);
+int pack_delete(pack *store, const char *name);
+// The data of an entry, checked against its hash
+int pack_read(const pack *store, const pack_entry *entry, void *data);
+int pack_snapshot(pack *store);
+// Copy every live record out of the older segments and remove them
+int pack_compact(pack *store);
+// Snapshots a writer's index first
+int pack_close(pack *store);
+
+#endif //SOCKET_FSM_PACK_H
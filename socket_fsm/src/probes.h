@@ -0,0 +1,38 @@
+#ifndef SOCKET_FSM_PROBES_H
+#define SOCKET_FSM_PROBES_H
+
+// USDT probes for perf, bpftrace and SystemTap, provider socket_fsm. Each probe
+// is a single nop in the code plus a note in the binary that tells the tracer
+// where the nop is and where to find the arguments; attaching turns the nop
+// into a breakpoint, so a probe nobody listens to costs nothing. Double
+// underscores in the names become dashes, e.g. usdt:./server:socket_fsm:file-end.
+//
+//   transition       from state, to state, ns in the handler of from
+//   accept           descriptor
+//   close            descriptor, bytes received, client number
+//   file__start      descriptor, size, file number
+//   file__end        descriptor, bytes, file number
+//   file__failed     descriptor, bytes, file number
+//   frame__received  descriptor, bytes
+//   frame__sent      descriptor, payload bytes, tag
+//
+// Without sys/sdt.h (systemtap-sdt-dev) or with SOCKET_FSM_USDT off, the probes
+// are not compiled in.
+#if defined(USE_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE1(name, a)       DTRACE_PROBE1(socket_fsm, name, a)
+#define PROBE2(name, a, b)    DTRACE_PROBE2(socket_fsm, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(socket_fsm, name, a, b, c)
+#else
+#define PROBE1(name, a)       ((void)0)
+#define PROBE2(name, a, b)    ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
+
+#endif //SOCKET_FSM_PROBES_H
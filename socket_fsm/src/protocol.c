@@ -0,0 +1,112 @@
+#include "protocol.h"
+#include "codec.h"
+#include "tls.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int read_fully(int fd, void *buffer, size_t size)
+{
+    size_t bytes_read = 0;
+    while (bytes_read < size)
+    {
+        ssize_t result = net_read(fd, (char *)buffer + bytes_read, size - bytes_read);
+        if (result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return -1;
+        }
+        bytes_read += (size_t)result;
+    }
+    return 0;
+}
+
+int write_fully(int fd, const void *buffer, size_t size)
+{
+    size_t bytes_written = 0;
+    while (bytes_written < size)
+    {
+        ssize_t result = net_write(fd, (const char *)buffer + bytes_written, size - bytes_written);
+        if (result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return -1;
+        }
+        bytes_written += (size_t)result;
+    }
+    return 0;
+}
+
+// Hash of the whole file, read with pread so the offset is untouched.
+int hash_file(int fd, uint64_t *hash)
+{
+    unsigned char buffer[65536];
+    uint64_t      value  = HASH_BASIS;
+    off_t         offset = 0;
+    ssize_t       result;
+
+    while ((result = pread(fd, buffer, sizeof(buffer), offset)) > 0)
+    {
+        value   = hash_bytes(value, buffer, (size_t)result);
+        offset += result;
+    }
+    if (result == -1)
+    {
+        return -1;
+    }
+    *hash = value;
+    return 0;
+}
+
+int write_ack(int fd, uint32_t file, uint32_t status, uint64_t bytes)
+{
+    unsigned char frame[ACK_FRAME_SIZE];
+
+    return write_fully(fd, frame, encode_ack(frame, file, status, bytes));
+}
+
+int read_ack(int fd, uint32_t *file, uint32_t *status, uint64_t *bytes)
+{
+    unsigned char frame[ACK_FRAME_SIZE];
+
+    if (read_fully(fd, frame, sizeof(frame)) == -1)
+    {
+        return -1;
+    }
+    return decode_ack(frame, file, status, bytes);
+}
+
+// byte_reader over a socket, source is the descriptor
+int socket_read(void *source, void *buffer, size_t size)
+{
+    return read_fully((int)(intptr_t)source, buffer, size);
+}
+
+// Returns 1 and fills addr for a unix:/path endpoint, 0 for any other address and
+// -1 when the path does not fit in sun_path.
+int unix_endpoint(const char *address, struct sockaddr_storage *addr)
+{
+    struct sockaddr_un *unix_addr = (struct sockaddr_un *)addr;
+    const char         *path      = address + strlen(UNIX_PREFIX);
+
+    if (strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX)) != 0)
+    {
+        return 0;
+    }
+    if (*path == '\0' || strlen(path) >= sizeof(unix_addr->sun_path))
+    {
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    unix_addr->sun_family = AF_UNIX;
+    strcpy(unix_addr->sun_path, path);
+    return 1;
+}
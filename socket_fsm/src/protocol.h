@@ -0,0 +1,87 @@
+#ifndef SOCKET_FSM_PROTOCOL_H
+#define SOCKET_FSM_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Wire format shared by the client and the server. All integers are sent in host
+// byte order, like the original file header.
+//
+// A plain file transfer starts with the length of its name. Lengths at or above
+// FRAME_TAG_BASE can never be a real name length, so they tag control frames
+// that newer clients may send in front of (or instead of) a plain file.
+#define FRAME_TAG_BASE     0xFFFFFF00u
+#define FRAME_MANIFEST     0xFFFFFF01u
+#define FRAME_PLAN         0xFFFFFF02u
+#define FRAME_STREAM_OPEN  0xFFFFFF03u
+#define FRAME_STREAM_DATA  0xFFFFFF04u
+#define FRAME_STREAM_END   0xFFFFFF05u
+#define FRAME_HELLO        0xFFFFFF06u
+#define FRAME_ACK          0xFFFFFF07u
+#define FRAME_FD_PASS      0xFFFFFF08u
+
+#define MAX_NAME_LEN          4096
+#define MAX_MANIFEST_ENTRIES  (1u << 20)
+#define MANIFEST_HASH_LEN     8
+#define MAX_STREAMS           64
+#define MAX_FRAME_PAYLOAD     (16u << 20)
+
+// Endpoints written as unix:/path are AF_UNIX stream sockets on this host and
+// take no port; the protocol on them is unchanged.
+#define UNIX_PREFIX "unix:"
+
+// Manifest (client -> server):
+//   u32 FRAME_MANIFEST, u32 count, then count entries of
+//   u32 name_len, name, u64 size, u32 hash_len (0 or 8), hash
+// Plan (server -> client):
+//   u32 FRAME_PLAN, u32 count, then one u8 action per manifest entry
+//
+// Stream frames let one connection carry many files at once. Each starts with
+//   u32 tag, u32 stream id, u32 payload length
+// FRAME_STREAM_OPEN carries u64 file size then the name, FRAME_STREAM_DATA carries
+// file bytes and FRAME_STREAM_END has no payload. At most MAX_STREAMS streams are
+// open per connection; an id may be reused once its stream has ended.
+typedef struct {
+    uint32_t tag;
+    uint32_t stream;
+    uint32_t length;
+} frame_header;
+
+//
+// FRAME_HELLO (client -> server): u32 FRAME_HELLO, u32 feature flags. With
+// FEATURE_ACKS the server answers every file, as soon as it is committed, with
+//   u32 FRAME_ACK, u32 file, u32 ack_status, u64 bytes committed
+// where file is the stream id for stream frames and the 1-based position among
+// the plain files of the connection otherwise.
+#define FEATURE_ACKS   0x1u
+#define ACK_FRAME_SIZE 20
+
+// FRAME_FD_PASS (client -> server, Unix domain sockets only):
+//   u32 FRAME_FD_PASS, u32 name_len, name
+// with the descriptor of a regular file attached to the tag as SCM_RIGHTS. The
+// server places the file's contents under name without any data on the socket,
+// and numbers and acknowledges it like a plain file.
+
+typedef enum {
+    ACK_OK     = 0,
+    ACK_FAILED = 1
+} ack_status;
+
+typedef enum {
+    PLAN_SEND   = 0,  // server prepared the file, client must send it
+    PLAN_SKIP   = 1,  // server already has this content
+    PLAN_REJECT = 2   // batch does not fit, nothing is sent
+} plan_action;
+
+int unix_endpoint(const char *address, struct sockaddr_storage *addr);
+// Socket helpers, through TLS when the connection uses it
+int read_fully(int fd, void *buffer, size_t size);
+int write_fully(int fd, const void *buffer, size_t size);
+int socket_read(void *source, void *buffer, size_t size);
+// hash_bytes of the whole file (codec.h)
+int hash_file(int fd, uint64_t *hash);
+int write_ack(int fd, uint32_t file, uint32_t status, uint64_t bytes);
+int read_ack(int fd, uint32_t *file, uint32_t *status, uint64_t *bytes);
+
+#endif //SOCKET_FSM_PROTOCOL_H
@@ -0,0 +1,76 @@
+#include "ratelimit.h"
+#include <stdlib.h>
+#include <time.h>
+
+uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SECOND + (uint64_t)now.tv_nsec;
+}
+
+// Bytes per second with an optional K, M or G suffix (powers of 1024).
+int parse_rate(const char *text, uint64_t *rate)
+{
+    char               *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    int                shift = 0;
+
+    if (end == text)
+    {
+        return -1;
+    }
+    switch (*end)
+    {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || value == 0 || value > (UINT64_MAX >> shift))
+    {
+        return -1;
+    }
+    *rate = (uint64_t)value << shift;
+    return 0;
+}
+
+void bucket_init(token_bucket *bucket, uint64_t rate)
+{
+    bucket->rate    = rate;
+    bucket->burst   = (double)(rate / BUCKET_BURST_DIVISOR > BUCKET_MIN_BURST ? rate / BUCKET_BURST_DIVISOR : BUCKET_MIN_BURST);
+    bucket->tokens  = bucket->burst;
+    bucket->last_ns = monotonic_ns();
+}
+
+void bucket_refill(token_bucket *bucket, uint64_t now_ns)
+{
+    if (bucket->rate == 0 || now_ns <= bucket->last_ns)
+    {
+        return;
+    }
+    bucket->tokens += (double)bucket->rate * (double)(now_ns - bucket->last_ns) / NS_PER_SECOND;
+    if (bucket->tokens > bucket->burst)
+    {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last_ns = now_ns;
+}
+
+void bucket_take(token_bucket *bucket, uint64_t bytes)
+{
+    if (bucket->rate != 0)
+    {
+        bucket->tokens -= (double)bytes;
+    }
+}
+
+// Time until the bucket is out of debt, 0 when traffic may flow now.
+uint64_t bucket_wait_ns(const token_bucket *bucket)
+{
+    if (bucket->rate == 0 || bucket->tokens > 0)
+    {
+        return 0;
+    }
+    return (uint64_t)(-bucket->tokens * NS_PER_SECOND / (double)bucket->rate) + 1;
+}
@@ -0,0 +1,29 @@
+#ifndef SOCKET_FSM_RATELIMIT_H
+#define SOCKET_FSM_RATELIMIT_H
+
+#include <stdint.h>
+
+// Token buckets for bandwidth limits. Tokens are bytes; a bucket refills at
+// rate bytes per second up to its burst. A whole frame is always taken at once,
+// so the balance may go negative and the debt is paid back before more input
+// or output is allowed.
+#define NS_PER_SECOND 1000000000ull
+// A full bucket holds 100 ms of traffic, but never less than one stream frame
+#define BUCKET_BURST_DIVISOR 10
+#define BUCKET_MIN_BURST (64 * 1024)
+
+typedef struct {
+    uint64_t rate;      // bytes per second, 0 means unlimited
+    double   burst;
+    double   tokens;
+    uint64_t last_ns;
+} token_bucket;
+
+uint64_t monotonic_ns(void);
+int parse_rate(const char *text, uint64_t *rate);
+void bucket_init(token_bucket *bucket, uint64_t rate);
+void bucket_refill(token_bucket *bucket, uint64_t now_ns);
+void bucket_take(token_bucket *bucket, uint64_t bytes);
+uint64_t bucket_wait_ns(const token_bucket *bucket);
+
+#endif //SOCKET_FSM_RATELIMIT_H
@@ -0,0 +1,601 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "capture.h"
+#include "protocol.h"
+#include "ratelimit.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Replays client captures (client -X) into a server. Every session in the
+// captures becomes a connection that sends the recorded bytes again, each write
+// at its recorded time scaled by -x, or as fast as the server takes them with
+// -x 0. With -c every session is replayed by that many connections at once.
+// Whatever the server sends back is read and dropped, counting acks on the
+// way, so the server sees the traffic it saw from the real clients without
+// the clients' files or disks.
+//
+// The report has the throughput, session times, acks, and how far the sends
+// fell behind the recorded schedule: with the server keeping up the lag stays
+// near zero, so lag is what shows it falling behind at the original pace.
+
+#define DEFAULT_SCALE  1.0
+#define MAX_TEMPLATES  4096
+#define MAX_REPLAYS    100000
+#define READ_SIZE      65536
+#define NS_PER_MS      1000000.0
+
+// One session of a capture file, as offsets of its records in the mapping
+typedef struct {
+    const unsigned char *base;
+    uint64_t            *records;
+    uint32_t            count;
+    uint64_t            bytes;
+    uint64_t            first_ns;
+    uint64_t            last_ns;
+} session_template;
+
+typedef enum {
+    REPLAY_WAITING,
+    REPLAY_CONNECTING,
+    REPLAY_SENDING,
+    REPLAY_DRAINING,
+    REPLAY_DONE
+} replay_phase;
+
+typedef struct {
+    const session_template *template;
+    replay_phase          phase;
+    int                   fd;
+    uint32_t              next;       // record being sent
+    uint32_t              sent;       // bytes of it already sent
+    uint64_t              started_ns;
+    uint64_t              finished_ns;
+    int                   failed;
+    // Replies: acks and plans are parsed to count acks
+    unsigned char         reply[ACK_FRAME_SIZE];
+    size_t                reply_used;
+    uint64_t              reply_skip; // plan bytes still to drop
+    int                   reply_lost; // an unknown frame, only bytes count from here
+} replay;
+
+typedef struct {
+    uint64_t *values;
+    size_t   count;
+    size_t   capacity;
+} samples;
+
+static session_template templates[MAX_TEMPLATES];
+static int              num_templates;
+static replay           *replays;
+static int              num_replays;
+static struct sockaddr_storage server_addr;
+static socklen_t        server_addr_len;
+static double           scale = DEFAULT_SCALE;
+static uint64_t         replay_start_ns;
+static uint64_t         bytes_sent;
+static uint64_t         bytes_received;
+static uint64_t         acks;
+static uint64_t         failed_acks;
+static samples          lag;
+static samples          session_times;
+
+static void usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-x scale] [-c copies] [-o results] <address> <port> <capture>...\n"
+                    "       %s -l <capture>...\n", program_name, program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -x <scale>  Time scale of the recorded schedule: 1 is the original pace,\n"
+          "              0.5 twice as fast, 0 as fast as the server reads (default 1)\n", stderr);
+    fputs("  -c <copies>  Connections replaying each session at the same time (default 1)\n", stderr);
+    fputs("  -o <file>  Write the JSON results to <file> instead of stdout\n", stderr);
+    fputs("  -l  List the sessions in the captures and exit\n", stderr);
+}
+
+static void record(samples *into, uint64_t value)
+{
+    if (into->count == into->capacity)
+    {
+        size_t   capacity = into->capacity ? into->capacity * 2 : 1024;
+        uint64_t *grown   = realloc(into->values, capacity * sizeof(uint64_t));
+        if (grown == NULL)
+        {
+            return;
+        }
+        into->values   = grown;
+        into->capacity = capacity;
+    }
+    into->values[into->count++] = value;
+}
+
+static int by_value(const void *left, const void *right)
+{
+    uint64_t a = *(const uint64_t *)left;
+    uint64_t b = *(const uint64_t *)right;
+    return (a > b) - (a < b);
+}
+
+static double percentile_ms(samples *from, double q)
+{
+    size_t index;
+
+    if (from->count == 0)
+    {
+        return 0.0;
+    }
+    index = (size_t)(q * (double)(from->count - 1) + 0.5);
+    return (double)from->values[index] / NS_PER_MS;
+}
+
+static session_template *find_template(const unsigned char *base, uint32_t session, int first)
+{
+    for (int i = first; i < num_templates; i++)
+    {
+        if (templates[i].base == base && i - first + 1 == (int)session)
+        {
+            return &templates[i];
+        }
+    }
+    return NULL;
+}
+
+// Map a capture and add its sessions. Records are checked here once, so the
+// replay can trust their lengths.
+static int load_capture(const char *path)
+{
+    struct stat         st;
+    const unsigned char *base;
+    uint64_t            offset = CAPTURE_MAGIC_LEN;
+    int                 first  = num_templates;
+    int                 fd     = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    base = st.st_size > 0 ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED || (uint64_t)st.st_size < CAPTURE_MAGIC_LEN ||
+        memcmp(base, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "%s is not a capture\n", path);
+        return -1;
+    }
+    while (offset < (uint64_t)st.st_size)
+    {
+        capture_record   header;
+        session_template *template;
+
+        if ((uint64_t)st.st_size - offset < CAPTURE_RECORD_SIZE)
+        {
+            break;
+        }
+        memcpy(&header, base + offset, sizeof(header));
+        if ((uint64_t)st.st_size - offset - CAPTURE_RECORD_SIZE < header.length || header.session == 0)
+        {
+            break;
+        }
+        // Sessions are numbered in the order they start
+        template = find_template(base, header.session, first);
+        if (template == NULL)
+        {
+            if (num_templates == MAX_TEMPLATES || header.session != (uint32_t)(num_templates - first + 1))
+            {
+                break;
+            }
+            template           = &templates[num_templates++];
+            template->base     = base;
+            template->first_ns = header.ns;
+        }
+        if ((template->count & (template->count - 1)) == 0)
+        {
+            uint64_t *grown = realloc(template->records, (template->count ? template->count * 2 : 1) * sizeof(uint64_t));
+            if (grown == NULL)
+            {
+                perror("realloc");
+                return -1;
+            }
+            template->records = grown;
+        }
+        template->records[template->count++] = offset;
+        template->bytes  += header.length;
+        template->last_ns = header.ns;
+        offset += CAPTURE_RECORD_SIZE + header.length;
+    }
+    if (offset != (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "%s: stops at a damaged record, %llu bytes in; replaying what is before it\n", path,
+                (unsigned long long)offset);
+    }
+    if (num_templates == first)
+    {
+        fprintf(stderr, "%s has no sessions\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static capture_record record_at(const session_template *template, uint32_t index)
+{
+    capture_record header;
+
+    memcpy(&header, template->base + template->records[index], sizeof(header));
+    return header;
+}
+
+static uint64_t due_ns(const session_template *template, uint32_t index)
+{
+    return replay_start_ns + (uint64_t)((double)record_at(template, index).ns * scale);
+}
+
+static void finish(replay *r, int failed, uint64_t now)
+{
+    if (r->fd != -1)
+    {
+        close(r->fd);
+        r->fd = -1;
+    }
+    r->phase       = REPLAY_DONE;
+    r->failed      = failed;
+    r->finished_ns = now;
+    if (!failed)
+    {
+        record(&session_times, now - r->started_ns);
+    }
+}
+
+static void start(replay *r, uint64_t now)
+{
+    r->fd         = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    r->started_ns = now;
+    r->phase      = REPLAY_CONNECTING;
+    if (r->fd == -1 ||
+        (connect(r->fd, (struct sockaddr *)&server_addr, server_addr_len) == -1 && errno != EINPROGRESS))
+    {
+        finish(r, 1, now);
+    }
+}
+
+// Send what is due, record by record, until the socket is full
+static void send_due(replay *r, uint64_t now)
+{
+    while (r->next < r->template->count)
+    {
+        capture_record header = record_at(r->template, r->next);
+        uint64_t       due    = due_ns(r->template, r->next);
+        ssize_t        sent;
+
+        if (due > now)
+        {
+            return;
+        }
+        if (r->sent == 0 && scale > 0)
+        {
+            record(&lag, now - due);
+        }
+        sent = send(r->fd, r->template->base + r->template->records[r->next] + CAPTURE_RECORD_SIZE + r->sent,
+                    header.length - r->sent, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                finish(r, 1, now);
+            }
+            return;
+        }
+        bytes_sent += (uint64_t)sent;
+        r->sent    += (uint32_t)sent;
+        if (r->sent == header.length)
+        {
+            r->next++;
+            r->sent = 0;
+        }
+    }
+    // The server answers the last files and closes once it sees the end
+    shutdown(r->fd, SHUT_WR);
+    r->phase = REPLAY_DRAINING;
+}
+
+// Count the acks in what the server sent. Plans are skipped by their count;
+// anything else ends the parsing, the bytes are still read.
+static void parse_replies(replay *r, const unsigned char *data, size_t size)
+{
+    while (size > 0 && !r->reply_lost)
+    {
+        size_t   need;
+        size_t   take;
+        uint32_t tag;
+
+        if (r->reply_skip > 0)
+        {
+            take = size < r->reply_skip ? size : (size_t)r->reply_skip;
+            r->reply_skip -= take;
+            data += take;
+            size -= take;
+            continue;
+        }
+        need = sizeof(uint32_t);
+        if (r->reply_used >= sizeof(uint32_t))
+        {
+            memcpy(&tag, r->reply, sizeof(tag));
+            need = tag == FRAME_ACK ? ACK_FRAME_SIZE : tag == FRAME_PLAN ? 2 * sizeof(uint32_t) : 0;
+            if (need == 0)
+            {
+                r->reply_lost = 1;
+                return;
+            }
+        }
+        take = need - r->reply_used < size ? need - r->reply_used : size;
+        memcpy(r->reply + r->reply_used, data, take);
+        r->reply_used += take;
+        data += take;
+        size -= take;
+        if (r->reply_used == need && need > sizeof(uint32_t))
+        {
+            uint32_t value;
+            memcpy(&tag, r->reply, sizeof(tag));
+            memcpy(&value, r->reply + (tag == FRAME_ACK ? 8 : 4), sizeof(value));
+            if (tag == FRAME_ACK)
+            {
+                acks++;
+                failed_acks += value != ACK_OK;
+            }
+            else
+            {
+                r->reply_skip = value;
+            }
+            r->reply_used = 0;
+        }
+    }
+}
+
+static void receive(replay *r, uint64_t now)
+{
+    static unsigned char buffer[READ_SIZE];
+    ssize_t              got = recv(r->fd, buffer, sizeof(buffer), 0);
+
+    if (got == -1)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            finish(r, 1, now);
+        }
+        return;
+    }
+    if (got == 0)
+    {
+        // Closed before all was sent is a failure, closed after is the end
+        finish(r, r->phase != REPLAY_DRAINING, now);
+        return;
+    }
+    bytes_received += (uint64_t)got;
+    parse_replies(r, buffer, (size_t)got);
+}
+
+static int resolve(const char *address, const char *port)
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+    struct addrinfo *found;
+
+    if (getaddrinfo(address, port, &hints, &found) != 0)
+    {
+        return -1;
+    }
+    memcpy(&server_addr, found->ai_addr, found->ai_addrlen);
+    server_addr_len = found->ai_addrlen;
+    freeaddrinfo(found);
+    return 0;
+}
+
+static void list_sessions(void)
+{
+    for (int i = 0; i < num_templates; i++)
+    {
+        printf("session %d: %u writes, %llu bytes, from %.3f ms for %.3f ms\n", i + 1, templates[i].count,
+               (unsigned long long)templates[i].bytes, templates[i].first_ns / NS_PER_MS,
+               (templates[i].last_ns - templates[i].first_ns) / NS_PER_MS);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char    *results_path = NULL;
+    FILE          *results      = stdout;
+    int           copies        = 1;
+    int           list          = 0;
+    int           first_capture;
+    int           done          = 0;
+    int           failed        = 0;
+    struct pollfd *fds;
+    struct rlimit limit;
+    uint64_t      elapsed;
+    int           opt;
+
+    while ((opt = getopt(argc, argv, "hx:c:o:l")) != -1)
+    {
+        switch (opt)
+        {
+            case 'x': scale = strtod(optarg, NULL); break;
+            case 'c': copies = atoi(optarg); break;
+            case 'o': results_path = optarg; break;
+            case 'l': list = 1; break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    first_capture = optind + (list ? 0 : 2);
+    if (first_capture >= argc || scale < 0 || copies <= 0 ||
+        (!list && resolve(argv[optind], argv[optind + 1]) == -1))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = first_capture; i < argc; i++)
+    {
+        if (load_capture(argv[i]) == -1)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    if (list)
+    {
+        list_sessions();
+        return EXIT_SUCCESS;
+    }
+    if ((uint64_t)num_templates * (uint64_t)copies > MAX_REPLAYS)
+    {
+        fputs("At most 100000 connections\n", stderr);
+        return EXIT_FAILURE;
+    }
+    if (results_path != NULL && (results = fopen(results_path, "w")) == NULL)
+    {
+        perror(results_path);
+        return EXIT_FAILURE;
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    num_replays = num_templates * copies;
+    replays     = calloc((size_t)num_replays, sizeof(replay));
+    fds         = calloc((size_t)num_replays, sizeof(struct pollfd));
+    if (replays == NULL || fds == NULL)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_replays; i++)
+    {
+        replays[i].template = &templates[i / copies];
+        replays[i].fd       = -1;
+    }
+
+    replay_start_ns = monotonic_ns();
+    while (done < num_replays)
+    {
+        uint64_t now     = monotonic_ns();
+        int      timeout = -1;
+
+        for (int i = 0; i < num_replays; i++)
+        {
+            replay *r = &replays[i];
+
+            fds[i].fd      = -1;
+            fds[i].events  = 0;
+            fds[i].revents = 0;
+            if (r->phase == REPLAY_WAITING && due_ns(r->template, 0) <= now)
+            {
+                start(r, now);
+            }
+            if (r->phase == REPLAY_DONE)
+            {
+                continue;
+            }
+            if (r->phase == REPLAY_WAITING || (r->phase == REPLAY_SENDING && r->sent == 0 &&
+                                               due_ns(r->template, r->next) > now))
+            {
+                uint64_t wait_ms = (due_ns(r->template, r->phase == REPLAY_WAITING ? 0 : r->next) - now + 999999) /
+                                   1000000;
+                timeout = timeout == -1 || wait_ms < (uint64_t)timeout ? (int)wait_ms : timeout;
+            }
+            if (r->phase != REPLAY_WAITING)
+            {
+                fds[i].fd     = r->fd;
+                fds[i].events = r->phase == REPLAY_CONNECTING ? POLLOUT : POLLIN;
+                if (r->phase == REPLAY_SENDING && due_ns(r->template, r->next) <= now)
+                {
+                    fds[i].events |= POLLOUT;
+                }
+            }
+        }
+        if (poll(fds, (nfds_t)num_replays, timeout) == -1 && errno != EINTR)
+        {
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+        now = monotonic_ns();
+        for (int i = 0; i < num_replays; i++)
+        {
+            replay *r = &replays[i];
+
+            if (r->phase == REPLAY_CONNECTING && fds[i].revents != 0)
+            {
+                int       error = 0;
+                socklen_t len   = sizeof(error);
+                getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                if (error != 0)
+                {
+                    finish(r, 1, now);
+                }
+                else
+                {
+                    r->phase = REPLAY_SENDING;
+                }
+            }
+            if ((r->phase == REPLAY_SENDING || r->phase == REPLAY_DRAINING) && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                receive(r, now);
+            }
+            if (r->phase == REPLAY_SENDING)
+            {
+                send_due(r, now);
+            }
+        }
+        done = 0;
+        for (int i = 0; i < num_replays; i++)
+        {
+            done += replays[i].phase == REPLAY_DONE;
+        }
+    }
+    elapsed = monotonic_ns() - replay_start_ns;
+    for (int i = 0; i < num_replays; i++)
+    {
+        failed += replays[i].failed;
+    }
+
+    qsort(lag.values, lag.count, sizeof(uint64_t), by_value);
+    qsort(session_times.values, session_times.count, sizeof(uint64_t), by_value);
+    double seconds  = (double)elapsed / 1e9;
+    double mb_per_s = (double)bytes_sent / (1024.0 * 1024.0) / seconds;
+    fprintf(results,
+            "{\"sessions\":%d,\"scale\":%g,\"seconds\":%.6f,\"bytes_sent\":%llu,\"bytes_received\":%llu,"
+            "\"mb_per_s\":%.3f,\"acks\":%llu,\"failed_acks\":%llu,\"failed_sessions\":%d,"
+            "\"session_p50_ms\":%.3f,\"session_p99_ms\":%.3f,\"lag_p50_ms\":%.3f,\"lag_p99_ms\":%.3f,"
+            "\"lag_max_ms\":%.3f}\n",
+            num_replays, scale, seconds, (unsigned long long)bytes_sent, (unsigned long long)bytes_received,
+            mb_per_s, (unsigned long long)acks, (unsigned long long)failed_acks, failed,
+            percentile_ms(&session_times, 0.5), percentile_ms(&session_times, 0.99), percentile_ms(&lag, 0.5),
+            percentile_ms(&lag, 0.99), percentile_ms(&lag, 1.0));
+    fprintf(stderr, "%d sessions in %.3f s: %.1f MiB/s, %llu acks (%llu failed), %d sessions failed, "
+                    "session p50 %.3f ms p99 %.3f ms",
+            num_replays, seconds, mb_per_s, (unsigned long long)acks, (unsigned long long)failed_acks, failed,
+            percentile_ms(&session_times, 0.5), percentile_ms(&session_times, 0.99));
+    if (scale > 0)
+    {
+        fprintf(stderr, ", behind schedule p99 %.3f ms max %.3f ms", percentile_ms(&lag, 0.99),
+                percentile_ms(&lag, 1.0));
+    }
+    fputc('\n', stderr);
+    if (results != stdout)
+    {
+        fclose(results);
+    }
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -6,10 +6,120 @@ int parse_arguments(int argc, char *argv[], char **ip_address, char **port, char
     FSMContext* context = (FSMContext*) ctx;
     int opt;
     opterr     = 0;
-    while((opt = getopt(argc, argv, "h")) != -1)
+    while((opt = getopt(argc, argv, "hcs:S:It:k:zq:W:r:A:G:M:T:")) != -1)
     {
         switch(opt)
         {
+            case 'q':
+            {
+                char *endptr;
+                long quantum = strtol(optarg, &endptr, BASE_TEN);
+                if(*endptr != '\0' || quantum < MIN_FRAME_COST || quantum > MAX_FRAME_PAYLOAD)
+                {
+                    SET_ERROR( context, "Quantum must be between 12 bytes and 16 MiB.");
+                    return -1;
+                }
+                context->quantum = (uint32_t)quantum;
+                break;
+            }
+            case 'W':
+            {
+                char *separator = strrchr(optarg, '=');
+                char *endptr;
+                long weight = separator != NULL ? strtol(separator + 1, &endptr, BASE_TEN) : 0;
+                if(separator == NULL || separator == optarg || *endptr != '\0' || weight < 1 || weight > MAX_WEIGHT ||
+                   (size_t)(separator - optarg) >= sizeof(context->weights[0].address) || context->num_weights == MAX_WEIGHT_RULES)
+                {
+                    SET_ERROR( context, "Weights are given as <address>=<1-1000>, at most 64 of them.");
+                    return -1;
+                }
+                weight_rule *rule = &context->weights[context->num_weights++];
+                memcpy(rule->address, optarg, separator - optarg);
+                rule->address[separator - optarg] = '\0';
+                rule->weight = (uint32_t)weight;
+                break;
+            }
+            case 'r':
+            case 'A':
+            case 'G':
+            {
+                uint64_t rate;
+                if(parse_rate(optarg, &rate) == -1)
+                {
+                    SET_ERROR( context, "Rates are bytes per second with an optional K, M or G suffix.");
+                    return -1;
+                }
+                if(opt == 'r')
+                {
+                    context->connection_rate = rate;
+                }
+                else if(opt == 'A')
+                {
+                    context->address_rate = rate;
+                }
+                else
+                {
+                    bucket_init(&context->global_limit, rate);
+                }
+                break;
+            }
+            case 'M':
+            {
+                context->metrics_endpoint = optarg;
+                break;
+            }
+            case 'T':
+            {
+#if TRACE_LEVEL > LEVEL_NONE
+                context->trace_path = optarg;
+                break;
+#else
+                SET_ERROR( context, "Built without tracing, see SOCKET_FSM_TRACE_LEVEL.");
+                return -1;
+#endif
+            }
+            case 't':
+            {
+                context->tls_cert = optarg;
+                break;
+            }
+            case 'k':
+            {
+                context->tls_key = optarg;
+                break;
+            }
+            case 'z':
+            {
+                context->zero_copy = 1;
+                break;
+            }
+            case 'S':
+            {
+                context->sink = optarg;
+                break;
+            }
+            case 'c':
+            {
+                context->cache_hints = 1;
+                break;
+            }
+            case 'I':
+            {
+                context->indexed = 1;
+                break;
+            }
+            case 's':
+            {
+                char *endptr;
+                long levels = strtol(optarg, &endptr, BASE_TEN);
+                if(*endptr != '\0' || levels < 0 || levels > MAX_SHARD_LEVELS)
+                {
+                    SET_ERROR( context, "Shard levels must be between 0 and 4.");
+                    return -1;
+                }
+                context->shard_levels = (int)levels;
+                break;
+            }
             case 'h':
             {
 
@@ -34,20 +144,58 @@ int parse_arguments(int argc, char *argv[], char **ip_address, char **port, char
             }
         }
     }
-    if(optind > argc -3 )
+    // A unix:/path endpoint has no port
+    int positional = optind < argc && strncmp(argv[optind], UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0 ? 2 : 3;
+    if(optind > argc - positional)
     {
         SET_ERROR( context, "Missing arguments");
         return -1;
 
     }
-    if(optind < argc - 3)
+    if(optind < argc - positional)
     {
         SET_ERROR( context, "Too many arguments.");
         return -1;
     }
     *ip_address = argv[optind];
-    *port       = argv[optind + 1];
-    *directory = argv[optind + 2];
+    *port       = positional == 3 ? argv[optind + 1] : NULL;
+    *directory = argv[optind + positional - 1];
+    return 0;
+}
+
+
+// Every descriptor the process may hold gets a slot, so the descriptor limit
+// and not a table size decides how many clients are served at once
+static int size_fd_tables(void* ctx)
+{
+    FSMContext*   context = (FSMContext*) ctx;
+    struct rlimit limit;
+
+    context->max_fds = MAX_CONNECTIONS;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        if(limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            if(setrlimit(RLIMIT_NOFILE, &limit) == -1)
+            {
+                getrlimit(RLIMIT_NOFILE, &limit);
+            }
+        }
+        if(limit.rlim_cur < MAX_CONNECTIONS)
+        {
+            context->max_fds = (int)limit.rlim_cur;
+        }
+    }
+    context->connections    = calloc((size_t)context->max_fds, sizeof(connection));
+    context->address_limits = calloc((size_t)context->max_fds, sizeof(address_limit));
+    context->client         = calloc((size_t)context->max_fds, sizeof(int));
+    context->spare_fd       = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if(context->connections == NULL || context->address_limits == NULL || context->client == NULL)
+    {
+        SET_ERROR( context, "Cannot allocate the connection tables.");
+        return -1;
+    }
     return 0;
 }
 
@@ -61,14 +209,72 @@ int handle_arguments(const char *binary_name, const char *ip_address, const char
         return -1;
 
     }
-    if(port_str == NULL)
+    int is_unix = strncmp(ip_address, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0;
+    if(port_str == NULL && !is_unix)
     {
         SET_ERROR( context, "The port is required.");
         return -1;
     }
-    if(parse_in_port_t(binary_name, port_str, port, ctx)== -1){
+    if(port_str != NULL && parse_in_port_t(binary_name, port_str, port, ctx)== -1){
+        return -1;
+    }
+    if(is_unix && context->tls_cert != NULL)
+    {
+        SET_ERROR( context, "TLS is not used on a Unix domain socket.");
+        return -1;
+    }
+    if((context->tls_cert == NULL) != (context->tls_key == NULL))
+    {
+        SET_ERROR( context, "TLS needs both a certificate (-t) and a key (-k).");
+        return -1;
+    }
+    if(size_fd_tables(ctx) == -1)
+    {
+        return -1;
+    }
+    if(context->tls_cert != NULL && tls_server_init(context->tls_cert, context->tls_key) == -1)
+    {
+        SET_ERROR( context, "Cannot set up TLS.");
+        return -1;
+    }
+    storage_config config = { context->directory, context->shard_levels, context->cache_hints, context->indexed };
+    if(storage_start(&context->store, context->sink, &config) == -1)
+    {
+        SET_ERROR( context, errno == EINVAL        ? "The storage sink is one of " STORAGE_SINKS "."
+                          : errno == EWOULDBLOCK ? "Another process is using that directory."
+                                                 : "Cannot open the directory to store files.");
+        return -1;
+    }
+    if(storage_keeps_files(&context->store) && storage_next_generation(&context->store) == -1)
+    {
+        SET_ERROR( context, "Cannot count this run in the store's generation.");
         return -1;
     }
+    if(context->indexed)
+    {
+        uint64_t started = monotonic_ns();
+        if(!storage_keeps_files(&context->store))
+        {
+            context->indexed = 0;       // nothing for cleanup_server to close
+            SET_ERROR( context, "The catalog (-I) needs a sink that keeps files: file, buffered or packed.");
+            return -1;
+        }
+        if(catalog_open(&context->catalog, context->directory, context->store.generation) == -1)
+        {
+            context->indexed = 0;
+            SET_ERROR( context, errno == EWOULDBLOCK ? "Another process is using that directory."
+                                                     : "Cannot open the catalog of received files.");
+            return -1;
+        }
+        printf("Catalog: %" PRIu64 " files loaded in %.3f ms, %" PRIu64 " log records replayed, %" PRIu64
+               " bytes damaged\n", context->catalog.count, (double)(monotonic_ns() - started) / 1e6,
+               context->catalog.replayed, context->catalog.damaged);
+        if(context->catalog.forgotten > 0)
+        {
+            printf("Catalog: the store changed in a run it did not follow, %" PRIu64 " files forgotten\n",
+                   context->catalog.forgotten);
+        }
+    }
     return 0;
 }
 
@@ -113,9 +319,26 @@ void usage(const char *program_name, const char *message)
     {
         fprintf(stderr, "%s\n", message);
     }
-    fprintf(stderr, "Usage: %s [-h] <ip 4 or 6 address to bind to> <port> ./directory-to-store-files\n", program_name);
+    fprintf(stderr, "Usage: %s [-h] [-c] [-s levels] [-S sink] [-I] [-t cert -k key] [-z] [-q bytes] [-W address=weight] [-r rate] [-A rate] [-G rate] [-M endpoint] [-T trace] <ip 4 or 6 address to bind to> <port> ./directory-to-store-files\n", program_name);
+    fprintf(stderr, "       %s [options] unix:/path/to/socket ./directory-to-store-files\n", program_name);
     fputs("Options:\n", stderr);
     fputs("  -h  Display this help message\n", stderr);
+    fputs("  -c  Write behind received files and drop them from the page cache\n", stderr);
+    fputs("  -s <levels>  Store files in <levels> of hashed subdirectories (0-4)\n", stderr);
+    fputs("  -S <sink>  Where received files go: file (default), buffered, memory, null or packed\n", stderr);
+    fputs("  -I  Keep a catalog of the stored files, with their sizes and hashes, to answer manifests\n", stderr);
+    fputs("  -t <cert>  Require TLS, with this PEM certificate chain\n", stderr);
+    fputs("  -k <key>  PEM private key for the TLS certificate\n", stderr);
+    fputs("  -z  Receive file data with splice instead of copying it\n", stderr);
+    fputs("  -q <bytes>  Bytes each client may send per scheduling round (default 65536)\n", stderr);
+    fputs("  -W <address>=<weight>  Give clients from <address> <weight> quanta per round;\n"
+          "                         unix: matches local clients (repeatable)\n", stderr);
+    fputs("  -r <rate>  Limit each connection to <rate> bytes per second (K, M and G suffixes)\n", stderr);
+    fputs("  -A <rate>  Limit all connections from one address together to <rate>\n", stderr);
+    fputs("  -G <rate>  Limit all clients together to <rate>\n", stderr);
+    fputs("  -M <address>:<port> | unix:<path>  Serve Prometheus metrics over HTTP;\n"
+          "                                    SIGUSR1 writes them to stderr\n", stderr);
+    fputs("  -T <file>  Write binary trace events to <file>, read it with tracedump\n", stderr);
 }
 
 
@@ -134,6 +357,41 @@ int setup_signal_handler(void* ctx)
         SET_ERROR( context, "sigaction");
         return -1;
     }
+    // Acks and plans go to clients that may already be gone
+    sa.sa_handler = SIG_IGN;
+    if(sigaction(SIGPIPE, &sa, NULL) == -1)
+    {
+        SET_ERROR( context, "sigaction");
+        return -1;
+    }
+    // Before any other thread starts, so they all leave SIGUSR1 to the exporter
+    static const char *state_names[STATE_EXIT + 1];
+    for(int state = 0; state <= STATE_EXIT; state++)
+    {
+        state_names[state] = state_to_string((server_state)state);
+    }
+    if(metrics_start(context->metrics_endpoint, state_names, STATE_EXIT + 1) == -1)
+    {
+        SET_ERROR( context, "Cannot start the metrics listener");
+        return -1;
+    }
+    if(context->trace_path != NULL && trace_start(context->trace_path, state_names, STATE_EXIT + 1) == -1)
+    {
+        SET_ERROR( context, "Cannot open the trace file");
+        return -1;
+    }
+    // A SIGINT taken while clients are served would only set exit_flag, and the
+    // next poll would wait for traffic before seeing it. Keep it pending until
+    // ppoll lets it in, so it always ends the wait.
+    sigset_t interrupt;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    if(pthread_sigmask(SIG_BLOCK, &interrupt, &context->poll_mask) != 0)
+    {
+        SET_ERROR( context, "pthread_sigmask");
+        return -1;
+    }
+    sigdelset(&context->poll_mask, SIGINT);
     return 0;
 }
 #pragma GCC diagnostic push
@@ -151,6 +409,16 @@ int convert_address(const char *address, struct sockaddr_storage *addr, void* ct
 {
     FSMContext* context = (FSMContext*) ctx;
     memset(addr, 0, sizeof(*addr));
+    switch(unix_endpoint(address, addr))
+    {
+        case 1:
+            return 0;
+        case -1:
+            SET_ERROR(context, "Unix socket path is too long");
+            return -1;
+        default:
+            break;
+    }
     if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) == 1)
     {
         // IPv4 address
@@ -187,6 +455,24 @@ int socket_bind(int sockfd, struct sockaddr_storage *addr, in_port_t port, void*
     FSMContext* context = (FSMContext*) ctx;
     char      addr_str[INET6_ADDRSTRLEN];
     in_port_t net_port;
+    if(addr->ss_family == AF_UNIX)
+    {
+        const char  *path = ((struct sockaddr_un *)addr)->sun_path;
+        struct stat st;
+        printf("Binding to: %s%s\n", UNIX_PREFIX, path);
+        // Replace the socket of a previous run, but never a regular file
+        if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        {
+            unlink(path);
+        }
+        if(bind(sockfd, (struct sockaddr *)addr, sizeof(struct sockaddr_un)) == -1)
+        {
+            SET_ERROR(context,"Binding failed");
+            return -1;
+        }
+        printf("Bound to socket: %s%s\n", UNIX_PREFIX, path);
+        return 0;
+    }
     if(inet_ntop(addr->ss_family, addr->ss_family == AF_INET ? (void *)&(((struct sockaddr_in *)addr)->sin_addr) : (void *)&(((struct sockaddr_in6 *)addr)->sin6_addr), addr_str, sizeof(addr_str)) == NULL)
     {
         SET_ERROR(context, "inet_ntop");
@@ -250,7 +536,25 @@ int handle_new_client(int server_socket, int **client_sockets, nfds_t *max_clien
 
     client_len = sizeof(address);
     new_socket = accept(server_socket, (struct sockaddr *)&address, &client_len);
+    metrics_add(METRIC_SYSCALL_ACCEPT, 1);
 
+    if(new_socket == -1 && (errno == EMFILE || errno == ENFILE))
+    {
+        // Out of descriptors: take the client off the queue and reset it, or
+        // poll would report it again and again
+        if(context->spare_fd != -1)
+        {
+            close(context->spare_fd);
+            new_socket = accept(server_socket, NULL, NULL);
+            if(new_socket != -1)
+            {
+                close(new_socket);
+            }
+            context->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        printf("Too many connections, closing the new one\n");
+        return 0;
+    }
     if(new_socket == -1)
     {
         if(errno != EINTR)
@@ -260,10 +564,55 @@ int handle_new_client(int server_socket, int **client_sockets, nfds_t *max_clien
         }
         return -1;
     }
+    // Connection state is kept in tables indexed by descriptor
+    if(new_socket >= context->max_fds)
+    {
+        printf("Too many connections, closing the new one\n");
+        close(new_socket);
+        return 0;
+    }
 
-    printf("New connection established\n");
+    LOG_INFO("New connection established\n");
+    metrics_add(METRIC_ACCEPTS, 1);
+    TRACE(LEVEL_INFO, TRACE_ACCEPT, new_socket, 0, 0);
+    PROBE1(accept, new_socket);
+    metrics_add(METRIC_CONNECTIONS, 1);
+    {
+        connection *conn = &context->connections[new_socket];
+        char       addr_str[INET6_ADDRSTRLEN];
+
+        peer_address(&address, addr_str, sizeof(addr_str));
+        conn->local         = address.ss_family == AF_UNIX;
+        if(!conn->local)
+        {
+            // Acks are a few bytes each, and Nagle would hold one back until
+            // the client's delayed ACK of the previous one
+            int nodelay = 1;
+            setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+        conn->passed_fd     = -1;
+        conn->weight        = client_weight(addr_str, ctx);
+        conn->address_limit = join_address_limit(addr_str, ctx);
+        bucket_init(&conn->bucket, context->connection_rate);
+        conn->handshake_deadline = 0;
+        if(context->tls_cert != NULL)
+        {
+            // The handshake is driven by poll like the transfers, so a client
+            // that connects and stays silent holds up no one but itself
+            conn->handshake_events   = POLLIN;
+            conn->handshake_deadline = monotonic_ns() + TLS_HANDSHAKE_TIMEOUT_MS * 1000000ull;
+        }
+    }
 
-    // Increase the size of the client_sockets array
+    // Take the slot of a disconnected client before growing the array
+    for(nfds_t i = 0; i < *max_clients; i++)
+    {
+        if((*client_sockets)[i] <= 0)
+        {
+            (*client_sockets)[i] = new_socket;
+            return 0;
+        }
+    }
     (*max_clients)++;
     *client_sockets = (int *)realloc(*client_sockets, sizeof(int) * (*max_clients));
 
@@ -295,184 +644,1300 @@ int receive_files(int sd, int **client_sockets, const nfds_t *max_clients, const
 {
     FSMContext* context = (FSMContext*) ctx;
     uint32_t filename_size;
-    uint32_t valread ;
-    valread = read(sd, &filename_size, sizeof(filename_size));
+    ssize_t valread;
+    if (sd < context->max_fds && context->connections[sd].plain.in_use) {
+        if (receive_plain_chunk(sd, &context->connections[sd], client[sd], ctx) != 0) {
+            handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
+        }
+        return 0;
+    }
+    valread = read_tag(sd, &filename_size, ctx);
 
     if (valread <= 0) {
-        printf("No more file left from client %d \n", client[sd]);
+        LOG_INFO("No more file left from client %d \n", client[sd]);
         handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
 
         return 0;
     }
-    printf("\nreceiving files from client %d\n",client[sd]);
-    char filename[filename_size + 1];
-    valread = read(sd, filename, filename_size);
-    if (valread <= 0) {
+    if (filename_size == FRAME_MANIFEST) {
+        if (receive_manifest(sd, dir, ctx) != 0) {
+            handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
+        }
+        return 0;
+    }
+    if (filename_size == FRAME_HELLO) {
+        if (receive_hello(sd, ctx) != 0) {
+            handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
+        }
+        return 0;
+    }
+    if (filename_size == FRAME_FD_PASS) {
+        if (receive_passed_file(sd, client[sd], ctx) != 0) {
+            handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
+        }
+        return 0;
+    }
+    if (filename_size == FRAME_STREAM_OPEN || filename_size == FRAME_STREAM_DATA || filename_size == FRAME_STREAM_END) {
+        // One frame per wakeup, so files on other streams and clients interleave
+        if (receive_stream_frame(sd, filename_size, client[sd], ctx) != 0) {
+            handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
+        }
+        return 0;
+    }
+    if (filename_size >= FRAME_TAG_BASE || filename_size > MAX_NAME_LEN) {
+        printf("Unknown frame from client %d\n", client[sd]);
         handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
-        return -1;
+        return 0;
     }
-    filename[filename_size] = '\0';
+    LOG_INFO("\nreceiving files from client %d\n",client[sd]);
+    char filename[filename_size + 1];
     uint32_t file_size;
-    valread = read(sd, &file_size, sizeof(filename_size));
-    if (valread <= 0) {
+    byte_reader in = { socket_read, (void *)(intptr_t)sd };
+    if (sd >= context->max_fds || decode_file_header(&in, filename_size, filename, &file_size) == -1) {
         handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
-        return -1;
+        return 0;
     }
-
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s/%s", dir, filename);
-    FILE *fp = fopen(filepath, "wb");
-    if (fp == NULL) {
-        perror("fopen file path");
-        return -1;
+    if (!valid_name(filename, filename_size)) {
+        printf("Invalid file name from client %d\n", client[sd]);
+        handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
+        return 0;
+    }
+    context->connections[sd].bytes_received += FILE_HEADER_SIZE(filename_size);
+    if (start_plain_file(&context->connections[sd], filename, file_size, ctx) == -1 ||
+        (file_size == 0 && finish_plain_file(sd, &context->connections[sd], client[sd], ctx) == -1)) {
+        handle_disconnection(sd, client_sockets, max_clients, client[sd], ctx);
     }
+    return 0;
+}
 
-    printf("File name: %s with the File size: %u is receiving.\n", filename, file_size);
-    uint32_t bytes_read = 0;
+// Set up the plain file whose header was just read. Its chunks are read by later
+// receive_files calls, so one large file does not hold up the other clients.
+int start_plain_file(connection *conn, const char *filename, uint32_t file_size, void* ctx)
+{
+    FSMContext*  context = (FSMContext*) ctx;
+    stream_state *plain  = &conn->plain;
 
-    while (bytes_read < file_size)
+    plain->name = strdup(filename);
+    if (plain->name == NULL)
     {
-        uint32_t buffer_size;
-        if (read_buffer_size(sd, sizeof(buffer_size), (void *) &buffer_size, ctx))
-
-        {
-            SET_ERROR(context,"Error reading buffer size");
-            fprintf(stderr, "read buffer size: %s (%d)\n", strerror(errno), errno);
-            return -1;
-        }
-
-        char *buffer = malloc(buffer_size);
-        if (!buffer && buffer_size > 0)
-        {
-            SET_ERROR(context,"Malloc failed");
-            perror("Malloc failed\n");
-            return -1;
-        }
-
-        memset(buffer, 0, buffer_size);
-
-        uint32_t bytes_received_for_current_buffer = 0;
-        while (bytes_received_for_current_buffer < buffer_size)
-        {
-            uint32_t temp_bytes_received = read(sd, buffer + bytes_received_for_current_buffer, buffer_size - bytes_received_for_current_buffer);
-            if (temp_bytes_received == -1)
-            {
-                SET_ERROR(context,"Recv failed");
-                fprintf(stderr, "recv: %s (%d)\n", strerror(errno), errno);
-                free(buffer);
-                return -1;
-            }
-            bytes_received_for_current_buffer += temp_bytes_received;
-        }
-
-        bytes_read += bytes_received_for_current_buffer;
-
-        fwrite(buffer, 1, buffer_size, fp);
-        fflush(fp);
-
-        free(buffer);
+        SET_ERROR(context, "Malloc failed");
+        return -1;
+    }
+    plain->file = open_stored(filename, file_size, ctx);
+    if (plain->file == NULL)
+    {
+        // Keep the connection, the data is read and dropped and the client told
+        perror("open file");
     }
-    fclose(fp);
+    LOG_INFO("File name: %s with the File size: %u is receiving.\n", filename, file_size);
+    metrics_add(METRIC_OPEN_FILES, 1);
+    metrics_add(METRIC_BYTES_IN_FLIGHT, file_size);
+    TRACE(LEVEL_INFO, TRACE_FILE_START, conn - context->connections, file_size, conn->files + 1);
+    PROBE3(file__start, conn - context->connections, file_size, conn->files + 1);
+    plain->in_use   = 1;
+    plain->id       = ++conn->files;
+    plain->size     = file_size;
+    plain->received = 0;
     return 0;
 }
 
-int read_buffer_size(int sockfd, uint32_t size, void *buffer, void* ctx)
+// Read the next [u32 length][data] chunk of the plain file in progress.
+int receive_plain_chunk(int sd, connection *conn, int client, void* ctx)
 {
     FSMContext* context = (FSMContext*) ctx;
-    uint32_t bytes_read;
-    uint32_t result;
+    byte_reader in      = { socket_read, (void *)(intptr_t)sd };
+    uint32_t    buffer_size;
 
-    bytes_read = 0;
-    while (bytes_read < size)
+    if (decode_chunk_header(&in, &buffer_size) == -1)
     {
-        result = read(sockfd, buffer + bytes_read, size - bytes_read);
-
-        if (result <= 0)
-        {
-            SET_ERROR(context,"Read buffer size failed ");
-            fprintf(stderr, "read size: %s (%d)\n", strerror(errno), errno);
-            return -1;
-        }
-
-        bytes_read += result;
+        SET_ERROR(context, "Invalid chunk");
+        return -1;
+    }
+    if (stream_data(sd, &conn->plain, buffer_size, ctx) == -1)
+    {
+        return -1;
+    }
+    conn->bytes_received += CHUNK_HEADER_SIZE + buffer_size;
+    if (conn->plain.received == conn->plain.size)
+    {
+        return finish_plain_file(sd, conn, client, ctx);
     }
-
     return 0;
 }
 
-int handle_disconnection(int sd, int **client_sockets, const nfds_t *max_clients, int client, void* ctx)
+int finish_plain_file(int sd, connection *conn, int client, void* ctx)
 {
-    FSMContext* context = (FSMContext*) ctx;
-    printf("Client %d disconnected\n", client);
-    close(sd);
+    stream_state *plain = &conn->plain;
+    uint32_t     status = commit_file(plain, ctx);
 
-    for (size_t i = 0; i < *max_clients; i++) {
-        if ((*client_sockets)[i] == sd) {
-            (*client_sockets)[i] = 0;
-            return 0;
-        }
-    }
-    SET_ERROR(context,"Error closing the disconnection");
-    // if we reach here, we couldn't find the socket descriptor in our list
-    fprintf(stderr, "Error: Could not find socket descriptor %d in client_sockets array.\n", sd);
-    return -1;
+    LOG_INFO("Client %d: %s %s.\n", client, plain->name, status == ACK_OK ? "received" : "failed");
+    acknowledge(sd, plain->id, status, status == ACK_OK ? plain->size : 0, ctx);
+    drop_file(plain);
+    return 0;
 }
 
-int setup_server_socket(int sockfd,void* ctx)
+// Features a client turns on before sending files.
+int receive_hello(int sd, void* ctx)
 {
     FSMContext* context = (FSMContext*) ctx;
-    int enable = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == -1) {
-        SET_ERROR(context,"setsockopt failed");
+    uint32_t    features;
+
+    if (sd >= context->max_fds || read_fully(sd, &features, sizeof(features)) == -1)
+    {
+        SET_ERROR(context, "Invalid hello");
         return -1;
     }
+    context->connections[sd].acks = (features & FEATURE_ACKS) != 0;
     return 0;
 }
 
-void setup_fds(struct pollfd *fds, int *client_sockets, nfds_t max_clients, int sockfd, int *client) {
-    // Set up the pollfd structure for the server socket
-    fds[0].fd = sockfd;
-    fds[0].events = POLLIN;
-
-    // Set up the pollfd structures for all client sockets
-    for(uint32_t i = 0; i < max_clients; i++) {
-        int sd = client_sockets[i];
-        client[sd]= (int)i+1;
-        fds[i + 1].fd = sd;
-        fds[i + 1].events = POLLIN;
+// A tag split across segments: the rest follows right behind it, the socket
+// blocks until it is there
+static ssize_t finish_tag(int sd, uint32_t *tag, ssize_t received)
+{
+    if (received < (ssize_t)sizeof(*tag) &&
+        read_fully(sd, (char *)tag + received, sizeof(*tag) - (size_t)received) == -1)
+    {
+        return -1;
     }
+    return (ssize_t)sizeof(*tag);
 }
 
-int handle_clients(struct pollfd *fds, nfds_t max_clients, int *client_sockets, char *directory, int *client, void* ctx) {
-    for(uint32_t i = 0; i < max_clients; i++) {
-        int sd = client_sockets[i];
-        if(fds[i + 1].revents & POLLIN) {
-            int result = receive_files(sd, &client_sockets, &max_clients, directory, client,  ctx);
-            printf("\n");
-            if (result < 0) {
-                return -1; // Return error if receive_files fails.
-            }
+// Read the tag of the next frame. A local client may attach a descriptor to it,
+// which is kept for receive_passed_file; any other frame drops it.
+ssize_t read_tag(int sd, uint32_t *tag, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    connection  *conn;
+    struct iovec iov = { tag, sizeof(*tag) };
+    union {
+        char           buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { 0 };
+    ssize_t received;
+
+    if (sd >= context->max_fds || !context->connections[sd].local)
+    {
+        received = net_read(sd, tag, sizeof(*tag));
+        return received > 0 ? finish_tag(sd, tag, received) : received;
+    }
+    conn = &context->connections[sd];
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    // Extra descriptors that do not fit are closed by the kernel (MSG_CTRUNC)
+    received = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC);
+    metrics_add(METRIC_SYSCALL_RECVMSG, 1);
+    if (conn->passed_fd != -1)
+    {
+        close(conn->passed_fd);
+        conn->passed_fd = -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); received > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        {
+            memcpy(&conn->passed_fd, CMSG_DATA(cmsg), sizeof(int));
         }
     }
-    return 0;  // Return 0 if everything went smoothly
+    if (received > 0)
+    {
+        received = finish_tag(sd, tag, received);
+    }
+    if (conn->passed_fd != -1 && (received <= 0 || *tag != FRAME_FD_PASS))
+    {
+        close(conn->passed_fd);
+        conn->passed_fd = -1;
+    }
+    return received;
 }
 
-int cleanup_server(int *client_sockets, nfds_t max_clients, struct pollfd *fds, int sockfd, void* ctx) {
-    FSMContext* context = (FSMContext*) ctx;
-    printf("Cleaning up\n");
-    for (uint32_t i = 0; i < max_clients; i++) {
-        int sd = client_sockets[i];
-        if (sd > 0) {
-            if(close(sd) < 0) {
-                SET_ERROR(context,"Error closing client socket");
-                return -1;
-            }
-        }
+// FRAME_FD_PASS: store a file whose descriptor came with the tag.
+int receive_passed_file(int sd, int client, void* ctx)
+{
+    FSMContext*  context = (FSMContext*) ctx;
+    connection   *conn;
+    uint32_t     name_len;
+    uint32_t     file_number;
+    struct stat  st;
+    int          in_fd;
+    storage_file *file;
+
+    if (sd >= context->max_fds || !context->connections[sd].local ||
+        read_fully(sd, &name_len, sizeof(name_len)) == -1 || name_len == 0 || name_len > MAX_NAME_LEN)
+    {
+        SET_ERROR(context, "Invalid descriptor frame");
+        return -1;
     }
+    conn  = &context->connections[sd];
+    in_fd = conn->passed_fd;
+    conn->passed_fd = -1;
 
-    free(client_sockets);
-    free(fds);
-    if (close(sockfd) < 0) {
+    char name[name_len + 1];
+    if (read_fully(sd, name, name_len) == -1 || in_fd == -1)
+    {
+        if (in_fd != -1)
+        {
+            close(in_fd);
+        }
+        SET_ERROR(context, "Invalid descriptor frame");
+        return -1;
+    }
+    name[name_len] = '\0';
+    if (!valid_name(name, name_len))
+    {
+        printf("Invalid file name from client %d\n", client);
+        close(in_fd);
+        SET_ERROR(context, "Invalid descriptor frame");
+        return -1;
+    }
+    file_number = ++conn->files;
+
+    // Only the contents are used, never the descriptor's own position or flags
+    if (fstat(in_fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        printf("Client %d passed a descriptor for %s that is not a regular file\n", client, name);
+        close(in_fd);
+        acknowledge(sd, file_number, ACK_FAILED, 0, ctx);
+        return 0;
+    }
+    LOG_INFO("File name: %s with the File size: %lld is placed from a passed descriptor.\n", name, (long long)st.st_size);
+    TRACE(LEVEL_INFO, TRACE_FILE_START, sd, st.st_size, file_number);
+    PROBE3(file__start, sd, st.st_size, file_number);
+    file = open_stored(name, (uint64_t)st.st_size, ctx);
+    if (file != NULL && storage_place(file, in_fd, (uint64_t)st.st_size) == -1)
+    {
+        storage_abort(file);
+        file = NULL;
+    }
+    if (file == NULL || commit_stored(file, name, ctx) == -1)
+    {
+        perror("place file");
+        close(in_fd);
+        acknowledge(sd, file_number, ACK_FAILED, 0, ctx);
+        return 0;
+    }
+    close(in_fd);
+    acknowledge(sd, file_number, ACK_OK, (uint64_t)st.st_size, ctx);
+    return 0;
+}
+
+// Tell a client that asked for acks how a file ended. A client that stopped
+// reading will notice on its side, so a failed write is only reported here.
+void acknowledge(int sd, uint32_t file, uint32_t status, uint64_t bytes, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    metrics_add(status == ACK_OK ? METRIC_FILES_RECEIVED : METRIC_FILES_FAILED, 1);
+    TRACE(LEVEL_INFO, status == ACK_OK ? TRACE_FILE_END : TRACE_FILE_FAILED, sd, bytes, file);
+    if (status == ACK_OK)
+    {
+        PROBE3(file__end, sd, bytes, file);
+    }
+    else
+    {
+        PROBE3(file__failed, sd, bytes, file);
+    }
+    if (sd < context->max_fds && context->connections[sd].acks && write_ack(sd, file, status, bytes) == -1)
+    {
+        perror("ack");
+    }
+}
+
+
+static stream_state *find_stream(connection *conn, uint32_t id)
+{
+    if (conn->streams == NULL)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < MAX_STREAMS; i++)
+    {
+        if (conn->streams[i].in_use && conn->streams[i].id == id)
+        {
+            return &conn->streams[i];
+        }
+    }
+    return NULL;
+}
+
+void drop_file(stream_state *file)
+{
+    if (file->in_use)
+    {
+        metrics_add(METRIC_OPEN_FILES, -1);
+        metrics_add(METRIC_BYTES_IN_FLIGHT, -(int64_t)(file->size - file->received));
+    }
+    if (file->file != NULL)
+    {
+        storage_abort(file->file);
+    }
+    free(file->name);
+    memset(file, 0, sizeof(*file));
+}
+
+static void end_stream(stream_state *stream, connection *conn)
+{
+    drop_file(stream);
+    conn->open_streams--;
+}
+
+// Read a frame payload into the shared frame buffer, growing it as needed.
+static char *read_frame_payload(int sd, uint32_t length, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    if (length > context->frame_buffer_size)
+    {
+        char *grown = realloc(context->frame_buffer, length);
+        if (grown == NULL)
+        {
+            SET_ERROR(context, "Malloc failed");
+            return NULL;
+        }
+        context->frame_buffer      = grown;
+        context->frame_buffer_size = length;
+    }
+    if (read_fully(sd, context->frame_buffer, length) == -1)
+    {
+        SET_ERROR(context, "Recv failed");
+        return NULL;
+    }
+    return context->frame_buffer;
+}
+
+static int open_stream(int sd, connection *conn, uint32_t id, uint32_t length, int client, void* ctx)
+{
+    FSMContext*  context = (FSMContext*) ctx;
+    stream_state *stream = NULL;
+    char         *payload;
+    uint64_t     size;
+
+    if (length <= sizeof(size) || length > sizeof(size) + MAX_NAME_LEN || find_stream(conn, id) != NULL)
+    {
+        SET_ERROR(context, "Invalid stream open");
+        return -1;
+    }
+    if (conn->streams == NULL && (conn->streams = calloc(MAX_STREAMS, sizeof(stream_state))) == NULL)
+    {
+        SET_ERROR(context, "Malloc failed");
+        return -1;
+    }
+    for (int i = 0; i < MAX_STREAMS && stream == NULL; i++)
+    {
+        if (!conn->streams[i].in_use)
+        {
+            stream = &conn->streams[i];
+        }
+    }
+    payload = read_frame_payload(sd, length, ctx);
+    if (stream == NULL || payload == NULL)
+    {
+        SET_ERROR(context, "Too many open streams");
+        return -1;
+    }
+    memcpy(&size, payload, sizeof(size));
+    stream->name = strndup(payload + sizeof(size), length - sizeof(size));
+    if (stream->name == NULL || !valid_name(stream->name, length - sizeof(size)))
+    {
+        free(stream->name);
+        stream->name = NULL;
+        SET_ERROR(context, "Invalid stream name");
+        return -1;
+    }
+    stream->file = open_stored(stream->name, size, ctx);
+    if (stream->file == NULL)
+    {
+        // The stream stays open so its data can be dropped and the failure acked
+        perror("open file");
+    }
+    metrics_add(METRIC_OPEN_FILES, 1);
+    metrics_add(METRIC_BYTES_IN_FLIGHT, (int64_t)size);
+    TRACE(LEVEL_INFO, TRACE_FILE_START, sd, size, id);
+    PROBE3(file__start, sd, size, id);
+    stream->in_use   = 1;
+    stream->id       = id;
+    stream->size     = size;
+    stream->received = 0;
+    conn->open_streams++;
+    LOG_INFO("Client %d stream %u: %s with the File size: %" PRIu64 " is receiving.\n", client, id, stream->name, size);
+    return 0;
+}
+
+int stream_data(int sd, stream_state *stream, uint32_t length, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    if (stream->received + length > stream->size)
+    {
+        SET_ERROR(context, "Stream longer than announced");
+        return -1;
+    }
+    if (stream->file != NULL && context->zero_copy && storage_can_splice(&context->store) &&
+        (!tls_enabled(sd) || tls_kernel_rx(sd)))
+    {
+        if (context->splice_pipe[0] == -1 && pipe(context->splice_pipe) == -1)
+        {
+            SET_ERROR(context, "pipe");
+            return -1;
+        }
+        uint64_t started = monotonic_ns();
+        if (storage_splice(stream->file, sd, context->splice_pipe, length) == -1)
+        {
+            SET_ERROR(context, "Splice failed");
+            return -1;
+        }
+        metrics_write_latency(monotonic_ns() - started);
+    }
+    else
+    {
+        char *payload = read_frame_payload(sd, length, ctx);
+        if (payload == NULL)
+        {
+            return -1;
+        }
+        uint64_t started = monotonic_ns();
+        if (stream->file != NULL && storage_write(stream->file, payload, length) == -1)
+        {
+            perror("write");
+            storage_abort(stream->file);
+            stream->file = NULL;
+        }
+        if (stream->file != NULL)
+        {
+            metrics_write_latency(monotonic_ns() - started);
+        }
+    }
+    stream->received += length;
+    metrics_add(METRIC_BYTES_IN_FLIGHT, -(int64_t)length);
+    return 0;
+}
+
+// Names come from the peer and must stay inside the store: a relative path whose
+// components are neither empty, "." nor "..", that does not reach into the
+// server's own files at the top of the directory.
+int valid_name(const char *name, size_t len)
+{
+    static const char *const reserved[] = { SHARD_INDEX_NAME, PARTIAL_DIR_NAME, PACK_DIR_NAME, CATALOG_DIR_NAME,
+                                            STORAGE_GENERATION_NAME };
+    const char *component = name;
+
+    if (len == 0 || strnlen(name, len) != len)
+    {
+        return 0;
+    }
+    for (;;)
+    {
+        const char *end    = strchr(component, '/');
+        size_t     length  = end != NULL ? (size_t)(end - component) : strlen(component);
+        if (length == 0 || (length <= 2 && strncmp(component, "..", length) == 0))
+        {
+            return 0;
+        }
+        if (end == NULL)
+        {
+            break;
+        }
+        component = end + 1;
+    }
+    for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++)
+    {
+        size_t length = strlen(reserved[i]);
+        if (strncmp(name, reserved[i], length) == 0 && (name[length] == '\0' || name[length] == '/'))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A catalog that missed a change would vouch for a file the store no longer
+// holds, in this run and, as it followed the run, in the next. It is given up
+// until the next run with -I, which starts it over.
+static void abandon_catalog(void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    perror("catalog");
+    context->indexed = 0;
+    if (catalog_abandon(&context->catalog) == -1)
+    {
+        perror("Cannot mark the catalog stale");
+    }
+    printf("Catalog: a change could not be recorded, the sink answers manifests for the rest of the run\n");
+}
+
+// The catalog (-I) forgets a name before its file starts to change and learns
+// it again at the commit, so it never vouches for a half written file.
+storage_file *open_stored(const char *name, uint64_t size, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    if (context->indexed && catalog_remove(&context->catalog, name) == -1)
+    {
+        abandon_catalog(ctx);
+    }
+    return storage_open(&context->store, name, size);
+}
+
+// Commit a file and enter it in the catalog. A catalog that cannot be written
+// costs the file nothing, it is only sent again.
+int commit_stored(storage_file *file, const char *name, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    uint64_t    size    = file->written;
+    uint64_t    hash;
+    int         hashed  = storage_hash(file, &hash) == 0;
+
+    if (storage_commit(file) == -1)
+    {
+        return -1;
+    }
+    if (context->indexed && catalog_put(&context->catalog, name, size, hashed ? &hash : NULL) == -1)
+    {
+        abandon_catalog(ctx);
+    }
+    return 0;
+}
+
+// Hand a fully received file to the storage sink. Returns the ack status.
+uint32_t commit_file(stream_state *file, void* ctx)
+{
+    storage_file *stored = file->file;
+
+    if (stored == NULL)
+    {
+        return ACK_FAILED;
+    }
+    file->file = NULL;
+    if (commit_stored(stored, file->name, ctx) == -1)
+    {
+        perror("commit");
+        return ACK_FAILED;
+    }
+    return ACK_OK;
+}
+
+static int finish_stream(int sd, stream_state *stream, connection *conn, int client, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    uint32_t    status;
+
+    if (stream->received != stream->size)
+    {
+        SET_ERROR(context, "Stream ended early");
+        acknowledge(sd, stream->id, ACK_FAILED, 0, ctx);
+        end_stream(stream, conn);
+        return -1;
+    }
+    status = commit_file(stream, ctx);
+    LOG_INFO("Client %d stream %u: %s %s.\n", client, stream->id, stream->name, status == ACK_OK ? "received" : "failed");
+    acknowledge(sd, stream->id, status, status == ACK_OK ? stream->size : 0, ctx);
+    end_stream(stream, conn);
+    return 0;
+}
+
+// Handle one stream frame whose tag has been read. Any error is a protocol error
+// and the caller drops the connection.
+int receive_stream_frame(int sd, uint32_t tag, int client, void* ctx)
+{
+    FSMContext*  context = (FSMContext*) ctx;
+    connection   *conn;
+    stream_state *stream;
+    byte_reader  in = { socket_read, (void *)(intptr_t)sd };
+    uint32_t     header[2];
+
+    if (sd >= context->max_fds)
+    {
+        SET_ERROR(context, "Too many connections");
+        return -1;
+    }
+    conn = &context->connections[sd];
+    if (decode_frame_header(&in, &header[0], &header[1]) == -1)
+    {
+        SET_ERROR(context, "Invalid frame");
+        return -1;
+    }
+    conn->bytes_received += sizeof(frame_header) + (tag == FRAME_STREAM_END ? 0 : header[1]);
+    if (tag == FRAME_STREAM_OPEN)
+    {
+        return open_stream(sd, conn, header[0], header[1], client, ctx);
+    }
+    stream = find_stream(conn, header[0]);
+    if (stream == NULL)
+    {
+        SET_ERROR(context, "Unknown stream");
+        return -1;
+    }
+    if (tag == FRAME_STREAM_DATA)
+    {
+        return stream_data(sd, stream, header[1], ctx);
+    }
+    if (header[1] != 0)
+    {
+        SET_ERROR(context, "Invalid frame");
+        return -1;
+    }
+    return finish_stream(sd, stream, conn, client, ctx);
+}
+
+// Abandon the files still open on a connection that went away, and forget its
+// features so the next connection on the descriptor starts clean.
+void close_streams(int sd, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    connection  *conn;
+
+    if (sd < 0 || sd >= context->max_fds)
+    {
+        return;
+    }
+    conn = &context->connections[sd];
+    for (int i = 0; conn->streams != NULL && i < MAX_STREAMS; i++)
+    {
+        if (conn->streams[i].in_use)
+        {
+            printf("Stream %u: %s incomplete, %" PRIu64 " of %" PRIu64 " bytes\n", conn->streams[i].id,
+                   conn->streams[i].name, conn->streams[i].received, conn->streams[i].size);
+            end_stream(&conn->streams[i], conn);
+        }
+    }
+    free(conn->streams);
+    conn->streams = NULL;
+    for (uint32_t i = 0; i < conn->num_reserved; i++)
+    {
+        storage_unreserve(&context->store, conn->reserved[i]);
+        free(conn->reserved[i]);
+    }
+    free(conn->reserved);
+    conn->reserved     = NULL;
+    conn->num_reserved = 0;
+    if (conn->plain.in_use)
+    {
+        printf("%s incomplete, %" PRIu64 " of %" PRIu64 " bytes\n", conn->plain.name, conn->plain.received, conn->plain.size);
+        drop_file(&conn->plain);
+    }
+    conn->acks           = 0;
+    conn->files          = 0;
+    conn->deficit        = 0;
+    conn->bytes_received = 0;
+    conn->buffered       = 0;
+    if (conn->throttled_since != 0)
+    {
+        conn->throttled_ns   += monotonic_ns() - conn->throttled_since;
+        conn->throttled_since = 0;
+    }
+    if (conn->throttled_ns > 0)
+    {
+        printf("Throttled for %.3f s\n", (double)conn->throttled_ns / NS_PER_SECOND);
+        context->throttled_ns += conn->throttled_ns;
+        metrics_add(METRIC_THROTTLED_NS, (int64_t)conn->throttled_ns);
+        conn->throttled_ns     = 0;
+    }
+    if (conn->address_limit >= 0 && --context->address_limits[conn->address_limit].users == 0)
+    {
+        context->address_limits[conn->address_limit].address[0] = '\0';
+    }
+    conn->address_limit = -1;
+    if (conn->passed_fd != -1)
+    {
+        close(conn->passed_fd);
+        conn->passed_fd = -1;
+    }
+}
+
+void close_pipe(int pipe_fds[2])
+{
+    if (pipe_fds[0] != -1)
+    {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        pipe_fds[0] = pipe_fds[1] = -1;
+    }
+}
+
+// With -I the catalog answers: a name it does not hold, or holds with another
+// size or hash, is sent. Only a hash it does not know is left to the sink. The
+// catalog was emptied at open unless it followed every run on the store
+// (catalog.h), so it does not vouch for files changed behind its back.
+static int stored_already(const manifest_entry *entry, void* ctx)
+{
+    FSMContext*         context = (FSMContext*) ctx;
+    const catalog_entry *found;
+
+    if (context->indexed)
+    {
+        found = catalog_find(&context->catalog, entry->name);
+        if (found == NULL || found->size != entry->size)
+        {
+            return 0;
+        }
+        if (!entry->has_hash)
+        {
+            return 1;
+        }
+        if (found->flags & CATALOG_HASHED)
+        {
+            return found->hash == entry->hash;
+        }
+    }
+    return storage_has(&context->store, entry->name, entry->size, entry->has_hash ? &entry->hash : NULL);
+}
+
+// Check one manifest entry against the store: skip it if the sink already holds
+// the same size (and hash, when given), otherwise let it prepare for the file.
+static void plan_entry(manifest_entry *entry, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    if (stored_already(entry, ctx))
+    {
+        entry->action = PLAN_SKIP;
+        return;
+    }
+    entry->action = PLAN_SEND;
+    storage_reserve(&context->store, entry->name, entry->size);
+}
+
+static void *plan_worker(void *arg)
+{
+    manifest_job *job = (manifest_job *)arg;
+    for (uint32_t i = job->first; i < job->count; i += job->stride)
+    {
+        plan_entry(&job->entries[i], job->ctx);
+    }
+    return NULL;
+}
+
+// Takes over name, 0 on success
+static int keep_reservation(int sd, char *name, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    connection  *conn;
+    char        **grown;
+
+    if (sd >= context->max_fds)
+    {
+        return -1;
+    }
+    conn  = &context->connections[sd];
+    grown = realloc(conn->reserved, (conn->num_reserved + 1) * sizeof(char *));
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    conn->reserved = grown;
+    conn->reserved[conn->num_reserved++] = name;
+    return 0;
+}
+
+// Read a manifest, plan every file on a pool of threads and answer with one action
+// per file. A batch larger than the free space of the store is rejected whole.
+int receive_manifest(int sd, const char *dir, void* ctx)
+{
+    FSMContext*     context = (FSMContext*) ctx;
+    uint32_t        count;
+    uint64_t        total_size = 0;
+    manifest_entry  *entries;
+    struct statvfs  vfs;
+    int             planned = 0;
+    int             result = -1;
+
+    if (read_fully(sd, &count, sizeof(count)) == -1 || count > MAX_MANIFEST_ENTRIES)
+    {
+        SET_ERROR(context, "Invalid manifest");
+        return -1;
+    }
+    entries = calloc(count ? count : 1, sizeof(manifest_entry));
+    if (entries == NULL)
+    {
+        SET_ERROR(context, "Malloc failed");
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t name_len;
+        uint32_t hash_len;
+        if (read_fully(sd, &name_len, sizeof(name_len)) == -1 || name_len == 0 || name_len > MAX_NAME_LEN)
+        {
+            goto done;
+        }
+        entries[i].name = malloc(name_len + 1);
+        if (entries[i].name == NULL || read_fully(sd, entries[i].name, name_len) == -1)
+        {
+            goto done;
+        }
+        entries[i].name[name_len] = '\0';
+        if (read_fully(sd, &entries[i].size, sizeof(entries[i].size)) == -1 ||
+            read_fully(sd, &hash_len, sizeof(hash_len)) == -1 ||
+            (hash_len != 0 && hash_len != MANIFEST_HASH_LEN))
+        {
+            goto done;
+        }
+        if (hash_len == MANIFEST_HASH_LEN)
+        {
+            if (read_fully(sd, &entries[i].hash, sizeof(entries[i].hash)) == -1)
+            {
+                goto done;
+            }
+            entries[i].has_hash = 1;
+        }
+        if (!valid_name(entries[i].name, name_len))
+        {
+            goto done;
+        }
+        // The sizes come from the peer: saturate, so no sum wraps below the check
+        total_size = entries[i].size > UINT64_MAX - total_size ? UINT64_MAX : total_size + entries[i].size;
+    }
+
+    if (statvfs(dir, &vfs) == 0 && total_size > (uint64_t)vfs.f_bavail * vfs.f_frsize)
+    {
+        printf("Rejecting manifest of %u files: %" PRIu64 " bytes do not fit\n", count, total_size);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            entries[i].action = PLAN_REJECT;
+        }
+    }
+    else if (count > 0)
+    {
+        long         cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+        uint32_t     workers = cpus > 0 && cpus < MANIFEST_WORKERS ? (uint32_t)cpus : MANIFEST_WORKERS;
+        pthread_t    threads[MANIFEST_WORKERS];
+        manifest_job jobs[MANIFEST_WORKERS];
+        uint32_t     started = 0;
+
+        if (workers > count)
+        {
+            workers = count;
+        }
+        for (uint32_t w = 0; w < workers; w++)
+        {
+            jobs[w] = (manifest_job){ entries, count, w, workers, ctx };
+            if (pthread_create(&threads[w], NULL, plan_worker, &jobs[w]) != 0)
+            {
+                break;
+            }
+            started++;
+        }
+        if (started == 0)
+        {
+            jobs[0] = (manifest_job){ entries, count, 0, 1, ctx };
+            plan_worker(&jobs[0]);
+        }
+        else if (started < workers)
+        {
+            // Plan the strides of the threads that failed to start ourselves
+            for (uint32_t w = started; w < workers; w++)
+            {
+                plan_worker(&jobs[w]);
+            }
+        }
+        for (uint32_t w = 0; w < started; w++)
+        {
+            pthread_join(threads[w], NULL);
+        }
+        planned = 1;
+    }
+
+    {
+        uint32_t tag     = FRAME_PLAN;
+        uint8_t  *plan   = malloc(count ? count : 1);
+        uint32_t skipped = 0;
+        if (plan == NULL)
+        {
+            SET_ERROR(context, "Malloc failed");
+            goto done;
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            plan[i] = entries[i].action;
+            skipped += entries[i].action == PLAN_SKIP;
+        }
+        if (write_fully(sd, &tag, sizeof(tag)) == 0 && write_fully(sd, &count, sizeof(count)) == 0 &&
+            write_fully(sd, plan, count) == 0)
+        {
+            printf("Manifest: %u files, %" PRIu64 " bytes, %u already stored\n", count, total_size, skipped);
+            result = 0;
+        }
+        free(plan);
+    }
+
+done:
+    if (result == -1 && context->error_message == NULL)
+    {
+        SET_ERROR(context, "Invalid manifest");
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // The connection holds on to what the plan reserved until it closes,
+        // files that never come give their space back then
+        if (planned && entries[i].action == PLAN_SEND)
+        {
+            if (result == 0 && keep_reservation(sd, entries[i].name, ctx) == 0)
+            {
+                continue;
+            }
+            storage_unreserve(&context->store, entries[i].name);
+        }
+        free(entries[i].name);
+    }
+    free(entries);
+    return result;
+}
+
+int handle_disconnection(int sd, int **client_sockets, const nfds_t *max_clients, int client, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    LOG_INFO("Client %d disconnected\n", client);
+    TRACE(LEVEL_INFO, TRACE_CLOSE, sd, sd < context->max_fds ? context->connections[sd].bytes_received : 0, client);
+    PROBE3(close, sd, sd < context->max_fds ? context->connections[sd].bytes_received : 0, client);
+    metrics_add(METRIC_DISCONNECTS, 1);
+    metrics_add(METRIC_CONNECTIONS, -1);
+    close_streams(sd, ctx);
+    tls_close(sd);
+    close(sd);
+
+    for (size_t i = 0; i < *max_clients; i++) {
+        if ((*client_sockets)[i] == sd) {
+            (*client_sockets)[i] = 0;
+            return 0;
+        }
+    }
+    SET_ERROR(context,"Error closing the disconnection");
+    // if we reach here, we couldn't find the socket descriptor in our list
+    fprintf(stderr, "Error: Could not find socket descriptor %d in client_sockets array.\n", sd);
+    return -1;
+}
+
+int setup_server_socket(int sockfd,void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    int enable = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == -1) {
+        SET_ERROR(context,"setsockopt failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Fill the poll set and return the poll timeout in milliseconds. A client over
+// its bandwidth limit is left out of the read set until its buckets refill, and
+// the timeout wakes the loop when the first of them can be read again.
+int setup_fds(struct pollfd *fds, int *client_sockets, nfds_t max_clients, int sockfd, int *client, void* ctx) {
+    FSMContext* context = (FSMContext*) ctx;
+    uint64_t now = monotonic_ns();
+    uint64_t wait_ns = UINT64_MAX;
+
+    // Set up the pollfd structure for the server socket
+    fds[0].fd = sockfd;
+    fds[0].events = POLLIN;
+
+    // Set up the pollfd structures for all client sockets
+    for(uint32_t i = 0; i < max_clients; i++) {
+        int sd = client_sockets[i];
+        // Disconnected slots hold 0, a negative fd makes poll skip them
+        if (sd <= 0) {
+            fds[i + 1].fd = -1;
+            fds[i + 1].events = 0;
+            continue;
+        }
+        client[sd]= (int)i+1;
+        fds[i + 1].fd = sd;
+        fds[i + 1].events = POLLIN;
+        if (sd < context->max_fds && context->connections[sd].handshake_deadline != 0) {
+            connection *conn = &context->connections[sd];
+            uint64_t   left  = conn->handshake_deadline > now ? conn->handshake_deadline - now : 0;
+            fds[i + 1].events = conn->handshake_events;
+            wait_ns = left < wait_ns ? left : wait_ns;
+            continue;
+        }
+        uint64_t delay = sd < context->max_fds ? throttle_delay(&context->connections[sd], now, ctx) : 0;
+        if (delay > 0) {
+            fds[i + 1].events = 0;
+            wait_ns = delay < wait_ns ? delay : wait_ns;
+        } else if (tls_pending(sd)) {
+            // Data already decrypted by TLS does not wake poll, so do not block on it
+            wait_ns = 0;
+        }
+    }
+    if (wait_ns == UINT64_MAX) {
+        return -1;
+    }
+    wait_ns = (wait_ns + 999999) / 1000000;
+    return wait_ns > INT32_MAX ? INT32_MAX : (int)wait_ns;
+}
+
+// More input is buffered for the client, in the kernel or in the TLS layer. The
+// kernel's count is asked for once and then used up as frames are consumed, so a
+// stream of small chunks does not cost a system call each. Control frames are not
+// counted in bytes_received, so after one the count is stale and asked for again;
+// trusting it would block in the next read until the client sends more. Under
+// TLS the kernel counts records, which are larger than the plaintext read from
+// them, so there the count is never kept.
+static int has_input(int sd, connection *conn, uint64_t consumed)
+{
+    int available = 0;
+
+    conn->buffered = conn->buffered > consumed && consumed > 0 ? conn->buffered - consumed : 0;
+    if (conn->buffered > 0 || tls_pending(sd))
+    {
+        return 1;
+    }
+    metrics_add(METRIC_SYSCALL_IOCTL, 1);
+    if (ioctl(sd, FIONREAD, &available) == -1)
+    {
+        return 0;
+    }
+    conn->buffered = tls_enabled(sd) ? 0 : (uint64_t)available;
+    return available > 0;
+}
+
+// Step the TLS handshake of a client poll found ready, and drop the client when
+// the handshake failed or ran past its deadline.
+static int continue_handshake(int sd, short revents, int **client_sockets, const nfds_t *max_clients, int client, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    connection *conn = &context->connections[sd];
+    int        result;
+
+    if (revents == 0) {
+        if (monotonic_ns() < conn->handshake_deadline) {
+            return 0;
+        }
+        printf("TLS handshake timed out, closing connection\n");
+        return handle_disconnection(sd, client_sockets, max_clients, client, ctx);
+    }
+    result = tls_accept(sd);
+    if (result == -1) {
+        // A failed handshake only costs this client its connection
+        printf("TLS handshake failed, closing connection\n");
+        return handle_disconnection(sd, client_sockets, max_clients, client, ctx);
+    }
+    if (result == 0) {
+        conn->handshake_deadline = 0;
+    } else {
+        conn->handshake_events = result == TLS_WANT_WRITE ? POLLOUT : POLLIN;
+    }
+    return 0;
+}
+
+// One deficit round robin round over the ready clients. Each is credited its
+// quantum times its weight and served a frame or chunk at a time until the
+// credit is spent or it has nothing buffered. A frame that overdraws the credit
+// is paid back next round; an idle client does not bank credit.
+int handle_clients(struct pollfd *fds, nfds_t max_clients, int *client_sockets, char *directory, int *client, void* ctx) {
+    FSMContext* context = (FSMContext*) ctx;
+    for(uint32_t i = 0; i < max_clients; i++) {
+        int sd = client_sockets[i];
+        if(sd > 0 && sd < context->max_fds && context->connections[sd].handshake_deadline != 0) {
+            if (continue_handshake(sd, fds[i + 1].revents, &client_sockets, &max_clients, client[sd], ctx) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if(sd <= 0 || fds[i + 1].events == 0 || !((fds[i + 1].revents & POLLIN) || tls_pending(sd))) {
+            continue;
+        }
+        if(sd >= context->max_fds) {
+            // receive_files turns it away
+            if (receive_files(sd, &client_sockets, &max_clients, directory, client, ctx) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        connection *conn = &context->connections[sd];
+        conn->deficit += (int64_t)context->quantum * conn->weight;
+        while (conn->deficit > 0) {
+            uint64_t before = conn->bytes_received;
+            if (receive_files(sd, &client_sockets, &max_clients, directory, client, ctx) < 0) {
+                return -1; // Return error if receive_files fails.
+            }
+            if (client_sockets[i] != sd) {
+                break;  // disconnected
+            }
+            uint64_t cost = conn->bytes_received - before;
+            metrics_add(METRIC_BYTES_RECEIVED, (int64_t)cost);
+            TRACE(LEVEL_DEBUG, TRACE_FRAME_RECEIVED, sd, cost, 0);
+            PROBE2(frame__received, sd, cost);
+            conn->deficit -= (int64_t)(cost > MIN_FRAME_COST ? cost : MIN_FRAME_COST);
+            if (charge_buckets(conn, cost > MIN_FRAME_COST ? cost : MIN_FRAME_COST, ctx)) {
+                // Out of bandwidth, poll leaves it alone until the buckets refill
+                if (conn->deficit > 0) {
+                    conn->deficit = 0;
+                }
+                break;
+            }
+            if (!has_input(sd, conn, cost)) {
+                if (conn->deficit > 0) {
+                    conn->deficit = 0;
+                }
+                break;
+            }
+        }
+    }
+    return 0;  // Return 0 if everything went smoothly
+}
+
+// Peer address as the -W rules spell it, "unix:" for local clients.
+void peer_address(const struct sockaddr_storage *address, char *addr_str, size_t len)
+{
+    snprintf(addr_str, len, "%s", UNIX_PREFIX);
+    if (address->ss_family == AF_INET)
+    {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)address)->sin_addr, addr_str, (socklen_t)len);
+    }
+    else if (address->ss_family == AF_INET6)
+    {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)address)->sin6_addr, addr_str, (socklen_t)len);
+    }
+}
+
+// Scheduling weight for a new client, from the -W rules for its address.
+uint32_t client_weight(const char *address, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+
+    for (int i = 0; i < context->num_weights; i++)
+    {
+        if (strcmp(context->weights[i].address, address) == 0)
+        {
+            return context->weights[i].weight;
+        }
+    }
+    return 1;
+}
+
+// Share the -A bucket of the other connections from the same address, or start
+// one. Returns the slot, or -1 without a per-address limit.
+int join_address_limit(const char *address, void* ctx)
+{
+    FSMContext* context = (FSMContext*) ctx;
+    int         free_slot = -1;
+
+    if (context->address_rate == 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < context->address_slots; i++)
+    {
+        address_limit *limit = &context->address_limits[i];
+        if (limit->users > 0 && strcmp(limit->address, address) == 0)
+        {
+            limit->users++;
+            return i;
+        }
+        if (limit->users == 0 && free_slot == -1)
+        {
+            free_slot = i;
+        }
+    }
+    // One slot per connection at most, so there is always a free one
+    if (free_slot == -1)
+    {
+        free_slot = context->address_slots++;
+    }
+    snprintf(context->address_limits[free_slot].address, sizeof(context->address_limits[free_slot].address), "%s", address);
+    context->address_limits[free_slot].users = 1;
+    bucket_init(&context->address_limits[free_slot].bucket, context->address_rate);
+    return free_slot;
+}
+
+// How long until every bucket the client draws from is out of debt, 0 when it
+// may be read now. The time a client spends waiting is added up.
+uint64_t throttle_delay(connection *conn, uint64_t now_ns, void* ctx)
+{
+    FSMContext*  context = (FSMContext*) ctx;
+    token_bucket *buckets[3] = { &conn->bucket, &context->global_limit,
+                                 conn->address_limit >= 0 ? &context->address_limits[conn->address_limit].bucket : NULL };
+    uint64_t     delay = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (buckets[i] != NULL)
+        {
+            bucket_refill(buckets[i], now_ns);
+            uint64_t wait_ns = bucket_wait_ns(buckets[i]);
+            delay = wait_ns > delay ? wait_ns : delay;
+        }
+    }
+    if (delay > 0 && conn->throttled_since == 0)
+    {
+        conn->throttled_since = now_ns;
+    }
+    else if (delay == 0 && conn->throttled_since != 0)
+    {
+        conn->throttled_ns   += now_ns - conn->throttled_since;
+        conn->throttled_since = 0;
+    }
+    return delay;
+}
+
+// Take what a frame cost from the client's buckets. Nonzero once any of them
+// is empty and the client has to wait.
+int charge_buckets(connection *conn, uint64_t cost, void* ctx)
+{
+    FSMContext*  context = (FSMContext*) ctx;
+    token_bucket *buckets[3] = { &conn->bucket, &context->global_limit,
+                                 conn->address_limit >= 0 ? &context->address_limits[conn->address_limit].bucket : NULL };
+    int          empty = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (buckets[i] != NULL)
+        {
+            bucket_take(buckets[i], cost);
+            empty |= bucket_wait_ns(buckets[i]) > 0;
+        }
+    }
+    return empty;
+}
+
+int cleanup_server(int *client_sockets, nfds_t max_clients, struct pollfd *fds, int sockfd, void* ctx) {
+    FSMContext* context = (FSMContext*) ctx;
+    printf("Cleaning up\n");
+    for (uint32_t i = 0; i < max_clients; i++) {
+        if (client_sockets[i] > 0) {
+            close_streams(client_sockets[i], ctx);
+        }
+    }
+    if (context->throttled_ns > 0) {
+        printf("Clients were throttled for %.3f s in total\n", (double)context->throttled_ns / NS_PER_SECOND);
+    }
+    metrics_stop();
+#if LOG_LEVEL >= LEVEL_INFO
+    metrics_report(stdout);
+#endif
+    trace_stop();
+    free(context->frame_buffer);
+    close_pipe(context->splice_pipe);
+    tls_cleanup();
+    for (uint32_t i = 0; i < max_clients; i++) {
+        int sd = client_sockets[i];
+        if (sd > 0) {
+            if(close(sd) < 0) {
+                SET_ERROR(context,"Error closing client socket");
+                return -1;
+            }
+        }
+    }
+
+    free(client_sockets);
+    free(fds);
+    free(context->connections);
+    free(context->address_limits);
+    free(context->client);
+    if (context->spare_fd != -1) {
+        close(context->spare_fd);
+    }
+    if (context->indexed && catalog_close(&context->catalog) == -1) {
+        perror("Cannot write the catalog");
+    }
+    storage_stop(&context->store);
+    if (context->addr.ss_family == AF_UNIX) {
+        unlink(((struct sockaddr_un *)&context->addr)->sun_path);
+    }
+    // -1 when an error came before the socket was created
+    if (sockfd != -1 && close(sockfd) < 0) {
         SET_ERROR(context,"Error closing server socket");
         return -1;
     }
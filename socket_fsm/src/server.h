@@ -5,19 +5,44 @@
 #ifndef SOCKET_FSM_SERVER_H
 #define SOCKET_FSM_SERVER_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <sys/poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include "protocol.h"
+#include "codec.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
+#include "storage.h"
+#include "pack.h"
+#include "catalog.h"
 
 int setup_signal_handler(void* ctx);
 void sigint_handler(int signum);
@@ -33,14 +58,33 @@ int handle_new_client(int server_socket, int **client_sockets, nfds_t *max_clien
 int socket_close(int sockfd, void* ctx);
 int handle_disconnection(int sd, int **client_sockets, const nfds_t *max_clients, int client, void* ctx);
 int receive_files(int sd, int **client_sockets, const nfds_t *max_clients, const char *dir, int *client, void* ctx);
-int read_buffer_size(int sockfd, uint32_t size, void *buffer, void* ctx);
 int setup_server_socket(int sockfd, void* ctx);
-void setup_fds(struct pollfd *fds, int *client_sockets, nfds_t max_clients, int sockfd, int *client);
+int setup_fds(struct pollfd *fds, int *client_sockets, nfds_t max_clients, int sockfd, int *client, void* ctx);
 int handle_clients(struct pollfd *fds, nfds_t max_clients, int *client_sockets, char *directory, int *client, void* ctx);
 int cleanup_server(int *client_sockets, nfds_t max_clients, struct pollfd *fds, int sockfd, void* ctx);
+void close_pipe(int pipe_fds[2]);
+int receive_stream_frame(int sd, uint32_t tag, int client, void* ctx);
+void close_streams(int sd, void* ctx);
+int receive_hello(int sd, void* ctx);
+ssize_t read_tag(int sd, uint32_t *tag, void* ctx);
+int receive_passed_file(int sd, int client, void* ctx);
+void acknowledge(int sd, uint32_t file, uint32_t status, uint64_t bytes, void* ctx);
+int receive_manifest(int sd, const char *dir, void* ctx);
 
 #define UNKNOWN_OPTION_MESSAGE_LEN 24
 #define BASE_TEN 10
+// Upper bound on threads used to plan a manifest
+#define MANIFEST_WORKERS 8
+// Connection state is kept in tables indexed by descriptor, as large as the
+// descriptor limit (raised to the hard limit at startup) but no larger than this
+#define MAX_CONNECTIONS TLS_MAX_FDS
+// A client that has not finished the TLS handshake by then is dropped
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+// Deficit round robin across clients (-q, -W)
+#define DRR_QUANTUM (64 * 1024)
+#define MIN_FRAME_COST 12   // charged for frames that carry no file data
+#define MAX_WEIGHT 1000
+#define MAX_WEIGHT_RULES 64
 
 // Helper macros
 typedef enum {
@@ -60,6 +104,8 @@ typedef enum {
     STATE_EXIT // useful to have an explicit exit state
 } server_state;
 
+const char* state_to_string(server_state state);
+
 
 typedef struct {
     server_state state;
@@ -73,21 +119,108 @@ typedef server_state (*StateHandlerFunc)(void* context);
     slash ? slash + 1 : file; \
 })
 
+typedef struct {
+    char     *name;
+    uint64_t size;
+    uint64_t hash;
+    int      has_hash;
+    uint8_t  action;
+} manifest_entry;
+
+typedef struct {
+    manifest_entry *entries;
+    uint32_t       count;
+    uint32_t       first;
+    uint32_t       stride;
+    void           *ctx;
+} manifest_job;
+
+typedef struct {
+    uint32_t id;
+    int      in_use;
+    storage_file *file;         // NULL once the file failed, the rest is discarded
+    char     *name;
+    uint64_t size;
+    uint64_t received;
+} stream_state;
+
+// Per-connection state, indexed by socket descriptor
+typedef struct {
+    stream_state *streams;      // MAX_STREAMS slots, allocated on the first open
+    int          open_streams;
+    int          acks;          // client asked for FRAME_ACK (FEATURE_ACKS)
+    uint32_t     files;         // plain files received, numbers their acks
+    int          local;         // AF_UNIX, may pass descriptors
+    int          passed_fd;     // descriptor from SCM_RIGHTS waiting for its frame, or -1
+    stream_state plain;         // plain file whose chunks are still arriving
+    int64_t      deficit;       // bytes the scheduler still owes, negative when overdrawn
+    uint32_t     weight;        // quanta per round
+    uint64_t     bytes_received;
+    uint64_t     buffered;      // input known to be waiting, from FIONREAD
+    token_bucket bucket;        // -r
+    int          address_limit; // slot in address_limits, or -1
+    uint64_t     throttled_since;
+    uint64_t     throttled_ns;
+    uint64_t     handshake_deadline; // while the TLS handshake runs, 0 after it
+    short        handshake_events;   // what the handshake waits for
+    char         **reserved;    // names manifests reserved space for, given back at close
+    uint32_t     num_reserved;
+} connection;
+
+typedef struct {
+    char     address[INET6_ADDRSTRLEN];
+    uint32_t weight;
+} weight_rule;
+
+// Bandwidth shared by every connection from one source address (-A)
+typedef struct {
+    char         address[INET6_ADDRSTRLEN];
+    int          users;
+    token_bucket bucket;
+} address_limit;
+
 typedef struct {
     int argc;
     char **argv;
     char                    *address;
     char                    *port_str;
     char                    *directory;
+    int                     cache_hints;
+    int                     shard_levels;
+    char                    *sink;
+    storage                 store;
+    int                     indexed;        // -I
+    catalog                 catalog;
+    char                    *tls_cert;
+    char                    *tls_key;
+    int                     zero_copy;
+    uint32_t                quantum;
+    weight_rule             weights[MAX_WEIGHT_RULES];
+    int                     num_weights;
+    uint64_t                connection_rate;
+    uint64_t                address_rate;
+    token_bucket            global_limit;
+    address_limit           *address_limits;
+    int                     address_slots;  // address_limits in use or freed, the rest are unused
+    uint64_t                throttled_ns;
+    char                    *metrics_endpoint;
+    char                    *trace_path;
+    connection              *connections;
+    int                     max_fds;        // size of the tables indexed by descriptor
+    int                     spare_fd;       // given up to accept a connection past the limit
+    char                    *frame_buffer;
+    uint32_t                frame_buffer_size;
+    int                     splice_pipe[2];
     in_port_t               port;
     int                     *client_sockets;
     nfds_t                  max_clients;
     int                     num_ready;
+    sigset_t                poll_mask;      // SIGINT only gets through while in ppoll
     int                     sockfd;
     int                     enable;
     struct sockaddr_storage addr;
     struct pollfd *fds;
-    int  client[1024];
+    int  *client;
     char *trace_message;
     server_state trace_state;
     int trace_line;
@@ -96,6 +229,21 @@ typedef struct {
     const char    *file_name;
     int     error_line;
 } FSMContext;
+int start_plain_file(connection *conn, const char *filename, uint32_t file_size, void* ctx);
+int receive_plain_chunk(int sd, connection *conn, int client, void* ctx);
+int finish_plain_file(int sd, connection *conn, int client, void* ctx);
+int stream_data(int sd, stream_state *stream, uint32_t length, void* ctx);
+int valid_name(const char *name, size_t len);
+storage_file *open_stored(const char *name, uint64_t size, void* ctx);
+int commit_stored(storage_file *file, const char *name, void* ctx);
+uint32_t commit_file(stream_state *file, void* ctx);
+void drop_file(stream_state *file);
+void peer_address(const struct sockaddr_storage *address, char *addr_str, size_t len);
+uint32_t client_weight(const char *address, void* ctx);
+int join_address_limit(const char *address, void* ctx);
+uint64_t throttle_delay(connection *conn, uint64_t now_ns, void* ctx);
+int charge_buckets(connection *conn, uint64_t cost, void* ctx);
+
 #define SET_ERROR(ctx, msg) \
     do { \
         ctx -> error_message = msg; \
@@ -109,8 +257,9 @@ typedef struct {
         ctx->trace_message = msg; \
         ctx->trace_state = curr_state; \
         ctx->trace_line = __LINE__; \
-        printf("TRACE: %s \nEntered state %s (%d) at line %d.\n\n", \
+        LOG_DEBUG("TRACE: %s \nEntered state %s (%d) at line %d.\n\n", \
                ctx->trace_message, state_to_string(ctx->trace_state),ctx->trace_state, ctx->trace_line); \
+        TRACE(LEVEL_DEBUG, TRACE_STATE, curr_state, __LINE__, 0); \
     } while (0)
 
 
@@ -110,9 +110,11 @@ server_state poll_handler(void* ctx) {
         return STATE_ERROR;
     }
 
-    setup_fds(context->fds, context->client_sockets, context->max_clients, context->sockfd, context->client);
+    int timeout = setup_fds(context->fds, context->client_sockets, context->max_clients, context->sockfd, context->client, ctx);
 
-    context->num_ready = poll(context->fds, context->max_clients + 1, -1);
+    struct timespec wait = { timeout / 1000, (timeout % 1000) * 1000000L };
+    context->num_ready = ppoll(context->fds, context->max_clients + 1, timeout < 0 ? NULL : &wait, &context->poll_mask);
+    metrics_add(METRIC_SYSCALL_POLL, 1);
     if(context->num_ready < 0 && errno != EINTR) {
         SET_ERROR(context, "Poll error.");
         return STATE_ERROR;
@@ -201,6 +203,10 @@ int main(int argc, char **argv) {
     memset(&context, 0, sizeof(context)); // Zero out the context structure
     context.argc = argc;
     context.argv = argv;
+    context.splice_pipe[0] = context.splice_pipe[1] = -1;
+    context.sockfd = -1;
+    context.spare_fd = -1;
+    context.quantum = DRR_QUANTUM;
 
     server_state current_state = STATE_PARSE_ARGUMENTS;
 
@@ -221,7 +227,11 @@ int main(int argc, char **argv) {
         }
 
         // Call the state handler
+        uint64_t entered = monotonic_ns();
         server_state next_state = current_fsm_state->state_handler(&context);
+        uint64_t elapsed = monotonic_ns() - entered;
+        metrics_transition(current_state, next_state, elapsed);
+        PROBE3(transition, current_state, next_state, elapsed);
 
         // If the exit flag is set, move to cleanup state
         if (exit_flag) {
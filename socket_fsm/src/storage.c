@@ -0,0 +1,1345 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "storage.h"
+#include "codec.h"
+#include "metrics.h"
+#include "pack.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+
+// The memory sink starts a file with room for at most this much of its
+// announced size, the size comes from the peer
+#define MEMORY_MAX_RESERVE (64u << 20)
+#define MEMORY_BUCKETS     1024
+
+typedef struct {
+    int    store_fd;            // the directory with -s, AT_FDCWD without
+    int    partial_fd;          // PARTIAL_DIR_NAME in the directory
+    FILE   *shard_index;
+    size_t buffer_size;         // 0 writes every chunk through
+    uint64_t written_files;     // numbers the files being written
+} file_sink;
+
+typedef struct {
+    storage_file base;
+    char         *name;
+    char         temp[48];      // in PARTIAL_DIR_NAME until the commit
+    int          fd;
+    char         *buffer;
+    size_t       capacity;
+    size_t       buffered;
+    uint64_t     synced;        // write-behind position (-c)
+} file_handle;
+
+typedef struct memory_entry {
+    struct memory_entry *next;
+    char                *name;
+    unsigned char       *data;
+    uint64_t            size;
+} memory_entry;
+
+typedef struct {
+    memory_entry **buckets;
+    size_t       num_buckets;
+    size_t       count;
+} memory_sink;
+
+typedef struct {
+    storage_file  base;
+    char          *name;
+    unsigned char *data;
+    uint64_t      capacity;
+} memory_file;
+
+typedef struct {
+    int devnull;
+} null_sink;
+
+typedef struct {
+    pack    log;
+    storage files;              // a file sink for what is too large to pack
+} packed_sink;
+
+typedef struct {
+    memory_file  small;         // collects the data until the commit
+    storage_file *large;        // or the file sink has the file
+} packed_file;
+
+// Build "ab/cd/filename" from the low bytes of the name hash, one byte per level.
+int shard_path(const char *filename, int levels, char *path, size_t path_len)
+{
+    uint32_t hash = hash_name(filename);
+    size_t   used = 0;
+
+    for (int level = 0; level < levels; level++)
+    {
+        used += snprintf(path + used, path_len - used, "%02x/", (hash >> (level * 8)) & 0xff);
+    }
+    if (snprintf(path + used, path_len - used, "%s", filename) >= (int)(path_len - used))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// 32-bit FNV-1a
+uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Move one chunk from the socket into a file through a pipe, without copying
+// it through user space.
+static int splice_to_file(int sd, int pipe_fds[2], int fd, uint32_t size)
+{
+#ifdef __linux__
+    while (size > 0)
+    {
+        ssize_t in_pipe = splice(sd, NULL, pipe_fds[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        metrics_add(METRIC_SYSCALL_SPLICE, 1);
+        if (in_pipe <= 0)
+        {
+            if (in_pipe == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        size -= (uint32_t)in_pipe;
+        while (in_pipe > 0)
+        {
+            ssize_t out = splice(pipe_fds[0], NULL, fd, NULL, (size_t)in_pipe, SPLICE_F_MOVE);
+            metrics_add(METRIC_SYSCALL_SPLICE, 1);
+            if (out <= 0)
+            {
+                if (out == -1 && errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            in_pipe -= out;
+        }
+    }
+    return 0;
+#else
+    (void)sd; (void)pipe_fds; (void)fd; (void)size;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Copy a whole file between descriptors without the data passing through user
+// space: share the extents with a reflink where the filesystem can, otherwise let
+// copy_file_range (which may reflink on its own) or sendfile move the pages.
+static int place_file(int in_fd, int out_fd, uint64_t size)
+{
+    uint64_t copied = 0;
+    off_t    offset = 0;
+
+#ifdef FICLONE
+    if (ioctl(out_fd, FICLONE, in_fd) == 0)
+    {
+        return 0;
+    }
+#endif
+    while (copied < size)
+    {
+        loff_t  in_offset = (loff_t)copied;
+        ssize_t moved     = copy_file_range(in_fd, &in_offset, out_fd, NULL, size - copied, 0);
+        if (moved <= 0)
+        {
+            break;
+        }
+        copied += moved;
+    }
+    // memfds and some filesystem pairs do not support copy_file_range
+    offset = (off_t)copied;
+    if (lseek(out_fd, offset, SEEK_SET) == -1)
+    {
+        return -1;
+    }
+    while (copied < size)
+    {
+        ssize_t moved = sendfile(out_fd, in_fd, &offset, size - copied);
+        if (moved <= 0)
+        {
+            return -1;
+        }
+        copied += moved;
+    }
+    return ftruncate(out_fd, (off_t)size);
+}
+
+// Start writeback of every full window behind the write position, wait for the
+// window before it and drop its now clean pages. The final call flushes the tail
+// and drops the whole file so a bulk transfer does not evict other processes.
+static void write_behind(int fd, uint64_t written, uint64_t *synced, int final)
+{
+#ifdef __linux__
+    while (written - *synced >= WRITE_BEHIND_WINDOW)
+    {
+        sync_file_range(fd, *synced, WRITE_BEHIND_WINDOW, SYNC_FILE_RANGE_WRITE);
+        if (*synced >= WRITE_BEHIND_WINDOW)
+        {
+            off_t previous = *synced - WRITE_BEHIND_WINDOW;
+            sync_file_range(fd, previous, WRITE_BEHIND_WINDOW,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd, previous, WRITE_BEHIND_WINDOW, POSIX_FADV_DONTNEED);
+        }
+        *synced += WRITE_BEHIND_WINDOW;
+    }
+    if (final)
+    {
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        *synced = written;
+    }
+#else
+    (void)fd; (void)written; (void)synced; (void)final;
+#endif
+}
+
+// Print how many pages of the file are still resident, so the effect of -c can be
+// compared against the Cached/Dirty/Writeback counters in /proc/meminfo.
+static void report_page_cache(int fd, uint64_t file_size)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t pages;
+    size_t resident = 0;
+    unsigned char *vec;
+    void *map;
+
+    if (file_size == 0 || page_size <= 0)
+    {
+        return;
+    }
+    pages = (file_size + page_size - 1) / page_size;
+    map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return;
+    }
+    vec = malloc(pages);
+    if (vec != NULL && mincore(map, file_size, (void *)vec) == 0)
+    {
+        for (size_t i = 0; i < pages; i++)
+        {
+            resident += vec[i] & 1;
+        }
+        LOG_INFO("Page cache: %zu of %zu pages resident\n", resident, pages);
+    }
+    free(vec);
+    munmap(map, file_size);
+}
+
+// Resolve where a received file is stored. Without sharding this is dir/filename
+// relative to the working directory; with -s it is a hashed path relative to the
+// open storage directory.
+static int store_path(storage *store, const char *filename, char *path, size_t path_len, int *base_fd)
+{
+    file_sink *sink = (file_sink *)store->state;
+
+    *base_fd = sink->store_fd;
+    if (store->config.shard_levels == 0)
+    {
+        if (snprintf(path, path_len, "%s/%s", store->config.directory, filename) >= (int)path_len)
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        return 0;
+    }
+    if (shard_path(filename, store->config.shard_levels, path, path_len) == -1)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// Create the directories on the way to a file: the shard levels ("ab/") and
+// those of a name from a tree upload (client -r)
+static int make_parent_dirs(int base_fd, char *filepath)
+{
+    for (char *slash = strchr(filepath + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdirat(base_fd, filepath, 0755) == -1 && errno != EEXIST)
+        {
+            *slash = '/';
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+// "r-<name>", with '/' and '%' escaped so names from a tree stay one entry of
+// PARTIAL_DIR_NAME. -1 when it does not fit a file name.
+static int reservation_name(const char *filename, char *reserved, size_t reserved_len)
+{
+    size_t used = 2;
+
+    memcpy(reserved, "r-", 2);
+    for (const char *p = filename; *p != '\0'; p++)
+    {
+        if (used + 4 > reserved_len || used + 4 > NAME_MAX)
+        {
+            return -1;
+        }
+        if (*p == '/' || *p == '%')
+        {
+            used += (size_t)sprintf(reserved + used, "%%%02X", (unsigned char)*p);
+        }
+        else
+        {
+            reserved[used++] = *p;
+        }
+    }
+    reserved[used] = '\0';
+    return 0;
+}
+
+// Create the file a received file is written to until its commit, taking over
+// the space a manifest reserved for the name. Every open gets a file of its own,
+// so two connections sending one name cannot mix or remove each other's data.
+static int open_partial_fd(storage *store, const char *filename, char *temp, size_t temp_len, int flags)
+{
+    file_sink *sink = (file_sink *)store->state;
+    char      reserved[1024];
+
+    snprintf(temp, temp_len, "w-%ld-%" PRIu64, (long)getpid(),
+             __atomic_fetch_add(&sink->written_files, 1, __ATOMIC_RELAXED));
+    if (reservation_name(filename, reserved, sizeof(reserved)) == 0)
+    {
+        renameat(sink->partial_fd, reserved, sink->partial_fd, temp);
+    }
+    return openat(sink->partial_fd, temp, flags | O_CREAT | O_CLOEXEC, 0644);
+}
+
+// Move a written file to where it is stored, creating its directories on first
+// use. An older file of the name is replaced in one step.
+static int publish_file(storage *store, const char *temp, const char *filename)
+{
+    file_sink *sink = (file_sink *)store->state;
+    char      filepath[1024];
+    int       base_fd;
+
+    if (store_path(store, filename, filepath, sizeof(filepath), &base_fd) == -1)
+    {
+        return -1;
+    }
+    if (renameat(sink->partial_fd, temp, base_fd, filepath) == 0)
+    {
+        return 0;
+    }
+    if (errno != ENOENT || make_parent_dirs(base_fd, filepath) == -1)
+    {
+        return -1;
+    }
+    return renameat(sink->partial_fd, temp, base_fd, filepath);
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        metrics_add(METRIC_SYSCALL_WRITE, 1);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        data  = (const char *)data + written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+// Reservations of an earlier run (or of one still running, which only loses the
+// space it set aside) and the files of writers that are gone would hold disk
+// space for ever, and manifests are rejected by the free space that is left.
+static void clear_partial(int partial_fd)
+{
+    int           fd  = dup(partial_fd);
+    DIR           *dir = fd != -1 ? fdopendir(fd) : NULL;
+    struct dirent *entry;
+
+    if (dir == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        long pid;
+        if (strncmp(entry->d_name, "r-", 2) == 0)
+        {
+            unlinkat(partial_fd, entry->d_name, 0);
+        }
+        else if (strncmp(entry->d_name, "w-", 2) == 0 && (pid = strtol(entry->d_name + 2, NULL, 10)) > 0 &&
+                 kill((pid_t)pid, 0) == -1 && errno == ESRCH)
+        {
+            unlinkat(partial_fd, entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+static int file_sink_start(storage *store, size_t buffer_size)
+{
+    file_sink *sink = calloc(1, sizeof(file_sink));
+
+    if (sink == NULL)
+    {
+        return -1;
+    }
+    sink->store_fd    = AT_FDCWD;
+    sink->partial_fd  = -1;
+    sink->buffer_size = buffer_size;
+    store->state      = sink;
+    int dir_fd = open(store->config.directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        return -1;
+    }
+    if (mkdirat(dir_fd, PARTIAL_DIR_NAME, 0755) == -1 && errno != EEXIST)
+    {
+        close(dir_fd);
+        return -1;
+    }
+    sink->partial_fd = openat(dir_fd, PARTIAL_DIR_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sink->partial_fd == -1)
+    {
+        close(dir_fd);
+        return -1;
+    }
+    clear_partial(sink->partial_fd);
+    if (store->config.shard_levels == 0)
+    {
+        close(dir_fd);
+    }
+    else
+    {
+        // Keep the store open so every file is created relative to it with openat
+        sink->store_fd = dir_fd;
+        int index_fd = openat(sink->store_fd, SHARD_INDEX_NAME, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (index_fd == -1 || (sink->shard_index = fdopen(index_fd, "a")) == NULL)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int file_start(storage *store)
+{
+    return file_sink_start(store, 0);
+}
+
+static int buffered_start(storage *store)
+{
+    return file_sink_start(store, STORAGE_BUFFER_SIZE);
+}
+
+// The file is written in PARTIAL_DIR_NAME and not truncated there, so space
+// reserved by a manifest is used; the commit sets the final size and moves it
+// into place. With -s the mapping is appended to the shard index.
+static storage_file *file_open(storage *store, const char *name, uint64_t size)
+{
+    file_sink   *sink   = (file_sink *)store->state;
+    file_handle *handle = calloc(1, sizeof(file_handle));
+
+    if (handle == NULL || (handle->name = strdup(name)) == NULL)
+    {
+        free(handle);
+        return NULL;
+    }
+    // Read access lets report_page_cache map the file for mincore
+    handle->fd = open_partial_fd(store, name, handle->temp, sizeof(handle->temp),
+                                 store->config.cache_hints ? O_RDWR : O_WRONLY);
+    if (handle->fd == -1)
+    {
+        free(handle->name);
+        free(handle);
+        return NULL;
+    }
+    if (sink->buffer_size > 0 && size > 0)
+    {
+        handle->capacity = size < sink->buffer_size ? (size_t)size : sink->buffer_size;
+        handle->buffer   = malloc(handle->capacity);
+        if (handle->buffer == NULL)
+        {
+            close(handle->fd);
+            free(handle->name);
+            free(handle);
+            return NULL;
+        }
+    }
+    if (sink->shard_index != NULL)
+    {
+        char filepath[1024];
+        shard_path(name, store->config.shard_levels, filepath, sizeof(filepath));
+        fprintf(sink->shard_index, "%s\t%s\n", name, filepath);
+        fflush(sink->shard_index);
+    }
+    return &handle->base;
+}
+
+static int flush_buffer(file_handle *handle)
+{
+    size_t buffered = handle->buffered;
+
+    handle->buffered = 0;
+    return buffered > 0 ? write_all(handle->fd, handle->buffer, buffered) : 0;
+}
+
+static int file_write(storage_file *file, const void *data, size_t size)
+{
+    file_handle *handle = (file_handle *)file;
+
+    if (size >= handle->capacity)
+    {
+        if (flush_buffer(handle) == -1 || write_all(handle->fd, data, size) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        if (handle->buffered + size > handle->capacity && flush_buffer(handle) == -1)
+        {
+            return -1;
+        }
+        memcpy(handle->buffer + handle->buffered, data, size);
+        handle->buffered += size;
+    }
+    if (file->store->config.cache_hints)
+    {
+        // Only what reached the kernel can be written back
+        write_behind(handle->fd, file->written + size - handle->buffered, &handle->synced, 0);
+    }
+    return 0;
+}
+
+static int file_splice(storage_file *file, int sd, int pipe_fds[2], uint32_t size)
+{
+    file_handle *handle = (file_handle *)file;
+
+    if (flush_buffer(handle) == -1 || splice_to_file(sd, pipe_fds, handle->fd, size) == -1)
+    {
+        return -1;
+    }
+    if (file->store->config.cache_hints)
+    {
+        write_behind(handle->fd, file->written + size, &handle->synced, 0);
+    }
+    return 0;
+}
+
+static int file_place(storage_file *file, int in_fd, uint64_t size)
+{
+    file_handle *handle = (file_handle *)file;
+
+    return flush_buffer(handle) == -1 ? -1 : place_file(in_fd, handle->fd, size);
+}
+
+static void file_release(file_handle *handle)
+{
+    close(handle->fd);
+    free(handle->buffer);
+    free(handle->name);
+    free(handle);
+}
+
+static int file_commit(storage_file *file)
+{
+    file_handle *handle = (file_handle *)file;
+    int         result  = 0;
+
+    // Drop stale data from an earlier attempt and any unused reservation
+    if (flush_buffer(handle) == -1 || ftruncate(handle->fd, (off_t)file->written) == -1)
+    {
+        result = -1;
+    }
+    else
+    {
+        if (file->store->config.cache_hints)
+        {
+            write_behind(handle->fd, file->written, &handle->synced, 1);
+            report_page_cache(handle->fd, file->written);
+        }
+        result = publish_file(file->store, handle->temp, handle->name);
+    }
+    file_release(handle);
+    return result;
+}
+
+// The stored file, if there is one, is left as it was; what was written goes
+static void file_abort(storage_file *file)
+{
+    file_handle *handle = (file_handle *)file;
+
+    unlinkat(((file_sink *)file->store->state)->partial_fd, handle->temp, 0);
+    file_release(handle);
+}
+
+static int file_has(storage *store, const char *name, uint64_t size, const uint64_t *hash)
+{
+    char        filepath[1024];
+    int         base_fd;
+    struct stat st;
+    uint64_t    stored;
+    int         fd;
+    int         found;
+
+    if (store_path(store, name, filepath, sizeof(filepath), &base_fd) == -1 ||
+        fstatat(base_fd, filepath, &st, 0) == -1 || (uint64_t)st.st_size != size)
+    {
+        return 0;
+    }
+    if (hash == NULL)
+    {
+        return 1;
+    }
+    fd = openat(base_fd, filepath, O_RDONLY);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    found = hash_file(fd, &stored) == 0 && stored == *hash;
+    close(fd);
+    return found;
+}
+
+// Pre-create the file with its final size reserved, so the writes that follow do
+// not have to allocate. It stays in PARTIAL_DIR_NAME until it is committed, so
+// a reserved file is never taken for a stored one.
+static void file_reserve(storage *store, const char *name, uint64_t size)
+{
+    file_sink *sink = (file_sink *)store->state;
+    char      reserved[1024];
+    int       fd    = -1;
+
+    if (reservation_name(name, reserved, sizeof(reserved)) == 0)
+    {
+        fd = openat(sink->partial_fd, reserved, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (fd != -1)
+    {
+        if (size > 0)
+        {
+            posix_fallocate(fd, 0, (off_t)size);
+        }
+        close(fd);
+    }
+}
+
+static void file_unreserve(storage *store, const char *name)
+{
+    file_sink *sink = (file_sink *)store->state;
+    char      reserved[1024];
+
+    if (reservation_name(name, reserved, sizeof(reserved)) == 0)
+    {
+        unlinkat(sink->partial_fd, reserved, 0);
+    }
+}
+
+static void file_stop(storage *store)
+{
+    file_sink *sink = (file_sink *)store->state;
+
+    if (sink == NULL)
+    {
+        return;
+    }
+    if (sink->shard_index != NULL)
+    {
+        fclose(sink->shard_index);
+    }
+    if (sink->store_fd >= 0)
+    {
+        close(sink->store_fd);
+    }
+    if (sink->partial_fd >= 0)
+    {
+        close(sink->partial_fd);
+    }
+    free(sink);
+    store->state = NULL;
+}
+
+static memory_entry **memory_slot(memory_sink *sink, const char *name)
+{
+    memory_entry **slot = &sink->buckets[hash_name(name) & (sink->num_buckets - 1)];
+
+    while (*slot != NULL && strcmp((*slot)->name, name) != 0)
+    {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Double the table once it holds more names than buckets
+static void memory_grow(memory_sink *sink)
+{
+    size_t       num_buckets = sink->num_buckets * 2;
+    memory_entry **buckets   = calloc(num_buckets, sizeof(memory_entry *));
+
+    if (buckets == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < sink->num_buckets; i++)
+    {
+        while (sink->buckets[i] != NULL)
+        {
+            memory_entry *entry = sink->buckets[i];
+            size_t       bucket = hash_name(entry->name) & (num_buckets - 1);
+            sink->buckets[i] = entry->next;
+            entry->next      = buckets[bucket];
+            buckets[bucket]  = entry;
+        }
+    }
+    free(sink->buckets);
+    sink->buckets     = buckets;
+    sink->num_buckets = num_buckets;
+}
+
+static int memory_start(storage *store)
+{
+    memory_sink *sink = calloc(1, sizeof(memory_sink));
+
+    if (sink == NULL)
+    {
+        return -1;
+    }
+    store->state      = sink;
+    sink->num_buckets = MEMORY_BUCKETS;
+    sink->buckets     = calloc(sink->num_buckets, sizeof(memory_entry *));
+    return sink->buckets == NULL ? -1 : 0;
+}
+
+static storage_file *memory_open(storage *store, const char *name, uint64_t size)
+{
+    memory_file *file = calloc(1, sizeof(memory_file));
+
+    (void)store;
+    (void)size;
+    if (file == NULL || (file->name = strdup(name)) == NULL)
+    {
+        free(file);
+        return NULL;
+    }
+    return &file->base;
+}
+
+static int memory_write(storage_file *file, const void *data, size_t size)
+{
+    memory_file *memory = (memory_file *)file;
+    uint64_t    needed  = file->written + size;
+
+    if (needed > memory->capacity)
+    {
+        uint64_t      capacity = memory->capacity == 0 ? (file->size < MEMORY_MAX_RESERVE ? file->size : MEMORY_MAX_RESERVE)
+                                                       : memory->capacity * 2;
+        unsigned char *grown;
+
+        capacity = capacity < needed ? needed : capacity;
+        grown    = realloc(memory->data, capacity);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        memory->data     = grown;
+        memory->capacity = capacity;
+    }
+    memcpy(memory->data + file->written, data, size);
+    return 0;
+}
+
+static void memory_release(memory_file *file)
+{
+    free(file->name);
+    free(file->data);
+    free(file);
+}
+
+// The file replaces what was stored under its name
+static int memory_commit(storage_file *file)
+{
+    memory_file  *memory = (memory_file *)file;
+    memory_sink  *sink   = (memory_sink *)file->store->state;
+    memory_entry **slot  = memory_slot(sink, memory->name);
+    memory_entry *entry  = *slot;
+
+    if (entry == NULL)
+    {
+        entry = calloc(1, sizeof(memory_entry));
+        if (entry == NULL)
+        {
+            memory_release(memory);
+            return -1;
+        }
+        entry->name = memory->name;
+        *slot       = entry;
+        memory->name = NULL;
+        if (++sink->count > sink->num_buckets)
+        {
+            memory_grow(sink);
+        }
+    }
+    free(entry->data);
+    entry->data  = memory->data;
+    entry->size  = file->written;
+    memory->data = NULL;
+    memory_release(memory);
+    return 0;
+}
+
+static void memory_abort(storage_file *file)
+{
+    memory_release((memory_file *)file);
+}
+
+static int memory_has(storage *store, const char *name, uint64_t size, const uint64_t *hash)
+{
+    memory_entry *entry = *memory_slot((memory_sink *)store->state, name);
+
+    return entry != NULL && entry->size == size &&
+           (hash == NULL || hash_bytes(HASH_BASIS, entry->data, (size_t)entry->size) == *hash);
+}
+
+static void memory_stop(storage *store)
+{
+    memory_sink *sink = (memory_sink *)store->state;
+
+    if (sink == NULL)
+    {
+        return;
+    }
+    printf("Memory sink: %zu files stored, %" PRIu64 " files and %" PRIu64 " bytes committed\n", sink->count,
+           store->files, store->bytes);
+    for (size_t i = 0; sink->buckets != NULL && i < sink->num_buckets; i++)
+    {
+        while (sink->buckets[i] != NULL)
+        {
+            memory_entry *entry = sink->buckets[i];
+            sink->buckets[i] = entry->next;
+            free(entry->name);
+            free(entry->data);
+            free(entry);
+        }
+    }
+    free(sink->buckets);
+    free(sink);
+    store->state = NULL;
+}
+
+static int null_start(storage *store)
+{
+    null_sink *sink = malloc(sizeof(null_sink));
+
+    if (sink == NULL)
+    {
+        return -1;
+    }
+    store->state  = sink;
+    sink->devnull = open("/dev/null", O_WRONLY);
+    return sink->devnull == -1 ? -1 : 0;
+}
+
+static storage_file *null_open(storage *store, const char *name, uint64_t size)
+{
+    (void)store;
+    (void)name;
+    (void)size;
+    return calloc(1, sizeof(storage_file));
+}
+
+static int null_write(storage_file *file, const void *data, size_t size)
+{
+    (void)file;
+    (void)data;
+    (void)size;
+    return 0;
+}
+
+// -z still takes the data off the socket without a copy
+static int null_splice(storage_file *file, int sd, int pipe_fds[2], uint32_t size)
+{
+    return splice_to_file(sd, pipe_fds, ((null_sink *)file->store->state)->devnull, size);
+}
+
+static int null_place(storage_file *file, int in_fd, uint64_t size)
+{
+    (void)file;
+    (void)in_fd;
+    (void)size;
+    return 0;
+}
+
+static int null_commit(storage_file *file)
+{
+    free(file);
+    return 0;
+}
+
+static void null_abort(storage_file *file)
+{
+    free(file);
+}
+
+static int null_has(storage *store, const char *name, uint64_t size, const uint64_t *hash)
+{
+    (void)store;
+    (void)name;
+    (void)size;
+    (void)hash;
+    return 0;
+}
+
+static void null_stop(storage *store)
+{
+    null_sink *sink = (null_sink *)store->state;
+
+    if (sink == NULL)
+    {
+        return;
+    }
+    printf("Null sink: %" PRIu64 " files and %" PRIu64 " bytes dropped\n", store->files, store->bytes);
+    if (sink->devnull != -1)
+    {
+        close(sink->devnull);
+    }
+    free(sink);
+    store->state = NULL;
+}
+
+static int packed_start(storage *store)
+{
+    packed_sink    *sink = calloc(1, sizeof(packed_sink));
+    storage_config files;
+
+    if (sink == NULL)
+    {
+        return -1;
+    }
+    store->state = sink;
+    if (pack_open(&sink->log, store->config.directory, 1) == -1)
+    {
+        return -1;
+    }
+    LOG_INFO("Packed sink: %zu files in segments %" PRIu32 " to %" PRIu32 ", %" PRIu64
+             " records replayed, %" PRIu64 " bytes damaged\n", sink->log.files, sink->log.first_segment,
+             sink->log.segment, sink->log.replayed, sink->log.damaged);
+    // storage_write on the packed sink already hashes the large files
+    files           = store->config;
+    files.hash_data = 0;
+    return storage_start(&sink->files, "file", &files);
+}
+
+static storage_file *packed_open(storage *store, const char *name, uint64_t size)
+{
+    packed_sink *sink = (packed_sink *)store->state;
+    packed_file *file = calloc(1, sizeof(packed_file));
+
+    if (file == NULL || (file->small.name = strdup(name)) == NULL)
+    {
+        free(file);
+        return NULL;
+    }
+    if (size > PACK_MAX_FILE && (file->large = storage_open(&sink->files, name, size)) == NULL)
+    {
+        memory_release(&file->small);
+        return NULL;
+    }
+    return &file->small.base;
+}
+
+static int packed_write(storage_file *file, const void *data, size_t size)
+{
+    packed_file *packed = (packed_file *)file;
+
+    return packed->large != NULL ? storage_write(packed->large, data, size) : memory_write(file, data, size);
+}
+
+static int packed_place(storage_file *file, int in_fd, uint64_t size)
+{
+    packed_file   *packed = (packed_file *)file;
+    unsigned char *data;
+
+    if (packed->large != NULL)
+    {
+        return storage_place(packed->large, in_fd, size);
+    }
+    data = realloc(packed->small.data, size > 0 ? (size_t)size : 1);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    packed->small.data     = data;
+    packed->small.capacity = size;
+    for (uint64_t done = 0; done < size;)
+    {
+        ssize_t got = pread(in_fd, data + done, (size_t)(size - done), (off_t)done);
+        if (got <= 0)
+        {
+            return -1;
+        }
+        done += (uint64_t)got;
+    }
+    return 0;
+}
+
+// Whichever of the pack and the file sink takes the file, the other one's copy
+// of the name goes, so it cannot shadow or outlive the new file
+static int packed_commit(storage_file *file)
+{
+    packed_file *packed = (packed_file *)file;
+    packed_sink *sink   = (packed_sink *)file->store->state;
+    int         result;
+
+    if (packed->large != NULL)
+    {
+        result = storage_commit(packed->large);
+        if (result == 0)
+        {
+            result = pack_delete(&sink->log, packed->small.name);
+        }
+    }
+    else
+    {
+        char filepath[1024];
+        int  base_fd;
+
+        result = pack_append(&sink->log, packed->small.name, packed->small.data, file->written);
+        metrics_add(METRIC_SYSCALL_WRITE, 1);
+        if (result == 0 && store_path(&sink->files, packed->small.name, filepath, sizeof(filepath), &base_fd) == 0)
+        {
+            unlinkat(base_fd, filepath, 0);
+        }
+    }
+    memory_release(&packed->small);
+    return result;
+}
+
+static void packed_abort(storage_file *file)
+{
+    packed_file *packed = (packed_file *)file;
+
+    if (packed->large != NULL)
+    {
+        storage_abort(packed->large);
+    }
+    memory_release(&packed->small);
+}
+
+static int packed_has(storage *store, const char *name, uint64_t size, const uint64_t *hash)
+{
+    packed_sink      *sink  = (packed_sink *)store->state;
+    const pack_entry *entry = pack_find(&sink->log, name);
+
+    if (entry != NULL)
+    {
+        return entry->size == size && (hash == NULL || entry->hash == *hash);
+    }
+    return storage_has(&sink->files, name, size, hash);
+}
+
+static void packed_reserve(storage *store, const char *name, uint64_t size)
+{
+    if (size > PACK_MAX_FILE)
+    {
+        storage_reserve(&((packed_sink *)store->state)->files, name, size);
+    }
+}
+
+static void packed_unreserve(storage *store, const char *name)
+{
+    storage_unreserve(&((packed_sink *)store->state)->files, name);
+}
+
+static void packed_stop(storage *store)
+{
+    packed_sink *sink = (packed_sink *)store->state;
+
+    if (sink == NULL)
+    {
+        return;
+    }
+    printf("Packed sink: %zu files in %" PRIu64 " bytes of segments (%" PRIu64 " live), %" PRIu64
+           " files stored whole\n", sink->log.files, sink->log.log_bytes, sink->log.live_bytes, sink->files.files);
+    if (pack_close(&sink->log) == -1)
+    {
+        perror("Packed sink: cannot write the index snapshot");
+    }
+    storage_stop(&sink->files);
+    free(sink);
+    store->state = NULL;
+}
+
+static const storage_ops file_ops = {
+    "file", file_start, file_open, file_write, file_splice, file_place, file_commit, file_abort, file_has,
+    file_reserve, file_unreserve, file_stop, 1
+};
+static const storage_ops buffered_ops = {
+    "buffered", buffered_start, file_open, file_write, file_splice, file_place, file_commit, file_abort, file_has,
+    file_reserve, file_unreserve, file_stop, 1
+};
+static const storage_ops memory_ops = {
+    "memory", memory_start, memory_open, memory_write, NULL, NULL, memory_commit, memory_abort, memory_has,
+    NULL, NULL, memory_stop, 0
+};
+static const storage_ops null_ops = {
+    "null", null_start, null_open, null_write, null_splice, null_place, null_commit, null_abort, null_has,
+    NULL, NULL, null_stop, 0
+};
+static const storage_ops packed_ops = {
+    "packed", packed_start, packed_open, packed_write, NULL, packed_place, packed_commit, packed_abort, packed_has,
+    packed_reserve, packed_unreserve, packed_stop, 1
+};
+static const storage_ops *const sinks[] = { &file_ops, &buffered_ops, &memory_ops, &null_ops, &packed_ops };
+
+// Start the sink called name, file when it is NULL. Fails with EINVAL for a
+// name that is not a sink.
+int storage_start(storage *store, const char *sink, const storage_config *config)
+{
+    memset(store, 0, sizeof(*store));
+    store->config = *config;
+    for (size_t i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++)
+    {
+        if (strcmp(sinks[i]->name, sink != NULL ? sink : "file") == 0)
+        {
+            store->ops = sinks[i];
+        }
+    }
+    if (store->ops == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (store->ops->start(store) == -1)
+    {
+        int saved = errno;
+        storage_stop(store);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// NULL when the file cannot be stored, with errno set
+storage_file *storage_open(storage *store, const char *name, uint64_t size)
+{
+    storage_file *file = store->ops->open(store, name, size);
+
+    if (file != NULL)
+    {
+        file->store   = store;
+        file->size    = size;
+        file->written = 0;
+        file->hash    = HASH_BASIS;
+        file->hashed  = store->config.hash_data;
+    }
+    return file;
+}
+
+int storage_write(storage_file *file, const void *data, size_t size)
+{
+    if (file->store->ops->write(file, data, size) == -1)
+    {
+        return -1;
+    }
+    if (file->hashed)
+    {
+        file->hash = hash_bytes(file->hash, data, size);
+    }
+    file->written += size;
+    return 0;
+}
+
+int storage_can_splice(const storage *store)
+{
+    return store->ops->splice != NULL;
+}
+
+int storage_splice(storage_file *file, int sd, int pipe_fds[2], uint32_t size)
+{
+    if (file->store->ops->splice(file, sd, pipe_fds, size) == -1)
+    {
+        return -1;
+    }
+    // The data never passes through here to be hashed
+    file->hashed   = 0;
+    file->written += size;
+    return 0;
+}
+
+// Sinks without their own way are handed the file in reads of 64 KiB
+int storage_place(storage_file *file, int in_fd, uint64_t size)
+{
+    static unsigned char buffer[65536];
+
+    if (file->store->ops->place != NULL)
+    {
+        if (file->store->ops->place(file, in_fd, size) == -1)
+        {
+            return -1;
+        }
+        file->hashed  = 0;
+        file->written = size;
+        return 0;
+    }
+    while (file->written < size)
+    {
+        size_t  want = size - file->written < sizeof(buffer) ? (size_t)(size - file->written) : sizeof(buffer);
+        ssize_t got  = pread(in_fd, buffer, want, (off_t)file->written);
+        if (got <= 0 || storage_write(file, buffer, (size_t)got) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The content hash of the file so far, when every byte went through storage_write
+int storage_hash(const storage_file *file, uint64_t *hash)
+{
+    if (!file->hashed)
+    {
+        return -1;
+    }
+    *hash = file->hash;
+    return 0;
+}
+
+int storage_commit(storage_file *file)
+{
+    storage  *store   = file->store;
+    uint64_t written  = file->written;
+
+    if (store->ops->commit(file) == -1)
+    {
+        return -1;
+    }
+    store->files++;
+    store->bytes += written;
+    return 0;
+}
+
+void storage_abort(storage_file *file)
+{
+    file->store->ops->abort(file);
+}
+
+int storage_has(storage *store, const char *name, uint64_t size, const uint64_t *hash)
+{
+    return store->ops->has(store, name, size, hash);
+}
+
+void storage_reserve(storage *store, const char *name, uint64_t size)
+{
+    if (store->ops->reserve != NULL)
+    {
+        store->ops->reserve(store, name, size);
+    }
+}
+
+void storage_unreserve(storage *store, const char *name)
+{
+    if (store->ops->unreserve != NULL)
+    {
+        store->ops->unreserve(store, name);
+    }
+}
+
+int storage_keeps_files(const storage *store)
+{
+    return store->ops->keeps_files;
+}
+
+// Count this run in STORAGE_GENERATION_NAME. The new count is written in
+// PARTIAL_DIR_NAME, synced and renamed into place before any file changes, so a
+// run that changed files is never left uncounted.
+int storage_next_generation(storage *store)
+{
+    char    text[32];
+    int     dir_fd = open(store->config.directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int     fd;
+    int     length;
+    int     result = -1;
+    ssize_t got;
+
+    if (dir_fd == -1)
+    {
+        return -1;
+    }
+    store->generation = 0;
+    fd = openat(dir_fd, STORAGE_GENERATION_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno != ENOENT)
+    {
+        close(dir_fd);
+        return -1;
+    }
+    if (fd != -1)
+    {
+        got = read(fd, text, sizeof(text) - 1);
+        close(fd);
+        text[got > 0 ? got : 0] = '\0';
+        store->generation = strtoull(text, NULL, 10);
+    }
+    store->generation++;
+    length = snprintf(text, sizeof(text), "%" PRIu64 "\n", store->generation);
+    fd = openat(dir_fd, PARTIAL_DIR_NAME "/generation", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1 && write(fd, text, (size_t)length) == length && fsync(fd) == 0 &&
+        renameat(dir_fd, PARTIAL_DIR_NAME "/generation", dir_fd, STORAGE_GENERATION_NAME) == 0 && fsync(dir_fd) == 0)
+    {
+        result = 0;
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    close(dir_fd);
+    return result;
+}
+
+void storage_stop(storage *store)
+{
+    if (store->ops != NULL)
+    {
+        store->ops->stop(store);
+        store->ops = NULL;
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef SOCKET_FSM_STORAGE_H
+#define SOCKET_FSM_STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Where the server puts received files (-S). The protocol code opens a storage
+// file for every file it receives, writes the data in order and then commits or
+// aborts it; a sink is a table of storage_ops behind those calls:
+//   file      one file per name under the directory (default)
+//   buffered  the same files, written in 1 MiB blocks instead of once per chunk
+//   memory    the last contents of every name, kept in memory only
+//   null      nothing, the data is dropped once it is read
+//   packed    files up to PACK_MAX_FILE appended to a log of segments (pack.h),
+//             larger ones as with file
+// memory and null take the disk out of a measurement, null also the copy.
+#define STORAGE_SINKS "file, buffered, memory, null or packed"
+// Hashed directory fan-out (-s): each level is one byte of the name hash
+#define MAX_SHARD_LEVELS 4
+#define SHARD_INDEX_NAME ".index"
+// File sinks write each file here and rename it into place at the commit, so a
+// stored name is always a complete file. "r-<name>" is space a manifest
+// reserved (with '/' written as %2F), "w-<pid>-<n>" a file being written.
+// Reservations, and files of writers that are gone, are cleared at start.
+#define PARTIAL_DIR_NAME ".partial"
+// Counts the server runs on a store that keeps files, so an index of the store
+// (the catalog, -I) can tell whether a run it did not follow may have changed it
+#define STORAGE_GENERATION_NAME ".generation"
+// Write-behind window used by the page-cache hints (-c)
+#define WRITE_BEHIND_WINDOW (8 * 1024 * 1024)
+#define STORAGE_BUFFER_SIZE (1024 * 1024)
+
+typedef struct storage      storage;
+typedef struct storage_file storage_file;
+
+typedef struct {
+    const char *directory;
+    int        shard_levels;    // -s, file sinks only
+    int        cache_hints;     // -c, file sinks only
+    int        hash_data;       // keep a content hash of what goes through storage_write
+} storage_config;
+
+typedef struct {
+    const char   *name;
+    int          (*start)(storage *store);
+    storage_file *(*open)(storage *store, const char *name, uint64_t size);
+    int          (*write)(storage_file *file, const void *data, size_t size);
+    // Optional: move size bytes from a socket through a pipe, without a copy
+    int          (*splice)(storage_file *file, int sd, int pipe_fds[2], uint32_t size);
+    // Optional: take the whole file from a descriptor (passed files)
+    int          (*place)(storage_file *file, int in_fd, uint64_t size);
+    // Both release the file. A commit makes what was written the stored file.
+    int          (*commit)(storage_file *file);
+    void         (*abort)(storage_file *file);
+    // Manifests: whether name is stored with this size, and hash when given.
+    // Called from the planning threads, while nothing is written.
+    int          (*has)(storage *store, const char *name, uint64_t size, const uint64_t *hash);
+    // Optional: prepare for a file the client was told to send
+    void         (*reserve)(storage *store, const char *name, uint64_t size);
+    // Optional: give back what reserve took, once the file is not coming
+    void         (*unreserve)(storage *store, const char *name);
+    void         (*stop)(storage *store);
+    int          keeps_files;   // what was committed is still there after a restart
+} storage_ops;
+
+struct storage {
+    const storage_ops *ops;
+    storage_config    config;
+    void              *state;
+    uint64_t          files;        // committed
+    uint64_t          bytes;
+    uint64_t          generation;   // this run's, from storage_next_generation
+};
+
+// The start of every sink's file
+struct storage_file {
+    storage  *store;
+    uint64_t size;                  // announced
+    uint64_t written;
+    uint64_t hash;                  // hash_bytes of what was written, while hashed
+    int      hashed;
+};
+
+int storage_start(storage *store, const char *sink, const storage_config *config);
+storage_file *storage_open(storage *store, const char *name, uint64_t size);
+int storage_write(storage_file *file, const void *data, size_t size);
+int storage_can_splice(const storage *store);
+int storage_splice(storage_file *file, int sd, int pipe_fds[2], uint32_t size);
+int storage_place(storage_file *file, int in_fd, uint64_t size);
+int storage_hash(const storage_file *file, uint64_t *hash);
+int storage_commit(storage_file *file);
+void storage_abort(storage_file *file);
+int storage_has(storage *store, const char *name, uint64_t size, const uint64_t *hash);
+void storage_reserve(storage *store, const char *name, uint64_t size);
+void storage_unreserve(storage *store, const char *name);
+int storage_keeps_files(const storage *store);
+int storage_next_generation(storage *store);
+void storage_stop(storage *store);
+int shard_path(const char *filename, int levels, char *path, size_t path_len);
+uint32_t hash_name(const char *name);
+
+#endif //SOCKET_FSM_STORAGE_H
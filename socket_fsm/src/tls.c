@@ -0,0 +1,414 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "tls.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+static SSL_CTX *tls_ctx;
+static SSL     **sessions;
+static SSL     **handshakes;   // accepted, handshake not finished
+static int     num_fds;        // size of both tables
+
+static SSL *session(int fd)
+{
+    return fd >= 0 && fd < num_fds ? sessions[fd] : NULL;
+}
+
+static SSL_CTX *new_context(const SSL_METHOD *method)
+{
+    struct rlimit limit;
+    SSL_CTX *ctx;
+
+    num_fds = TLS_MAX_FDS;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < TLS_MAX_FDS)
+    {
+        num_fds = (int)limit.rlim_cur;
+    }
+    sessions = calloc((size_t)num_fds, sizeof(*sessions));
+    handshakes = calloc((size_t)num_fds, sizeof(*handshakes));
+    if (sessions == NULL || handshakes == NULL)
+    {
+        return NULL;
+    }
+    ctx = SSL_CTX_new(method);
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // Ask OpenSSL to install the negotiated keys into the kernel
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    return ctx;
+}
+
+int tls_server_init(const char *cert_file, const char *key_file)
+{
+    tls_ctx = new_context(TLS_server_method());
+    if (tls_ctx == NULL ||
+        SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    // Clients never resume sessions, and unread tickets would make their close
+    // reset the connection before the last file is read
+    SSL_CTX_set_num_tickets(tls_ctx, 0);
+    return 0;
+}
+
+// Verify the server against ca_file, and its certificate against the address we
+// connect to (as an IP address SAN, or a host name).
+int tls_client_init(const char *ca_file, const char *address)
+{
+    X509_VERIFY_PARAM *param;
+
+    tls_ctx = new_context(TLS_client_method());
+    if (tls_ctx == NULL || SSL_CTX_load_verify_locations(tls_ctx, ca_file, NULL) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+    param = SSL_CTX_get0_param(tls_ctx);
+    if (X509_VERIFY_PARAM_set1_ip_asc(param, address) != 1 &&
+        X509_VERIFY_PARAM_set1_host(param, address, 0) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    return 0;
+}
+
+static SSL *new_session(int fd)
+{
+    SSL *ssl;
+
+    if (tls_ctx == NULL || fd < 0 || fd >= num_fds)
+    {
+        return NULL;
+    }
+    ssl = SSL_new(tls_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    return ssl;
+}
+
+static void established(int fd, SSL *ssl)
+{
+    sessions[fd] = ssl;
+    printf("TLS %s established, kernel TLS send: %s, receive: %s\n", SSL_get_version(ssl),
+           tls_kernel_tx(fd) ? "yes" : "no", tls_kernel_rx(fd) ? "yes" : "no");
+}
+
+// The server's handshakes run non-blocking next to the connections it serves.
+// The socket stays O_NONBLOCK until the handshake is over, as OpenSSL only
+// reports what it waits for when the socket would block.
+int tls_accept(int fd)
+{
+    SSL *ssl = fd >= 0 && fd < num_fds ? handshakes[fd] : NULL;
+    int flags = fcntl(fd, F_GETFL);
+    int result;
+
+    if (flags == -1)
+    {
+        return -1;
+    }
+    if (ssl == NULL)
+    {
+        if ((ssl = new_session(fd)) == NULL || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            SSL_free(ssl);
+            return -1;
+        }
+        handshakes[fd] = ssl;
+    }
+    ERR_clear_error();
+    result = SSL_accept(ssl);
+    if (result != 1)
+    {
+        switch (SSL_get_error(ssl, result))
+        {
+            case SSL_ERROR_WANT_READ:
+                return TLS_WANT_READ;
+            case SSL_ERROR_WANT_WRITE:
+                return TLS_WANT_WRITE;
+            default:
+                ERR_print_errors_fp(stderr);
+                SSL_free(ssl);
+                handshakes[fd] = NULL;
+                return -1;
+        }
+    }
+    handshakes[fd] = NULL;
+    if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+    {
+        SSL_free(ssl);
+        return -1;
+    }
+    established(fd, ssl);
+    return 0;
+}
+
+int tls_connect(int fd)
+{
+    SSL *ssl = new_session(fd);
+
+    if (ssl == NULL)
+    {
+        return -1;
+    }
+    if (SSL_connect(ssl) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    established(fd, ssl);
+    return 0;
+}
+
+void tls_close(int fd)
+{
+    SSL *ssl = session(fd);
+    if (ssl != NULL)
+    {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        sessions[fd] = NULL;
+    }
+    if (fd >= 0 && fd < num_fds && handshakes[fd] != NULL)
+    {
+        SSL_free(handshakes[fd]);
+        handshakes[fd] = NULL;
+    }
+}
+
+void tls_cleanup(void)
+{
+    for (int fd = 0; fd < num_fds; fd++)
+    {
+        tls_close(fd);
+    }
+    free(sessions);
+    free(handshakes);
+    sessions = NULL;
+    handshakes = NULL;
+    num_fds = 0;
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+}
+
+int tls_enabled(int fd)
+{
+    return session(fd) != NULL;
+}
+
+int tls_kernel_tx(int fd)
+{
+    SSL *ssl = session(fd);
+    return ssl != NULL && BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+int tls_kernel_rx(int fd)
+{
+    SSL *ssl = session(fd);
+    return ssl != NULL && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+// Decrypted bytes OpenSSL holds that poll cannot see on the socket
+int tls_pending(int fd)
+{
+    SSL *ssl = session(fd);
+    return ssl != NULL && SSL_pending(ssl) > 0;
+}
+
+static ssize_t transport_read(int fd, void *buffer, size_t size)
+{
+    SSL *ssl = session(fd);
+    if (ssl == NULL || tls_kernel_rx(fd))
+    {
+        return read(fd, buffer, size);
+    }
+    size_t bytes_read;
+    int    result = SSL_read_ex(ssl, buffer, size, &bytes_read);
+    if (result == 1)
+    {
+        return (ssize_t)bytes_read;
+    }
+    return SSL_get_error(ssl, result) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+static ssize_t transport_write(int fd, const void *buffer, size_t size)
+{
+    SSL *ssl = session(fd);
+    if (ssl == NULL || tls_kernel_tx(fd))
+    {
+        return write(fd, buffer, size);
+    }
+    size_t bytes_written;
+    if (SSL_write_ex(ssl, buffer, size, &bytes_written) != 1)
+    {
+        errno = errno ? errno : EIO;
+        return -1;
+    }
+    return (ssize_t)bytes_written;
+}
+#else
+int tls_server_init(const char *cert_file, const char *key_file)
+{
+    (void)cert_file; (void)key_file;
+    fprintf(stderr, "Built without OpenSSL, TLS is not available\n");
+    return -1;
+}
+
+int tls_client_init(const char *ca_file, const char *address)
+{
+    (void)ca_file; (void)address;
+    fprintf(stderr, "Built without OpenSSL, TLS is not available\n");
+    return -1;
+}
+
+int tls_accept(int fd)            { (void)fd; return -1; }
+int tls_connect(int fd)           { (void)fd; return -1; }
+void tls_close(int fd)            { (void)fd; }
+void tls_cleanup(void)            { }
+int tls_enabled(int fd)           { (void)fd; return 0; }
+int tls_kernel_tx(int fd)         { (void)fd; return 0; }
+int tls_kernel_rx(int fd)         { (void)fd; return 0; }
+int tls_pending(int fd)           { (void)fd; return 0; }
+
+static ssize_t transport_read(int fd, void *buffer, size_t size)
+{
+    return read(fd, buffer, size);
+}
+
+static ssize_t transport_write(int fd, const void *buffer, size_t size)
+{
+    return write(fd, buffer, size);
+}
+#endif
+
+// Send part of a file. Plain sockets and kTLS use sendfile (SSL_sendfile keeps
+// OpenSSL's view of the session in step); user-space TLS has to copy.
+static ssize_t transport_sendfile(int fd, int file_fd, off_t offset, size_t size)
+{
+#ifdef HAVE_OPENSSL
+    SSL *ssl = session(fd);
+    if (ssl != NULL && tls_kernel_tx(fd))
+    {
+        return SSL_sendfile(ssl, file_fd, offset, size, 0);
+    }
+    if (ssl != NULL)
+    {
+        char    buffer[16384];
+        ssize_t result = pread(file_fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer), offset);
+        return result <= 0 ? result : transport_write(fd, buffer, (size_t)result);
+    }
+#endif
+#ifdef __linux__
+    return sendfile(fd, file_fd, &offset, size);
+#else
+    char    buffer[16384];
+    ssize_t result = pread(file_fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer), offset);
+    return result <= 0 ? result : write(fd, buffer, (size_t)result);
+#endif
+}
+
+// Egress limit of one connection (client --rate). When the kernel paces the
+// socket the bucket is unlimited and only counts what was sent.
+static int          limited_fd = -1;
+static token_bucket limit;
+static uint64_t     limited_bytes;
+
+void net_limit(int fd, uint64_t rate)
+{
+    limited_fd = fd;
+    bucket_init(&limit, rate);
+}
+
+uint64_t net_limited_bytes(void)
+{
+    return limited_bytes;
+}
+
+// Wait until the connection's bucket is out of debt, and cap the write at one
+// burst so a large sendfile does not run far ahead of the rate.
+static size_t limit_before(int fd, size_t size)
+{
+    uint64_t wait_ns;
+
+    if (fd != limited_fd || limit.rate == 0)
+    {
+        return size;
+    }
+    bucket_refill(&limit, monotonic_ns());
+    while ((wait_ns = bucket_wait_ns(&limit)) > 0)
+    {
+        struct timespec delay = { (time_t)(wait_ns / NS_PER_SECOND), (long)(wait_ns % NS_PER_SECOND) };
+        nanosleep(&delay, NULL);
+        bucket_refill(&limit, monotonic_ns());
+    }
+    return size < (size_t)limit.burst ? size : (size_t)limit.burst;
+}
+
+static void limit_after(int fd, ssize_t sent)
+{
+    if (fd == limited_fd && sent > 0)
+    {
+        limited_bytes += (uint64_t)sent;
+        bucket_take(&limit, (uint64_t)sent);
+    }
+}
+
+ssize_t net_read(int fd, void *buffer, size_t size)
+{
+    metrics_add(METRIC_SYSCALL_READ, 1);
+    return transport_read(fd, buffer, size);
+}
+
+ssize_t net_write(int fd, const void *buffer, size_t size)
+{
+    metrics_add(METRIC_SYSCALL_WRITE, 1);
+    ssize_t result = transport_write(fd, buffer, limit_before(fd, size));
+    limit_after(fd, result);
+    if (result > 0)
+    {
+        capture_data(fd, buffer, (size_t)result);
+    }
+    return result;
+}
+
+ssize_t net_sendfile(int fd, int file_fd, off_t offset, size_t size)
+{
+    metrics_add(METRIC_SYSCALL_SENDFILE, 1);
+    ssize_t result = transport_sendfile(fd, file_fd, offset, limit_before(fd, size));
+    limit_after(fd, result);
+    if (result > 0)
+    {
+        capture_file(fd, file_fd, offset, (size_t)result);
+    }
+    return result;
+}
@@ -0,0 +1,41 @@
+#ifndef SOCKET_FSM_TLS_H
+#define SOCKET_FSM_TLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Optional TLS for the transfer connection. The handshake runs in user space with
+// OpenSSL; afterwards the record layer is handed to the kernel (kTLS) whenever the
+// kernel supports the negotiated cipher, so plain read/write, sendfile and splice
+// keep working on the socket. Without kTLS the same calls fall back to SSL_read
+// and SSL_write. Built without OpenSSL, every function below is a plain syscall
+// and the setup functions fail.
+// Sessions are kept per descriptor, for every descriptor below the limit
+// (RLIMIT_NOFILE) at setup, but never more than this
+#define TLS_MAX_FDS (1 << 20)
+
+int tls_server_init(const char *cert_file, const char *key_file);
+int tls_client_init(const char *ca_file, const char *address);
+// Step the server handshake on fd: 0 once it is done, -1 if it failed, or what it
+// waits for on the socket. Call it again when poll reports that.
+#define TLS_WANT_READ  1
+#define TLS_WANT_WRITE 2
+int tls_accept(int fd);
+int tls_connect(int fd);
+void tls_close(int fd);
+void tls_cleanup(void);
+
+int tls_enabled(int fd);
+int tls_kernel_tx(int fd);
+int tls_kernel_rx(int fd);
+int tls_pending(int fd);
+
+ssize_t net_read(int fd, void *buffer, size_t size);
+ssize_t net_write(int fd, const void *buffer, size_t size);
+ssize_t net_sendfile(int fd, int file_fd, off_t offset, size_t size);
+// Hold writes to fd to rate bytes per second in user space, 0 to only count them
+void net_limit(int fd, uint64_t rate);
+uint64_t net_limited_bytes(void);
+
+#endif //SOCKET_FSM_TLS_H
@@ -0,0 +1,216 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "trace.h"
+#include "ratelimit.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// One producer, the owning thread, and one consumer, the writer. head and tail
+// only grow; their difference is the number of records waiting.
+typedef struct {
+    _Alignas(64) atomic_int owned;
+    _Atomic uint64_t head;
+    _Alignas(64) _Atomic uint64_t tail;
+    trace_record     *slots;
+} trace_ring;
+
+atomic_int trace_on;
+
+static trace_ring              rings[MAX_TRACE_RINGS];
+static _Thread_local trace_ring *local_ring;
+static _Thread_local int        no_ring;
+static pthread_key_t           ring_key;
+static pthread_once_t          ring_once = PTHREAD_ONCE_INIT;
+static _Atomic uint64_t        dropped;
+static FILE                    *trace_file;
+static pthread_t               writer;
+static atomic_int              stopping;
+
+// An exiting thread hands its ring to the next new thread; the writer keeps
+// draining it in between.
+static void release_ring(void *ring)
+{
+    atomic_store(&((trace_ring *)ring)->owned, 0);
+}
+
+static void create_ring_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static trace_ring *ring(void)
+{
+    if (local_ring != NULL || no_ring)
+    {
+        return local_ring;
+    }
+    pthread_once(&ring_once, create_ring_key);
+    for (int i = 0; i < MAX_TRACE_RINGS; i++)
+    {
+        int expected = 0;
+        if (rings[i].slots != NULL && atomic_compare_exchange_strong(&rings[i].owned, &expected, 1))
+        {
+            local_ring = &rings[i];
+            pthread_setspecific(ring_key, local_ring);
+            return local_ring;
+        }
+    }
+    // More threads than rings, this one's events are dropped
+    no_ring = 1;
+    return NULL;
+}
+
+void trace_emit(trace_event event, uint64_t a, uint64_t b, uint32_t c)
+{
+    trace_ring   *own = ring();
+    trace_record *record;
+    uint64_t     head;
+
+    if (own == NULL)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    head = atomic_load_explicit(&own->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&own->tail, memory_order_acquire) == TRACE_RING_SIZE)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    record         = &own->slots[head & (TRACE_RING_SIZE - 1)];
+    record->ns     = monotonic_ns();
+    record->a      = a;
+    record->b      = b;
+    record->c      = c;
+    record->event  = (uint16_t)event;
+    record->thread = (uint16_t)(own - rings);
+    atomic_store_explicit(&own->head, head + 1, memory_order_release);
+}
+
+static void drain(void)
+{
+    for (int i = 0; i < MAX_TRACE_RINGS; i++)
+    {
+        trace_ring *r = &rings[i];
+        uint64_t   tail;
+        uint64_t   head;
+
+        if (r->slots == NULL)
+        {
+            continue;
+        }
+        tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+        while (tail != head)
+        {
+            uint64_t start = tail & (TRACE_RING_SIZE - 1);
+            uint64_t count = head - tail;
+            if (start + count > TRACE_RING_SIZE)
+            {
+                count = TRACE_RING_SIZE - start;
+            }
+            fwrite(&r->slots[start], sizeof(trace_record), count, trace_file);
+            tail += count;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    fflush(trace_file);
+}
+
+static void *write_trace(void *arg)
+{
+    struct timespec interval = { 0, TRACE_FLUSH_MS * 1000000L };
+    (void)arg;
+
+    while (!atomic_load(&stopping))
+    {
+        nanosleep(&interval, NULL);
+        drain();
+    }
+    return NULL;
+}
+
+static int write_header(const char *const *state_names, int num_states)
+{
+    uint32_t record_size = sizeof(trace_record);
+    uint32_t count       = (uint32_t)num_states;
+
+    if (fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file) != strlen(TRACE_MAGIC) ||
+        fwrite(&record_size, sizeof(record_size), 1, trace_file) != 1 ||
+        fwrite(&count, sizeof(count), 1, trace_file) != 1)
+    {
+        return -1;
+    }
+    for (int i = 0; i < num_states; i++)
+    {
+        uint32_t length = (uint32_t)strlen(state_names[i]);
+        if (fwrite(&length, sizeof(length), 1, trace_file) != 1 ||
+            fwrite(state_names[i], 1, length, trace_file) != length)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Open the trace file and start the writer. Must run before the threads that
+// trace are started, as it sets up their rings.
+int trace_start(const char *path, const char *const *state_names, int num_states)
+{
+    sigset_t all;
+    sigset_t previous;
+    int      result;
+
+    trace_file = fopen(path, "wb");
+    result     = trace_file != NULL && write_header(state_names, num_states) == 0 ? 0 : -1;
+    for (int i = 0; i < MAX_TRACE_RINGS && result == 0; i++)
+    {
+        rings[i].slots = calloc(TRACE_RING_SIZE, sizeof(trace_record));
+        result         = rings[i].slots != NULL ? 0 : -1;
+    }
+    if (result == 0)
+    {
+        // Signals stay with the threads that wait for them, never the writer
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &previous);
+        result = pthread_create(&writer, NULL, write_trace, NULL) == 0 ? 0 : -1;
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    }
+    if (result == -1)
+    {
+        for (int i = 0; i < MAX_TRACE_RINGS; i++)
+        {
+            free(rings[i].slots);
+            rings[i].slots = NULL;
+        }
+        trace_stop();
+        return -1;
+    }
+    atomic_store(&trace_on, 1);
+    return 0;
+}
+
+void trace_stop(void)
+{
+    if (atomic_exchange(&trace_on, 0))
+    {
+        atomic_store(&stopping, 1);
+        pthread_join(writer, NULL);
+        drain();
+        if (atomic_load(&dropped) > 0)
+        {
+            fprintf(stderr, "trace: %llu events dropped\n", (unsigned long long)atomic_load(&dropped));
+        }
+    }
+    if (trace_file != NULL)
+    {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    // A thread may be just past its check of trace_on, so the rings stay until exit
+}
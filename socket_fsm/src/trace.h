@@ -0,0 +1,84 @@
+#ifndef SOCKET_FSM_TRACE_H
+#define SOCKET_FSM_TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Log and trace levels are fixed at compile time (SOCKET_FSM_LOG_LEVEL and
+// SOCKET_FSM_TRACE_LEVEL in CMake); anything above them is not compiled in.
+// Logs are the usual text on stdout. Trace events are binary records that each
+// thread puts in its own ring buffer; a background thread writes them to the
+// file given with -T, and tracedump turns the file back into text.
+#define LEVEL_NONE  0
+#define LEVEL_ERROR 1
+#define LEVEL_INFO  2
+#define LEVEL_DEBUG 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LEVEL_INFO
+#endif
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL LEVEL_NONE
+#endif
+
+// A log that is compiled out still has its arguments type-checked, in sizeof
+// where they are never evaluated
+#if LOG_LEVEL >= LEVEL_INFO
+#define LOG_INFO(...) printf(__VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)sizeof(printf(__VA_ARGS__)))
+#endif
+#if LOG_LEVEL >= LEVEL_DEBUG
+#define LOG_DEBUG(...) printf(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)sizeof(printf(__VA_ARGS__)))
+#endif
+
+#if TRACE_LEVEL > LEVEL_NONE
+#define TRACE(level, event, a, b, c) \
+    do { \
+        if ((level) <= TRACE_LEVEL && atomic_load_explicit(&trace_on, memory_order_relaxed)) \
+            trace_emit(event, (uint64_t)(a), (uint64_t)(b), (uint32_t)(c)); \
+    } while (0)
+#else
+#define TRACE(level, event, a, b, c) ((void)0)
+#endif
+
+#define TRACE_MAGIC "SFSMTRC1"
+#define TRACE_RING_SIZE 4096    // records per thread, a power of two
+#define MAX_TRACE_RINGS 64
+#define TRACE_FLUSH_MS 10
+
+// The meaning of a, b and c for each event
+typedef enum {
+    TRACE_STATE,            // state, source line
+    TRACE_ACCEPT,           // descriptor
+    TRACE_CLOSE,            // descriptor, bytes received, client number
+    TRACE_FILE_START,       // descriptor, size, file number
+    TRACE_FILE_END,         // descriptor, bytes, file number
+    TRACE_FILE_FAILED,      // descriptor, 0, file number
+    TRACE_FRAME_RECEIVED,   // descriptor, bytes
+    TRACE_FRAME_SENT,       // descriptor, payload bytes, tag
+    TRACE_EVENT_COUNT
+} trace_event;
+
+// File layout, host byte order: the magic, u32 record size, u32 state count and
+// the state names as u32 length and bytes, then records in batches, each batch
+// from one thread in order.
+typedef struct {
+    uint64_t ns;        // CLOCK_MONOTONIC
+    uint64_t a;
+    uint64_t b;
+    uint32_t c;
+    uint16_t event;
+    uint16_t thread;
+} trace_record;
+
+extern atomic_int trace_on;
+
+int trace_start(const char *path, const char *const *state_names, int num_states);
+void trace_emit(trace_event event, uint64_t a, uint64_t b, uint32_t c);
+void trace_stop(void);
+
+#endif //SOCKET_FSM_TRACE_H
@@ -0,0 +1,143 @@
+#include "trace.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Decode a trace file written with -T into one line per event, in time order:
+// milliseconds since the first event, the thread's ring, the event and its
+// arguments.
+
+static const char *const event_names[TRACE_EVENT_COUNT] = {
+    [TRACE_STATE]          = "state",
+    [TRACE_ACCEPT]         = "accept",
+    [TRACE_CLOSE]          = "close",
+    [TRACE_FILE_START]     = "file_start",
+    [TRACE_FILE_END]       = "file_end",
+    [TRACE_FILE_FAILED]    = "file_failed",
+    [TRACE_FRAME_RECEIVED] = "frame_received",
+    [TRACE_FRAME_SENT]     = "frame_sent",
+};
+
+static int by_time(const void *left, const void *right)
+{
+    const trace_record *a = left;
+    const trace_record *b = right;
+    return a->ns < b->ns ? -1 : a->ns > b->ns;
+}
+
+static int read_exact(FILE *in, void *buffer, size_t size)
+{
+    return fread(buffer, 1, size, in) == size ? 0 : -1;
+}
+
+static void print_record(const trace_record *record, uint64_t first, char **states, uint32_t num_states)
+{
+    printf("%12.6f t%-2u %-14s ", (double)(record->ns - first) / 1e6, record->thread,
+           record->event < TRACE_EVENT_COUNT ? event_names[record->event] : "unknown");
+    switch (record->event)
+    {
+        case TRACE_STATE:
+            printf("%s line %" PRIu64 "\n", record->a < num_states ? states[record->a] : "UNKNOWN_STATE", record->b);
+            break;
+        case TRACE_ACCEPT:
+            printf("fd %" PRIu64 "\n", record->a);
+            break;
+        case TRACE_CLOSE:
+            printf("fd %" PRIu64 " client %u bytes %" PRIu64 "\n", record->a, record->c, record->b);
+            break;
+        case TRACE_FILE_START:
+            printf("fd %" PRIu64 " file %u size %" PRIu64 "\n", record->a, record->c, record->b);
+            break;
+        case TRACE_FILE_END:
+        case TRACE_FILE_FAILED:
+            printf("fd %" PRIu64 " file %u bytes %" PRIu64 "\n", record->a, record->c, record->b);
+            break;
+        case TRACE_FRAME_RECEIVED:
+            printf("fd %" PRIu64 " bytes %" PRIu64 "\n", record->a, record->b);
+            break;
+        case TRACE_FRAME_SENT:
+            printf("fd %" PRIu64 " tag 0x%08x bytes %" PRIu64 "\n", record->a, record->c, record->b);
+            break;
+        default:
+            printf("a %" PRIu64 " b %" PRIu64 " c %u\n", record->a, record->b, record->c);
+            break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char         magic[sizeof(TRACE_MAGIC) - 1];
+    uint32_t     record_size;
+    uint32_t     num_states;
+    char         **states;
+    trace_record *records  = NULL;
+    size_t       count     = 0;
+    size_t       capacity  = 0;
+    FILE         *in;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    in = fopen(argv[1], "rb");
+    if (in == NULL)
+    {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (read_exact(in, magic, sizeof(magic)) == -1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        read_exact(in, &record_size, sizeof(record_size)) == -1 || record_size != sizeof(trace_record) ||
+        read_exact(in, &num_states, sizeof(num_states)) == -1 || num_states > 1024)
+    {
+        fprintf(stderr, "%s: not a trace file from this build\n", argv[1]);
+        fclose(in);
+        return EXIT_FAILURE;
+    }
+    states = calloc(num_states, sizeof(char *));
+    for (uint32_t i = 0; states != NULL && i < num_states; i++)
+    {
+        uint32_t length;
+        if (read_exact(in, &length, sizeof(length)) == -1 || length > 256 ||
+            (states[i] = calloc(1, length + 1)) == NULL || read_exact(in, states[i], length) == -1)
+        {
+            fprintf(stderr, "%s: truncated state names\n", argv[1]);
+            fclose(in);
+            return EXIT_FAILURE;
+        }
+    }
+    for (;;)
+    {
+        if (count == capacity)
+        {
+            capacity       = capacity ? capacity * 2 : 4096;
+            trace_record *grown = realloc(records, capacity * sizeof(trace_record));
+            if (grown == NULL)
+            {
+                perror("realloc");
+                fclose(in);
+                return EXIT_FAILURE;
+            }
+            records = grown;
+        }
+        if (read_exact(in, &records[count], sizeof(trace_record)) == -1)
+        {
+            break;
+        }
+        count++;
+    }
+    fclose(in);
+    // Each thread's batches are in order, but batches of different threads interleave
+    qsort(records, count, sizeof(trace_record), by_time);
+    for (size_t i = 0; i < count; i++)
+    {
+        print_record(&records[i], records[0].ns, states, num_states);
+    }
+    for (uint32_t i = 0; states != NULL && i < num_states; i++)
+    {
+        free(states[i]);
+    }
+    free(states);
+    free(records);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,372 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "walk.h"
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int has_wildcard(const char *path)
+{
+    return strpbrk(path, "*?[") != NULL;
+}
+
+// Caller holds the lock
+static int push_node(path_walker *walker, walk_kind kind, const char *path)
+{
+    walk_node *node = malloc(sizeof(walk_node));
+    if (node == NULL || (node->path = strdup(path)) == NULL)
+    {
+        free(node);
+        return -1;
+    }
+    node->kind      = kind;
+    node->next      = walker->pending;
+    walker->pending = node;
+    walker->num_pending++;
+    walker->active++;
+    pthread_cond_signal(&walker->work_ready);
+    return 0;
+}
+
+static void visit_directory(path_walker *walker, const char *path);
+
+static void queue_directory(path_walker *walker, const char *path)
+{
+    pthread_mutex_lock(&walker->lock);
+    if (walker->num_pending >= WALK_MAX_PENDING)
+    {
+        pthread_mutex_unlock(&walker->lock);
+        visit_directory(walker, path);
+        return;
+    }
+    if (push_node(walker, WALK_DIRECTORY, path) == -1)
+    {
+        fprintf(stderr, "Skipping %s: out of memory\n", path);
+    }
+    pthread_mutex_unlock(&walker->lock);
+}
+
+static void queue_file(path_walker *walker, const char *path)
+{
+    char *copy = strdup(path);
+    if (copy == NULL)
+    {
+        fprintf(stderr, "Skipping %s: out of memory\n", path);
+        return;
+    }
+    pthread_mutex_lock(&walker->lock);
+    while (walker->count == WALK_QUEUE_CAPACITY && !walker->stop)
+    {
+        pthread_cond_wait(&walker->file_space, &walker->lock);
+    }
+    if (walker->stop)
+    {
+        pthread_mutex_unlock(&walker->lock);
+        free(copy);
+        return;
+    }
+    walker->files[(walker->head + walker->count) % WALK_QUEUE_CAPACITY] = copy;
+    walker->count++;
+    walker->found++;
+    pthread_cond_signal(&walker->file_ready);
+    pthread_mutex_unlock(&walker->lock);
+}
+
+// Queue a path whose type is not known yet. Symlinks to files are sent, symlinks
+// to directories are not followed so the walk cannot loop.
+static void classify(path_walker *walker, const char *path, int follow)
+{
+    struct stat st;
+    if ((follow ? stat(path, &st) : lstat(path, &st)) == -1)
+    {
+        fprintf(stderr, "Skipping %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (S_ISLNK(st.st_mode))
+    {
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            queue_file(walker, path);
+        }
+        return;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        queue_directory(walker, path);
+    }
+    else if (S_ISREG(st.st_mode))
+    {
+        queue_file(walker, path);
+    }
+}
+
+static void visit_directory(path_walker *walker, const char *path)
+{
+    DIR           *dir = opendir(path);
+    struct dirent *entry;
+    size_t        path_len = strlen(path);
+
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Skipping %s: %s\n", path, strerror(errno));
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL && !walker->stop)
+    {
+        size_t name_len = strlen(entry->d_name);
+        char   *child;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        child = malloc(path_len + name_len + 2);
+        if (child == NULL)
+        {
+            continue;
+        }
+        memcpy(child, path, path_len);
+        child[path_len] = '/';
+        memcpy(child + path_len + 1, entry->d_name, name_len + 1);
+        // d_type saves a stat per entry on file systems that report it
+        switch (entry->d_type)
+        {
+            case DT_REG:
+                queue_file(walker, child);
+                break;
+            case DT_DIR:
+                queue_directory(walker, child);
+                break;
+            case DT_LNK:
+            case DT_UNKNOWN:
+                classify(walker, child, 0);
+                break;
+            default:
+                break;
+        }
+        free(child);
+    }
+    closedir(dir);
+}
+
+// Mark where the name of a command line argument starts: "tree/" becomes
+// "./tree", "a/b" "a/./b". An argument without a name of its own (".", "..",
+// "/") gives its entries their names: "./.", "../.".
+static void classify_root(path_walker *walker, const char *path)
+{
+    size_t     len = strlen(path);
+    const char *slash;
+    const char *name;
+    char       *marked;
+
+    while (len > 1 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    slash  = memrchr(path, '/', len);
+    name   = slash != NULL ? slash + 1 : path;
+    marked = malloc(len + 4);
+    if (marked == NULL)
+    {
+        fprintf(stderr, "Skipping %s: out of memory\n", path);
+        return;
+    }
+    if (name == path + len || (path + len - name == 1 && name[0] == '.') ||
+        (path + len - name == 2 && name[0] == '.' && name[1] == '.'))
+    {
+        snprintf(marked, len + 4, "%.*s/.", (int)len, path);
+    }
+    else if (slash == NULL)
+    {
+        snprintf(marked, len + 4, "./%.*s", (int)len, path);
+    }
+    else
+    {
+        snprintf(marked, len + 4, "%.*s/./%.*s", (int)(slash - path), path, (int)(path + len - name), name);
+    }
+    classify(walker, marked, 1);
+    free(marked);
+}
+
+static void visit(path_walker *walker, walk_node *node)
+{
+    switch (node->kind)
+    {
+        case WALK_CLASSIFY:
+            classify_root(walker, node->path);
+            break;
+        case WALK_PATTERN:
+        {
+            glob_t matches;
+            if (glob(node->path, 0, NULL, &matches) == 0)
+            {
+                for (size_t i = 0; i < matches.gl_pathc; i++)
+                {
+                    classify_root(walker, matches.gl_pathv[i]);
+                }
+            }
+            else
+            {
+                fprintf(stderr, "Skipping %s: no matches\n", node->path);
+            }
+            globfree(&matches);
+            break;
+        }
+        case WALK_DIRECTORY:
+            visit_directory(walker, node->path);
+            break;
+    }
+}
+
+static void *walk_worker(void *arg)
+{
+    path_walker *walker = (path_walker *)arg;
+
+    pthread_mutex_lock(&walker->lock);
+    for (;;)
+    {
+        walk_node *node;
+        while (walker->pending == NULL && walker->active > 0 && !walker->stop)
+        {
+            pthread_cond_wait(&walker->work_ready, &walker->lock);
+        }
+        if (walker->pending == NULL || walker->stop)
+        {
+            break;
+        }
+        node            = walker->pending;
+        walker->pending = node->next;
+        walker->num_pending--;
+        pthread_mutex_unlock(&walker->lock);
+
+        visit(walker, node);
+        free(node->path);
+        free(node);
+
+        pthread_mutex_lock(&walker->lock);
+        if (--walker->active == 0)
+        {
+            // The walk is over, release idle workers and the consumer
+            pthread_cond_broadcast(&walker->work_ready);
+            pthread_cond_broadcast(&walker->file_ready);
+        }
+    }
+    pthread_mutex_unlock(&walker->lock);
+    return NULL;
+}
+
+int walker_start(path_walker *walker, char **roots, int num_roots, int num_threads)
+{
+    memset(walker, 0, sizeof(*walker));
+    pthread_mutex_init(&walker->lock, NULL);
+    pthread_cond_init(&walker->work_ready, NULL);
+    pthread_cond_init(&walker->file_ready, NULL);
+    pthread_cond_init(&walker->file_space, NULL);
+
+    for (int i = 0; i < num_roots; i++)
+    {
+        // Arguments that exist are taken literally even if they contain wildcards
+        walk_kind kind = has_wildcard(roots[i]) && access(roots[i], F_OK) != 0 ? WALK_PATTERN : WALK_CLASSIFY;
+        if (push_node(walker, kind, roots[i]) == -1)
+        {
+            walker_stop(walker);
+            return -1;
+        }
+    }
+    if (num_threads > WALK_MAX_THREADS)
+    {
+        num_threads = WALK_MAX_THREADS;
+    }
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (pthread_create(&walker->threads[i], NULL, walk_worker, walker) != 0)
+        {
+            break;
+        }
+        walker->num_threads++;
+    }
+    if (walker->num_threads == 0)
+    {
+        walker_stop(walker);
+        return -1;
+    }
+    return 0;
+}
+
+// Next file found by the walk, or NULL once the walk is over and drained. The
+// caller owns the returned string.
+char *walker_next(path_walker *walker)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&walker->lock);
+    while (walker->count == 0 && walker->active > 0 && !walker->stop)
+    {
+        pthread_cond_wait(&walker->file_ready, &walker->lock);
+    }
+    if (walker->count > 0)
+    {
+        path         = walker->files[walker->head];
+        walker->head = (walker->head + 1) % WALK_QUEUE_CAPACITY;
+        walker->count--;
+        pthread_cond_signal(&walker->file_space);
+    }
+    pthread_mutex_unlock(&walker->lock);
+    return path;
+}
+
+void walker_stop(path_walker *walker)
+{
+    pthread_mutex_lock(&walker->lock);
+    walker->stop = 1;
+    pthread_cond_broadcast(&walker->work_ready);
+    pthread_cond_broadcast(&walker->file_space);
+    pthread_cond_broadcast(&walker->file_ready);
+    pthread_mutex_unlock(&walker->lock);
+
+    for (int i = 0; i < walker->num_threads; i++)
+    {
+        pthread_join(walker->threads[i], NULL);
+    }
+    walker->num_threads = 0;
+    while (walker->pending != NULL)
+    {
+        walk_node *node = walker->pending;
+        walker->pending = node->next;
+        free(node->path);
+        free(node);
+    }
+    while (walker->count > 0)
+    {
+        free(walker->files[walker->head]);
+        walker->head = (walker->head + 1) % WALK_QUEUE_CAPACITY;
+        walker->count--;
+    }
+    pthread_mutex_destroy(&walker->lock);
+    pthread_cond_destroy(&walker->work_ready);
+    pthread_cond_destroy(&walker->file_ready);
+    pthread_cond_destroy(&walker->file_space);
+}
+
+// The name a walked file is stored under, NULL for a path that is not marked
+const char *walk_name(const char *path)
+{
+    const char *name = NULL;
+
+    for (const char *mark = strstr(path, "/./"); mark != NULL; mark = strstr(mark + 1, "/./"))
+    {
+        name = mark + 3;
+    }
+    if (name == NULL && strncmp(path, "./", 2) == 0)
+    {
+        name = path + 2;
+    }
+    return name != NULL && *name != '\0' ? name : NULL;
+}
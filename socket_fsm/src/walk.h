@@ -0,0 +1,57 @@
+#ifndef SOCKET_FSM_WALK_H
+#define SOCKET_FSM_WALK_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Parallel directory walker used by the client's recursive mode (-r). Worker
+// threads expand globs and walk directory trees, streaming regular files into a
+// bounded queue that the send loop drains while the walk is still running.
+//
+// Files come out as <parent>/./<root>/<path below it>, marked the way rsync -R
+// marks paths: what follows the last "/./" (walk_name) is the name the file is
+// stored under, the root argument's own name and the path below it.
+#define WALK_QUEUE_CAPACITY 4096
+// Directories waiting for a worker. Past this a worker walks the directories it
+// finds itself, so memory is bounded by the depth of the tree, not its width.
+#define WALK_MAX_PENDING 4096
+#define WALK_DEFAULT_THREADS 4
+#define WALK_MAX_THREADS 64
+
+typedef enum {
+    WALK_CLASSIFY,  // command line argument, may be a file or a directory
+    WALK_PATTERN,   // command line argument with wildcards
+    WALK_DIRECTORY
+} walk_kind;
+
+typedef struct walk_node {
+    struct walk_node *next;
+    walk_kind        kind;
+    char             *path;
+} walk_node;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work_ready;
+    pthread_cond_t  file_ready;
+    pthread_cond_t  file_space;
+    walk_node       *pending;     // stack of arguments and directories to visit
+    size_t          num_pending;
+    size_t          active;       // nodes pending or being visited
+    char            *files[WALK_QUEUE_CAPACITY];
+    size_t          head;
+    size_t          count;
+    atomic_int      stop;         // set under lock, also read without it while reading a directory
+    pthread_t       threads[WALK_MAX_THREADS];
+    int             num_threads;
+    uint64_t        found;
+} path_walker;
+
+int walker_start(path_walker *walker, char **roots, int num_roots, int num_threads);
+char *walker_next(path_walker *walker);
+void walker_stop(path_walker *walker);
+const char *walk_name(const char *path);
+
+#endif //SOCKET_FSM_WALK_H
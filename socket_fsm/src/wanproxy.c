@@ -0,0 +1,462 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ratelimit.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// A TCP proxy that makes loopback look like a long fat network. Every byte read
+// from one side is delivered to the other when an emulated link would have
+// carried it:
+//   - one link per direction, shared by all connections, sends at the
+//     bandwidth limit, one read after another;
+//   - each read then arrives after the one-way delay plus a random jitter,
+//     never before the read in front of it, as TCP delivers in order;
+//   - a lost segment is resent after a round trip, as a fast retransmit would,
+//     and holds back everything behind it.
+// Each direction may hold a window of bytes that were read but not yet
+// delivered; while it is full the proxy stops reading, so the sender's TCP
+// window fills as it would on the real path. The proxy does not shrink the
+// sender's congestion window on loss, so loss shows as stalls only.
+
+#define DEFAULT_WINDOW   (4u << 20)
+#define READ_SIZE        (64 * 1024)
+#define SEGMENT_SIZE     1448  // TCP payload of a 1500 byte packet
+#define MAX_LINKS        4096
+#define NS_PER_MS        1000000.0
+// Smallest stall for a lost segment when there is no delay to retransmit over
+#define MIN_LOSS_STALL_NS 1000000ull
+
+typedef struct segment {
+    struct segment *next;
+    uint64_t       due_ns;
+    uint32_t       size;
+    uint32_t       sent;
+    unsigned char  data[];
+} segment;
+
+typedef struct {
+    segment  *head;
+    segment  *tail;
+    uint64_t queued;        // read and not yet delivered
+    uint64_t last_due_ns;
+    uint64_t bytes;
+    int      eof;           // the source shut down its side
+    int      shut;          // and that was passed on
+} direction;
+
+typedef struct {
+    int       fd[2];        // client, server
+    int       connecting;
+    uint32_t  number;
+    direction dir[2];       // dir[i] carries fd[i] to fd[1 - i]
+} proxy_link;
+
+static proxy_link *links[MAX_LINKS];
+static int        num_links;
+static uint32_t   links_accepted;
+static struct sockaddr_storage server_addr;
+static socklen_t  server_addr_len;
+static uint64_t   delay_ns;
+static uint64_t   jitter_ns;
+static uint64_t   bandwidth;
+static double     loss;
+static uint64_t   window = DEFAULT_WINDOW;
+static uint64_t   link_free_ns[2];  // when each direction's link has sent all it has
+static uint64_t   random_state = 0x9E3779B97F4A7C15ull;
+
+static void usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-d ms] [-j ms] [-b rate] [-l percent] [-w bytes] [-S seed]\n"
+                    "          <listen address> <listen port> <server address> <server port>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -d <ms>  One-way delay in each direction, the round trip is twice this\n", stderr);
+    fputs("  -j <ms>  Extra random delay, 0 to <ms>, without reordering\n", stderr);
+    fputs("  -b <rate>  Bandwidth of each direction in bytes per second, shared by all\n"
+          "             connections, K, M and G suffixes (default unlimited)\n", stderr);
+    fputs("  -l <percent>  Chance that a 1448 byte segment is lost and resent\n", stderr);
+    fputs("  -w <bytes>  Bytes in flight per direction before the proxy stops reading\n"
+          "             (default 4M)\n", stderr);
+    fputs("  -S <seed>  Seed for jitter and loss, for repeatable runs\n", stderr);
+}
+
+static uint64_t next_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static double uniform(void)
+{
+    return (double)(next_random() >> 11) / (double)(1ull << 53);
+}
+
+static int resolve(const char *address, const char *port, int passive, struct sockaddr_storage *addr,
+                   socklen_t *addr_len)
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = passive ? AI_PASSIVE : 0 };
+    struct addrinfo *found;
+
+    if (getaddrinfo(address, port, &hints, &found) != 0)
+    {
+        return -1;
+    }
+    memcpy(addr, found->ai_addr, found->ai_addrlen);
+    *addr_len = found->ai_addrlen;
+    freeaddrinfo(found);
+    return 0;
+}
+
+static void no_delay(int fd)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+static void close_link(int index)
+{
+    proxy_link *link = links[index];
+
+    printf("Connection %u closed: %llu bytes to the server, %llu bytes back\n", link->number,
+           (unsigned long long)link->dir[0].bytes, (unsigned long long)link->dir[1].bytes);
+    for (int side = 0; side < 2; side++)
+    {
+        close(link->fd[side]);
+        while (link->dir[side].head != NULL)
+        {
+            segment *next = link->dir[side].head->next;
+            free(link->dir[side].head);
+            link->dir[side].head = next;
+        }
+    }
+    free(link);
+    links[index] = links[--num_links];
+}
+
+static void accept_link(int listen_fd)
+{
+    int        client = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    int        server;
+    proxy_link *link;
+
+    if (client == -1)
+    {
+        return;
+    }
+    if (num_links == MAX_LINKS)
+    {
+        fprintf(stderr, "Too many connections, closing the new one\n");
+        close(client);
+        return;
+    }
+    server = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    link   = calloc(1, sizeof(proxy_link));
+    if (server == -1 || link == NULL ||
+        (connect(server, (struct sockaddr *)&server_addr, server_addr_len) == -1 && errno != EINPROGRESS))
+    {
+        perror("connect");
+        close(client);
+        if (server != -1)
+        {
+            close(server);
+        }
+        free(link);
+        return;
+    }
+    no_delay(client);
+    no_delay(server);
+    link->fd[0]      = client;
+    link->fd[1]      = server;
+    link->connecting = 1;
+    link->number     = ++links_accepted;
+    links[num_links++] = link;
+}
+
+// When the bytes just read reach the other side
+static uint64_t arrival(direction *dir, int side, uint32_t size, uint64_t now)
+{
+    uint64_t due = now;
+
+    if (bandwidth > 0)
+    {
+        uint64_t start = link_free_ns[side] > now ? link_free_ns[side] : now;
+        link_free_ns[side] = start + size * NS_PER_SECOND / bandwidth;
+        due = link_free_ns[side];
+    }
+    due += delay_ns;
+    if (jitter_ns > 0)
+    {
+        due += (uint64_t)(uniform() * (double)jitter_ns);
+    }
+    if (loss > 0)
+    {
+        uint64_t stall = 2 * delay_ns > MIN_LOSS_STALL_NS ? 2 * delay_ns : MIN_LOSS_STALL_NS;
+        for (uint32_t at = 0; at < size; at += SEGMENT_SIZE)
+        {
+            if (uniform() < loss)
+            {
+                due += stall;
+                break;
+            }
+        }
+    }
+    if (due < dir->last_due_ns)
+    {
+        due = dir->last_due_ns;
+    }
+    dir->last_due_ns = due;
+    return due;
+}
+
+// Read what the window has room for from one side. Returns -1 when the link is
+// broken.
+static int pump_in(proxy_link *link, int side, uint64_t now)
+{
+    static unsigned char buffer[READ_SIZE];
+    direction           *dir  = &link->dir[side];
+    uint64_t            room  = window - dir->queued;
+    ssize_t             got   = read(link->fd[side], buffer, room < sizeof(buffer) ? room : sizeof(buffer));
+    segment             *seg;
+
+    if (got == -1)
+    {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    if (got == 0)
+    {
+        dir->eof = 1;
+        return 0;
+    }
+    seg = malloc(sizeof(segment) + (size_t)got);
+    if (seg == NULL)
+    {
+        return -1;
+    }
+    memcpy(seg->data, buffer, (size_t)got);
+    seg->next   = NULL;
+    seg->size   = (uint32_t)got;
+    seg->sent   = 0;
+    seg->due_ns = arrival(dir, side, seg->size, now);
+    if (dir->tail != NULL)
+    {
+        dir->tail->next = seg;
+    }
+    else
+    {
+        dir->head = seg;
+    }
+    dir->tail    = seg;
+    dir->queued += (uint64_t)got;
+    return 0;
+}
+
+// Deliver everything that is due to the other side. Returns -1 when the link
+// is broken.
+static int pump_out(proxy_link *link, int side, uint64_t now)
+{
+    direction *dir = &link->dir[side];
+    int       to   = link->fd[1 - side];
+
+    while (dir->head != NULL && dir->head->due_ns <= now)
+    {
+        segment *seg  = dir->head;
+        ssize_t sent = write(to, seg->data + seg->sent, seg->size - seg->sent);
+        if (sent == -1)
+        {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        seg->sent   += (uint32_t)sent;
+        dir->queued -= (uint64_t)sent;
+        dir->bytes  += (uint64_t)sent;
+        if (seg->sent < seg->size)
+        {
+            return 0;
+        }
+        dir->head = seg->next;
+        if (dir->head == NULL)
+        {
+            dir->tail = NULL;
+        }
+        free(seg);
+    }
+    if (dir->head == NULL && dir->eof && !dir->shut)
+    {
+        shutdown(to, SHUT_WR);
+        dir->shut = 1;
+    }
+    return 0;
+}
+
+static int finish_connect(proxy_link *link)
+{
+    int       error = 0;
+    socklen_t len   = sizeof(error);
+
+    if (getsockopt(link->fd[1], SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+    {
+        fprintf(stderr, "Connection %u: server unreachable: %s\n", link->number, strerror(error ? error : errno));
+        return -1;
+    }
+    link->connecting = 0;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_storage listen_addr;
+    socklen_t               listen_addr_len;
+    struct pollfd           fds[1 + 2 * MAX_LINKS];
+    int                     listen_fd;
+    int                     on = 1;
+    int                     opt;
+
+    while ((opt = getopt(argc, argv, "hd:j:b:l:w:S:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': delay_ns = (uint64_t)(strtod(optarg, NULL) * NS_PER_MS); break;
+            case 'j': jitter_ns = (uint64_t)(strtod(optarg, NULL) * NS_PER_MS); break;
+            case 'l': loss = strtod(optarg, NULL) / 100.0; break;
+            case 'S': random_state = strtoull(optarg, NULL, 10) | 1; break;
+            case 'b':
+                if (parse_rate(optarg, &bandwidth) == -1)
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                if (parse_rate(optarg, &window) == -1 || window == 0)
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 4 != argc || loss < 0 || loss >= 1 ||
+        resolve(argv[optind], argv[optind + 1], 1, &listen_addr, &listen_addr_len) == -1 ||
+        resolve(argv[optind + 2], argv[optind + 3], 0, &server_addr, &server_addr_len) == -1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    listen_fd = socket(listen_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+        bind(listen_fd, (struct sockaddr *)&listen_addr, listen_addr_len) == -1 || listen(listen_fd, SOMAXCONN) == -1)
+    {
+        perror("listen");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("Proxying %s %s to %s %s: %.3f ms each way, %.3f ms jitter, %llu bytes/s, %.2f%% loss\n", argv[optind],
+           argv[optind + 1], argv[optind + 2], argv[optind + 3], delay_ns / NS_PER_MS, jitter_ns / NS_PER_MS,
+           (unsigned long long)bandwidth, loss * 100.0);
+
+    for (;;)
+    {
+        uint64_t now     = monotonic_ns();
+        int      timeout = -1;
+        nfds_t   nfds    = 1;
+
+        fds[0].fd     = listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < num_links; i++)
+        {
+            proxy_link *link = links[i];
+            for (int side = 0; side < 2; side++)
+            {
+                direction *in  = &link->dir[side];
+                direction *out = &link->dir[1 - side];
+                short     events = 0;
+
+                if (side == 1 && link->connecting)
+                {
+                    events = POLLOUT;
+                }
+                else
+                {
+                    if (!in->eof && in->queued < window)
+                    {
+                        events |= POLLIN;
+                    }
+                    if (out->head != NULL && out->head->due_ns <= now)
+                    {
+                        events |= POLLOUT;
+                    }
+                    else if (out->head != NULL)
+                    {
+                        uint64_t wait_ms = (out->head->due_ns - now + 999999) / 1000000;
+                        if (timeout == -1 || wait_ms < (uint64_t)timeout)
+                        {
+                            timeout = (int)wait_ms;
+                        }
+                    }
+                }
+                // A side with nothing to do is left out, or a hangup would wake us
+                fds[nfds].fd        = events != 0 ? link->fd[side] : -1;
+                fds[nfds].events    = events;
+                fds[nfds++].revents = 0;
+            }
+        }
+        if (poll(fds, nfds, timeout) == -1 && errno != EINTR)
+        {
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+        now = monotonic_ns();
+        // Backwards, as closing a link moves the last one into its place
+        for (int i = num_links - 1; i >= 0; i--)
+        {
+            proxy_link *link   = links[i];
+            int        broken  = 0;
+
+            for (int side = 0; side < 2 && !broken; side++)
+            {
+                short revents = fds[1 + 2 * i + side].revents;
+                if (side == 1 && link->connecting)
+                {
+                    broken = revents != 0 && finish_connect(link) == -1;
+                }
+                else if ((revents & (POLLIN | POLLHUP | POLLERR)) && !link->dir[side].eof &&
+                         link->dir[side].queued < window)
+                {
+                    broken = pump_in(link, side, now) == -1;
+                }
+            }
+            for (int side = 0; side < 2 && !broken; side++)
+            {
+                // Nothing goes to the server before it has accepted
+                if (side == 0 && link->connecting)
+                {
+                    continue;
+                }
+                broken = pump_out(link, side, now) == -1;
+            }
+            if (broken || (link->dir[0].shut && link->dir[1].shut))
+            {
+                close_link(i);
+            }
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            accept_link(listen_fd);
+        }
+    }
+}